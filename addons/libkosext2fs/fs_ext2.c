@@ -14,6 +14,7 @@
 #include <sys/queue.h>
 
 #include <kos/fs.h>
+#include <kos/fs_cache.h>
 #include <kos/mutex.h>
 #include <kos/dbglog.h>
 
@@ -1894,7 +1895,8 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT         /* list */
     },
 
-    0, NULL,                    /* no caching, privdata */
+    VFS_CACHE_MMAP | VFS_CACHE_DENTRY,  /* file and stat caches */
+    NULL,                       /* privdata */
 
     fs_ext2_open,               /* open */
     fs_ext2_close,              /* close */
@@ -2010,6 +2012,7 @@ int fs_ext2_unmount(const char *mp) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_cache_invalidate(i->vfsh, NULL);
         ext2_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
@@ -2075,6 +2078,7 @@ int fs_ext2_shutdown(void) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_cache_invalidate(i->vfsh, NULL);
         ext2_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
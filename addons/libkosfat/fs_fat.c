@@ -15,6 +15,7 @@
 #include <sys/queue.h>
 
 #include <kos/fs.h>
+#include <kos/fs_cache.h>
 #include <kos/mutex.h>
 #include <kos/dbglog.h>
 
@@ -1322,7 +1323,8 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT         /* list */
     },
 
-    0, NULL,                    /* no caching, privdata */
+    VFS_CACHE_MMAP | VFS_CACHE_DENTRY,  /* file and stat caches */
+    NULL,                       /* privdata */
 
     fs_fat_open,                /* open */
     fs_fat_close,               /* close */
@@ -1438,6 +1440,7 @@ int fs_fat_unmount(const char *mp) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_cache_invalidate(i->vfsh, NULL);
         fat_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
@@ -1503,6 +1506,7 @@ int fs_fat_shutdown(void) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        fs_cache_invalidate(i->vfsh, NULL);
         fat_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
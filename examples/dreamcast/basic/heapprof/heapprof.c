@@ -0,0 +1,167 @@
+/* KallistiOS ##version##
+
+   heapprof.c
+
+   Heap Profiler Example
+
+   This program shows what the heap profiler in malloc.h can find. It starts
+   the profiler, then does the kind of things that make a program run out of
+   memory: one function builds a list and forgets to free part of it, another
+   keeps a cache that only ever grows, and a third allocates lots of blocks of
+   different sizes and frees every other one, leaving the heap full of holes.
+
+   It then prints the profile over dbgio, with the call sites holding the
+   most memory first, and writes the same thing to a file in /ram and prints
+   how long that came out.
+
+   The sites are named after the nearest symbol the kernel exports before
+   them. That is right for calls made from inside the kernel, but the
+   functions in a program aren't exported, so for those, look the printed
+   address up with sh-elf-addr2line -e heapprof.elf.
+
+   It also times malloc() and free() with the profiler off and with it
+   sampling every allocation and one in 64, to show what it costs.
+*/
+
+#include <kos/timer.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define NODES       500
+#define CACHE       200
+#define HOLES       400
+#define OPS         20000
+#define SLOTS       64
+
+typedef struct node {
+    struct node *next;
+    char data[40];
+} node_t;
+
+static void *cache[CACHE];
+static void *holes[HOLES];
+
+static uint32_t seed = 0x1234;
+
+static uint32_t rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* Builds a list, and then only frees the first half of it. */
+static void leaky_list(void) {
+    node_t *head = NULL, *n;
+    int i;
+
+    for(i = 0; i < NODES; ++i) {
+        if(!(n = (node_t *)malloc(sizeof(node_t))))
+            break;
+
+        n->next = head;
+        head = n;
+    }
+
+    for(i = 0; i < NODES / 2 && head; ++i) {
+        n = head->next;
+        free(head);
+        head = n;
+    }
+}
+
+/* A cache that is never trimmed. */
+static void growing_cache(void) {
+    int i;
+
+    for(i = 0; i < CACHE; ++i)
+        cache[i] = malloc(256 + rnd() % 256);
+}
+
+/* Blocks of all sizes, with every other one freed. */
+static void make_holes(void) {
+    int i;
+
+    for(i = 0; i < HOLES; ++i)
+        holes[i] = malloc(64 + rnd() % 2048);
+
+    for(i = 0; i < HOLES; i += 2) {
+        free(holes[i]);
+        holes[i] = NULL;
+    }
+}
+
+static void cleanup(void) {
+    int i;
+
+    for(i = 0; i < CACHE; ++i)
+        free(cache[i]);
+
+    for(i = 0; i < HOLES; ++i)
+        free(holes[i]);
+
+    /* The rest of the list is lost for good, which is the point. */
+}
+
+static uint64_t time_heap(void) {
+    static void *slots[SLOTS];
+    uint64_t start;
+    uint32_t s, i;
+
+    memset(slots, 0, sizeof(slots));
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < OPS; ++i) {
+        s = rnd() % SLOTS;
+        free(slots[s]);
+        slots[s] = malloc(16 + rnd() % 240);
+    }
+
+    for(s = 0; s < SLOTS; ++s)
+        free(slots[s]);
+
+    return (timer_ns_gettime64() - start) / OPS;
+}
+
+int main(int argc, char *argv[]) {
+    struct stat st;
+    uint64_t t_off, t_all, t_some;
+
+    (void)argc;
+    (void)argv;
+
+    if(malloc_prof_start(1) < 0) {
+        printf("Can't start the heap profiler\n");
+        return EXIT_FAILURE;
+    }
+
+    leaky_list();
+    growing_cache();
+    make_holes();
+
+    malloc_prof_dump(NULL);
+
+    if(!malloc_prof_dump("/ram/heapprof.txt") &&
+       !stat("/ram/heapprof.txt", &st))
+        printf("Wrote %lu bytes to /ram/heapprof.txt\n",
+               (unsigned long)st.st_size);
+
+    malloc_prof_stop();
+    cleanup();
+
+    t_off = time_heap();
+    malloc_prof_start(1);
+    t_all = time_heap();
+    malloc_prof_start(64);
+    t_some = time_heap();
+    malloc_prof_stop();
+
+    printf("malloc + free: %lu ns off, %lu ns sampling all, "
+           "%lu ns sampling 1 in 64\n", (unsigned long)t_off,
+           (unsigned long)t_all, (unsigned long)t_some);
+
+    return EXIT_SUCCESS;
+}
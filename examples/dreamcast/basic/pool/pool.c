@@ -0,0 +1,180 @@
+/* KallistiOS ##version##
+
+   pool.c
+
+   Object Pool Benchmark
+
+   This program compares the object pools in kos/pool.h with malloc() and
+   free() for the kind of objects the kernel keeps in them: file handles,
+   sockets and packet buffers.
+
+   First it times allocating and freeing objects of each of those sizes, with
+   a set of them live at any one time and a random one replaced each time.
+
+   Then it looks at fragmentation. Many times over, it allocates a batch of
+   socket-sized objects with a few long-lived strings of random sizes mixed in
+   between them, and then frees the objects but keeps the strings, which is
+   what a program that opens and closes connections while building up state
+   does to the heap. When the objects come from malloc(), the strings end up
+   scattered through the space they used, and it stays split up into holes;
+   when they come from a pool, the strings are packed together and the pool's
+   slabs go back to the heap in one piece. For each way, it prints how much
+   the heap grew and how much of that is free but stuck in holes between live
+   blocks.
+
+   Last, it prints the statistics of every pool in the system, including the
+   ones the kernel itself uses.
+*/
+
+#include <kos/pool.h>
+#include <kos/timer.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SLOTS       64
+#define OPS         20000
+#define ROUNDS      50
+#define BATCH       100
+#define STRINGS     8
+
+static const size_t sizes[] = { 32, 128, 384, 1632 };
+
+static void *slots[SLOTS];
+static char *strings[ROUNDS * STRINGS];
+
+static uint32_t seed = 0x1234;
+
+static uint32_t rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static uint64_t time_malloc(size_t size) {
+    uint64_t start;
+    uint32_t s, i;
+
+    memset(slots, 0, sizeof(slots));
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < OPS; ++i) {
+        s = rnd() % SLOTS;
+        free(slots[s]);
+        slots[s] = malloc(size);
+    }
+
+    for(s = 0; s < SLOTS; ++s)
+        free(slots[s]);
+
+    return timer_ns_gettime64() - start;
+}
+
+static uint64_t time_pool(pool_t *p) {
+    uint64_t start;
+    uint32_t s, i;
+
+    memset(slots, 0, sizeof(slots));
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < OPS; ++i) {
+        s = rnd() % SLOTS;
+        pool_free(p, slots[s]);
+        slots[s] = pool_alloc(p);
+    }
+
+    for(s = 0; s < SLOTS; ++s)
+        pool_free(p, slots[s]);
+
+    return timer_ns_gettime64() - start;
+}
+
+static void bench_latency(void) {
+    uint64_t t_malloc, t_pool;
+    pool_t p;
+    size_t i;
+
+    printf("Allocate and free, %d times with %d live:\n", OPS, SLOTS);
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        pool_init(&p, "bench", sizes[i], 0, NULL, NULL, NULL, 0);
+
+        t_malloc = time_malloc(sizes[i]);
+        t_pool = time_pool(&p);
+
+        pool_destroy(&p);
+
+        printf("  %4u bytes: malloc %5lu ns, pool %5lu ns\n",
+               (unsigned int)sizes[i], (unsigned long)(t_malloc / OPS),
+               (unsigned long)(t_pool / OPS));
+    }
+}
+
+/* One run of the fragmentation test, with the objects from the pool if
+   there is one, or from malloc() if not. */
+static void churn(pool_t *p, const char *name) {
+    struct mallinfo before, after;
+    static void *objs[BATCH];
+    int r, i, n = 0;
+
+    before = mallinfo();
+
+    for(r = 0; r < ROUNDS; ++r) {
+        for(i = 0; i < BATCH; ++i) {
+            objs[i] = p ? pool_alloc(p) : malloc(sizes[2]);
+
+            /* Now and then, something that sticks around. */
+            if(i % (BATCH / STRINGS) == 0 && n < ROUNDS * STRINGS)
+                strings[n++] = malloc(16 + rnd() % 240);
+        }
+
+        for(i = 0; i < BATCH; ++i) {
+            if(p)
+                pool_free(p, objs[i]);
+            else
+                free(objs[i]);
+        }
+    }
+
+    if(p)
+        pool_shrink(p);
+
+    after = mallinfo();
+
+    printf("  %-6s heap grew %4d KiB, %4d KiB free in holes\n", name,
+           (after.arena - before.arena) / 1024,
+           ((after.fordblks - after.keepcost) -
+            (before.fordblks - before.keepcost)) / 1024);
+
+    for(i = 0; i < n; ++i)
+        free(strings[i]);
+}
+
+static void bench_fragmentation(void) {
+    pool_t p;
+
+    printf("Fragmentation, %d rounds of %d objects of %u bytes:\n", ROUNDS,
+           BATCH, (unsigned int)sizes[2]);
+
+    churn(NULL, "malloc");
+
+    pool_init(&p, "bench", sizes[2], 0, NULL, NULL, NULL, 0);
+    churn(&p, "pool");
+    pool_destroy(&p);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    bench_latency();
+    bench_fragmentation();
+
+    printf("\n");
+    pool_print_stats(printf);
+
+    return 0;
+}
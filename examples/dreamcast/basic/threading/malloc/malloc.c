@@ -0,0 +1,194 @@
+/* KallistiOS ##version##
+
+   malloc.c
+
+   Malloc Benchmark
+
+   This program times malloc() and free() with several threads using the heap
+   at once, the way the network stack, C++ containers and stdio all do in a
+   real program. Each thread keeps a set of live blocks and over and over
+   frees a random one and allocates a new one in its place, with sizes that
+   are mostly small (as most allocations are) and now and then a few
+   kilobytes. Every block is filled in when it is allocated and checked before
+   it is freed, so a block being handed out twice shows up.
+
+   The whole thing is run once with the heap on its own, and then again with
+   the per-thread caches turned on with mallopt(M_THREAD_CACHE, ...), and for
+   each run it prints the average and worst time taken by a malloc() and a
+   free() across all of the threads.
+*/
+
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define THREADS     4
+#define SLOTS       64
+#define OPS         20000
+#define CACHE       16
+
+typedef struct {
+    uint32_t seed;
+    uint64_t alloc_ns, free_ns;
+    uint32_t alloc_max, free_max;
+    uint32_t failed;
+    bool ok;
+} bench_t;
+
+static bench_t results[THREADS];
+
+static uint32_t rnd(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Mostly small sizes, some medium and a few large. */
+static size_t pick_size(uint32_t *seed) {
+    uint32_t r = rnd(seed);
+
+    switch(r & 15) {
+        case 0:
+            return 1024 + (r >> 4) % 3072;
+
+        case 1:
+        case 2:
+            return 256 + (r >> 4) % 768;
+
+        default:
+            return 4 + (r >> 4) % 252;
+    }
+}
+
+static void fill(uint8_t *p, size_t size, uint8_t tag) {
+    /* Only the ends, or the fill would swamp the timing. */
+    p[0] = tag;
+    p[size - 1] = tag ^ 0xff;
+}
+
+static bool check(const uint8_t *p, size_t size, uint8_t tag) {
+    return p[0] == tag && p[size - 1] == (uint8_t)(tag ^ 0xff);
+}
+
+static void *bench_thd(void *data) {
+    bench_t *b = (bench_t *)data;
+    uint8_t *blocks[SLOTS];
+    size_t sizes[SLOTS];
+    uint64_t start;
+    uint32_t t, i, s;
+
+    memset(blocks, 0, sizeof(blocks));
+
+    for(i = 0; i < OPS; ++i) {
+        s = rnd(&b->seed) % SLOTS;
+
+        if(blocks[s]) {
+            if(!check(blocks[s], sizes[s], (uint8_t)s))
+                b->ok = false;
+
+            start = timer_ns_gettime64();
+            free(blocks[s]);
+            t = (uint32_t)(timer_ns_gettime64() - start);
+
+            b->free_ns += t;
+
+            if(t > b->free_max)
+                b->free_max = t;
+        }
+
+        sizes[s] = pick_size(&b->seed);
+
+        start = timer_ns_gettime64();
+        blocks[s] = malloc(sizes[s]);
+        t = (uint32_t)(timer_ns_gettime64() - start);
+
+        b->alloc_ns += t;
+
+        if(t > b->alloc_max)
+            b->alloc_max = t;
+
+        if(blocks[s])
+            fill(blocks[s], sizes[s], (uint8_t)s);
+        else
+            ++b->failed;
+    }
+
+    for(s = 0; s < SLOTS; ++s) {
+        if(blocks[s] && !check(blocks[s], sizes[s], (uint8_t)s))
+            b->ok = false;
+
+        free(blocks[s]);
+    }
+
+    return NULL;
+}
+
+static bool run(const char *name) {
+    kthread_t *thds[THREADS];
+    uint64_t alloc_ns = 0, free_ns = 0;
+    uint32_t alloc_max = 0, free_max = 0, failed = 0;
+    bool ok = true;
+    int i;
+
+    for(i = 0; i < THREADS; ++i) {
+        memset(&results[i], 0, sizeof(bench_t));
+        results[i].seed = 0x1234 + i;
+        results[i].ok = true;
+        thds[i] = thd_create(false, bench_thd, &results[i]);
+    }
+
+    for(i = 0; i < THREADS; ++i) {
+        thd_join(thds[i], NULL);
+
+        alloc_ns += results[i].alloc_ns;
+        free_ns += results[i].free_ns;
+        failed += results[i].failed;
+        ok &= results[i].ok;
+
+        if(results[i].alloc_max > alloc_max)
+            alloc_max = results[i].alloc_max;
+
+        if(results[i].free_max > free_max)
+            free_max = results[i].free_max;
+    }
+
+    printf("%s:\n", name);
+    printf("  malloc: %5lu ns average, %7lu ns worst\n",
+           (unsigned long)(alloc_ns / (THREADS * OPS)),
+           (unsigned long)alloc_max);
+    printf("  free:   %5lu ns average, %7lu ns worst\n",
+           (unsigned long)(free_ns / (THREADS * OPS)),
+           (unsigned long)free_max);
+
+    if(failed)
+        printf("  %lu allocations failed\n", (unsigned long)failed);
+
+    if(!ok)
+        printf("  blocks were corrupted!\n");
+
+    return ok && !failed;
+}
+
+int main(int argc, char *argv[]) {
+    bool ok = true;
+
+    (void)argc;
+    (void)argv;
+
+    printf("%d threads, %d operations each\n", THREADS, OPS);
+
+    ok &= run("Heap only");
+
+    mallopt(M_THREAD_CACHE, CACHE);
+    ok &= run("Per-thread caches");
+    mallopt(M_THREAD_CACHE, 0);
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
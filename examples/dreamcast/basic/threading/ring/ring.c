@@ -0,0 +1,298 @@
+/* KallistiOS ##version##
+
+   ring.c
+
+   Ring Buffer Example, Test and Benchmark
+
+   This program checks and times the single-producer, single-consumer ring
+   buffers in kos/ring.h. First, an interrupt handler (the watchdog timer,
+   set up as an interval timer) feeds a sequence of numbers through a ring to
+   the main thread, with nobody disabling interrupts or taking a lock. Then a
+   second thread streams bytes to the main thread, using both the copying and
+   the in-place functions on each side, and the main thread checks that every
+   byte arrives, in order.
+
+   Last, it times moving data through a ring in chunks of a few sizes, and the
+   same thing done the way it is usually done by hand: with interrupts
+   disabled around a copy that wraps at the end of the buffer with a modulo.
+*/
+
+#include <kos/ring.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+#include <arch/irq.h>
+#include <dc/wdt.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IRQ_PERIOD      100         /* us between timer interrupts */
+#define IRQ_TEST_MS     2000
+#define STREAM_BYTES    (4 * 1024 * 1024)
+#define BENCH_BYTES     (4 * 1024 * 1024)
+#define RING_SIZE       4096
+
+static ring_t ring;
+static uint8_t storage[RING_SIZE] __attribute__((aligned(32)));
+
+/* The interrupt side: one number per tick, or a note that the ring was
+   full. */
+static volatile uint32_t irq_seq, irq_full;
+
+static void irq_producer(void *data) {
+    uint32_t seq = irq_seq;
+
+    (void)data;
+
+    if(ring_write(&ring, &seq, 1))
+        irq_seq = seq + 1;
+    else
+        ++irq_full;
+}
+
+static bool test_irq(void) {
+    uint32_t buf[64], expect = 0, got = 0;
+    uint64_t end;
+    size_t i, n;
+    bool ok = true;
+
+    ring_init(&ring, sizeof(uint32_t), RING_SIZE / sizeof(uint32_t), storage);
+    irq_seq = irq_full = 0;
+
+    wdt_enable_timer(0, IRQ_PERIOD, 15, irq_producer, NULL);
+    end = timer_ms_gettime64() + IRQ_TEST_MS;
+
+    while(timer_ms_gettime64() < end) {
+        n = ring_read(&ring, buf, 64);
+
+        for(i = 0; i < n; ++i) {
+            if(buf[i] != expect++)
+                ok = false;
+        }
+
+        got += n;
+
+        /* Let the ring fill up now and then. */
+        if(!n)
+            thd_sleep(10);
+    }
+
+    wdt_disable();
+
+    /* Pick up the stragglers. */
+    while((n = ring_read(&ring, buf, 64))) {
+        for(i = 0; i < n; ++i) {
+            if(buf[i] != expect++)
+                ok = false;
+        }
+
+        got += n;
+    }
+
+    ok = ok && got == irq_seq;
+
+    printf("IRQ -> thread: %lu numbers, %lu times full: %s\n",
+           (unsigned long)got, (unsigned long)irq_full, ok ? "ok" : "FAILED");
+
+    return ok;
+}
+
+/* The thread side: a byte stream in odd-sized pieces. */
+static uint8_t pattern(uint32_t pos) {
+    return (uint8_t)(pos * 31 + (pos >> 8));
+}
+
+static void *stream_producer(void *data) {
+    uint8_t buf[300];
+    uint32_t pos = 0;
+    size_t n, i;
+    uint8_t *p;
+
+    (void)data;
+
+    while(pos < STREAM_BYTES) {
+        n = (pos % 293) + 1;
+
+        if(n > STREAM_BYTES - pos)
+            n = STREAM_BYTES - pos;
+
+        if(pos & 1) {
+            /* Copy it in. */
+            for(i = 0; i < n; ++i)
+                buf[i] = pattern(pos + i);
+
+            n = ring_write(&ring, buf, n);
+        }
+        else if((p = ring_reserve(&ring, &n))) {
+            /* Build it in place. */
+            for(i = 0; i < n; ++i)
+                p[i] = pattern(pos + i);
+
+            ring_commit(&ring, n);
+        }
+
+        if(!n)
+            thd_pass();
+
+        pos += n;
+    }
+
+    return NULL;
+}
+
+static bool test_stream(void) {
+    kthread_t *thd;
+    uint8_t buf[512];
+    const uint8_t *p;
+    uint32_t pos = 0;
+    size_t n, i;
+    bool ok = true;
+
+    ring_init(&ring, 1, RING_SIZE, storage);
+    thd = thd_create(false, stream_producer, NULL);
+
+    while(pos < STREAM_BYTES) {
+        n = (pos % 509) + 1;
+
+        if(pos & 2) {
+            n = ring_read(&ring, buf, n);
+
+            for(i = 0; i < n; ++i) {
+                if(buf[i] != pattern(pos + i))
+                    ok = false;
+            }
+        }
+        else if((p = ring_peek(&ring, &n))) {
+            for(i = 0; i < n; ++i) {
+                if(p[i] != pattern(pos + i))
+                    ok = false;
+            }
+
+            ring_consume(&ring, n);
+        }
+
+        if(!n)
+            thd_pass();
+
+        pos += n;
+    }
+
+    thd_join(thd, NULL);
+
+    printf("thread -> thread: %lu bytes: %s\n", (unsigned long)pos,
+           ok ? "ok" : "FAILED");
+
+    return ok;
+}
+
+/* The usual hand-rolled ring, for comparison. */
+static struct {
+    uint8_t buf[RING_SIZE];
+    size_t head, tail, cnt;
+} old;
+
+static size_t old_write(const uint8_t *src, size_t n) {
+    size_t avail;
+
+    irq_disable_scoped();
+
+    if(n > RING_SIZE - old.cnt)
+        n = RING_SIZE - old.cnt;
+
+    if(old.tail + n > RING_SIZE) {
+        avail = RING_SIZE - old.tail;
+        memcpy(old.buf + old.tail, src, avail);
+        memcpy(old.buf, src + avail, n - avail);
+    }
+    else {
+        memcpy(old.buf + old.tail, src, n);
+    }
+
+    old.tail = (old.tail + n) % RING_SIZE;
+    old.cnt += n;
+
+    return n;
+}
+
+static size_t old_read(uint8_t *dst, size_t n) {
+    size_t avail;
+
+    irq_disable_scoped();
+
+    if(n > old.cnt)
+        n = old.cnt;
+
+    if(old.head + n > RING_SIZE) {
+        avail = RING_SIZE - old.head;
+        memcpy(dst, old.buf + old.head, avail);
+        memcpy(dst + avail, old.buf, n - avail);
+    }
+    else {
+        memcpy(dst, old.buf + old.head, n);
+    }
+
+    old.head = (old.head + n) % RING_SIZE;
+    old.cnt -= n;
+
+    return n;
+}
+
+static void bench(size_t chunk) {
+    static uint8_t buf[1024];
+    uint64_t start, t_ring, t_old;
+    size_t done;
+
+    ring_init(&ring, 1, RING_SIZE, storage);
+
+    start = timer_us_gettime64();
+
+    for(done = 0; done < BENCH_BYTES; done += chunk) {
+        ring_write(&ring, buf, chunk);
+        ring_read(&ring, buf, chunk);
+    }
+
+    t_ring = timer_us_gettime64() - start;
+
+    memset(&old, 0, sizeof(old));
+    start = timer_us_gettime64();
+
+    for(done = 0; done < BENCH_BYTES; done += chunk) {
+        old_write(buf, chunk);
+        old_read(buf, chunk);
+    }
+
+    t_old = timer_us_gettime64() - start;
+
+    if(!t_ring)
+        t_ring = 1;
+
+    if(!t_old)
+        t_old = 1;
+
+    printf("%4u byte chunks: ring %5llu KiB/s, by hand %5llu KiB/s\n",
+           (unsigned int)chunk,
+           (unsigned long long)BENCH_BYTES * 1000000 / 1024 / t_ring,
+           (unsigned long long)BENCH_BYTES * 1000000 / 1024 / t_old);
+}
+
+int main(int argc, char *argv[]) {
+    bool ok = true;
+
+    (void)argc;
+    (void)argv;
+
+    ok &= test_irq();
+    ok &= test_stream();
+
+    bench(1);
+    bench(16);
+    bench(256);
+    bench(1024);
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
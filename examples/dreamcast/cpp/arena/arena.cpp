@@ -0,0 +1,240 @@
+/* KallistiOS ##version##
+
+   examples/dreamcast/cpp/arena/arena.cpp
+
+*/
+
+/*
+    Arena Benchmark
+
+    This program compares the arenas in kos/arena.h with malloc() and free()
+    for the things a game allocates and throws away every frame. Each frame,
+    it builds a list of draw commands, formats some strings for a HUD and
+    copies in a few network packets of random sizes, and then throws them all
+    away at the end of the frame, either by freeing each one or by resetting
+    an arena.
+
+    It runs the frames three ways: with malloc() and free(), with an arena
+    from C, and with std::pmr containers that get their memory from an arena
+    through kos::arena_resource, next to the same containers using the heap.
+    For each, it prints the time a frame took.
+
+    While all this goes on, now and then something is allocated that sticks
+    around, the way a game loads things and keeps state as it goes. When the
+    short-lived blocks come from the heap, those end up scattered through the
+    space they used, and the heap is left full of holes; with an arena, they
+    are packed together. After each run, it prints how much the heap grew and
+    how much of that is free but stuck in holes between live blocks.
+*/
+
+#include <kos/arena.h>
+#include <kos/timer.h>
+
+#include <malloc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#define FRAMES      500
+#define COMMANDS    200
+#define STRINGS     20
+#define PACKETS     8
+#define KEEP_EVERY  10
+#define ARENA_SIZE  (64 * 1024)
+
+struct command {
+    uint32_t cmd;
+    float x, y, z, u, v;
+    uint32_t argb;
+};
+
+static uint32_t seed;
+
+static uint32_t rnd() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* The things that stick around. */
+static std::vector<void *> kept;
+
+static void keep_something(int frame) {
+    if(frame % KEEP_EVERY == 0)
+        kept.push_back(malloc(32 + rnd() % 480));
+}
+
+static void free_kept() {
+    for(void *p : kept)
+        free(p);
+
+    kept.clear();
+}
+
+/* One frame's worth, allocated with alloc and freed with release. */
+template<typename Alloc, typename Release>
+static void frame(int n, Alloc alloc, Release release) {
+    static void *blocks[COMMANDS + STRINGS + PACKETS];
+    int i, cnt = 0;
+    size_t len;
+    char *s;
+
+    for(i = 0; i < COMMANDS; ++i) {
+        command *c = static_cast<command *>(alloc(sizeof(command)));
+        c->cmd = i;
+        blocks[cnt++] = c;
+
+        if(i == COMMANDS / 2)
+            keep_something(n);
+    }
+
+    for(i = 0; i < STRINGS; ++i) {
+        len = 16 + rnd() % 64;
+        s = static_cast<char *>(alloc(len));
+        snprintf(s, len, "score %d lives %d frame %d", i * 100, i, n);
+        blocks[cnt++] = s;
+    }
+
+    for(i = 0; i < PACKETS; ++i) {
+        len = 64 + rnd() % 1436;
+        s = static_cast<char *>(alloc(len));
+        memset(s, i, len);
+        blocks[cnt++] = s;
+    }
+
+    release(blocks, cnt);
+}
+
+static void report(const char *name, uint64_t ns,
+                   const struct mallinfo &before) {
+    struct mallinfo after = mallinfo();
+
+    printf("  %-18s %6lu us/frame, heap grew %4d KiB, %4d KiB in holes\n",
+           name, (unsigned long)(ns / FRAMES / 1000),
+           (after.arena - before.arena) / 1024,
+           ((after.fordblks - after.keepcost) -
+            (before.fordblks - before.keepcost)) / 1024);
+
+    free_kept();
+}
+
+static void bench_c() {
+    struct mallinfo before;
+    uint64_t start;
+    arena_t a;
+    int n;
+
+    printf("C, %d frames of %d commands, %d strings and %d packets:\n",
+           FRAMES, COMMANDS, STRINGS, PACKETS);
+
+    seed = 0x1234;
+    before = mallinfo();
+    start = timer_ns_gettime64();
+
+    for(n = 0; n < FRAMES; ++n) {
+        frame(n, malloc, [](void **blocks, int cnt) {
+            for(int i = 0; i < cnt; ++i)
+                free(blocks[i]);
+        });
+    }
+
+    report("malloc", timer_ns_gettime64() - start, before);
+
+    arena_init(&a, NULL, ARENA_SIZE);
+
+    seed = 0x1234;
+    before = mallinfo();
+    start = timer_ns_gettime64();
+
+    for(n = 0; n < FRAMES; ++n) {
+        frame(n, [&a](size_t size) {
+            return arena_alloc(&a, size);
+        }, [&a](void **, int) {
+            arena_reset(&a);
+        });
+    }
+
+    report("arena", timer_ns_gettime64() - start, before);
+
+    printf("  arena peak %lu of %lu bytes, %lu failed\n",
+           (unsigned long)arena_peak(&a), (unsigned long)ARENA_SIZE,
+           (unsigned long)arena_failed(&a));
+
+    arena_destroy(&a);
+}
+
+/* The same sort of frame with containers. */
+static void container_frame(int n, std::pmr::memory_resource *res) {
+    std::pmr::vector<command> cmds(res);
+    std::pmr::vector<std::pmr::string> strs(res);
+    char buf[16];
+    int i;
+
+    for(i = 0; i < COMMANDS; ++i) {
+        cmds.push_back(command { static_cast<uint32_t>(i), 0, 0, 0, 0, 0, 0 });
+
+        if(i == COMMANDS / 2)
+            keep_something(n);
+    }
+
+    for(i = 0; i < STRINGS; ++i) {
+        /* The strings get their memory from the vector's resource too. */
+        snprintf(buf, sizeof(buf), "%d", i * 100);
+        strs.emplace_back("score ");
+        strs.back() += buf;
+        strs.back() += " and a long enough tail to leave the small buffer";
+    }
+}
+
+static void bench_cpp() {
+    struct mallinfo before;
+    uint64_t start;
+    arena_t a;
+    int n;
+
+    printf("C++, %d frames of std::pmr containers:\n", FRAMES);
+
+    seed = 0x1234;
+    before = mallinfo();
+    start = timer_ns_gettime64();
+
+    for(n = 0; n < FRAMES; ++n)
+        container_frame(n, std::pmr::new_delete_resource());
+
+    report("new/delete", timer_ns_gettime64() - start, before);
+
+    arena_init(&a, NULL, ARENA_SIZE);
+
+    seed = 0x1234;
+    before = mallinfo();
+    start = timer_ns_gettime64();
+
+    for(n = 0; n < FRAMES; ++n) {
+        /* Anything that doesn't fit goes to the heap rather than failing. */
+        kos::arena_resource res(&a, std::pmr::new_delete_resource());
+
+        container_frame(n, &res);
+        arena_reset(&a);
+    }
+
+    report("arena_resource", timer_ns_gettime64() - start, before);
+
+    printf("  arena peak %lu of %lu bytes, %lu spilled to the heap\n",
+           (unsigned long)arena_peak(&a), (unsigned long)ARENA_SIZE,
+           (unsigned long)arena_failed(&a));
+
+    arena_destroy(&a);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    bench_c();
+    bench_cpp();
+
+    return 0;
+}
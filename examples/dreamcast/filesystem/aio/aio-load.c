@@ -0,0 +1,179 @@
+/* KallistiOS ##version##
+
+   aio-load.c
+
+   This example shows how to overlap loading with other work using the
+   asynchronous file I/O API. It loads a file from the CD in 64 KiB chunks
+   while "rendering" frames (here, just spinning for a few milliseconds per
+   frame), first with fs_read() in between frames and then with the chunks
+   submitted in one batch to a completion queue, and prints how long each
+   took. Chunks start on sector boundaries and the buffer is 32-byte aligned,
+   so the CD filesystem streams them straight into memory by DMA.
+
+   The file used is the first regular file found in the root of the disc, or
+   the path given on the command line.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <kos/init.h>
+#include <kos/fs.h>
+#include <kos/fs_aio.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define CHUNK_SIZE  (64 * 1024)
+#define MAX_CHUNKS  64
+#define FRAME_US    5000
+
+static char path[PATH_MAX];
+static fs_aio_req_t reqs[MAX_CHUNKS];
+
+static int find_file(void) {
+    dirent_t *de;
+    file_t d;
+
+    if((d = fs_open("/cd", O_RDONLY | O_DIR)) < 0)
+        return -1;
+
+    while((de = fs_readdir(d))) {
+        if(!(de->attr & O_DIR) && de->size > 0) {
+            snprintf(path, sizeof(path), "/cd/%s", de->name);
+            fs_close(d);
+            return 0;
+        }
+    }
+
+    fs_close(d);
+    return -1;
+}
+
+static void render_frame(void) {
+    uint64_t end = timer_us_gettime64() + FRAME_US;
+
+    while(timer_us_gettime64() < end)
+        ;
+}
+
+static uint64_t load_sync(uint8_t *buf, size_t size, int *frames) {
+    uint64_t start = timer_us_gettime64();
+    size_t done = 0;
+    ssize_t rv;
+    file_t fd;
+
+    if((fd = fs_open(path, O_RDONLY)) < 0)
+        return 0;
+
+    *frames = 0;
+
+    while(done < size) {
+        rv = fs_read(fd, buf + done, CHUNK_SIZE);
+
+        if(rv <= 0)
+            break;
+
+        done += rv;
+        render_frame();
+        (*frames)++;
+    }
+
+    fs_close(fd);
+
+    return timer_us_gettime64() - start;
+}
+
+static uint64_t load_async(uint8_t *buf, size_t size, int *frames) {
+    uint64_t start = timer_us_gettime64();
+    fs_aio_req_t *list[MAX_CHUNKS];
+    fs_aio_queue_t *q;
+    fs_aio_req_t *req;
+    size_t i, n;
+    file_t fd;
+
+    if(!(q = fs_aio_queue_create()))
+        return 0;
+
+    if((fd = fs_open(path, O_RDONLY)) < 0) {
+        fs_aio_queue_destroy(q);
+        return 0;
+    }
+
+    n = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    for(i = 0; i < n; i++) {
+        memset(&reqs[i], 0, sizeof(reqs[i]));
+        fs_aio_prep_read(&reqs[i], fd, buf + i * CHUNK_SIZE, CHUNK_SIZE,
+                         i * CHUNK_SIZE);
+        list[i] = &reqs[i];
+    }
+
+    if(fs_aio_submit(q, list, n) != (int)n)
+        printf("Could not submit every chunk\n");
+
+    /* The requests keep the file open. */
+    fs_close(fd);
+
+    *frames = 0;
+
+    while(fs_aio_pending(q)) {
+        render_frame();
+        (*frames)++;
+
+        while((req = fs_aio_peek(q))) {
+            if(req->result < 0)
+                printf("Chunk at %ld failed: %s\n", (long)req->offset,
+                       strerror(req->error));
+        }
+    }
+
+    fs_aio_queue_destroy(q);
+
+    return timer_us_gettime64() - start;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t t;
+    uint8_t *buf;
+    size_t size;
+    file_t fd;
+    int frames;
+
+    if(argc > 1)
+        strncpy(path, argv[1], sizeof(path) - 1);
+    else if(find_file() < 0) {
+        printf("No file to test with on the disc\n");
+        return 1;
+    }
+
+    if((fd = fs_open(path, O_RDONLY)) < 0) {
+        printf("Cannot open %s\n", path);
+        return 1;
+    }
+
+    size = fs_total(fd);
+    fs_close(fd);
+
+    if(size > MAX_CHUNKS * CHUNK_SIZE)
+        size = MAX_CHUNKS * CHUNK_SIZE;
+
+    if(!(buf = aligned_alloc(32, MAX_CHUNKS * CHUNK_SIZE))) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    printf("Loading %u bytes of %s:\n", (unsigned int)size, path);
+
+    t = load_sync(buf, size, &frames);
+    printf("  fs_read:   %llu us, %d frames\n", t, frames);
+
+    t = load_async(buf, size, &frames);
+    printf("  fs_aio:    %llu us, %d frames\n", t, frames);
+
+    free(buf);
+
+    return 0;
+}
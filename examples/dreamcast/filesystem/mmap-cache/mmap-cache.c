@@ -0,0 +1,112 @@
+/* KallistiOS ##version##
+
+   mmap-cache.c
+
+   This example compares two ways of getting a file from the CD into memory
+   over and over again, as an asset manager reloading the same textures and
+   sounds between levels might: reading it into a malloc'd buffer each time
+   with fs_load(), and mapping it with fs_mmap(), which goes through the VFS
+   file cache on the CD filesystem. It then pins the file and prints the cache
+   statistics.
+
+   The file used is the first regular file found in the root of the disc, or
+   the path given on the command line.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <kos/init.h>
+#include <kos/fs.h>
+#include <kos/fs_cache.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define ROUNDS  20
+
+static char path[PATH_MAX];
+
+static int find_file(void) {
+    dirent_t *de;
+    file_t d;
+
+    if((d = fs_open("/cd", O_RDONLY | O_DIR)) < 0)
+        return -1;
+
+    while((de = fs_readdir(d))) {
+        if(!(de->attr & O_DIR) && de->size > 0) {
+            snprintf(path, sizeof(path), "/cd/%s", de->name);
+            fs_close(d);
+            return 0;
+        }
+    }
+
+    fs_close(d);
+    return -1;
+}
+
+static uint64_t bench_load(void) {
+    uint64_t start = timer_us_gettime64();
+    void *buf;
+    int i;
+
+    for(i = 0; i < ROUNDS; i++) {
+        if(fs_load(path, &buf) < 0)
+            return 0;
+
+        free(buf);
+    }
+
+    return timer_us_gettime64() - start;
+}
+
+static uint64_t bench_mmap(void) {
+    uint64_t start = timer_us_gettime64();
+    file_t fd;
+    int i;
+
+    for(i = 0; i < ROUNDS; i++) {
+        if((fd = fs_open(path, O_RDONLY)) < 0)
+            return 0;
+
+        if(!fs_mmap(fd)) {
+            fs_close(fd);
+            return 0;
+        }
+
+        fs_close(fd);
+    }
+
+    return timer_us_gettime64() - start;
+}
+
+int main(int argc, char *argv[]) {
+    fs_cache_stats_t st;
+
+    if(argc > 1)
+        strncpy(path, argv[1], sizeof(path) - 1);
+    else if(find_file() < 0) {
+        printf("No file to test with on the disc\n");
+        return 1;
+    }
+
+    printf("Loading %s %d times:\n", path, ROUNDS);
+    printf("  fs_load: %llu us\n", bench_load());
+    printf("  fs_mmap: %llu us\n", bench_mmap());
+
+    if(fs_cache_pin(path) < 0)
+        printf("Could not pin %s\n", path);
+
+    fs_cache_get_stats(&st);
+    printf("Cache: %lu hits, %lu misses, %lu evictions, %lu files "
+           "(%lu pinned), %lu/%lu bytes\n", st.hits, st.misses,
+           st.evictions, st.entries, st.pinned, (unsigned long)st.bytes,
+           (unsigned long)st.limit);
+
+    fs_cache_unpin(path);
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+/* KallistiOS ##version##
+
+   ramdisk-bench.c
+
+   This example times a couple of access patterns on the /ram filesystem that
+   used to be slow: appending to a log file in lots of small writes, and
+   creating, opening and deleting many files in one directory. It also shows
+   how to preallocate space for a file with RAMDISK_IOCTL_RESERVE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <kos/init.h>
+#include <kos/fs.h>
+#include <kos/fs_ramdisk.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define LOG_LINES   20000
+#define NUM_FILES   1000
+
+static const char line[] = "frame 000000: everything is fine\n";
+
+static uint64_t bench_append(int reserve) {
+    uint64_t start;
+    file_t fd;
+    int i;
+
+    fd = fs_open("/ram/log.txt", O_WRONLY | O_TRUNC);
+
+    if(fd < 0) {
+        printf("Cannot open /ram/log.txt\n");
+        return 0;
+    }
+
+    start = timer_us_gettime64();
+
+    if(reserve)
+        fs_ioctl(fd, RAMDISK_IOCTL_RESERVE, (size_t)LOG_LINES * sizeof(line));
+
+    for(i = 0; i < LOG_LINES; i++)
+        fs_write(fd, line, sizeof(line) - 1);
+
+    start = timer_us_gettime64() - start;
+
+    fs_close(fd);
+    fs_unlink("/ram/log.txt");
+
+    return start;
+}
+
+static void bench_files(void) {
+    uint64_t create, lookup, remove;
+    char name[32];
+    file_t fd;
+    int i;
+
+    create = timer_us_gettime64();
+
+    for(i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "/ram/file%04d.dat", i);
+
+        if((fd = fs_open(name, O_WRONLY)) >= 0) {
+            fs_write(fd, name, strlen(name));
+            fs_close(fd);
+        }
+    }
+
+    lookup = timer_us_gettime64();
+    create = lookup - create;
+
+    for(i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "/ram/file%04d.dat", (i * 7) % NUM_FILES);
+
+        if((fd = fs_open(name, O_RDONLY)) >= 0)
+            fs_close(fd);
+    }
+
+    remove = timer_us_gettime64();
+    lookup = remove - lookup;
+
+    for(i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "/ram/file%04d.dat", i);
+        fs_unlink(name);
+    }
+
+    remove = timer_us_gettime64() - remove;
+
+    printf("%d files: create %llu us, open %llu us, unlink %llu us\n",
+           NUM_FILES, create, lookup, remove);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Appending %d lines of %d bytes:\n", LOG_LINES,
+           (int)sizeof(line) - 1);
+    printf("  growing:      %llu us\n", bench_append(0));
+    printf("  preallocated: %llu us\n", bench_append(1));
+
+    bench_files();
+
+    return 0;
+}
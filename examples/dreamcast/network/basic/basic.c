@@ -49,10 +49,28 @@ int main(int argc, char **argv) {
            "Packets received successfully:   %6ld\n"
            "Packets rejected (bad size):     %6ld\n"
            "                 (bad checksum): %6ld\n"
-           "                 (no socket):    %6ld\n\n",
+           "                 (no socket):    %6ld\n"
+           "Packets dropped (queue full):    %6ld\n"
+           "                (no buffer):     %6ld\n\n",
            udp.pkt_sent, udp.pkt_send_failed, udp.pkt_recv,
            udp.pkt_recv_bad_size, udp.pkt_recv_bad_chksum,
-           udp.pkt_recv_no_sock);
+           udp.pkt_recv_no_sock, udp.pkt_recv_dropped, udp.pkt_recv_no_buf);
+
+    if(net_default_dev) {
+        netif_stats_t *dev = &net_default_dev->stats;
+
+        printf("Device Stats (%s):\n"
+               "Frames received:                 %6ld\n"
+               "Bytes received:                  %6ld\n"
+               "Frames dropped on receive:       %6ld\n"
+               "Receive poll rounds:             %6ld\n"
+               "Frames sent:                     %6ld\n"
+               "Bytes sent:                      %6ld\n"
+               "Frames that failed to send:      %6ld\n\n",
+               net_default_dev->name, dev->rx_packets, dev->rx_bytes,
+               dev->rx_dropped, dev->rx_polls, dev->tx_packets,
+               dev->tx_bytes, dev->tx_dropped);
+    }
 
     return 0;
 }
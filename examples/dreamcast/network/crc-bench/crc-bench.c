@@ -0,0 +1,94 @@
+/* KallistiOS ##version##
+
+   crc-bench.c
+
+   This example checks the CRC functions of the network stack against the
+   standard check values (the CRC of the string "123456789"), and measures how
+   fast they are. The network drivers use the CRC-32 functions to work out
+   which bit of the multicast filter each address they're given goes in, so
+   it times them on 6 byte addresses as well as on a full sized frame.
+
+   For each function and size, it prints the time per call and the throughput.
+   No network adapter is needed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define BUF_SIZE    1514
+#define BYTES       (4 * 1024 * 1024)
+
+static const uint8_t check_str[] = "123456789";
+
+static uint8_t buf[BUF_SIZE];
+static volatile uint32_t sink;
+
+typedef uint32_t (*crc_func)(const uint8_t *data, int size);
+
+static uint32_t crc16(const uint8_t *data, int size) {
+    return net_crc16ccitt(data, size, 0xFFFF);
+}
+
+static const struct {
+    const char *name;
+    crc_func func;
+    uint32_t check;
+} funcs[] = {
+    { "net_crc32le", net_crc32le, 0xCBF43926 },
+    { "net_crc32be", net_crc32be, 0x9B63D02C },
+    { "net_crc16ccitt", crc16, 0x29B1 }
+};
+
+static const int sizes[] = { 6, 64, BUF_SIZE };
+
+static void run(size_t f, int size) {
+    uint64_t start, us;
+    int i, count = BYTES / size;
+
+    start = timer_us_gettime64();
+
+    for(i = 0; i < count; i++) {
+        buf[0] = (uint8_t)i;
+        sink += funcs[f].func(buf, size);
+    }
+
+    us = timer_us_gettime64() - start;
+
+    if(!us)
+        us = 1;
+
+    printf("  %4d bytes: %llu ns per call, %llu KiB/s\n", size,
+           us * 1000 / count, (uint64_t)count * size * 1000000 / 1024 / us);
+}
+
+int main(int argc, char *argv[]) {
+    size_t f, i;
+    uint32_t crc;
+    int rv = 0;
+
+    for(i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)rand();
+
+    for(f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+        crc = funcs[f].func(check_str, sizeof(check_str) - 1);
+
+        printf("%s: check value %08lx (%s)\n", funcs[f].name,
+               (unsigned long)crc, crc == funcs[f].check ? "ok" : "WRONG");
+
+        if(crc != funcs[f].check)
+            rv = 1;
+
+        for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+            run(f, sizes[i]);
+    }
+
+    return rv;
+}
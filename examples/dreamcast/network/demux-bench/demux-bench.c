@@ -0,0 +1,223 @@
+/* KallistiOS ##version##
+
+   demux-bench.c
+
+   This example measures how long it takes to find the socket an incoming
+   packet belongs to, depending on how many sockets are open. It makes up
+   Ethernet frames addressed to this machine and feeds them straight into
+   net_input(), so nothing needs to be connected to the network besides the
+   adapter itself.
+
+   For each number of sockets it times two things:
+     - UDP datagrams sent to the oldest of that many bound UDP sockets, which
+       is the last one a walk through every socket would get to.
+     - TCP segments (with RST set, so nothing is sent back) sent to a port
+       nobody is listening on while that many TCP sockets are listening, which
+       used to mean looking at every one of them before giving up.
+
+   The times printed are per packet, and include everything net_input() does
+   with it (checksums, the ARP cache, queueing the datagram, and so on), so
+   what matters is how much they change as the number of sockets goes up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define BASE_PORT   20000
+#define NO_PORT     19999
+#define PEER_PORT   4321
+#define ROUNDS      10
+#define PER_ROUND   100
+#define PAYLOAD     32
+
+static const int counts[] = { 1, 10, 100, 500 };
+
+static const uint8_t peer_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t peer_ip[4] = { 10, 254, 254, 1 };
+
+static int socks[500];
+static uint8_t frame[14 + 20 + 20 + PAYLOAD];
+
+static uint32_t sum16(const uint8_t *data, size_t len, uint32_t sum) {
+    size_t i;
+
+    for(i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+
+    if(len & 1)
+        sum += data[len - 1] << 8;
+
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum) {
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+/* Fill in frame with an IPv4 packet from the made-up peer to us, carrying len
+   bytes of the given protocol that are already in place after the IP header.
+   The checksum of the payload goes at offset csum in it. */
+static int build_frame(int proto, size_t len, size_t csum) {
+    uint8_t *ip = frame + 14, *l4 = ip + 20;
+    uint32_t sum;
+
+    memcpy(frame, net_default_dev->mac_addr, 6);
+    memcpy(frame + 6, peer_mac, 6);
+    put16(frame + 12, 0x0800);
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, (uint16_t)(20 + len));
+    ip[8] = 64;
+    ip[9] = (uint8_t)proto;
+    memcpy(ip + 12, peer_ip, 4);
+    memcpy(ip + 16, net_default_dev->ip_addr, 4);
+    put16(ip + 10, fold(sum16(ip, 20, 0)));
+
+    /* Pseudo-header, then the payload itself */
+    sum = sum16(ip + 12, 8, proto + len);
+    put16(l4 + csum, 0);
+    put16(l4 + csum, fold(sum16(l4, len, sum)));
+
+    return (int)(14 + 20 + len);
+}
+
+static int build_udp(uint16_t dport) {
+    uint8_t *udp = frame + 34;
+
+    put16(udp, PEER_PORT);
+    put16(udp + 2, dport);
+    put16(udp + 4, 8 + PAYLOAD);
+    memset(udp + 8, 'K', PAYLOAD);
+
+    return build_frame(IPPROTO_UDP, 8 + PAYLOAD, 6);
+}
+
+static int build_rst(uint16_t dport) {
+    uint8_t *tcp = frame + 34;
+
+    memset(tcp, 0, 20);
+    put16(tcp, PEER_PORT);
+    put16(tcp + 2, dport);
+    put16(tcp + 12, (5 << 12) | 0x04);
+
+    return build_frame(IPPROTO_TCP, 20, 16);
+}
+
+static int open_socks(int type, int n) {
+    struct sockaddr_in addr;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    for(i = 0; i < n; ++i) {
+        if((socks[i] = socket(PF_INET, type, 0)) < 0) {
+            perror("socket");
+            return i;
+        }
+
+        addr.sin_port = htons(BASE_PORT + i);
+
+        if(bind(socks[i], (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+           (type == SOCK_STREAM && listen(socks[i], 1) < 0)) {
+            perror("bind/listen");
+            close(socks[i]);
+            return i;
+        }
+    }
+
+    return n;
+}
+
+static void close_socks(int n) {
+    int i;
+
+    for(i = 0; i < n; ++i)
+        close(socks[i]);
+}
+
+/* Feed the frame in PER_ROUND times per round, returning the average time per
+   frame in nanoseconds. For UDP, the queued datagrams are read back out
+   between rounds, outside of the timing. */
+static uint64_t time_input(int len, int drain) {
+    uint8_t buf[PAYLOAD];
+    uint64_t start, total = 0;
+    int i, j;
+
+    for(i = 0; i < ROUNDS; ++i) {
+        start = timer_ns_gettime64();
+
+        for(j = 0; j < PER_ROUND; ++j)
+            net_input(net_default_dev, frame, len);
+
+        total += timer_ns_gettime64() - start;
+
+        if(drain >= 0) {
+            while(recv(drain, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ;
+        }
+    }
+
+    return total / (ROUNDS * PER_ROUND);
+}
+
+int main(int argc, char *argv[]) {
+    size_t i;
+    int n, len;
+
+    if(!net_default_dev) {
+        printf("No network device\n");
+        return 1;
+    }
+
+    printf("sockets  UDP ns/packet  TCP ns/packet\n");
+
+    for(i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+        uint64_t udp, tcp;
+
+        if((n = open_socks(SOCK_DGRAM, counts[i])) != counts[i]) {
+            close_socks(n);
+            break;
+        }
+
+        len = build_udp(BASE_PORT);
+        udp = time_input(len, socks[0]);
+        close_socks(n);
+
+        if((n = open_socks(SOCK_STREAM, counts[i])) != counts[i]) {
+            close_socks(n);
+            break;
+        }
+
+        len = build_rst(NO_PORT);
+        tcp = time_input(len, -1);
+        close_socks(n);
+
+        printf("%7d  %13llu  %13llu\n", counts[i], udp, tcp);
+    }
+
+    return 0;
+}
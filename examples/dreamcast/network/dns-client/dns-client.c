@@ -4,7 +4,8 @@
    Copyright (C) 2014 Lawrence Sebald
 
    This example demonstrates how to use getaddrinfo() to look up the network
-   address for a given hostname.
+   address for a given hostname, and how to do the same thing without blocking
+   with getaddrinfo_async().
 
    This example also shows how to display things on the framebuffer with the
    "fb" device for dbgio.
@@ -13,6 +14,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
@@ -23,6 +25,7 @@
 #include <kos/init.h>
 #include <kos/net.h>
 #include <kos/thread.h>
+#include <kos/timer.h>
 
 KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
 
@@ -60,7 +63,10 @@ static void print_addrinfo(struct addrinfo *ai) {
 int main(int argc, char *argv[]) {
     struct addrinfo *ai;
     struct addrinfo hints;
-    int err;
+    gai_async_t *req;
+    struct pollfd pfd;
+    uint64_t start;
+    int err, polls = 0;
 
     /* Set the framebuffer as the output device for dbgio. */
     dbgio_dev_select("fb");
@@ -107,6 +113,38 @@ int main(int argc, char *argv[]) {
        parts of the hints structure) pass NULL instead of a pointer to the hints
        structure. */
 
+    /* Lookups can also be done without waiting for them. Start one for both
+       kinds of address, then keep doing other things (counting, here) while
+       checking on it every so often. The descriptor from getaddrinfo_async_fd()
+       can be used with poll() to wait for the response instead, like this. */
+    printf("Looking up kos.example.net without blocking\n");
+
+    if((err = getaddrinfo_async("kos.example.net", NULL, NULL, &req))) {
+        printf("Error starting lookup: %d\n", err);
+    }
+    else {
+        pfd.events = POLLIN;
+
+        while((err = getaddrinfo_async_poll(req, &ai)) == EAI_INPROGRESS) {
+            pfd.fd = getaddrinfo_async_fd(req);
+            poll(&pfd, 1, 100);
+            ++polls;
+        }
+
+        printf("Finished after %d polls: %d\n", polls, err);
+        print_addrinfo(ai);
+        freeaddrinfo(ai);
+    }
+
+    /* Looking up the same thing again is answered from the cache, without
+       asking the server again. */
+    start = timer_us_gettime64();
+    err = getaddrinfo("sylverant.net", NULL, NULL, &ai);
+    printf("Looked up sylverant.net again in %lu us: %d\n",
+           (unsigned long)(timer_us_gettime64() - start), err);
+    print_addrinfo(ai);
+    freeaddrinfo(ai);
+
     /* Wait 10 seconds for the user to see what's on the screen before we clear
        it during the exit back to the loader */
     thd_sleep(10 * 1000);
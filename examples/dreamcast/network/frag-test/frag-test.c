@@ -0,0 +1,191 @@
+/* KallistiOS ##version##
+
+   frag-test.c
+
+   This example checks that IP fragmentation and reassembly work, for both
+   IPv4 and IPv6, without anything on the other end of the cable. It turns
+   the MTU of the loopback device down, so that UDP datagrams of a few
+   kilobytes have to be sent to the loopback address (127.0.0.1 or ::1) in
+   pieces, and checks that every one of them comes back whole.
+
+   Each size is tried twice: once with the fragments arriving in order, and
+   once with the loopback device holding some of them back so that the ones
+   after them overtake them, which makes reassembly deal with fragments in
+   any order, including the last one arriving first.
+
+   For each size, it prints how many datagrams came back intact and how long
+   each took, and at the end, the fragment counters of the IPv4 and IPv6
+   layers. No network adapter is needed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PORT        1238
+#define COUNT       20
+#define BUF_SIZE    60000
+#define MTU4        576
+#define MTU6        1280
+#define TIMEOUT     1000
+
+static const int sizes[] = { 1000, 4000, 16000, BUF_SIZE };
+
+static uint8_t sbuf[BUF_SIZE], rbuf[BUF_SIZE];
+
+static void fill(uint8_t *buf, int size, int seq) {
+    int i;
+
+    for(i = 0; i < size; i++)
+        buf[i] = (uint8_t)(i * 7 + seq + size);
+}
+
+/* Wait for a datagram for up to TIMEOUT ms. */
+static int recv_wait(int s, uint8_t *buf, int size) {
+    uint64_t end = timer_ms_gettime64() + TIMEOUT;
+    int rv;
+
+    do {
+        if((rv = recv(s, buf, size, MSG_DONTWAIT)) >= 0)
+            return rv;
+
+        thd_pass();
+    } while(timer_ms_gettime64() < end);
+
+    return -1;
+}
+
+static int run(int s, const struct sockaddr *addr, socklen_t alen,
+               int size) {
+    uint64_t start, us;
+    int i, good = 0;
+
+    start = timer_us_gettime64();
+
+    for(i = 0; i < COUNT; i++) {
+        fill(sbuf, size, i);
+
+        if(sendto(s, sbuf, size, 0, addr, alen) != size) {
+            perror("sendto");
+            break;
+        }
+
+        if(recv_wait(s, rbuf, BUF_SIZE) == size && !memcmp(sbuf, rbuf, size))
+            ++good;
+    }
+
+    us = timer_us_gettime64() - start;
+
+    printf("  %5d bytes: %2d of %d intact, %llu us each\n", size, good,
+           COUNT, us / COUNT);
+
+    return good == COUNT;
+}
+
+static int test(int family, int reorder) {
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+    struct sockaddr *addr;
+    socklen_t alen;
+    size_t i;
+    int s, ok = 1;
+
+    if(family == AF_INET) {
+        memset(&addr4, 0, sizeof(addr4));
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons(PORT);
+        addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr = (struct sockaddr *)&addr4;
+        alen = sizeof(addr4);
+    }
+    else {
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(PORT);
+        addr6.sin6_addr = in6addr_loopback;
+        addr = (struct sockaddr *)&addr6;
+        alen = sizeof(addr6);
+    }
+
+    if((s = socket(family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return 0;
+    }
+
+    if(bind(s, addr, alen) < 0) {
+        perror("bind");
+        close(s);
+        return 0;
+    }
+
+    printf("%s, %s:\n", family == AF_INET ? "IPv4" : "IPv6",
+           reorder ? "reordered" : "in order");
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        ok &= run(s, addr, alen, sizes[i]);
+
+    close(s);
+
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    net_link_params_t params, old;
+    net_ipv4_stats_t st4;
+    net_ipv6_stats_t st6;
+    int mtu, ok = 1;
+    uint32_t mtu6;
+
+    if(!net_loopback_dev) {
+        printf("No loopback device\n");
+        return 1;
+    }
+
+    /* Make anything over a few hundred bytes need fragmenting. */
+    mtu = net_loopback_dev->mtu;
+    mtu6 = net_loopback_dev->mtu6;
+    net_loopback_dev->mtu = MTU4;
+    net_loopback_dev->mtu6 = MTU6;
+    net_link_get_params(net_loopback_dev, &old);
+
+    ok &= test(AF_INET, 0);
+    ok &= test(AF_INET6, 0);
+
+    /* Hold back one frame in five, for long enough that several others get
+       ahead of it. */
+    params = old;
+    params.reorder = 200;
+    params.reorder_delay = 2000;
+    net_link_set_params(net_loopback_dev, &params);
+
+    ok &= test(AF_INET, 1);
+    ok &= test(AF_INET6, 1);
+
+    net_link_set_params(net_loopback_dev, &old);
+    net_loopback_dev->mtu = mtu;
+    net_loopback_dev->mtu6 = mtu6;
+
+    st4 = net_ipv4_get_stats();
+    st6 = net_ipv6_get_stats();
+
+    printf("IPv4: %u fragments, %u datagrams reassembled, %u dropped\n",
+           st4.frag_recv, st4.frag_reasm, st4.frag_dropped);
+    printf("IPv6: %u fragments, %u datagrams reassembled, %u dropped\n",
+           st6.frag_recv, st6.frag_reasm, st6.frag_dropped);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+
+    return !ok;
+}
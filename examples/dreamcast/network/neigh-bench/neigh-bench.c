@@ -0,0 +1,126 @@
+/* KallistiOS ##version##
+
+   neigh-bench.c
+
+   This example measures how long it takes to find the Ethernet address of the
+   next hop of a packet being sent, depending on how many other hosts are in
+   the ARP and NDP caches. Every packet sent to another machine on an Ethernet
+   device goes through one of these lookups, so it is part of the cost of
+   sending anything.
+
+   For each number of hosts, it fills the caches with that many made-up
+   neighbors (which are never actually sent anything), then looks each of them
+   up in turn with net_arp_lookup() and net_ndp_lookup(), and prints the time
+   per lookup. The caches are hash tables, so the times should barely change
+   as the number of hosts goes up.
+
+   A network adapter is needed, since the caches belong to it, but nothing
+   needs to be plugged into it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define MAX_PEERS   500
+#define LOOKUPS     20000
+
+static const int counts[] = { 1, 10, 100, MAX_PEERS };
+
+static const uint8_t peer_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+/* Made-up neighbors: 10.254.x.y and fe80::ff:fe00:xxyy */
+static void peer_ip(int i, uint8_t ip[4]) {
+    ip[0] = 10;
+    ip[1] = 254;
+    ip[2] = (uint8_t)(i >> 8);
+    ip[3] = (uint8_t)(i + 1);
+}
+
+static void peer_ip6(int i, struct in6_addr *ip6) {
+    memset(ip6, 0, sizeof(*ip6));
+    ip6->s6_addr[0] = 0xFE;
+    ip6->s6_addr[1] = 0x80;
+    ip6->s6_addr[12] = 0xFF;
+    ip6->s6_addr[13] = 0xFE;
+    ip6->s6_addr[14] = (uint8_t)(i >> 8);
+    ip6->s6_addr[15] = (uint8_t)(i + 1);
+}
+
+static uint64_t time_arp(int n) {
+    uint8_t ip[4], mac[6];
+    uint64_t start;
+    int i;
+
+    for(i = 0; i < n; ++i) {
+        peer_ip(i, ip);
+        net_arp_insert(net_default_dev, peer_mac, ip, timer_ms_gettime64());
+    }
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < LOOKUPS; ++i) {
+        peer_ip(i % n, ip);
+
+        if(net_arp_lookup(net_default_dev, ip, mac, NULL, NULL, 0)) {
+            printf("ARP lookup of peer %d failed\n", i % n);
+            break;
+        }
+    }
+
+    return (timer_ns_gettime64() - start) / LOOKUPS;
+}
+
+static uint64_t time_ndp(int n) {
+    struct in6_addr ip6;
+    uint8_t mac[6];
+    uint64_t start;
+    int i;
+
+    for(i = 0; i < n; ++i) {
+        peer_ip6(i, &ip6);
+        net_ndp_insert(net_default_dev, peer_mac, &ip6, 0);
+    }
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < LOOKUPS; ++i) {
+        peer_ip6(i % n, &ip6);
+
+        if(net_ndp_lookup(net_default_dev, &ip6, mac, NULL, NULL, 0)) {
+            printf("NDP lookup of peer %d failed\n", i % n);
+            break;
+        }
+    }
+
+    return (timer_ns_gettime64() - start) / LOOKUPS;
+}
+
+int main(int argc, char *argv[]) {
+    size_t i;
+
+    if(!net_default_dev) {
+        printf("No network device\n");
+        return 1;
+    }
+
+    printf("hosts  ARP ns/lookup  NDP ns/lookup\n");
+
+    for(i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+        uint64_t arp = time_arp(counts[i]);
+        uint64_t ndp = time_ndp(counts[i]);
+
+        printf("%5d  %13llu  %13llu\n", counts[i], arp, ndp);
+    }
+
+    return 0;
+}
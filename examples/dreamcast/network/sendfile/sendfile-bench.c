@@ -0,0 +1,169 @@
+/* KallistiOS ##version##
+
+   sendfile-bench.c
+
+   This example compares two ways of serving a file over TCP: reading it into
+   a buffer with fs_read() and passing that to send(), and handing the whole
+   thing to sendfile(). The file is a 1 MiB file on the ramdisk, which can be
+   mapped, so sendfile() copies it straight from the ramdisk into the socket.
+
+   The program listens on port 1234 and serves the file once to each of the
+   first two clients that connect, first with the read() and send() loop and
+   then with sendfile(). From a PC, run something like this twice:
+
+       nc <dreamcast ip> 1234 > /dev/null
+
+   For each method, it prints the time taken, the throughput and the CPU time
+   the serving thread used per megabyte.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+
+#include <kos/init.h>
+#include <kos/fs.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define FILE_PATH   "/ram/bench.bin"
+#define FILE_SIZE   (1024 * 1024)
+#define BUF_SIZE    4096
+#define PORT        1234
+
+static int make_file(void) {
+    uint8_t buf[BUF_SIZE];
+    file_t fd;
+    int i;
+
+    for(i = 0; i < BUF_SIZE; i++)
+        buf[i] = (uint8_t)i;
+
+    if((fd = fs_open(FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+        return -1;
+
+    for(i = 0; i < FILE_SIZE / BUF_SIZE; i++) {
+        if(fs_write(fd, buf, BUF_SIZE) != BUF_SIZE) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+
+    fs_close(fd);
+    return 0;
+}
+
+static ssize_t serve_read_send(int s, file_t fd) {
+    uint8_t buf[BUF_SIZE];
+    ssize_t total = 0, rv, sent, n;
+
+    while((rv = fs_read(fd, buf, BUF_SIZE)) > 0) {
+        sent = 0;
+
+        while(sent < rv) {
+            if((n = send(s, buf + sent, rv - sent, 0)) < 0)
+                return -1;
+
+            sent += n;
+        }
+
+        total += rv;
+    }
+
+    return total;
+}
+
+static ssize_t serve_sendfile(int s, file_t fd) {
+    ssize_t total = 0, rv;
+
+    while(total < FILE_SIZE) {
+        if((rv = sendfile(s, fd, NULL, FILE_SIZE - total)) <= 0)
+            return -1;
+
+        total += rv;
+    }
+
+    return total;
+}
+
+static void serve(int ls, const char *name,
+                  ssize_t (*func)(int s, file_t fd)) {
+    uint64_t start, end, cpu;
+    ssize_t sent;
+    file_t fd;
+    int s;
+
+    printf("Waiting for a client for %s...\n", name);
+
+    if((s = accept(ls, NULL, NULL)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    if((fd = fs_open(FILE_PATH, O_RDONLY)) < 0) {
+        printf("Cannot open %s\n", FILE_PATH);
+        close(s);
+        return;
+    }
+
+    cpu = thd_get_cpu_time(thd_current);
+    start = timer_us_gettime64();
+    sent = func(s, fd);
+    end = timer_us_gettime64();
+    cpu = thd_get_cpu_time(thd_current) - cpu;
+
+    fs_close(fd);
+    close(s);
+
+    if(sent != FILE_SIZE) {
+        printf("  %s: only sent %d bytes\n", name, (int)sent);
+        return;
+    }
+
+    printf("  %s: %llu us, %llu KiB/s, %llu us of CPU per MiB\n", name,
+           end - start, (uint64_t)FILE_SIZE * 1000000 / 1024 / (end - start),
+           cpu / 1000 / (FILE_SIZE / (1024 * 1024)));
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    int ls;
+
+    if(make_file() < 0) {
+        printf("Cannot create %s\n", FILE_PATH);
+        return 1;
+    }
+
+    if((ls = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(ls, 1) < 0) {
+        perror("bind/listen");
+        close(ls);
+        return 1;
+    }
+
+    serve(ls, "read+send", serve_read_send);
+    serve(ls, "sendfile", serve_sendfile);
+
+    close(ls);
+    fs_unlink(FILE_PATH);
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+/* KallistiOS ##version##
+
+   tcp-bulk.c
+
+   This example measures bulk TCP throughput with different socket buffer
+   sizes. The size of the buffers limits how much data can be in flight at
+   once, so with small buffers a connection can't go any faster than one
+   buffer per round trip, however fast the link is.
+
+   It also shows what small writes cost. Those are coalesced into full
+   segments by Nagle's algorithm, unless TCP_NODELAY is set, in which case
+   each one goes out as a segment of its own.
+
+   The program listens on port 1236. For each configuration, it serves two
+   clients: it sends a block of data to the first and receives a block of data
+   from the second. The configurations that don't set SO_RCVBUF at all have the
+   receive buffer autotuned. From a PC, run something like this once per
+   configuration:
+
+       nc <dreamcast ip> 1236 > /dev/null
+       head -c 8388608 /dev/zero | nc -N <dreamcast ip> 1236
+
+   For each run, it prints the throughput, the packets sent and received per
+   second, the CPU time used per megabyte and what SO_RCVBUF and SO_SNDBUF
+   ended up as.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PORT        1236
+#define XFER_SIZE   (8 * 1024 * 1024)
+#define BUF_SIZE    16384
+
+/* Configurations to try. A buffer size of zero means to leave the default
+   alone, and chunk is how much is passed to each send() call. */
+typedef struct {
+    int rcvbuf;
+    int sndbuf;
+    int chunk;
+    int nodelay;
+} run_t;
+
+static const run_t runs[] = {
+    { 8192, 8192, BUF_SIZE, 0 },
+    { 65536, 65536, BUF_SIZE, 0 },
+    { 262144, 262144, BUF_SIZE, 0 },
+    { 0, 262144, BUF_SIZE, 0 },
+    { 0, 65536, 256, 0 },
+    { 0, 65536, 256, 1 }
+};
+
+static uint8_t buf[BUF_SIZE];
+static net_tcp_stats_t before;
+static uint64_t cpu;
+
+static int accept_client(int ls, const run_t *run) {
+    int s, rcvbuf = run->rcvbuf, sndbuf = run->sndbuf;
+
+    if((s = accept(ls, NULL, NULL)) < 0) {
+        perror("accept");
+        return -1;
+    }
+
+    /* The receive window was already offered when the connection was set up,
+       so a larger SO_RCVBUF set here just makes room for a larger one. */
+    if(rcvbuf && setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                            sizeof(rcvbuf)) < 0)
+        perror("setsockopt(SO_RCVBUF)");
+
+    if(sndbuf && setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                            sizeof(sndbuf)) < 0)
+        perror("setsockopt(SO_SNDBUF)");
+
+    if(run->nodelay && setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &run->nodelay,
+                                  sizeof(run->nodelay)) < 0)
+        perror("setsockopt(TCP_NODELAY)");
+
+    before = net_tcp_get_stats();
+    cpu = thd_get_cpu_time(thd_current);
+
+    return s;
+}
+
+static void end_run(int s, const char *what, size_t xfer, uint64_t us) {
+    net_tcp_stats_t after = net_tcp_get_stats();
+    socklen_t len;
+    int rcvbuf = 0, sndbuf = 0;
+
+    cpu = thd_get_cpu_time(thd_current) - cpu;
+
+    len = sizeof(rcvbuf);
+    getsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    len = sizeof(sndbuf);
+    getsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    close(s);
+
+    if(!us)
+        us = 1;
+
+    printf("  %s: %u KiB in %llu ms, %llu KiB/s\n", what,
+           (unsigned int)(xfer / 1024), us / 1000,
+           (uint64_t)xfer * 1000000 / 1024 / us);
+    printf("    %llu packets/s out, %llu packets/s in\n",
+           (uint64_t)(after.pkt_sent - before.pkt_sent) * 1000000 / us,
+           (uint64_t)(after.pkt_recv - before.pkt_recv) * 1000000 / us);
+    printf("    %llu us of CPU per MiB\n",
+           cpu * 1024 * 1024 / (xfer ? xfer : 1) / 1000);
+    printf("    SO_RCVBUF %d, SO_SNDBUF %d\n", rcvbuf, sndbuf);
+}
+
+static void run_send(int ls, const run_t *run) {
+    uint64_t start;
+    ssize_t n;
+    size_t sent = 0;
+    int s;
+
+    printf("Waiting for a client to send to...\n");
+
+    if((s = accept_client(ls, run)) < 0)
+        return;
+
+    memset(buf, 'K', sizeof(buf));
+    start = timer_us_gettime64();
+
+    while(sent < XFER_SIZE) {
+        if((n = send(s, buf, run->chunk, 0)) <= 0) {
+            perror("send");
+            break;
+        }
+
+        sent += n;
+    }
+
+    end_run(s, "send", sent, timer_us_gettime64() - start);
+}
+
+static void run_recv(int ls, const run_t *run) {
+    uint64_t start;
+    ssize_t n;
+    size_t rcvd = 0;
+    int s;
+
+    printf("Waiting for a client to receive from...\n");
+
+    if((s = accept_client(ls, run)) < 0)
+        return;
+
+    start = timer_us_gettime64();
+
+    while((n = recv(s, buf, BUF_SIZE, 0)) > 0)
+        rcvd += n;
+
+    end_run(s, "recv", rcvd, timer_us_gettime64() - start);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    size_t i;
+    int ls;
+
+    if((ls = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(ls, 1) < 0) {
+        perror("bind/listen");
+        close(ls);
+        return 1;
+    }
+
+    for(i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        if(runs[i].rcvbuf)
+            printf("SO_RCVBUF %d", runs[i].rcvbuf);
+        else
+            printf("SO_RCVBUF autotuned");
+
+        printf(", SO_SNDBUF %d, %d byte writes%s:\n", runs[i].sndbuf,
+               runs[i].chunk, runs[i].nodelay ? ", TCP_NODELAY" : "");
+
+        run_send(ls, runs + i);
+        run_recv(ls, runs + i);
+    }
+
+    close(ls);
+
+    return 0;
+}
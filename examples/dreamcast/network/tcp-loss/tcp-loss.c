@@ -0,0 +1,310 @@
+/* KallistiOS ##version##
+
+   tcp-loss.c
+
+   This example measures how well TCP copes with a bad link. It hooks the
+   network device's transmit function and the network input path so that a
+   given percentage of TCP frames, in both directions, are silently thrown away
+   or held back and delivered after the next frame, as a lossy or reordering
+   link (like a wireless bridge) would.
+
+   The program listens on port 1235. For each combination of loss and
+   reordering it serves two clients: it sends a block of data to the first and
+   receives a block of data from the second. From a PC, run something like
+   this once per combination:
+
+       nc <dreamcast ip> 1235 > /dev/null
+       head -c 2097152 /dev/zero | nc -N <dreamcast ip> 1235
+
+   For each run, it prints the throughput, the longest time a single send() or
+   recv() call was stuck waiting for the connection to recover, and how many
+   retransmission timeouts, fast retransmits and resent segments it took, as
+   well as how many segments arrived out of order and were queued.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <arch/irq.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PORT        1235
+#define XFER_SIZE   (2 * 1024 * 1024)
+#define BUF_SIZE    8192
+#define FRAME_SIZE  1514
+
+static const struct {
+    int loss;
+    int reorder;
+} runs[] = {
+    { 0, 0 }, { 1, 0 }, { 2, 0 }, { 5, 0 }, { 10, 0 }, { 0, 5 }, { 2, 5 }
+};
+
+/* A frame held back to be delivered after the next one. */
+typedef struct {
+    uint8_t data[FRAME_SIZE];
+    int len;
+} held_t;
+
+static int (*real_tx)(netif_t *self, const uint8_t *data, int len,
+                      int blocking);
+static net_input_func real_input;
+static volatile int loss_pct, reorder_pct;
+static volatile uint32_t dropped, reordered;
+static held_t tx_held, rx_held;
+
+/* Is this an Ethernet frame carrying a TCP segment over IPv4 or IPv6? */
+static int is_tcp(const uint8_t *data, int len) {
+    if(len < 54 || len > FRAME_SIZE)
+        return 0;
+
+    if(data[12] == 0x08 && data[13] == 0x00)
+        return data[23] == IPPROTO_TCP;
+    else if(data[12] == 0x86 && data[13] == 0xDD)
+        return data[20] == IPPROTO_TCP;
+
+    return 0;
+}
+
+/* Decide what to do with a frame: returns 0 to pass it on, 1 to drop it and 2
+   to hold it back, if nothing else is being held already. */
+static int impair(const uint8_t *data, int len, held_t *held) {
+    int r;
+
+    if(!is_tcp(data, len))
+        return 0;
+
+    r = rand() % 100;
+
+    if(r < loss_pct) {
+        ++dropped;
+        return 1;
+    }
+
+    if(r < loss_pct + reorder_pct && !held->len) {
+        ++reordered;
+        return 2;
+    }
+
+    return 0;
+}
+
+static int lossy_tx(netif_t *self, const uint8_t *data, int len,
+                    int blocking) {
+    static uint8_t frame[FRAME_SIZE];
+    irq_mask_t old;
+    int rv, flen = 0;
+
+    old = irq_disable();
+
+    switch(impair(data, len, &tx_held)) {
+        case 1:
+            irq_restore(old);
+            return 0;
+
+        case 2:
+            memcpy(tx_held.data, data, len);
+            tx_held.len = len;
+            irq_restore(old);
+            return 0;
+    }
+
+    if(tx_held.len) {
+        memcpy(frame, tx_held.data, tx_held.len);
+        flen = tx_held.len;
+        tx_held.len = 0;
+    }
+
+    irq_restore(old);
+
+    rv = real_tx(self, data, len, blocking);
+
+    if(flen)
+        real_tx(self, frame, flen, blocking);
+
+    return rv;
+}
+
+static int lossy_input(netif_t *nif, const uint8_t *pkt, int len) {
+    int rv;
+
+    switch(impair(pkt, len, &rx_held)) {
+        case 1:
+            return 0;
+
+        case 2:
+            memcpy(rx_held.data, pkt, len);
+            rx_held.len = len;
+            return 0;
+    }
+
+    rv = real_input(nif, pkt, len);
+
+    if(rx_held.len) {
+        real_input(nif, rx_held.data, rx_held.len);
+        rx_held.len = 0;
+    }
+
+    return rv;
+}
+
+static void start_run(int loss, int reorder, net_tcp_stats_t *before) {
+    *before = net_tcp_get_stats();
+    dropped = reordered = 0;
+    loss_pct = loss;
+    reorder_pct = reorder;
+}
+
+static void end_run(const char *what, size_t xfer, uint64_t us,
+                    uint64_t stall, const net_tcp_stats_t *before) {
+    net_tcp_stats_t after = net_tcp_get_stats();
+
+    loss_pct = reorder_pct = 0;
+
+    printf("  %s: %u KiB in %llu ms, %llu KiB/s\n", what,
+           (unsigned int)(xfer / 1024), us / 1000,
+           (uint64_t)xfer * 1000000 / 1024 / us);
+    printf("    longest stall: %llu ms\n", stall / 1000);
+    printf("    %u frames dropped, %u reordered\n", (unsigned int)dropped,
+           (unsigned int)reordered);
+    printf("    %u timeouts, %u fast retransmits, %u segments resent "
+           "(%u SACK holes)\n",
+           (unsigned int)(after.timeouts - before->timeouts),
+           (unsigned int)(after.fast_retransmits - before->fast_retransmits),
+           (unsigned int)(after.retransmits - before->retransmits),
+           (unsigned int)(after.sack_retransmits - before->sack_retransmits));
+    printf("    %u segments queued out of order\n",
+           (unsigned int)(after.pkt_recv_ooo - before->pkt_recv_ooo));
+}
+
+static void run_send(int ls, int loss, int reorder) {
+    static uint8_t buf[BUF_SIZE];
+    net_tcp_stats_t before;
+    uint64_t start, t, stall = 0;
+    ssize_t n;
+    size_t sent = 0;
+    int s;
+
+    printf("Waiting for a client to send to...\n");
+
+    if((s = accept(ls, NULL, NULL)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    memset(buf, 'K', sizeof(buf));
+    start_run(loss, reorder, &before);
+    start = timer_us_gettime64();
+
+    while(sent < XFER_SIZE) {
+        t = timer_us_gettime64();
+
+        if((n = send(s, buf, BUF_SIZE, 0)) <= 0) {
+            perror("send");
+            break;
+        }
+
+        t = timer_us_gettime64() - t;
+
+        if(t > stall)
+            stall = t;
+
+        sent += n;
+    }
+
+    t = timer_us_gettime64() - start;
+    close(s);
+    end_run("send", sent, t, stall, &before);
+}
+
+static void run_recv(int ls, int loss, int reorder) {
+    static uint8_t buf[BUF_SIZE];
+    net_tcp_stats_t before;
+    uint64_t start, t, stall = 0;
+    ssize_t n;
+    size_t rcvd = 0;
+    int s;
+
+    printf("Waiting for a client to receive from...\n");
+
+    if((s = accept(ls, NULL, NULL)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    start_run(loss, reorder, &before);
+    start = timer_us_gettime64();
+
+    for(;;) {
+        t = timer_us_gettime64();
+
+        if((n = recv(s, buf, BUF_SIZE, 0)) <= 0)
+            break;
+
+        t = timer_us_gettime64() - t;
+
+        if(t > stall)
+            stall = t;
+
+        rcvd += n;
+    }
+
+    t = timer_us_gettime64() - start;
+    close(s);
+    end_run("recv", rcvd, t, stall, &before);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    size_t i;
+    int ls;
+
+    if(!net_default_dev) {
+        printf("No network device\n");
+        return 1;
+    }
+
+    if((ls = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(ls, 1) < 0) {
+        perror("bind/listen");
+        close(ls);
+        return 1;
+    }
+
+    real_tx = net_default_dev->if_tx;
+    net_default_dev->if_tx = lossy_tx;
+    real_input = net_input_set_target(lossy_input);
+
+    for(i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        printf("%d%% loss, %d%% reordering:\n", runs[i].loss, runs[i].reorder);
+        run_send(ls, runs[i].loss, runs[i].reorder);
+        run_recv(ls, runs[i].loss, runs[i].reorder);
+    }
+
+    net_input_set_target(real_input);
+    net_default_dev->if_tx = real_tx;
+    close(ls);
+
+    return 0;
+}
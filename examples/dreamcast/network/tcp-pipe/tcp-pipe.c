@@ -0,0 +1,200 @@
+/* KallistiOS ##version##
+
+   tcp-pipe.c
+
+   This example measures TCP over links of different quality, without needing
+   any network hardware or anything on the other end of a cable. It creates a
+   pipe, which is a pair of virtual Ethernet devices where anything sent on
+   one end arrives at the other, gives the two ends addresses on their own
+   network, and connects to the address of one end from the other, so every
+   segment goes all the way down through the stack, across the pipe and back
+   up again.
+
+   For each run, the link parameters of both ends are set to give the pipe a
+   bandwidth, a latency and a percentage of frames that are lost or reordered
+   on the way. Then a block of data is sent across it, and the throughput is
+   printed along with how many retransmission timeouts, fast retransmits and
+   resent segments it took, and how many segments arrived out of order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PORT        1238
+#define XFER_SIZE   (1024 * 1024)
+#define BUF_SIZE    8192
+
+/* Addresses of the two ends of the pipe, in host byte order */
+#define CLIENT_IP   0x0A630001      /* 10.99.0.1 */
+#define SERVER_IP   0x0A630002      /* 10.99.0.2 */
+
+static const struct {
+    uint32_t bandwidth;             /* bits per second */
+    uint32_t latency;               /* us, each way */
+    uint16_t loss;                  /* tenths of a percent */
+    uint16_t reorder;               /* tenths of a percent */
+} runs[] = {
+    { 0, 0, 0, 0 },
+    { 100000000, 1000, 0, 0 },
+    { 10000000, 20000, 0, 0 },
+    { 10000000, 20000, 10, 0 },
+    { 10000000, 20000, 50, 0 },
+    { 10000000, 20000, 0, 50 },
+    { 1000000, 100000, 20, 20 }
+};
+
+static uint8_t sbuf[BUF_SIZE], rbuf[BUF_SIZE];
+static int listener;
+
+/* Receive everything sent on one connection, returning how much it was. */
+static void *server(void *arg) {
+    intptr_t total = 0;
+    ssize_t n;
+    int s;
+
+    (void)arg;
+
+    if((s = accept(listener, NULL, NULL)) < 0) {
+        perror("accept");
+        return (void *)-1;
+    }
+
+    while((n = recv(s, rbuf, BUF_SIZE, 0)) > 0)
+        total += n;
+
+    close(s);
+
+    return (void *)total;
+}
+
+static void set_address(netif_t *dev, uint32_t ip) {
+    net_ipv4_parse_address(ip, dev->ip_addr);
+    net_ipv4_parse_address(0xFFFFFF00, dev->netmask);
+    net_ipv4_parse_address(ip | 0xFF, dev->broadcast);
+}
+
+static void run(netif_t *ends[2], size_t i) {
+    net_link_params_t params;
+    net_tcp_stats_t before, after;
+    struct sockaddr_in addr;
+    kthread_t *thd;
+    uint64_t start, us;
+    size_t sent = 0;
+    void *got;
+    ssize_t n;
+    int s;
+
+    memset(&params, 0, sizeof(params));
+    params.bandwidth = runs[i].bandwidth;
+    params.latency = runs[i].latency;
+    params.loss = runs[i].loss;
+    params.reorder = runs[i].reorder;
+    params.reorder_delay = runs[i].latency / 4;
+    net_link_set_params(ends[0], &params);
+    net_link_set_params(ends[1], &params);
+
+    if((s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return;
+    }
+
+    thd = thd_create(0, server, NULL);
+    before = net_tcp_get_stats();
+    start = timer_us_gettime64();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(SERVER_IP);
+
+    if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+    }
+    else {
+        while(sent < XFER_SIZE) {
+            if((n = send(s, sbuf, BUF_SIZE, 0)) <= 0) {
+                perror("send");
+                break;
+            }
+
+            sent += n;
+        }
+    }
+
+    close(s);
+    thd_join(thd, &got);
+
+    us = timer_us_gettime64() - start;
+    after = net_tcp_get_stats();
+
+    if(!us)
+        us = 1;
+
+    printf("%lu bit/s, %lu us, loss %u.%u%%, reorder %u.%u%%:\n",
+           (unsigned long)runs[i].bandwidth, (unsigned long)runs[i].latency,
+           runs[i].loss / 10, runs[i].loss % 10,
+           runs[i].reorder / 10, runs[i].reorder % 10);
+    printf("  %d of %u bytes in %llu ms = %llu KiB/s\n",
+           (int)(intptr_t)got, (unsigned int)sent, us / 1000,
+           (uint64_t)sent * 1000000 / 1024 / us);
+    printf("  rto %lu, fastretx %lu, retx %lu, ooo %lu\n",
+           (unsigned long)(after.timeouts - before.timeouts),
+           (unsigned long)(after.fast_retransmits - before.fast_retransmits),
+           (unsigned long)(after.retransmits - before.retransmits),
+           (unsigned long)(after.pkt_recv_ooo - before.pkt_recv_ooo));
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    netif_t *ends[2];
+    size_t i;
+
+    if(net_pipe_create(ends) < 0) {
+        perror("net_pipe_create");
+        return 1;
+    }
+
+    set_address(ends[0], CLIENT_IP);
+    set_address(ends[1], SERVER_IP);
+
+    if((listener = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(listener, 1) < 0) {
+        perror("listen");
+        close(listener);
+        return 1;
+    }
+
+    memset(sbuf, 'K', sizeof(sbuf));
+
+    for(i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+        run(ends, i);
+
+    close(listener);
+    net_pipe_destroy(ends[0]);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+/* KallistiOS ##version##
+
+   sfxdefrag.c
+
+   Sound Effect Defragmentation Example
+
+   This program shows how unloading sound effects leaves sound RAM in pieces,
+   and how snd_sfx_defrag() puts it back together. It makes up a lot of
+   short beeps of different lengths and loads them until sound RAM is full,
+   the way a game loads the sounds for a level, then unloads every other one,
+   the way it might drop the ones for an area the player has left.
+
+   That frees up half of what the beeps used, but in holes no bigger than a
+   single beep, so a long sound that would fit in the free space can't be
+   loaded. It prints the allocator's statistics, defragments sound RAM,
+   prints them again along with how long that took, and then loads the long
+   sound and plays it, along with one of the beeps that was moved to show
+   its handle still works.
+*/
+
+#include <kos/thread.h>
+#include <kos/timer.h>
+#include <dc/sound/sound.h>
+#include <dc/sound/sfxmgr.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define RATE        22050
+#define BEEPS       256
+
+/* As long as a sound effect can be: 65504 16-bit samples. */
+#define LONG_LEN    (65504 * 2)
+
+static sfxhnd_t beeps[BEEPS];
+static int16_t samples[LONG_LEN / 2];
+
+static uint32_t seed = 0x1234;
+
+static uint32_t rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* A square wave, len bytes of 16-bit mono. */
+static sfxhnd_t make_tone(size_t len, int period) {
+    size_t i;
+
+    for(i = 0; i < len / 2; ++i)
+        samples[i] = (i / (period / 2)) & 1 ? 4000 : -4000;
+
+    return snd_sfx_load_raw_buf((char *)samples, len, RATE, 16, 1);
+}
+
+static void print_stats(const char *when) {
+    snd_mem_stats_t st;
+
+    snd_mem_get_stats(&st);
+
+    printf("%s: %lu KiB free in %lu blocks, largest %lu KiB, "
+           "%lu%% fragmented, %lu of %lu effects movable\n", when,
+           (unsigned long)st.free / 1024, (unsigned long)st.free_blocks,
+           (unsigned long)st.largest_free / 1024,
+           (unsigned long)st.fragmentation,
+           (unsigned long)st.movable_blocks, (unsigned long)st.used_blocks);
+}
+
+int main(int argc, char *argv[]) {
+    sfxhnd_t tone;
+    uint64_t start;
+    size_t len;
+    int i, cnt, moved;
+
+    (void)argc;
+    (void)argv;
+
+    snd_init();
+
+    /* Fill up sound RAM with beeps. */
+    for(cnt = 0; cnt < BEEPS; ++cnt) {
+        len = (2048 + rnd() % 24576) & ~31;
+
+        if((beeps[cnt] = make_tone(len, 20 + cnt % 40)) == SFXHND_INVALID)
+            break;
+    }
+
+    printf("Loaded %d beeps\n", cnt);
+
+    for(i = 0; i < cnt; i += 2) {
+        snd_sfx_unload(beeps[i]);
+        beeps[i] = SFXHND_INVALID;
+    }
+
+    print_stats("Before");
+
+    if((tone = make_tone(LONG_LEN, 100)) != SFXHND_INVALID) {
+        printf("The long sound fit anyway; try making it longer\n");
+        snd_sfx_unload(tone);
+    }
+
+    start = timer_ns_gettime64();
+    moved = snd_sfx_defrag();
+    printf("Moved %d blocks in %lu us\n", moved,
+           (unsigned long)((timer_ns_gettime64() - start) / 1000));
+
+    print_stats("After");
+
+    if((tone = make_tone(LONG_LEN, 100)) == SFXHND_INVALID) {
+        printf("Still can't load the long sound\n");
+        return EXIT_FAILURE;
+    }
+
+    snd_sfx_play(tone, 200, 128);
+    thd_sleep(3000);
+    snd_sfx_play(beeps[cnt - 1 - (cnt & 1)], 200, 128);
+    thd_sleep(1000);
+
+    snd_sfx_unload_all();
+    snd_shutdown();
+
+    return EXIT_SUCCESS;
+}
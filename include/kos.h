@@ -36,6 +36,8 @@ __BEGIN_DECLS
 #include <kos/fs.h>
 #include <kos/fs_romdisk.h>
 #include <kos/fs_ramdisk.h>
+#include <kos/fs_cache.h>
+#include <kos/fs_aio.h>
 #include <kos/fs_dev.h>
 #include <kos/fs_pty.h>
 #include <kos/limits.h>
@@ -46,6 +48,8 @@ __BEGIN_DECLS
 #include <kos/once.h>
 #include <kos/tls.h>
 #include <kos/mutex.h>
+#include <kos/pool.h>
+#include <kos/arena.h>
 #include <kos/cond.h>
 #include <kos/genwait.h>
 #include <kos/library.h>
@@ -0,0 +1,320 @@
+/* KallistiOS ##version##
+
+   include/kos/arena.h
+
+*/
+
+/** \file    kos/arena.h
+    \brief   Arena (region) allocator.
+    \ingroup arena
+
+    This file contains an allocator for data that all goes away at the same
+    time, like everything built up while drawing a frame: display lists,
+    temporary strings, decoded packets. Allocating from an arena just moves a
+    pointer along a block of memory, and instead of being freed one at a
+    time, everything allocated from it is thrown away at once, by resetting
+    it or by going back to a mark. Since none of this goes through malloc(),
+    it can't leave the heap full of holes the way lots of short-lived blocks
+    of different sizes do over a long run.
+
+    For C++, this also has a std::pmr::memory_resource that allocates from an
+    arena, so that containers can use one.
+
+    \see    malloc.h
+    \see    kos/pool.h
+*/
+
+#ifndef __KOS_ARENA_H
+#define __KOS_ARENA_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \defgroup arena Arenas
+    \brief          Linear allocator for data with a shared lifetime
+    \ingroup        system_allocator
+
+    An arena is set up on a block of memory, which can be one the caller
+    already has (a static array, say), one it allocates from the heap, or one
+    taken for good from the top of the heap with malloc_morecore().
+    Allocations come out of the block one after the other, and there's no way
+    to free one on its own. Instead, arena_mark() says where the arena is up to, and
+    arena_release() throws away everything allocated since then;
+    arena_reset() throws away everything.
+
+    Arenas are not locked, so one should only be used by one thread at a time.
+    Give each thread its own instead.
+
+    @{
+*/
+
+/** \brief  Alignment of arena_alloc() allocations.
+
+    This is the same as for malloc().
+*/
+#define ARENA_ALIGN     8
+
+/** \brief  Arena.
+
+    The contents of this structure are private, and should only be accessed
+    through the functions in this file.
+
+    \headerfile kos/arena.h
+*/
+typedef struct arena {
+    /** \cond */
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+    uint32_t failed;
+    int owned;
+    /** \endcond */
+} arena_t;
+
+/** \brief  A point to go back to with arena_release(). */
+typedef size_t arena_mark_t;
+
+/** \brief  Set up an arena on a block of memory.
+
+    \param  a               The arena to set up.
+    \param  buf             The block to allocate from, or NULL to allocate
+                            one from the heap, which arena_destroy() frees.
+    \param  size            The size of the block.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to ENOMEM if a block
+                            couldn't be allocated.
+*/
+int arena_init(arena_t *a, void *buf, size_t size);
+
+/** \brief  Set up an arena on memory taken from the top of the heap.
+
+    The memory is taken from the top of the heap for good: it is never given
+    back, not even by arena_destroy(). This is for an arena that lasts as long
+    as the program does, and keeps even one big block from sitting in the
+    middle of the heap. It is taken with malloc_morecore(), so the low memory
+    handlers hear about it just as they would about the heap growing.
+
+    \param  a               The arena to set up.
+    \param  size            How many bytes to take.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to ENOMEM if there isn't
+                            that much memory left.
+*/
+int arena_init_sbrk(arena_t *a, size_t size);
+
+/** \brief  Tear down an arena.
+
+    This frees the arena's block if arena_init() allocated it. Anything
+    allocated from the arena is gone after this.
+
+    \param  a               The arena to tear down.
+*/
+void arena_destroy(arena_t *a);
+
+/** \cond */
+void *arena_alloc_failed(arena_t *a);
+/** \endcond */
+
+/** \brief  Allocate from an arena with a given alignment.
+
+    \param  a               The arena to allocate from.
+    \param  size            The number of bytes to allocate.
+    \param  align           The alignment, which must be a power of two.
+    \return                 The allocated memory, or NULL (with errno set to
+                            ENOMEM) if there isn't room for it.
+*/
+static inline void *arena_alloc_aligned(arena_t *a, size_t size,
+                                        size_t align) {
+    uintptr_t end = (uintptr_t)a->base + a->size;
+    uintptr_t p = ((uintptr_t)a->base + a->used + align - 1) &
+                  ~(uintptr_t)(align - 1);
+
+    if(__predict_false(p > end || size > end - p))
+        return arena_alloc_failed(a);
+
+    a->used = p + size - (uintptr_t)a->base;
+
+    return (void *)p;
+}
+
+/** \brief  Allocate from an arena.
+
+    The memory is aligned to \ref ARENA_ALIGN bytes.
+
+    \param  a               The arena to allocate from.
+    \param  size            The number of bytes to allocate.
+    \return                 The allocated memory, or NULL (with errno set to
+                            ENOMEM) if there isn't room for it.
+*/
+static inline void *arena_alloc(arena_t *a, size_t size) {
+    return arena_alloc_aligned(a, size, ARENA_ALIGN);
+}
+
+/** \brief  Copy a string into an arena.
+
+    \param  a               The arena to allocate from.
+    \param  s               The string to copy.
+    \return                 The copy, or NULL (with errno set to ENOMEM) if
+                            there isn't room for it.
+*/
+char *arena_strdup(arena_t *a, const char *s);
+
+/** \brief  Get the point an arena is up to.
+
+    \param  a               The arena.
+    \return                 A mark to pass to arena_release().
+*/
+static inline arena_mark_t arena_mark(const arena_t *a) {
+    return a->used;
+}
+
+/** \brief  Throw away everything allocated since a mark.
+
+    Marks can be nested: releasing to a mark also throws away any marks taken
+    after it.
+
+    \param  a               The arena.
+    \param  mark            A mark from arena_mark().
+*/
+void arena_release(arena_t *a, arena_mark_t mark);
+
+/** \brief  Throw away everything allocated from an arena.
+
+    \param  a               The arena.
+*/
+void arena_reset(arena_t *a);
+
+/** \brief  Get the number of bytes allocated from an arena.
+
+    \param  a               The arena.
+    \return                 The bytes in use, including alignment padding.
+*/
+static inline size_t arena_used(const arena_t *a) {
+    return a->used;
+}
+
+/** \brief  Get the number of bytes left in an arena.
+
+    \param  a               The arena.
+    \return                 The bytes that can still be allocated.
+*/
+static inline size_t arena_avail(const arena_t *a) {
+    return a->size - a->used;
+}
+
+/** \brief  Get the most bytes an arena has had allocated at once.
+
+    This is what to look at to see how big an arena needs to be.
+
+    \param  a               The arena.
+    \return                 The high-water mark, in bytes.
+*/
+size_t arena_peak(const arena_t *a);
+
+/** \brief  Get the number of allocations from an arena that failed.
+
+    \param  a               The arena.
+    \return                 How many allocations didn't fit.
+*/
+static inline uint32_t arena_failed(const arena_t *a) {
+    return a->failed;
+}
+
+/** @} */
+
+__END_DECLS
+
+#if defined(__cplusplus) && __cplusplus >= 201703L && \
+    __has_include(<memory_resource>)
+
+#include <memory_resource>
+
+namespace kos {
+
+/** \brief  A std::pmr::memory_resource that allocates from an arena.
+    \ingroup arena
+
+    Deallocating does nothing; the memory comes back when the arena is reset
+    or released. If the arena is full, allocations go to the upstream
+    resource instead, which by default is std::pmr::null_memory_resource()
+    and so fails them. Pass std::pmr::new_delete_resource() (or anything
+    else) to let them spill over to the heap instead.
+
+    \code
+    arena_t frame;
+    arena_init(&frame, NULL, 64 * 1024);
+    kos::arena_resource res(&frame);
+
+    std::pmr::vector<int> v(&res);
+    std::pmr::string s("temporary", &res);
+    \endcode
+
+    \headerfile kos/arena.h
+*/
+class arena_resource : public std::pmr::memory_resource {
+public:
+    /** \brief  Allocate from an arena.
+        \param  a           The arena, which must outlive this.
+        \param  upstream    Where to go when the arena is full.
+    */
+    explicit arena_resource(arena_t *a,
+                            std::pmr::memory_resource *upstream =
+                                std::pmr::null_memory_resource()) noexcept :
+        arena_(a), upstream_(upstream) {}
+
+    arena_resource(const arena_resource &) = delete;
+    arena_resource &operator=(const arena_resource &) = delete;
+
+    /** \brief  Get the arena this allocates from. */
+    arena_t *arena() const noexcept {
+        return arena_;
+    }
+
+    /** \brief  Get the resource used when the arena is full. */
+    std::pmr::memory_resource *upstream_resource() const noexcept {
+        return upstream_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *p = arena_alloc_aligned(arena_, bytes,
+                                      align > ARENA_ALIGN ? align : ARENA_ALIGN);
+
+        /* Upstream gets the alignment asked for, since that's what it will
+           be given back with. */
+        if(!p)
+            p = upstream_->allocate(bytes, align);
+
+        return p;
+    }
+
+    void do_deallocate(void *p, std::size_t bytes,
+                       std::size_t align) override {
+        uint8_t *b = static_cast<uint8_t *>(p);
+
+        /* Only the ones that spilled over need anything done. */
+        if(b < arena_->base || b >= arena_->base + arena_->size)
+            upstream_->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const
+        noexcept override {
+        return this == &other;
+    }
+
+private:
+    arena_t *arena_;
+    std::pmr::memory_resource *upstream_;
+};
+
+}
+
+#endif /* __cplusplus >= 201703L */
+
+#endif /* __KOS_ARENA_H */
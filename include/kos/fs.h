@@ -96,6 +96,17 @@ typedef int file_t;
 /** \brief  Invalid file handle constant (for open failure, etc) */
 #define FILEHND_INVALID ((file_t)-1)
 
+struct fs_aio_req;
+
+/** \name   VFS caching flags
+    \brief  Values for the cache member of vfs_handler_t, OR'd together.
+    @{
+*/
+#define VFS_CACHE_NONE      0x00    /**< \brief No caching */
+#define VFS_CACHE_MMAP      0x01    /**< \brief Map files through the file cache */
+#define VFS_CACHE_DENTRY    0x02    /**< \brief Cache fs_stat() lookups */
+/** @} */
+
 /** \brief  VFS handler interface.
 
     All VFS handlers must implement this interface.
@@ -107,7 +118,7 @@ typedef struct vfs_handler {
     nmmgr_handler_t nmmgr;
 
     /* Some VFS-specific pieces */
-    /** \brief Allow VFS caching; 0=no, 1=yes */
+    /** \brief Allow VFS caching; a combination of the VFS_CACHE_* flags */
     int cache;
     /** \brief Pointer to private data for the handler */
     void *privdata;
@@ -204,6 +215,12 @@ typedef struct vfs_handler {
 
     /** \brief Get status information on an already opened file. */
     int (*fstat)(void *hnd, struct stat *st);
+
+    /** \brief Start an asynchronous read or write (see kos/fs_aio.h)
+        \note  Return 0 once the request is started, and call fs_aio_done()
+               when it completes. Return -1 if it can't be started right away,
+               and it will be carried out by the worker threads instead. */
+    int (*aio)(void *hnd, struct fs_aio_req *req);
 } vfs_handler_t;
 
 /** \cond */
@@ -452,6 +469,11 @@ int fs_chdir(const char *fn);
                             this operation. If you attempt to use this function
                             on a filesystem that does not support it, the
                             function will return NULL and set errno to EINVAL.
+                            Filesystems without native support that use the
+                            file cache (see kos/fs_cache.h) can map files that
+                            were opened read-only; the buffer is shared with
+                            other descriptors mapping the same file and must
+                            not be written to.
 
     \param  hnd             The descriptor to memory map.
     
@@ -468,6 +490,8 @@ void *fs_mmap(file_t hnd);
                             this operation. If you attempt to use this function
                             on a filesystem that does not support it, the
                             function will return -1 and set errno to EINVAL.
+                            See kos/fs_aio.h for asynchronous I/O that works
+                            with every filesystem.
 
     \param  fd              The descriptor to complete I/O on.
     \param  rv              A buffer to store the size of the I/O in.
@@ -580,10 +604,52 @@ ssize_t fs_readlink(const char *path, char *buf, size_t bufsize);
                             the end of the path, pass AT_SYMLINK_NOFOLLOW,
                             otherwise pass 0.
     
+    On filesystems that allow it (see \ref VFS_CACHE_DENTRY), results are kept
+    in a cache keyed on the path, as is the fact that a path does not exist, so
+    looking up the same path again doesn't go through the filesystem. Only
+    normalized absolute paths (or relative paths that make one when appended to
+    the current directory) are cached, and lookups with AT_SYMLINK_NOFOLLOW
+    always go through the filesystem.
+
     \return                 0 on success, -1 on failure.
 */
 int fs_stat(const char *path, struct stat *buf, int flag);
 
+/** \brief   Directory entry cache statistics.
+
+    \headerfile kos/fs.h
+*/
+typedef struct fs_dcache_stats {
+    uint32_t hits;          /**< \brief Lookups of cached paths */
+    uint32_t neg_hits;      /**< \brief Lookups of paths cached as missing */
+    uint32_t misses;        /**< \brief Lookups that went to the filesystem */
+    uint32_t evictions;     /**< \brief Entries dropped to make room */
+    uint32_t invalidations; /**< \brief Entries dropped because they changed */
+    uint32_t entries;       /**< \brief Entries currently cached */
+} fs_dcache_stats_t;
+
+/** \brief   Retrieve directory entry cache statistics.
+
+    \param  st              Buffer to fill in with the statistics.
+*/
+void fs_dcache_get_stats(fs_dcache_stats_t *st);
+
+/** \brief   Drop cached directory entries.
+
+    The VFS drops entries itself when files are created, written, renamed or
+    removed through it. Filesystems only need to call this when their contents
+    change behind the VFS's back, such as when a disc is swapped or a
+    filesystem is unmounted.
+
+    \param  vfs             The filesystem, or NULL to drop every entry. This
+                            may be called from an interrupt, in which case
+                            every entry is dropped regardless.
+    \param  fn              The path within the filesystem to drop (along with
+                            everything below it), or NULL for the whole
+                            filesystem.
+*/
+void fs_dcache_invalidate(vfs_handler_t *vfs, const char *fn);
+
 /** \brief   Rewind a directory to the start.
 
     This function rewinds the position of a directory stream to the beginning of
@@ -0,0 +1,284 @@
+/* KallistiOS ##version##
+
+   kos/fs_aio.h
+
+*/
+
+/** \file    kos/fs_aio.h
+    \brief   Asynchronous file I/O.
+    \ingroup vfs_aio
+
+    This file contains an asynchronous I/O interface for the VFS. Reads and
+    writes are described by request structures which are submitted (one at a
+    time or in batches) and complete later, while the submitting thread goes on
+    with other work, such as rendering the next frame.
+
+    When a request completes, its completion callback is called if it has one.
+    Otherwise, it is placed on the completion queue it was submitted to, from
+    which it can be retrieved with fs_aio_wait() or fs_aio_peek().
+
+    Filesystems can start requests themselves by implementing the aio member of
+    their vfs_handler_t (the CD filesystem does so for sector-aligned reads,
+    which are streamed with DMA straight into the destination buffer). All
+    other requests are carried out by a small pool of worker threads, with the
+    handler's regular read and write functions. Requests on the same file are
+    always handled by the same worker, so requests using the current file
+    position are carried out in the order they were submitted.
+*/
+
+#ifndef __KOS_FS_AIO_H
+#define __KOS_FS_AIO_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <sys/queue.h>
+#include <kos/fs.h>
+#include <kos/worker_thread.h>
+
+/** \defgroup vfs_aio       Asynchronous I/O
+    \brief                  Submission and completion queues for file I/O
+    \ingroup                vfs
+
+    @{
+*/
+
+/** \name   Request types
+    @{
+*/
+#define FS_AIO_READ     0   /**< \brief Read from the file */
+#define FS_AIO_WRITE    1   /**< \brief Write to the file */
+/** @} */
+
+/** \brief  Use the current file position.
+
+    Pass this as the offset of a request to read or write at the current
+    position of the file, like fs_read() and fs_write() do.
+*/
+#define FS_AIO_CUR_POS  ((off_t)-1)
+
+/** \brief  Opaque completion queue type. */
+typedef struct fs_aio_queue fs_aio_queue_t;
+
+struct fs_aio_req;
+
+/** \brief  Completion callback type.
+
+    Callbacks are called from a worker thread, never from an interrupt. Once
+    the callback has been called, the request belongs to the caller again and
+    may be freed or reused from within the callback.
+
+    \param  req             The request that completed.
+*/
+typedef void (*fs_aio_callback_t)(struct fs_aio_req *req);
+
+/** \brief  Asynchronous I/O request.
+
+    Fill in the public members (fs_aio_prep_read() and fs_aio_prep_write() can
+    help with that) and submit the request. The request and its buffer must
+    stay valid, and must not be modified, until the request has completed.
+
+    \headerfile kos/fs_aio.h
+*/
+typedef struct fs_aio_req {
+    int op;                     /**< \brief FS_AIO_READ or FS_AIO_WRITE */
+    file_t fd;                  /**< \brief File to read or write */
+    void *buf;                  /**< \brief Data buffer */
+    size_t count;               /**< \brief Number of bytes to transfer */
+    off_t offset;               /**< \brief Offset, or FS_AIO_CUR_POS */
+    fs_aio_callback_t callback; /**< \brief Completion callback, or NULL */
+    void *data;                 /**< \brief User data, for the callback */
+
+    /** \brief  Number of bytes transferred, or -1 on error. */
+    ssize_t result;
+    /** \brief  errno value if the request failed. */
+    int error;
+
+    /** \cond */
+    /* Private; used by the VFS while the request is in flight. */
+    kthread_job_t job;
+    STAILQ_ENTRY(fs_aio_req) entry;
+    fs_aio_queue_t *queue;
+    vfs_handler_t *vfs;
+    void *hnd;
+    void *ref;
+    void *worker;
+    volatile int state;
+    /** \endcond */
+} fs_aio_req_t;
+
+/** \brief  Fill in a read request.
+
+    \param  req             The request to fill in.
+    \param  fd              The file to read from.
+    \param  buf             The buffer to read into.
+    \param  count           The number of bytes to read.
+    \param  offset          Where to read from, or FS_AIO_CUR_POS.
+*/
+static inline void fs_aio_prep_read(fs_aio_req_t *req, file_t fd, void *buf,
+                                    size_t count, off_t offset) {
+    req->op = FS_AIO_READ;
+    req->fd = fd;
+    req->buf = buf;
+    req->count = count;
+    req->offset = offset;
+}
+
+/** \brief  Fill in a write request.
+
+    \param  req             The request to fill in.
+    \param  fd              The file to write to.
+    \param  buf             The data to write.
+    \param  count           The number of bytes to write.
+    \param  offset          Where to write to, or FS_AIO_CUR_POS.
+*/
+static inline void fs_aio_prep_write(fs_aio_req_t *req, file_t fd,
+                                     const void *buf, size_t count,
+                                     off_t offset) {
+    req->op = FS_AIO_WRITE;
+    req->fd = fd;
+    req->buf = (void *)buf;
+    req->count = count;
+    req->offset = offset;
+}
+
+/** \brief  Create a completion queue.
+
+    \return                 The new queue, or NULL if out of memory.
+*/
+fs_aio_queue_t *fs_aio_queue_create(void);
+
+/** \brief  Destroy a completion queue.
+
+    \param  q               The queue to destroy.
+    \retval 0               On success.
+    \retval -1              If requests submitted to the queue are still in
+                            flight (sets errno to EBUSY).
+*/
+int fs_aio_queue_destroy(fs_aio_queue_t *q);
+
+/** \brief  Submit a batch of requests.
+
+    Requests are started in order. Requests with an explicit offset read or
+    write at that offset, and leave the file position just past the data they
+    transferred, as fs_seek() followed by fs_read() or fs_write() would.
+
+    The file descriptors may be closed once the requests are submitted; the
+    files stay open until the requests using them complete.
+
+    \param  q               The queue that receives the completions. This can
+                            only be NULL if every request has a callback.
+    \param  reqs            The requests to submit.
+    \param  cnt             The number of requests.
+    \return                 The number of requests submitted, or -1 if the
+                            first one could not be submitted. If fewer than
+                            cnt were submitted, errno is set for the first
+                            request that wasn't.
+
+    \par    Error Conditions:
+    \em     EBADF - a file descriptor is invalid \n
+    \em     EINVAL - bad request type, or no queue and no callback \n
+    \em     ENOMEM - the worker threads could not be started
+*/
+int fs_aio_submit(fs_aio_queue_t *q, fs_aio_req_t *reqs[], size_t cnt);
+
+/** \brief  Submit a single read request.
+
+    The callback and data members of the request are used as they are, so set
+    them (or clear them) before calling this.
+
+    \param  q               The queue that receives the completion.
+    \param  req             The request to fill in and submit.
+    \param  fd              The file to read from.
+    \param  buf             The buffer to read into.
+    \param  count           The number of bytes to read.
+    \param  offset          Where to read from, or FS_AIO_CUR_POS.
+    \retval 0               On success.
+    \retval -1              On error, see fs_aio_submit().
+*/
+int fs_aio_read(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd, void *buf,
+                size_t count, off_t offset);
+
+/** \brief  Submit a single write request.
+
+    \param  q               The queue that receives the completion.
+    \param  req             The request to fill in and submit.
+    \param  fd              The file to write to.
+    \param  buf             The data to write.
+    \param  count           The number of bytes to write.
+    \param  offset          Where to write to, or FS_AIO_CUR_POS.
+    \retval 0               On success.
+    \retval -1              On error, see fs_aio_submit().
+*/
+int fs_aio_write(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd,
+                 const void *buf, size_t count, off_t offset);
+
+/** \brief  Wait for a request to complete.
+
+    Requests with a callback are not placed on the queue, so this only ever
+    returns requests submitted without one.
+
+    \param  q               The queue to wait on.
+    \param  timeout         Maximum time to wait, in milliseconds, or 0 to wait
+                            forever.
+    \return                 The completed request, or NULL on error.
+
+    \par    Error Conditions:
+    \em     EAGAIN - no request that could complete is in flight \n
+    \em     ETIMEDOUT - the timeout expired
+*/
+fs_aio_req_t *fs_aio_wait(fs_aio_queue_t *q, unsigned int timeout);
+
+/** \brief  Retrieve a completed request without waiting.
+
+    \param  q               The queue to look at.
+    \return                 The completed request, or NULL if none has
+                            completed yet (sets errno to EAGAIN).
+*/
+fs_aio_req_t *fs_aio_peek(fs_aio_queue_t *q);
+
+/** \brief  Retrieve the number of requests in flight on a queue.
+
+    \param  q               The queue to look at.
+    \return                 The number of requests submitted to the queue that
+                            have not completed (or have not been retrieved with
+                            fs_aio_wait() or fs_aio_peek()) yet.
+*/
+int fs_aio_pending(fs_aio_queue_t *q);
+
+/** \brief  Cancel a request.
+
+    Only requests still waiting for a worker thread can be canceled. They
+    complete with an error of ECANCELED.
+
+    \param  req             The request to cancel.
+    \retval 0               If the request will be canceled.
+    \retval -1              If it is already being carried out or has
+                            completed (sets errno to EBUSY).
+*/
+int fs_aio_cancel(fs_aio_req_t *req);
+
+/** \brief  Complete a request started by a filesystem.
+
+    Filesystems implementing the aio member of vfs_handler_t call this once a
+    request they started has completed. This may be called from an interrupt.
+
+    \param  req             The request.
+    \param  rv              The number of bytes transferred, or -1.
+    \param  err             The errno value if rv is -1.
+*/
+void fs_aio_done(fs_aio_req_t *req, ssize_t rv, int err);
+
+/** \cond */
+void fs_aio_shutdown(void);
+
+/* Used by fs_aio.c to keep files open while requests on them are in flight */
+void *fs_aio_hold(file_t fd, vfs_handler_t **vfs, void **hnd);
+void fs_aio_release(void *ref);
+/** \endcond */
+
+/** @} */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_AIO_H */
@@ -0,0 +1,131 @@
+/* KallistiOS ##version##
+
+   kos/fs_cache.h
+
+*/
+
+/** \file    kos/fs_cache.h
+    \brief   VFS file cache.
+    \ingroup vfs_cache
+
+    This file contains the interface to the VFS-level file cache. The cache is
+    used to implement fs_mmap() on filesystems that have no native support for
+    it: the first time a file is mapped it is read into memory in one piece, and
+    later mappings of the same file (by the same or other file descriptors)
+    share that copy until it is evicted.
+
+    Filesystems opt in by setting the cache member of their vfs_handler_t to 1.
+    Only files opened read-only can be mapped through the cache. Opening a file
+    for writing, unlinking it or renaming it drops any cached copy, and each
+    mapping also checks the size and modification time of the file against the
+    cached copy.
+
+    Cached files that are not currently mapped are kept on an LRU list and are
+    evicted when the cache grows beyond its size limit, or when malloc() runs
+    low on memory (see malloc_lowmem_register()). Files that are used a lot can
+    be pinned, which keeps them cached until they are unpinned.
+*/
+
+#ifndef __KOS_FS_CACHE_H
+#define __KOS_FS_CACHE_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <kos/fs.h>
+
+/** \defgroup vfs_cache     File Cache
+    \brief                  Shared file cache backing fs_mmap()
+    \ingroup                vfs
+
+    @{
+*/
+
+/** \brief  File cache statistics.
+
+    \headerfile kos/fs_cache.h
+*/
+typedef struct fs_cache_stats {
+    uint32_t hits;          /**< \brief Mappings served from the cache */
+    uint32_t misses;        /**< \brief Mappings that had to load the file */
+    uint32_t evictions;     /**< \brief Files dropped to free memory */
+    uint32_t invalidations; /**< \brief Files dropped because they changed */
+    uint32_t entries;       /**< \brief Files currently cached */
+    uint32_t pinned;        /**< \brief Files currently pinned */
+    size_t   bytes;         /**< \brief Total size of cached files */
+    size_t   limit;         /**< \brief Current size limit */
+} fs_cache_stats_t;
+
+/** \brief  Set the size limit of the file cache.
+
+    When the cache grows beyond this limit, files that are not mapped or pinned
+    are evicted (least recently used first) until it fits again. Mapped and
+    pinned files are never evicted, so the cache may be larger than the limit
+    if that is what is in use.
+
+    \param  bytes           The new limit, in bytes.
+*/
+void fs_cache_set_limit(size_t bytes);
+
+/** \brief  Load a file into the cache and keep it there.
+
+    The file must be on a filesystem that supports the cache. Pinning a file
+    that is already pinned does nothing.
+
+    \param  fn              The file to pin.
+    \retval 0               On success.
+    \retval -1              On error, sets errno as appropriate.
+
+    \par    Error Conditions:
+    \em     ENOENT - the file does not exist \n
+    \em     ENOTSUP - the filesystem does not support caching \n
+    \em     ENOMEM - out of memory \n
+    \em     EIO - error reading the file
+*/
+int fs_cache_pin(const char *fn);
+
+/** \brief  Allow a pinned file to be evicted again.
+
+    \param  fn              The file to unpin.
+    \retval 0               On success.
+    \retval -1              If the file was not pinned (sets errno to ENOENT).
+*/
+int fs_cache_unpin(const char *fn);
+
+/** \brief  Evict every file that is not mapped or pinned. */
+void fs_cache_flush(void);
+
+/** \brief  Drop cached copies of files that have changed.
+
+    Filesystems supporting the cache should call this when files change behind
+    the VFS's back, for instance when a disc is swapped or a filesystem is
+    unmounted. Copies that are still mapped stay valid for their current users,
+    but will not be handed out again.
+
+    \param  vfs             The filesystem the file(s) live on.
+    \param  fn              The path of the file within the filesystem, or NULL
+                            to drop every file on the filesystem.
+*/
+void fs_cache_invalidate(vfs_handler_t *vfs, const char *fn);
+
+/** \brief  Retrieve file cache statistics.
+
+    \param  st              Buffer to fill in with the statistics.
+*/
+void fs_cache_get_stats(fs_cache_stats_t *st);
+
+/** \cond */
+int fs_cache_init(void);
+void fs_cache_shutdown(void);
+
+/* Used by fs.c to map and unmap files for fs_mmap() */
+void *fs_cache_map(vfs_handler_t *vfs, void *hnd, const char *fn,
+                   void **cookie);
+void fs_cache_unmap(void *cookie);
+/** \endcond */
+
+/** @} */
+
+__END_DECLS
+
+#endif  /* __KOS_FS_CACHE_H */
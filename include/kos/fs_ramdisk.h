@@ -35,6 +35,30 @@ __BEGIN_DECLS
     @{
 */
 
+/** \name   Ramdisk ioctls
+    \brief  Commands that can be passed to fs_ioctl() on a ramdisk file.
+
+    Both of these require the file to be opened for writing and take a single
+    size_t argument.
+
+    @{
+*/
+/** \brief  Reserve space for at least the given number of bytes.
+
+    This preallocates the data block of the file (like fallocate() with
+    FALLOC_FL_KEEP_SIZE), so that later writes up to that size do not need to
+    grow it. The size of the file itself is not changed.
+*/
+#define RAMDISK_IOCTL_RESERVE   0x52440001
+
+/** \brief  Set the size of the file.
+
+    This works like ftruncate(). Growing the file fills the new space with
+    zeroes; shrinking it keeps the allocated space for later writes.
+*/
+#define RAMDISK_IOCTL_TRUNCATE  0x52440002
+/** @} */
+
 /** \cond */
 void fs_ramdisk_init(void);
 void fs_ramdisk_shutdown(void);
@@ -377,6 +377,63 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Send data from a file on a socket created with the protocol.
+
+        This function should implement the ::sendfile() system call for the
+        protocol, sending the data without going through a user buffer. It is
+        optional; if it is NULL or fails with errno set to EOPNOTSUPP (for
+        instance because the file can't be mapped), ::sendfile() falls back to
+        reading the file into a buffer and calling sendto.
+
+        \param  s           The socket to send data on
+        \param  fd          The file to send data from
+        \param  offset      Where to start reading the file from, updated on
+                            return. If NULL, the file position is used and
+                            updated instead.
+        \param  count       The number of bytes to send
+        \retval -1          On error (set errno appropriately)
+        \retval n           The number of bytes actually sent (may be less than
+                            count)
+    */
+    ssize_t (*sendfile)(net_socket_t *s, file_t fd, off_t *offset,
+                        size_t count);
+
+    /** \brief  Receive several messages on a socket created with the
+                protocol.
+
+        This function should implement the ::recvmmsg() system call for the
+        protocol. It is optional; if it is NULL, ::recvmmsg() and ::recvmsg()
+        call recvfrom for each message instead.
+
+        \param  s           The socket to receive data on
+        \param  msgvec      The messages to receive into
+        \param  vlen        The number of messages in msgvec
+        \param  flags       Flags to the function
+        \param  timeout     Longest time to wait for all of them (can be NULL)
+        \retval -1          On error (set errno appropriately)
+        \retval n           The number of messages received
+    */
+    int (*recvmmsg)(net_socket_t *s, struct mmsghdr *msgvec,
+                    unsigned int vlen, int flags,
+                    const struct timespec *timeout);
+
+    /** \brief  Send several messages on a socket created with the protocol.
+
+        This function should implement the ::sendmmsg() system call for the
+        protocol. It is optional; if it is NULL, ::sendmmsg() and ::sendmsg()
+        call sendto for each message instead.
+
+        \param  s           The socket to send data on
+        \param  msgvec      The messages to send
+        \param  vlen        The number of messages in msgvec
+        \param  flags       Flags to the function
+        \retval -1          On error, if no messages were sent (set errno
+                            appropriately)
+        \retval n           The number of messages sent
+    */
+    int (*sendmmsg)(net_socket_t *s, struct mmsghdr *msgvec,
+                    unsigned int vlen, int flags);
 } fs_socket_proto_t;
 
 /** \brief   Initializer for the entry field in the fs_socket_proto_t struct. 
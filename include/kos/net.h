@@ -42,6 +42,27 @@ __BEGIN_DECLS
     \ingroup                        networking
 */
 
+/** \brief   Traffic counters for one network device.
+    \ingroup networking_drivers
+
+    These are kept up to date by the device's driver, for the drivers that
+    support them, and are all zero for the rest.
+
+    \headerfile kos/net.h
+*/
+typedef struct netif_stats {
+    uint32_t  rx_packets;             /**< \brief Frames received */
+    uint32_t  rx_bytes;               /**< \brief Bytes received */
+    uint32_t  rx_dropped;             /**< \brief Frames received but
+                                                   dropped by the driver */
+    uint32_t  rx_polls;               /**< \brief Times the driver polled
+                                                   for received frames */
+    uint32_t  tx_packets;             /**< \brief Frames sent */
+    uint32_t  tx_bytes;               /**< \brief Bytes sent */
+    uint32_t  tx_dropped;             /**< \brief Frames that couldn't be
+                                                   sent */
+} netif_stats_t;
+
 /** \brief   Structure describing one usable network device.
     \ingroup networking_drivers
 
@@ -181,6 +202,9 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8_t *list, int count);
+
+    /** \brief  Traffic counters, kept by the driver. */
+    netif_stats_t       stats;
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -196,6 +220,7 @@ typedef struct knetif {
 #define NETIF_PROMISC       0x00010000      /**< \brief Promiscuous mode */
 #define NETIF_NEEDSPOLL     0x01000000      /**< \brief Needs to be polled for input */
 #define NETIF_NOETH         0x10000000      /**< \brief Does not use ethernet */
+#define NETIF_LOOPBACK      0x20000000      /**< \brief Is the loopback device */
 /** @} */
 
 /** \defgroup net_drivers_returns    TX Return Values
@@ -311,7 +336,8 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
 
     If no entry is found, then an ARP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in. Up to a few packets are kept for each address that is
+    being looked up, after which the oldest ones are dropped.
 
     \param  nif             The network device in use.
     \param  ip_in           The IP address to lookup.
@@ -509,6 +535,9 @@ typedef struct net_ipv4_stats {
     uint32_t  pkt_recv_bad_size;      /** \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /** \brief Packets with a bad checksum */
     uint32_t  pkt_recv_bad_proto;     /** \brief Packets with an unknown proto */
+    uint32_t  frag_recv;              /** \brief Fragments received */
+    uint32_t  frag_reasm;             /** \brief Packets reassembled */
+    uint32_t  frag_dropped;           /** \brief Partial packets dropped */
 } net_ipv4_stats_t;
 
 /** \brief   Retrieve statistics from the IPv4 layer.
@@ -710,6 +739,9 @@ typedef struct net_ipv6_stats {
     uint32_t  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_proto;     /**< \brief Packets with an unknown proto */
     uint32_t  pkt_recv_bad_ext;       /**< \brief Packets with an unknown hdr */
+    uint32_t  frag_recv;              /**< \brief Fragments received */
+    uint32_t  frag_reasm;             /**< \brief Packets reassembled */
+    uint32_t  frag_dropped;           /**< \brief Partial packets dropped */
 } net_ipv6_stats_t;
 
 /** \brief   Retrieve statistics from the IPv6 layer.
@@ -736,7 +768,8 @@ int net_ndp_init(void);
 void net_ndp_shutdown(void);
 
 /** \brief  Garbage collect timed out NDP entries.
-    This will be called periodically as NDP queries come in.
+    This is done periodically by the network thread, so there is normally no
+    need to call this. It also resends any queries that are due.
 */
 void net_ndp_gc(void);
 
@@ -754,7 +787,8 @@ int net_ndp_insert(netif_t *nif, const uint8_t mac[6], const struct in6_addr *ip
 
     If no entry is found, then an NDP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in. Up to a few packets are kept for each address that is
+    being looked up, after which the oldest ones are dropped.
 
     \param  net             The network device to use.
     \param  ip              The IPv6 address to query.
@@ -792,6 +826,10 @@ typedef struct net_udp_stats {
     uint32_t  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32_t  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32_t  pkt_recv_dropped;       /**< \brief Packets dropped because the
+                                                   socket's queue was full */
+    uint32_t  pkt_recv_no_buf;        /**< \brief Packets dropped for lack of a
+                                                   buffer */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
@@ -819,6 +857,33 @@ void net_udp_shutdown(void);
     @{
 */
 
+/** \brief  TCP statistics structure.
+
+    This structure holds some basic statistics about the TCP layer of the stack,
+    and can be retrieved with the appropriate function.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_tcp_stats {
+    uint32_t  pkt_sent;               /**< \brief Segments sent out */
+    uint32_t  pkt_recv;               /**< \brief Segments received */
+    uint32_t  pkt_recv_bad_chksum;    /**< \brief Segments with a bad checksum */
+    uint32_t  retransmits;            /**< \brief Data segments sent again */
+    uint32_t  timeouts;               /**< \brief Retransmission timeouts */
+    uint32_t  fast_retransmits;       /**< \brief Fast retransmits (three
+                                                   duplicate ACKs) */
+    uint32_t  pkt_recv_ooo;           /**< \brief Segments queued because they
+                                                   arrived out of order */
+    uint32_t  sack_retransmits;       /**< \brief Holes reported by SACK that
+                                                   were sent again */
+} net_tcp_stats_t;
+
+/** \brief  Retrieve statistics from the TCP layer.
+
+    \return                 The global TCP stats struct.
+*/
+net_tcp_stats_t net_tcp_get_stats(void);
+
 /** \brief  Init TCP.
     \retval 0               On success (no error conditions defined).
 */
@@ -829,6 +894,35 @@ void net_tcp_shutdown(void);
 
 /** @} */
 
+/***** net_pbuf.c *********************************************************/
+
+/** \brief  Packet buffer statistics structure.
+    \ingroup networking
+
+    This structure holds some basic statistics about the buffers that outgoing
+    packets are built in, and can be retrieved with the appropriate function.
+    Dividing copies by the number of packets sent gives how many times the
+    stack copied each packet on its way to the driver.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_pbuf_stats {
+    uint32_t  allocated;              /**< \brief Buffers allocated */
+    uint32_t  malloced;               /**< \brief Buffers too big for the
+                                                   buffer pool, which had to
+                                                   be allocated with malloc() */
+    uint32_t  copies;                 /**< \brief Times packet data was copied
+                                                   into a buffer */
+    uint64_t  bytes_copied;           /**< \brief Bytes of data copied */
+} net_pbuf_stats_t;
+
+/** \brief  Retrieve statistics about packet buffers.
+    \ingroup networking
+
+    \return                 The global packet buffer stats struct.
+*/
+net_pbuf_stats_t net_pbuf_get_stats(void);
+
 /***** net_crc.c **********************************************************/
 
 /** \defgroup networking_crc    CRC
@@ -919,6 +1013,105 @@ void net_multicast_shutdown(void);
 
 /** @} */
 
+/***** net_loop.c *********************************************************/
+
+/** \defgroup networking_virtual    Virtual Devices
+    \brief                          Loopback and pipe network devices
+    \ingroup                        networking_drivers
+
+    The stack always has a loopback device, which carries everything sent to
+    127.0.0.0/8 or ::1, and can create pipes, which are pairs of virtual
+    Ethernet devices where anything sent on one end arrives at the other. Both
+    deliver the frames sent on them from the network thread, some time after
+    they were sent, and the link they model can be made slower or less reliable
+    than a perfect one. This allows the protocols to be tested and benchmarked
+    without any network hardware, such as in an emulator.
+
+    @{
+*/
+
+/** \brief  Parameters of the link a virtual device sends on.
+
+    All zeros (which is how devices start out) is a perfect link: frames
+    arrive in order, as soon as the network thread gets to them.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_link_params {
+    uint32_t  latency;                /**< \brief Time each frame takes to
+                                                   arrive, in microseconds */
+    uint32_t  bandwidth;              /**< \brief Rate frames are sent at, in
+                                                   bits per second, 0 for no
+                                                   limit */
+    uint16_t  loss;                   /**< \brief Frames dropped, in tenths
+                                                   of a percent */
+    uint16_t  reorder;                /**< \brief Frames held back so that
+                                                   later ones overtake them, in
+                                                   tenths of a percent */
+    uint32_t  reorder_delay;          /**< \brief How long those are held
+                                                   back, in microseconds, 0 for
+                                                   1ms */
+    uint32_t  queue_len;              /**< \brief Frames that can be waiting
+                                                   to arrive before more are
+                                                   dropped, 0 for 256 */
+} net_link_params_t;
+
+/** \brief  The loopback device (read-only). */
+extern netif_t *net_loopback_dev;
+
+/** \brief  Set the parameters of the link a virtual device sends on.
+
+    For a pipe, this only applies to the frames sent on this end.
+
+    \param  dev             The loopback device or one end of a pipe.
+    \param  params          The new parameters.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to EINVAL if dev isn't a
+                            virtual device or the parameters are out of range.
+*/
+int net_link_set_params(netif_t *dev, const net_link_params_t *params);
+
+/** \brief  Get the parameters of the link a virtual device sends on.
+
+    \param  dev             The loopback device or one end of a pipe.
+    \param  params          Where to put the parameters.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to EINVAL if dev isn't a
+                            virtual device.
+*/
+int net_link_get_params(netif_t *dev, net_link_params_t *params);
+
+/** \brief  Create a pipe.
+
+    This makes two virtual Ethernet devices that are connected to each other,
+    and registers and starts them. Give each end an address on the same
+    network, and traffic for the address of one end goes out of the other.
+
+    \param  ends            Where to put the two ends.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to ENETDOWN if networking
+                            isn't initialized, or ENOMEM.
+*/
+int net_pipe_create(netif_t *ends[2]);
+
+/** \brief  Destroy a pipe.
+
+    This unregisters both ends of the pipe and frees them, dropping anything
+    still on its way. Close any sockets using the pipe first.
+
+    \param  end             Either end of the pipe.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to EINVAL if end isn't a
+                            pipe.
+*/
+int net_pipe_destroy(netif_t *end);
+
+/** @} */
+
 /***** net_core.c *********************************************************/
 
 /** \brief   Interface list; note: do not manipulate directly!
@@ -950,6 +1143,21 @@ extern netif_t *net_default_dev;
 */
 netif_t *net_set_default(netif_t *n);
 
+/** \brief   Find the device to send to an address through.
+    \ingroup networking_drivers
+
+    Loopback addresses go through the loopback device, and addresses on the
+    network of a running device go through that device. The address of one of
+    our own devices goes through another device on its network if there is
+    one (like the other end of a pipe), or the loopback device if not.
+    Everything else goes through the default device.
+
+    \param  dst             The address, with IPv4 addresses V4-mapped.
+
+    \return                 The device, or NULL if there is none.
+*/
+netif_t *net_route(const struct in6_addr *dst);
+
 /** \brief   Register a network device.
     \ingroup networking_drivers
 
@@ -132,6 +132,24 @@ __BEGIN_DECLS
 #define FS_RAMDISK_MAX_FILES 8
 #endif
 
+/** \brief  The default size limit of the VFS file cache, in bytes.
+            See kos/fs_cache.h for more information. */
+#ifndef FS_CACHE_DEFAULT_LIMIT
+#define FS_CACHE_DEFAULT_LIMIT (1024 * 1024)
+#endif
+
+/** \brief  The maximum number of entries in the VFS directory entry cache.
+            See fs_stat() for more information. */
+#ifndef FS_DCACHE_ENTRIES
+#define FS_DCACHE_ENTRIES 256
+#endif
+
+/** \brief  The number of worker threads carrying out asynchronous file I/O.
+            See kos/fs_aio.h for more information. */
+#ifndef FS_AIO_WORKERS
+#define FS_AIO_WORKERS 2
+#endif
+
 /** \brief  The number of distinct file descriptors, including files and
             network sockets, that can be in use at a time. Decreasing this
             value can reduce memory usage.  */
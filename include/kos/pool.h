@@ -0,0 +1,212 @@
+/* KallistiOS ##version##
+
+   include/kos/pool.h
+
+*/
+
+/** \file    kos/pool.h
+    \brief   Fixed-size object pools.
+    \ingroup pool
+
+    This file contains an allocator for objects that all have the same size,
+    for the things that kernel subsystems (and programs) allocate and free
+    over and over, like file handles, sockets and packet buffers. Objects are
+    carved out of larger blocks from the heap, called slabs, so that the heap
+    only sees a few big allocations instead of lots of small ones coming and
+    going, and a freed object is ready to be handed out again without going
+    back to the heap at all.
+
+    \see    malloc.h
+*/
+
+#ifndef __KOS_POOL_H
+#define __KOS_POOL_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <kos/mutex.h>
+
+/** \defgroup pool  Object Pools
+    \brief          Slab allocator for fixed-size objects
+    \ingroup        system_allocator
+
+    A pool hands out objects of one size and alignment. A pool can have a
+    constructor, which is run on each object when its slab is allocated, and
+    a destructor, which is run on each object when its slab is given back to
+    the heap. Objects are handed back to the pool in the state the
+    constructor left them in (or put them back in), so anything that is the
+    same for every free object, like an initialized mutex, only has to be
+    set up once instead of on every allocation.
+
+    Slabs that have nothing allocated from them are given back to the heap
+    once the pool has one of them already, or when pool_shrink() is called,
+    or when the heap runs low on memory, except for those kept by
+    pool_reserve().
+
+    Pools are safe to use from more than one thread at once. A pool created
+    with \ref POOL_IRQ can also be used from interrupts, at the cost of
+    disabling interrupts instead of taking a mutex, and can only get a new
+    slab in an interrupt if the heap isn't in use by the interrupted code.
+
+    @{
+*/
+
+/** \brief  Flag for pool_init(): objects are allocated and freed in
+            interrupts. */
+#define POOL_IRQ    0x0001
+
+/** \brief  Object constructor and destructor type.
+
+    \param  obj             The object.
+    \param  data            The pointer passed to pool_init().
+*/
+typedef void (*pool_ctor_t)(void *obj, void *data);
+
+/** \brief  Pool statistics.
+
+    \headerfile kos/pool.h
+*/
+typedef struct pool_stats {
+    const char *name;           /**< \brief Name of the pool */
+    size_t obj_size;            /**< \brief Size of each object */
+    size_t slot_size;           /**< \brief Space each object takes */
+    size_t per_slab;            /**< \brief Objects in each slab */
+    size_t slabs;               /**< \brief Slabs allocated now */
+    size_t slab_bytes;          /**< \brief Heap space taken by them */
+    size_t objs;                /**< \brief Objects in them */
+    size_t in_use;              /**< \brief Objects allocated now */
+    size_t peak;                /**< \brief Most objects ever allocated */
+    uint32_t allocs;            /**< \brief Calls to pool_alloc() */
+    uint32_t frees;             /**< \brief Calls to pool_free() */
+    uint32_t grows;             /**< \brief Slabs allocated */
+    uint32_t shrinks;           /**< \brief Slabs given back */
+    uint32_t failed;            /**< \brief Allocations that failed */
+} pool_stats_t;
+
+/** \cond */
+LIST_HEAD(pool_slab_list, pool_slab);
+/** \endcond */
+
+/** \brief  Object pool.
+
+    The contents of this structure are private, and should only be accessed
+    through the functions in this file.
+
+    \headerfile kos/pool.h
+*/
+typedef struct pool {
+    /** \cond */
+    LIST_ENTRY(pool) list;
+
+    size_t obj_off;
+    size_t slab_size;
+    size_t reserve;
+    size_t nempty;
+    int flags;
+
+    pool_ctor_t ctor;
+    pool_ctor_t dtor;
+    void *data;
+
+    mutex_t lock;
+
+    struct pool_slab_list partial;
+    struct pool_slab_list full;
+    struct pool_slab_list empty;
+
+    pool_stats_t stats;
+    /** \endcond */
+} pool_t;
+
+/** \brief  Set up a pool.
+
+    \param  p               The pool to set up.
+    \param  name            A name for it, for statistics. This is not copied.
+    \param  size            The size of each object.
+    \param  align           The alignment each object needs, which must be a
+                            power of two, or 0 for that of malloc().
+    \param  ctor            The constructor, or NULL for none.
+    \param  dtor            The destructor, or NULL for none.
+    \param  data            A pointer to pass to ctor and dtor.
+    \param  flags           \ref POOL_IRQ or 0.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to EINVAL if size is 0 or
+                            align is not a power of two.
+*/
+int pool_init(pool_t *p, const char *name, size_t size, size_t align,
+              pool_ctor_t ctor, pool_ctor_t dtor, void *data, int flags);
+
+/** \brief  Tear down a pool, giving all of its slabs back to the heap.
+
+    Every object should have been freed by now. Any that haven't are gone
+    after this.
+
+    \param  p               The pool to tear down.
+*/
+void pool_destroy(pool_t *p);
+
+/** \brief  Allocate an object from a pool.
+
+    \param  p               The pool to allocate from.
+    \return                 The object, or NULL (with errno set to ENOMEM) if
+                            there isn't room for another slab.
+*/
+void *pool_alloc(pool_t *p);
+
+/** \brief  Give an object back to its pool.
+
+    \param  p               The pool that it came from.
+    \param  obj             The object, or NULL to do nothing.
+*/
+void pool_free(pool_t *p, void *obj);
+
+/** \brief  Keep room for a number of objects in a pool.
+
+    This allocates enough slabs for count objects up front, if there aren't
+    that many already, and keeps that many from being given back to the heap
+    when they're not being used. This can be used to make sure that a pool
+    used from interrupts doesn't need to get a slab in one.
+
+    \param  p               The pool.
+    \param  count           The number of objects to keep room for.
+
+    \retval 0               On success.
+    \retval -1              If the slabs couldn't be allocated.
+*/
+int pool_reserve(pool_t *p, size_t count);
+
+/** \brief  Give a pool's unused slabs back to the heap.
+
+    \param  p               The pool.
+    \return                 The number of bytes given back.
+*/
+size_t pool_shrink(pool_t *p);
+
+/** \brief  Get the statistics for a pool.
+
+    \param  p               The pool.
+    \param  st              Where to put its statistics.
+*/
+void pool_get_stats(pool_t *p, pool_stats_t *st);
+
+/** \brief  Print the statistics of every pool.
+
+    This prints a line for each pool that has been set up, with how many
+    objects it has allocated, how much heap space it is taking and how much
+    of that is in use.
+
+    \param  pf              The printf-like function to print with.
+    \return                 0 on success.
+*/
+int pool_print_stats(int (*pf)(const char *fmt, ...));
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __KOS_POOL_H */
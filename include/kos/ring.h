@@ -0,0 +1,212 @@
+/* KallistiOS ##version##
+
+   include/kos/ring.h
+
+*/
+
+/** \file    kos/ring.h
+    \brief   Single-producer, single-consumer ring buffers.
+    \ingroup ring
+
+    This file contains a ring buffer (a circular FIFO) that one producer can
+    put data into while one consumer takes it out, without either of them
+    taking a lock or disabling interrupts. Either side can be an interrupt
+    handler, so this is suitable for handing data between an interrupt and a
+    thread, as well as between two threads.
+
+    \see    kos/worker_thread.h
+*/
+
+#ifndef __KOS_RING_H
+#define __KOS_RING_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \defgroup ring  Ring Buffers
+    \brief          Lock-free single-producer, single-consumer FIFOs
+    \ingroup        kthreads
+
+    A ring holds a power-of-two number of fixed-size elements (which are
+    single bytes for a byte stream). Exactly one producer may call the
+    functions that add to it (ring_write(), ring_reserve() and ring_commit())
+    and exactly one consumer may call the ones that take from it
+    (ring_read(), ring_peek() and ring_consume()) at any one time. If there
+    can be more than one of either, they have to be serialized by the caller,
+    with a mutex for example.
+
+    The producer and the consumer each keep their position in the ring on a
+    cache line of their own, along with their last look at the other's, so
+    that neither has to touch the other's line unless the ring looks full (or
+    empty) to it.
+
+    Besides copying elements in and out, the ring can be written to or read
+    from in place. ring_reserve() gives the producer the free space at its
+    position, which it fills and then hands over with ring_commit(), and
+    ring_peek() gives the consumer the elements at its position, which it
+    gives back with ring_consume() once it is done with them.
+
+    @{
+*/
+
+/** \brief  Size of the cache line that each side of a ring gets, in bytes. */
+#define RING_CACHE_LINE     32
+
+/** \brief  Ring buffer.
+
+    The contents of this structure are private, and should only be accessed
+    through the functions in this file. The structure is aligned to
+    RING_CACHE_LINE, so one that is allocated dynamically (or is part of
+    something that is) has to come from memalign() rather than malloc().
+
+    \headerfile kos/ring.h
+*/
+typedef struct ring {
+    /** \cond */
+    /* Set by ring_init(), and not changed after that. */
+    uint8_t *buf;
+    size_t elem_size;
+    size_t mask;
+    int own_buf;
+
+    /* Only written by the producer. */
+    volatile size_t head __attribute__((aligned(RING_CACHE_LINE)));
+    size_t tail_cache;
+
+    /* Only written by the consumer. */
+    volatile size_t tail __attribute__((aligned(RING_CACHE_LINE)));
+    size_t head_cache;
+    /** \endcond */
+} ring_t;
+
+/** \brief  Initialize a ring buffer.
+
+    \param  r               The ring to initialize.
+    \param  elem_size       Size of each element in bytes (1 for bytes).
+    \param  count           Number of elements it can hold. This is rounded
+                            up to a power of two.
+    \param  buf             Storage for count * elem_size bytes (after
+                            rounding), or NULL to allocate it.
+
+    \retval 0               On success.
+    \retval -1              On error, errno is set to EINVAL if elem_size or
+                            count is 0, or if buf is given and count is not a
+                            power of two, or ENOMEM if the storage couldn't
+                            be allocated. count must be no more than
+                            SIZE_MAX / 2 + 1, so that it can be rounded up.
+*/
+int ring_init(ring_t *r, size_t elem_size, size_t count, void *buf);
+
+/** \brief  Free anything a ring allocated.
+
+    \param  r               The ring to destroy.
+*/
+void ring_destroy(ring_t *r);
+
+/** \brief  Empty a ring.
+
+    This may only be called while neither side is using it.
+
+    \param  r               The ring to empty.
+*/
+void ring_clear(ring_t *r);
+
+/** \brief  Get the number of elements a ring can hold.
+
+    \param  r               The ring to check.
+    \return                 Its capacity, in elements.
+*/
+static inline size_t ring_capacity(const ring_t *r) {
+    return r->mask + 1;
+}
+
+/** \brief  Get the number of elements in a ring.
+
+    This is exact when called from either side, and a snapshot otherwise.
+
+    \param  r               The ring to check.
+    \return                 The number of elements waiting to be read.
+*/
+static inline size_t ring_count(const ring_t *r) {
+    return r->head - r->tail;
+}
+
+/** \brief  Get the number of free elements in a ring.
+
+    \param  r               The ring to check.
+    \return                 The number of elements that can be written.
+*/
+static inline size_t ring_space(const ring_t *r) {
+    return ring_capacity(r) - ring_count(r);
+}
+
+/** \brief  Copy elements into a ring (producer only).
+
+    \param  r               The ring to write to.
+    \param  src             The elements to write.
+    \param  count           The number of elements to write.
+    \return                 The number written, which is less than count if
+                            the ring filled up.
+*/
+size_t ring_write(ring_t *r, const void *src, size_t count);
+
+/** \brief  Copy elements out of a ring (consumer only).
+
+    \param  r               The ring to read from.
+    \param  dst             Where to put the elements.
+    \param  count           The most elements to read.
+    \return                 The number read, which is less than count if the
+                            ring ran out.
+*/
+size_t ring_read(ring_t *r, void *dst, size_t count);
+
+/** \brief  Get free space to write into in place (producer only).
+
+    This returns the free space at the producer's position in the ring, up to
+    where it wraps around, without handing anything to the consumer. Once it
+    has been filled in, call ring_commit() to do that.
+
+    \param  r               The ring to write to.
+    \param  count           The most elements wanted on input, and the number
+                            of elements of space there are on output.
+    \return                 The space, or NULL if the ring is full.
+*/
+void *ring_reserve(ring_t *r, size_t *count);
+
+/** \brief  Hand elements written in place to the consumer (producer only).
+
+    \param  r               The ring that was written to.
+    \param  count           The number of elements written, which must be no
+                            more than ring_reserve() returned.
+*/
+void ring_commit(ring_t *r, size_t count);
+
+/** \brief  Get elements to read in place (consumer only).
+
+    This returns the elements at the consumer's position in the ring, up to
+    where it wraps around, without removing them. Once it is done with them,
+    call ring_consume() to give their space back to the producer.
+
+    \param  r               The ring to read from.
+    \param  count           The most elements wanted on input, and the number
+                            of elements there are on output.
+    \return                 The elements, or NULL if the ring is empty.
+*/
+const void *ring_peek(ring_t *r, size_t *count);
+
+/** \brief  Remove elements that have been read in place (consumer only).
+
+    \param  r               The ring that was read from.
+    \param  count           The number of elements to remove, which must be
+                            no more than ring_peek() returned.
+*/
+void ring_consume(ring_t *r, size_t count);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __KOS_RING_H */
@@ -257,6 +257,12 @@ typedef __attribute__((aligned(32))) struct kthread {
     /** \brief Compiler-level thread-local storage. */
     void *tls_hnd;
 
+    /** \brief  Cache of small heap blocks.
+
+        \see    M_THREAD_CACHE
+    */
+    void *malloc_cache;
+
     /** \brief  Return value of the thread function.
 
         This is only used in joinable threads.
@@ -22,6 +22,8 @@
 #include <kos/cdefs.h>
 __BEGIN_DECLS
 
+#include <stdint.h>
+
 /** \defgroup system_allocator  Allocator
     \brief                      Dynamic memory heap management and allocation
     \ingroup                    system
@@ -214,6 +216,27 @@ struct mallinfo mallinfo();
 
 #define M_MMAP_MAX -4
 #define DEFAULT_MMAP_MAX 65536
+
+/** \brief  mallopt() parameter for the per-thread caches.
+
+    Setting this to a number of blocks turns on a cache in front of the heap
+    for each thread, which keeps up to that many free blocks of each size for
+    allocations of up to 256 bytes, so that most small allocations and frees
+    don't have to take the heap lock. The value can be up to 255, and 0 (the
+    default) turns the caches off, giving back the blocks in every thread's
+    cache. That is done with interrupts disabled, so it can take a while
+    with a lot of threads.
+
+    Blocks sitting in a cache count as in use in mallinfo() and
+    malloc_stats(). A thread's cache is given back to the heap when the thread
+    is destroyed, when malloc_thread_cache_flush() is called from it, and
+    before the low memory handlers run.
+
+    \see   malloc_thread_cache_flush
+*/
+#define M_THREAD_CACHE -5
+#define DEFAULT_THREAD_CACHE 0
+
 int  mallopt(int, int);
 
 /** \brief Debug function
@@ -232,6 +255,186 @@ void malloc_stats(void);
 */
 int malloc_irq_safe(void);
 
+/** \brief  Low memory handler type.
+
+    Functions of this type can be registered with malloc_lowmem_register() to be
+    told when the heap is running low, so that they can release any memory they
+    are holding on to purely as a cache.
+
+    \param  want            The size of the allocation that triggered the call,
+                            which is a hint for how much to give back.
+    \param  data            The pointer passed in at registration time.
+*/
+typedef void (*malloc_lowmem_handler_t)(size_t want, void *data);
+
+/** \brief  Register a low memory handler.
+
+    Low memory handlers are called when an allocation fails (after which the
+    allocation is tried one more time) and after the heap has grown to within
+    the low-water mark set by malloc_lowmem_set_mark() of the top of memory.
+
+    Handlers are called from the thread doing the allocation, outside of the
+    malloc lock, so they may free memory (and allocate it, although that is not
+    very helpful). They are never called from an interrupt, and must not call
+    malloc_lowmem_register() or malloc_lowmem_unregister() themselves.
+
+    \param  hnd             The handler to add.
+    \param  data            A pointer to pass to the handler.
+    \retval 0               On success.
+    \retval -1              If there are too many handlers registered.
+*/
+int malloc_lowmem_register(malloc_lowmem_handler_t hnd, void *data);
+
+/** \brief  Remove a low memory handler.
+
+    \param  hnd             The handler to remove.
+    \param  data            The data pointer it was registered with.
+    \retval 0               On success.
+    \retval -1              If the handler was not registered.
+*/
+int malloc_lowmem_unregister(malloc_lowmem_handler_t hnd, void *data);
+
+/** \brief  Set the low-water mark for the heap.
+
+    When the heap grows to within this many bytes of the top of memory, the low
+    memory handlers will be called after the allocation completes. The default
+    of 0 means handlers are only called when an allocation actually fails.
+
+    \param  bytes           The low-water mark, in bytes.
+*/
+void malloc_lowmem_set_mark(size_t bytes);
+
+/** \brief  Take memory from the top of the heap for good.
+
+    This is sbrk() the way the heap itself calls it: it is serialized with the
+    heap's own growth, and the low memory handlers are run just as they would
+    be for an allocation that took the heap within the low-water mark, or one
+    that failed (after which it is tried once more).
+
+    \param  size            How many bytes to take.
+    \return                 The start of the memory taken, or (void *)-1 if
+                            there isn't enough left.
+*/
+void *malloc_morecore(size_t size);
+
+/** \brief  Give back the calling thread's cached blocks.
+
+    This returns every block in the calling thread's cache (see
+    \ref M_THREAD_CACHE) to the heap. It does nothing if the thread has no
+    cache, or if it is called from an interrupt. Setting M_THREAD_CACHE to 0
+    does this for every thread at once.
+*/
+void malloc_thread_cache_flush(void);
+
+/** \cond */
+/* Give back everything in a thread's cache, for thd_destroy(). */
+struct kthread;
+void malloc_thread_cache_release(struct kthread *thd);
+/** \endcond */
+
+/** \brief  Number of size classes in the free chunk histogram.
+
+    Entry 0 of malloc_prof_stats_t::free_hist counts free chunks of less than
+    32 bytes, entry i counts those of 16 << i up to (32 << i) - 1 bytes, and
+    the last entry counts everything bigger.
+*/
+#define MALLOC_PROF_HIST    12
+
+/** \brief  Heap profiler statistics.
+
+    The first group is only filled in while the profiler is running. The
+    rest describes the free space in the heap, and is always filled in.
+
+    \headerfile malloc.h
+*/
+typedef struct malloc_prof_stats {
+    unsigned int rate;          /**< \brief One in this many allocations is
+                                            sampled */
+    size_t in_use;              /**< \brief Bytes allocated now */
+    size_t peak;                /**< \brief Most bytes allocated at once */
+    size_t sampled;             /**< \brief Allocations sampled */
+    size_t dropped;             /**< \brief Samples with no room to keep */
+    size_t sites;               /**< \brief Call sites seen */
+
+    size_t heap_size;           /**< \brief Bytes taken by the heap */
+    size_t free_bytes;          /**< \brief Bytes free inside the heap */
+    size_t free_chunks;         /**< \brief Free chunks inside the heap */
+    size_t largest_free;        /**< \brief Biggest of them */
+    size_t top_free;            /**< \brief Bytes free at the end of the
+                                            heap */
+    size_t free_hist[MALLOC_PROF_HIST]; /**< \brief Free chunks by size */
+} malloc_prof_stats_t;
+
+/** \brief  Heap profiler numbers for one call site.
+
+    These count only the sampled allocations. Multiply by the sampling rate
+    for an estimate of the real numbers.
+
+    \headerfile malloc.h
+*/
+typedef struct malloc_prof_site {
+    uintptr_t addr;             /**< \brief Return address of the call */
+    size_t allocs;              /**< \brief Allocations made */
+    size_t bytes;               /**< \brief Bytes allocated */
+    size_t live;                /**< \brief Blocks not freed yet */
+    size_t live_bytes;          /**< \brief Bytes not freed yet */
+} malloc_prof_site_t;
+
+/** \brief  Start the heap profiler.
+
+    Once started, the profiler keeps count of the bytes allocated and the most
+    there has been at once, and records where one in every rate allocations
+    was made from and whether it has been freed yet. Recording every
+    allocation (a rate of 1) gives exact numbers but slows the heap down and
+    runs out of room for blocks sooner; something like 16 or 64 is enough to
+    find what is holding on to memory.
+
+    The profiler takes about 64 KiB of its own from the heap, and isn't
+    available when the heap is built with KM_DBG. Calling this while it is
+    running just changes the rate.
+
+    \param  rate            Sample one in this many allocations.
+    \retval 0               On success.
+    \retval -1              On error, errno is set to EINVAL if rate is 0,
+                            ENOMEM if there isn't room for the profiler, or
+                            ENOSYS if it isn't available.
+*/
+int malloc_prof_start(unsigned int rate);
+
+/** \brief  Stop the heap profiler and throw away what it recorded. */
+void malloc_prof_stop(void);
+
+/** \brief  Get the heap profiler's statistics.
+
+    \param  st              Where to put them.
+*/
+void malloc_prof_get_stats(malloc_prof_stats_t *st);
+
+/** \brief  Get the call sites the heap profiler has seen.
+
+    The sites are sorted by the bytes they still have allocated, most first.
+
+    \param  sites           Where to put them.
+    \param  max             How many there is room for.
+    \return                 How many were put there.
+*/
+size_t malloc_prof_get_sites(malloc_prof_site_t *sites, size_t max);
+
+/** \brief  Print a heap profile.
+
+    This prints the profiler's statistics, a report of how the free space in
+    the heap is broken up, and each call site the profiler has seen with its
+    estimated numbers and the nearest exported symbol before it. The
+    fragmentation is the part of the free space that can't be allocated in
+    one piece.
+
+    \param  fn              The file to write to, or NULL to print over dbgio.
+    \retval 0               On success.
+    \retval -1              If the file couldn't be opened, or the profiler
+                            isn't available.
+*/
+int malloc_prof_dump(const char *fn);
+
 /** \brief Only available with KM_DBG
 */
 int mem_check_block(void *p);
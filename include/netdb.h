@@ -108,6 +108,7 @@ extern int h_errno;
 #define EAI_SOCKTYPE        8       /**< \brief Invalid socket type. */
 #define EAI_SYSTEM          9       /**< \brief System error, check errno. */
 #define EAI_OVERFLOW        10      /**< \brief Argument buffer overflow. */
+#define EAI_INPROGRESS      11      /**< \brief Lookup not finished yet. */
 /** @} */
 
 /** \defgroup addrinfo_flags    addrinfo ai_flags
@@ -160,6 +161,76 @@ void freeaddrinfo(struct addrinfo *ai);
 int getaddrinfo(const char *nodename, const char *servname,
                 const struct addrinfo *hints, struct addrinfo **res);
 
+/** \brief   A lookup started by getaddrinfo_async().
+    \ingroup network_db
+*/
+typedef struct gai_async gai_async_t;
+
+/** \brief   Start looking up an address without waiting for the result.
+    \ingroup network_db
+
+    This function starts the same lookup as getaddrinfo() does, but returns
+    without waiting for the DNS server to respond. The result is collected with
+    getaddrinfo_async_poll(). Both IPv4 and IPv6 addresses are asked for at
+    once when the family is AF_UNSPEC. Numeric addresses and names that are in
+    the cache are finished right away. This function is a KOS extension.
+
+    \param  nodename        The host to look up.
+    \param  servname        The service to look up.
+    \param  hints           Hints used in aiding lookup.
+    \param  req             Where to store the lookup in progress.
+    \return                 0 if the lookup was started, non-zero error code
+                            if it failed right away.
+    \see    addrinfo_errors
+*/
+int getaddrinfo_async(const char *nodename, const char *servname,
+                      const struct addrinfo *hints, gai_async_t **req);
+
+/** \brief   Get a descriptor to wait on for a lookup.
+    \ingroup network_db
+
+    This function returns a file descriptor that becomes readable with poll()
+    or select() when a response arrives for the lookup. Retries are only sent
+    from getaddrinfo_async_poll(), so it should be called at least every half
+    second or so even if nothing arrives.
+
+    \param  req             The lookup in progress.
+    \return                 The descriptor, or -1 if the lookup is finished.
+*/
+int getaddrinfo_async_fd(const gai_async_t *req);
+
+/** \brief   Check whether a lookup has finished.
+    \ingroup network_db
+
+    This function handles any responses that have arrived for the lookup and
+    sends it again if the server has taken too long, without blocking. Once
+    the lookup is finished, its result is returned just like getaddrinfo()
+    would and req is freed.
+
+    \param  req             The lookup in progress.
+    \param  res             The resulting address information.
+    \return                 EAI_INPROGRESS if the lookup is not finished yet,
+                            otherwise what getaddrinfo() would return.
+*/
+int getaddrinfo_async_poll(gai_async_t *req, struct addrinfo **res);
+
+/** \brief   Abandon a lookup.
+    \ingroup network_db
+
+    \param  req             The lookup in progress, which is freed.
+*/
+void getaddrinfo_async_cancel(gai_async_t *req);
+
+/** \brief   Forget every name that has been looked up.
+    \ingroup network_db
+
+    Names looked up in the DNS are remembered for as long as the server says
+    they're good for (including names that don't exist). This function throws
+    all of them away, such as after switching networks. This function is a KOS
+    extension.
+*/
+void getaddrinfo_cache_flush(void);
+
 /** \brief   Look up a host by its name.
     \ingroup network_db
 
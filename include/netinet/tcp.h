@@ -46,6 +46,7 @@ __BEGIN_DECLS
 */
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
+#define TCP_CORK                3 /**< \brief Only send full segments. */
 
 /** @} */
 
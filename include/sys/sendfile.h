@@ -0,0 +1,63 @@
+/* KallistiOS ##version##
+
+   sys/sendfile.h
+
+*/
+
+/** \file    sys/sendfile.h
+    \brief   Header for sending files over sockets.
+    \ingroup vfs_sockets
+
+    This file contains the sendfile() function, which sends data from a file
+    over a socket without reading it into a buffer first. The interface is the
+    same as the one found on Linux.
+*/
+
+#ifndef __SYS_SENDFILE_H
+#define __SYS_SENDFILE_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+/** \addtogroup vfs_sockets
+    @{
+*/
+
+/** \brief  Send data from a file over a socket.
+
+    This function sends up to count bytes from the file in_fd over the socket
+    out_fd. On TCP sockets, files that can be mapped with fs_mmap() (such as
+    those on a romdisk or a ramdisk, or on a filesystem using the VFS file
+    cache) are copied straight from the mapping into the socket's send buffer.
+    Other files are read into a buffer and sent from there, as a read() and
+    send() loop would.
+
+    As with send(), this blocks until all the data has been queued, unless the
+    socket is non-blocking, in which case it may send less than requested.
+
+    \param  out_fd          The socket to send the data on.
+    \param  in_fd           The file to read the data from.
+    \param  offset          If not NULL, where to start reading the file from;
+                            on return it is set just past the last byte sent
+                            and the file position is left unchanged. If NULL,
+                            the data is read from the file position, which is
+                            updated.
+    \param  count           The number of bytes to send.
+    \return                 The number of bytes sent, or -1 on error.
+
+    \par    Error Conditions:
+    \em     EBADF - an invalid file descriptor was given \n
+    \em     ENOTSOCK - out_fd is not a socket \n
+    \em     EWOULDBLOCK - the socket is non-blocking and its buffer is full \n
+    \em     ENOMEM - out of memory \n
+    plus any error send() or read() could return.
+*/
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __SYS_SENDFILE_H */
@@ -171,8 +171,51 @@ struct sockaddr_storage {
 #define MSG_TRUNC       0x20    /**< \brief Normal data truncated (U) */
 #define MSG_WAITALL     0x40    /**< \brief Attempt to fill read buffer */
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
+#define MSG_WAITFORONE  0x100   /**< \brief Only wait for the first message of
+                                             recvmmsg() (non-standard) */
 /** @} */
 
+/** \brief  Message header structure.
+
+    This structure describes a message for the recvmsg() and sendmsg()
+    functions, with its data spread over one or more buffers.
+
+    \headerfile sys/socket.h
+*/
+struct msghdr {
+    /** \brief  Address to send to, or space for the address received from
+                (can be NULL). */
+    void         *msg_name;
+    /** \brief  Size of msg_name, in bytes. */
+    socklen_t     msg_namelen;
+    /** \brief  Buffers holding the data of the message. */
+    struct iovec *msg_iov;
+    /** \brief  Number of buffers in msg_iov. */
+    int           msg_iovlen;
+    /** \brief  Ancillary data (not supported). */
+    void         *msg_control;
+    /** \brief  Size of msg_control, in bytes. */
+    socklen_t     msg_controllen;
+    /** \brief  Flags on the message received (such as MSG_TRUNC). */
+    int           msg_flags;
+};
+
+/** \brief  Message structure for sending or receiving several at once.
+
+    This structure is used with the recvmmsg() and sendmmsg() functions, which
+    are non-standard (but are found on other systems).
+
+    \headerfile sys/socket.h
+*/
+struct mmsghdr {
+    /** \brief  The message. */
+    struct msghdr msg_hdr;
+    /** \brief  Number of bytes received or sent for it. */
+    unsigned int  msg_len;
+};
+
+struct timespec;
+
 /** \addtogroup networking_sockets
     @{
 */
@@ -339,6 +382,74 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+/** \brief  Receive a message on a socket into several buffers.
+
+    This function works like recvfrom(), but with the data being received
+    spread over the buffers in msg->msg_iov. msg->msg_flags is set to MSG_TRUNC
+    if the message didn't fit.
+
+    \param  socket      The socket to receive on.
+    \param  msg         The message to receive into.
+    \param  flags       The type of message reception.
+
+    \return             On success, the length of the message in bytes. If no
+                        messages are available, and the socket has been shut
+                        down, 0. On error, -1, and sets errno as appropriate.
+*/
+ssize_t recvmsg(int socket, struct msghdr *msg, int flags);
+
+/** \brief  Send a message on a socket from several buffers.
+
+    This function works like sendto(), but with the data of the message
+    gathered from the buffers in msg->msg_iov.
+
+    \param  socket      The socket to send on.
+    \param  msg         The message to send.
+    \param  flags       The type of message transmission.
+
+    \return             On success, the number of bytes sent. On error, -1,
+                        and sets errno as appropriate.
+*/
+ssize_t sendmsg(int socket, const struct msghdr *msg, int flags);
+
+/** \brief  Receive several messages on a socket at once.
+
+    This function receives up to vlen messages, setting msg_len of each one
+    that is received to its length. For datagram sockets, this is much cheaper
+    than calling recvfrom() for each one. This function is not part of POSIX.
+
+    Unless the socket is non-blocking or MSG_DONTWAIT is given, this waits for
+    all vlen messages to arrive, or with MSG_WAITFORONE, only for the first one.
+    If timeout is not NULL, it limits how long to wait for all of them.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      The messages to receive into.
+    \param  vlen        The number of messages in msgvec.
+    \param  flags       The type of message reception.
+    \param  timeout     Longest time to wait (can be NULL).
+
+    \return             The number of messages received. On error, -1, and
+                        sets errno as appropriate.
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
+/** \brief  Send several messages on a socket at once.
+
+    This function sends up to vlen messages, setting msg_len of each one that
+    is sent to the number of bytes sent. This function is not part of POSIX.
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The messages to send.
+    \param  vlen        The number of messages in msgvec.
+    \param  flags       The type of message transmission.
+
+    \return             The number of messages sent, which is less than vlen
+                        if one of them failed. If the first one fails, -1, and
+                        sets errno as appropriate.
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
@@ -31,11 +31,14 @@ ISO9660 systems, as these were used as references as well.
 
 #include <dc/fs_iso9660.h>
 #include <dc/cdrom.h>
+#include <dc/g1ata.h>
 #include <dc/vblank.h>
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
 #include <kos/fs.h>
+#include <kos/fs_cache.h>
+#include <kos/fs_aio.h>
 #include <kos/opts.h>
 #include <kos/dbglog.h>
 
@@ -50,6 +53,7 @@ ISO9660 systems, as these were used as references as well.
 #include <sys/ioctl.h>
 
 static int init_percd(void);
+static vfs_handler_t vh;
 static int percd_done;
 
 /********************************************************************************/
@@ -344,6 +348,10 @@ static int init_percd(void) {
     /* Start off with no cached blocks and no open files*/
     iso_reset();
 
+    /* Anything in the file cache came off the old disc */
+    fs_cache_invalidate(&vh, NULL);
+    fs_dcache_invalidate(&vh, NULL);
+
     /* Locate the root session */
     if((i = cdrom_reinit()) != 0) {
         dbglog(DBG_ERROR, "fs_iso9660:init_percd: cdrom_reinit returned %d\n", i);
@@ -595,6 +603,12 @@ static TAILQ_HEAD(iso_fd_queue, iso_fd) iso_fd_queue;
 static mutex_t fh_mutex;
 static iso_fd_t *stream_fd = NULL;
 
+/* Asynchronous read being streamed in, if any. Once it's done, the stream it
+   used is left open until something else needs the drive. */
+static fs_aio_req_t *aio_req = NULL;
+static size_t aio_len;
+static bool aio_stream = false;
+
 /* Break all of our open file descriptor. This is necessary when the disc
    is changed so that we don't accidentally try to keep on doing stuff
    with the old info. As files are closed and re-opened, the broken flag
@@ -611,13 +625,18 @@ static inline void iso_break_all(void) {
 
 /* Abort the current stream. */
 static inline void iso_abort_stream(bool lock) {
-    if(stream_fd) {
+    if(stream_fd || aio_stream) {
         if(lock)
             mutex_lock(&fh_mutex);
 
         cdrom_stream_stop(false);
-        stream_fd->stream_part = 0;
-        stream_fd = NULL;
+
+        if(stream_fd) {
+            stream_fd->stream_part = 0;
+            stream_fd = NULL;
+        }
+
+        aio_stream = false;
 
         if(lock)
             mutex_unlock(&fh_mutex);
@@ -860,6 +879,83 @@ read_error:
     return -1;
 }
 
+/* Called from the G1 DMA interrupt when an asynchronous read is done */
+static void iso_aio_done(void *data) {
+    fs_aio_req_t *req = (fs_aio_req_t *)data;
+
+    aio_req = NULL;
+    fs_aio_done(req, aio_len, 0);
+}
+
+/* Start an asynchronous read. Only reads starting on a sector boundary into a
+   32-byte aligned buffer can be streamed straight into the buffer by DMA,
+   everything else is left to the VFS worker threads. */
+static int iso_aio(void * h, fs_aio_req_t *req) {
+    iso_fd_t *fd = (iso_fd_t *)h;
+    uint32_t sector;
+    size_t len;
+
+    if(req->op != FS_AIO_READ || (req->offset & 2047) ||
+       !__is_aligned(req->buf, 32) || fd->first_extent == 0 || fd->broken) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if(aio_req || g1_dma_in_progress() || mutex_trylock(&fh_mutex)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if((uint32_t)req->offset >= fd->size)
+        len = 0;
+    else if(req->count > fd->size - req->offset)
+        len = fd->size - req->offset;
+    else
+        len = req->count;
+
+    if(len & 31) {
+        mutex_unlock(&fh_mutex);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    fd->ptr = req->offset + len;
+
+    if(len == 0) {
+        mutex_unlock(&fh_mutex);
+        fs_aio_done(req, 0, 0);
+        return 0;
+    }
+
+    iso_abort_stream(false);
+
+    sector = fd->first_extent + req->offset / 2048;
+
+    if(cdrom_stream_start(sector + 150, (len + 2047) / 2048, CDROM_READ_DMA)) {
+        fd->ptr = req->offset;
+        mutex_unlock(&fh_mutex);
+        errno = EIO;
+        return -1;
+    }
+
+    aio_stream = true;
+    aio_req = req;
+    aio_len = len;
+    cdrom_stream_set_callback(iso_aio_done, req);
+
+    if(cdrom_stream_request(req->buf, len, false)) {
+        aio_req = NULL;
+        iso_abort_stream(false);
+        fd->ptr = req->offset;
+        mutex_unlock(&fh_mutex);
+        errno = EIO;
+        return -1;
+    }
+
+    mutex_unlock(&fh_mutex);
+    return 0;
+}
+
 /* Seek elsewhere in a file */
 static off_t iso_seek(void * h, off_t offset, int whence) {
     uint32_t old_ptr;
@@ -1107,9 +1203,13 @@ static void iso_vblank(uint32 evt, void *data) {
         return;
 
     if(iso_last_status != status) {
-        if(status == CD_STATUS_OPEN || status == CD_STATUS_NO_DISC)
+        if(status == CD_STATUS_OPEN || status == CD_STATUS_NO_DISC) {
             percd_done = 0;
 
+            /* We're in an interrupt, so this drops all cached entries */
+            fs_dcache_invalidate(&vh, NULL);
+        }
+
         iso_last_status = status;
     }
 }
@@ -1225,7 +1325,8 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT
     },
 
-    0, NULL,            /* no caching, privdata */
+    VFS_CACHE_MMAP | VFS_CACHE_DENTRY,  /* file and stat caches */
+    NULL,               /* privdata */
 
     iso_open,
     iso_close,
@@ -1252,7 +1353,8 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     iso_rewinddir,
-    iso_fstat
+    iso_fstat,
+    iso_aio
 };
 
 /* Initialize the file system */
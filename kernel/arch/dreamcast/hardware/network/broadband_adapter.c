@@ -49,6 +49,17 @@
 /* DMA transfer will be used only if the amount of bytes exceeds that threshold */
 #define DMA_THRESHOLD 128 // looks like a good value
 
+/* Interrupts we want from the chip. While the RX thread is polling, the RX
+   ones in RX_INTRS are masked off. */
+#define INTR_MASK   (RT_INT_PCIERR | RT_INT_TIMEOUT | RT_INT_RXFIFO_OVERFLOW | \
+                     RT_INT_RXFIFO_UNDERRUN | RT_INT_RXBUF_OVERFLOW | \
+                     RT_INT_TX_ERR | RT_INT_TX_OK | RT_INT_RX_ERR | RT_INT_RX_OK)
+#define RX_INTRS    (RT_INT_RX_ERR | RT_INT_RX_OK)
+
+/* Most frames the RX thread hands to the stack before letting other threads
+   have a turn, when it is polling through a burst. */
+#define RX_BUDGET   32
+
 /* Since callbacks will be running with interrupts enabled,
    it might be a good idea to protect bba_tx with a semaphore from inside.
    I'm not sure lwip needs that, but dcplaya does when using both lwip and its
@@ -232,6 +243,9 @@ static eth_rx_callback_t eth_rx_callback;
 /* Forward-declaration for IRQ handler */
 static void bba_irq_hnd(uint32 code, void *data);
 
+/* Our network device, whose counters are kept up to date from here */
+extern netif_t bba_if;
+
 /* Reads the MAC address of the BBA into the specified array */
 void bba_get_mac(uint8 *arr) {
     memcpy(arr, rtl.mac, 6);
@@ -370,15 +384,7 @@ static int bba_hw_init(void) {
     /* Enable receive interrupts */
     /* XXX need to handle more! */
     g2_write_16(NIC(RT_INTRSTATUS), 0xffff);
-    g2_write_16(NIC(RT_INTRMASK), RT_INT_PCIERR |
-                RT_INT_TIMEOUT |
-                RT_INT_RXFIFO_OVERFLOW |
-                RT_INT_RXFIFO_UNDERRUN |    // +link change
-                RT_INT_RXBUF_OVERFLOW |
-                RT_INT_TX_ERR |
-                RT_INT_TX_OK |
-                RT_INT_RX_ERR |
-                RT_INT_RX_OK);
+    g2_write_16(NIC(RT_INTRMASK), INTR_MASK);
 
     /* Reset RXMISSED counter */
     g2_write_32(NIC(RT_RXMISSED), 0);
@@ -481,6 +487,8 @@ static uint32 rx_size;
 static kthread_t * bba_rx_thread;
 static semaphore_t bba_rx_sema;
 static int bba_rx_exit_thread;
+static volatile int bba_rx_polling;
+static volatile int bba_rx_dma_wait;
 static semaphore_t bba_rx_sema2;
 
 static void bba_rx(void);
@@ -496,10 +504,20 @@ static void rx_finish_enq(int room) {
     rtl.cur_rx = (rtl.cur_rx + rx_size + 4 + 3) & ~3;
     g2_write_16(NIC(RT_RXBUFTAIL), (rtl.cur_rx - 16) & (RX_BUFFER_LEN - 1));
 
+    /* The RX thread is woken up once per burst, by the interrupt handler, and
+       otherwise only when it's waiting for a DMA to finish, which is this. */
+    if(bba_rx_dma_wait) {
+        bba_rx_dma_wait = 0;
+        sem_signal(&bba_rx_sema);
+    }
+
     if(room > 0 && (((rxin + 1) % MAX_PKTS) != rxout)) {
+        ++bba_if.stats.rx_packets;
+        bba_if.stats.rx_bytes += rx_pkt[rxin].pkt_size;
         rxin = (rxin + 1) % MAX_PKTS;
-        sem_signal(&bba_rx_sema);
-        thd_schedule(true);
+    }
+    else {
+        ++bba_if.stats.rx_dropped;
     }
 }
 
@@ -699,7 +717,31 @@ void bba_unlock(void) {
     //sem_signal(&bba_rx_sema2);
 }
 
+/* Hand up to budget frames from the queue to the stack, returning how many
+   there were. */
+static int bba_rx_deliver(int budget) {
+    int n = 0;
+
+    while(n < budget && rxout != rxin) {
+        /* Call the callback to process it */
+        eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
+
+        rxout = (rxout + 1) % MAX_PKTS;
+        ++n;
+    }
+
+    return n;
+}
+
+/* Once the interrupt handler has seen the first frame of a burst, it turns
+   off RX interrupts and wakes this up, and this polls the chip for the rest
+   of the burst, handing frames to the stack in batches. When there's nothing
+   left, RX interrupts go back on and this goes back to sleep. This way, a
+   burst costs one interrupt and one wakeup, not one of each per frame. */
 static void *bba_rx_threadfunc(void *dummy) {
+    irq_mask_t old;
+    int n;
+
     (void)dummy;
 
     while(!bba_rx_exit_thread) {
@@ -711,12 +753,46 @@ static void *bba_rx_threadfunc(void *dummy) {
 
         bba_lock();
 
-        if(rxout != rxin) {
+        for(;;) {
+            n = bba_rx_deliver(RX_BUDGET);
+            ++bba_if.stats.rx_polls;
 
-            /* Call the callback to process it */
-            eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
+            /* Pull in anything else the chip has gotten. */
+            old = irq_disable();
+            g2_write_16(NIC(RT_INTRSTATUS), RX_INTRS);
 
-            rxout = (rxout + 1) % MAX_PKTS;
+            if(!dma_used)
+                bba_rx();
+
+            if(rxout == rxin && !dma_used) {
+                /* All done. If anything comes in between checking and
+                   unmasking, the interrupt will go off straight away. */
+                bba_rx_polling = 0;
+                g2_write_16(NIC(RT_INTRMASK), INTR_MASK);
+                irq_restore(old);
+                break;
+            }
+
+            if(rxout == rxin) {
+                /* Nothing to do until the DMA finishes, so sleep until the
+                   DMA callback queues the frame and wakes us up. */
+                bba_rx_dma_wait = 1;
+                irq_restore(old);
+                sem_wait(&bba_rx_sema);
+
+                if(bba_rx_exit_thread)
+                    break;
+
+                continue;
+            }
+
+            irq_restore(old);
+
+            /* Let everyone else have a turn if we used up the budget. This
+               thread runs at a high priority, so thd_pass() would only let
+               other threads at that priority run; sleep instead. */
+            if(n == RX_BUDGET)
+                thd_sleep(1);
         }
 
         bba_unlock();
@@ -758,6 +834,8 @@ static void bba_rx(void) {
                 dbglog(DBG_KDEBUG, "bba: frame receive error, status is %08lx; skipping\n", rx_status);
             }
 
+            ++bba_if.stats.rx_dropped;
+
             dbglog(DBG_KDEBUG, "bba: bogus packet receive detected; skipping packet\n");
             rx_reset();
             break;
@@ -815,6 +893,15 @@ static void bba_irq_hnd(uint32 code, void *data) {
         /* so that the irq is not called again and again */
         g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_ACK);
 
+        /* Leave the rest of the burst to the RX thread, which will turn the
+           RX interrupts back on when it is done. */
+        if(bba_rx_thread && !bba_rx_polling) {
+            bba_rx_polling = 1;
+            g2_write_16(NIC(RT_INTRMASK), INTR_MASK & ~RX_INTRS);
+            sem_signal(&bba_rx_sema);
+            thd_schedule(true);
+        }
+
         hnd = 1;
     }
 
@@ -829,6 +916,7 @@ static void bba_irq_hnd(uint32 code, void *data) {
 
     if(intr & RT_INT_RXBUF_OVERFLOW) {
         dbglog(DBG_KDEBUG, "bba: RX overrun\n");
+        ++bba_if.stats.rx_dropped;
         rx_reset();
         hnd = 1;
     }
@@ -919,6 +1007,8 @@ static int bba_if_start(netif_t *self) {
     assert(bba_rx_thread == NULL);
     sem_init(&bba_rx_sema, 0);
     sem_init(&bba_rx_sema2, 1);
+    bba_rx_polling = 0;
+    bba_rx_dma_wait = 0;
     bba_rx_thread = thd_create(0, bba_rx_threadfunc, 0);
     bba_rx_thread->prio = 1;
     thd_set_label(bba_rx_thread, "BBA-rx-thd");
@@ -960,6 +1050,11 @@ static int bba_if_stop(netif_t *self) {
 
     bba_rx_thread = NULL;
 
+    /* The thread may have been stopped in the middle of a burst. */
+    bba_rx_polling = 0;
+    bba_rx_dma_wait = 0;
+    g2_write_16(NIC(RT_INTRMASK), INTR_MASK);
+
     bba_if.flags &= ~NETIF_RUNNING;
     return 0;
 }
@@ -970,8 +1065,13 @@ static int bba_if_tx(netif_t *self, const uint8 *data, int len, int blocking) {
     if(!(bba_if.flags & NETIF_RUNNING))
         return -1;
 
-    if(bba_tx(data, len, blocking) != BBA_TX_OK)
+    if(bba_tx(data, len, blocking) != BBA_TX_OK) {
+        ++bba_if.stats.tx_dropped;
         return -1;
+    }
+
+    ++bba_if.stats.tx_packets;
+    bba_if.stats.tx_bytes += len;
 
     return 0;
 }
@@ -996,12 +1096,8 @@ static int bba_if_rx_poll(netif_t *self) {
         g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_ACK);
     }
 
-    if(rxout != rxin) {
-        /* Call the callback to process it */
-        eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
-
-        rxout = (rxout + 1) % MAX_PKTS;
-    }
+    bba_rx_deliver(RX_BUDGET);
+    ++bba_if.stats.rx_polls;
 
     return 0;
 }
@@ -1131,6 +1227,7 @@ int bba_init(void) {
     memset(&bba_if.ip6_gateway, 0, sizeof(bba_if.ip6_gateway));
     bba_if.mtu6 = 0;
     bba_if.hop_limit = 0;
+    memset(&bba_if.stats, 0, sizeof(bba_if.stats));
 
     bba_if.if_init = bba_if_init;
     bba_if.if_shutdown = bba_if_shutdown;
@@ -247,6 +247,22 @@ void snd_sfx_stop(int chn);
 */
 void snd_sfx_stop_all(void);
 
+/** \brief  Defragment the sound effects in SPU RAM.
+
+    This stops all channels playing sound effects, and then moves the loaded
+    sound effects down in SPU RAM with snd_mem_compact() to close up the holes
+    left by ones that were unloaded, so that a bigger one can be loaded. Their
+    handles stay the same.
+
+    Effects playing on channels allocated with snd_sfx_chn_alloc() are not
+    stopped by this, so stop them first. Don't play any effects from another
+    thread while this runs.
+
+    \return                 The number of blocks moved, or -1 on error.
+    \see    snd_mem_compact()
+*/
+int snd_sfx_defrag(void);
+
 /** \brief  Allocate a sound channel for use outside the sound effect system.
 
     This function finds and allocates a channel for use for things other than
@@ -70,6 +70,95 @@ void snd_mem_free(uint32 addr);
 */
 uint32 snd_mem_available(void);
 
+/** \brief  SPU RAM pool statistics.
+
+    This structure is filled in by snd_mem_get_stats(). All sizes are in
+    bytes.
+
+    \headerfile dc/sound/sound.h
+*/
+typedef struct snd_mem_stats {
+    size_t total;           /**< \brief Size of the pool */
+    size_t used;            /**< \brief Bytes allocated */
+    size_t free;            /**< \brief Bytes not allocated */
+    size_t largest_free;    /**< \brief Largest free block */
+    size_t used_blocks;     /**< \brief Number of allocated blocks */
+    size_t free_blocks;     /**< \brief Number of free blocks */
+    size_t movable_blocks;  /**< \brief Allocated blocks snd_mem_compact() can move */
+
+    /** \brief  How fragmented the free space is, in percent.
+
+        This is 0 when all the free space is in one block, and gets closer to
+        100 the smaller a part of it the largest free block is.
+    */
+    uint32 fragmentation;
+} snd_mem_stats_t;
+
+/** \brief  Get statistics on the SPU RAM pool.
+
+    \param  st              Where to put the statistics.
+    \retval 0               On success.
+    \retval -1              If the pool couldn't be locked (errno will be set
+                            to EAGAIN).
+*/
+int snd_mem_get_stats(snd_mem_stats_t *st);
+
+/** \brief  SPU RAM block move callback.
+
+    Functions of this type are called by snd_mem_compact() after it has moved
+    a block, so that whoever owns it can update anything that has its address.
+    They are called with the allocator's spinlock held, so that nobody can see
+    the block at its new address before its owner knows about it. That means
+    they must be short, must not block or sleep, and must not call any of the
+    snd_mem functions (including from an interrupt they take), or they will
+    deadlock.
+
+    \param  from            The address the block used to be at.
+    \param  to              The address it is at now.
+    \param  data            The data passed to snd_mem_set_movable().
+*/
+typedef void (*snd_mem_move_cb_t)(uint32 from, uint32 to, void *data);
+
+/** \brief  Allow a block in the SPU RAM pool to be moved.
+
+    Blocks are pinned where they were allocated by default. This marks one as
+    something snd_mem_compact() may move, and says who to tell when it does.
+    Only do this for data that nothing but the caller keeps the address of,
+    and that isn't being played or DMAed while snd_mem_compact() runs.
+
+    \param  addr            The location of the start of the block.
+    \param  cb              The function to call when the block is moved, or
+                            NULL to pin it again.
+    \param  data            Data to pass to the callback.
+    \retval 0               On success.
+    \retval -1              On error, errno will be set to EINVAL if there is
+                            no allocated block at addr.
+*/
+int snd_mem_set_movable(uint32 addr, snd_mem_move_cb_t cb, void *data);
+
+/** \brief  Defragment the SPU RAM pool.
+
+    This moves the blocks marked with snd_mem_set_movable() down over the free
+    space below them, so that the free space is gathered together into bigger
+    blocks. Pinned blocks stay where they are, so free space can still be left
+    in between them. The data is copied with DMA through a buffer in main RAM,
+    which takes a while for a pool full of sound effects, so do this at a time
+    like a level load rather than every frame. The pool is only locked in
+    between copies, so the other snd_mem functions can still be used while
+    this runs, including from interrupts. A block that is freed while it is
+    being moved is freed once the copy is done, and its callback isn't
+    called.
+
+    This can't be called from an interrupt.
+
+    \return                 The number of blocks moved, or -1 on error (errno
+                            will be set to EPERM if called in an interrupt, or
+                            EBUSY if another compaction is already running).
+
+    \see    snd_sfx_defrag()
+*/
+int snd_mem_compact(void);
+
 /** \brief  Reinitialize the SPU RAM pool.
 
     This function reinitializes the SPU RAM pool with the given base offset
@@ -11,11 +11,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <malloc.h>
 #include <sys/queue.h>
 #include <dc/sound/sound.h>
+#include <dc/spu.h>
+#include <dc/g2bus.h>
 #include <arch/arch.h>
+#include <arch/cache.h>
 #include <arch/spinlock.h>
 #include <kos/dbglog.h>
+#include <kos/thread.h>
 
 /*
 
@@ -23,34 +28,53 @@ This is a very simple allocator for SPU RAM. I decided not to go with dlmalloc
 because of the massive number of changes it would require in the thing to
 make it use the g2_* bus calls. This is just a lot more sane.
 
-This still uses the same basic algorithm, though, it just doesn't bother
-trying to be super efficient. This is based on the assumption that the
-most common usage will be allocating or freeing a couple of very large
-chunks every once in a while, not a ton of tiny chunks constantly (like
-dlmalloc is optimized for).
+The SPU RAM is described by a list of blocks in regular RAM, in address
+order, each of which is either in use or free. Neighbouring free blocks are
+always merged, so a free block only ever has used blocks (or the ends of
+the pool) on either side of it.
+
+Free blocks are also kept on segregated free lists, one for each power of
+two size class (32-63 bytes, 64-127 bytes and so on). To allocate, we look
+for the smallest block that fits in the size's own class, and failing that,
+take the smallest block in the next class up that has anything in it. That
+is very nearly best fit, without looking at every block there is. If there
+is any space left over, the block is broken into two, the first one
+occupied and the second one unoccupied. Used blocks are kept in a small
+hash on their address, so that freeing doesn't have to search either.
+
+Loading and unloading banks of sound effects of different sizes over and
+over still leaves holes in between the ones that stay, though. So a block
+can be marked as movable by whoever owns it, along with a function to call
+when it moves, and snd_mem_compact() slides movable blocks down over the
+holes in front of them with DMA so that the free space ends up in one
+piece at the top. Blocks that aren't movable (stream buffers, anything
+the ARM side knows the address of) stay where they are. The lock is let go
+while each block is copied, so that nobody else has to wait for the DMA;
+the block being moved and the space it's moving into are marked so that
+nothing else touches them in the meantime.
 
-The malloc algorithm used here is a basic "best fit" algorithm. We store a
-linked list of available chunks of sound RAM in regular RAM and traverse it
-to find the chunk that is the smallest while still large enough to fit the
-block size we want. If there is any space left over, this chunk is broken
-into two chunks, the first one occupied and the second one unoccupied.
+*/
 
-The free algorithm is very lazy: it attempts to coalesce with neighbor
-blocks if any of them are free. Otherwise it simply tags the block as free
-in the hopes that a later free will coalesce with it.
+#define SNDMEMDEBUG 0
 
-This system is a bit more simplistic than the standard "buckets" system, but
-I figure we don't need that sort of complexity in this code.
+/* Number of size classes: class n holds blocks of 32 << n bytes up to twice
+   that, and the last one everything bigger. */
+#define SND_MEM_CLASSES     18
 
-*/
+/* Buckets in the hash of used blocks. */
+#define SND_MEM_HASH        64
 
-#define SNDMEMDEBUG 0
+/* Size of the bounce buffer that snd_mem_compact() moves data through. */
+#define SND_MEM_BOUNCE      (16 * 1024)
 
 /* A single block of SPU RAM */
 typedef struct snd_block_str {
     /* Our queue entry */
     TAILQ_ENTRY(snd_block_str)  qent;
 
+    /* Our entry on a free list if we're free, or in the hash if not */
+    LIST_ENTRY(snd_block_str)   lent;
+
     /* The address of this block (offset from SPU RAM base) */
     uint32  addr;
 
@@ -59,17 +83,98 @@ typedef struct snd_block_str {
 
     /* Is this block in use? */
     int inuse;
+
+    /* If the block can be moved, who to tell when it is */
+    snd_mem_move_cb_t move;
+    void *move_data;
+
+    /* Is snd_mem_compact() moving this block, and was it freed meanwhile? */
+    int moving;
+    int freed;
 } snd_block_t;
 
+LIST_HEAD(snd_block_list, snd_block_str);
+
 /* Our SPU RAM pool */
 static int initted = 0;
 static TAILQ_HEAD(snd_block_q, snd_block_str) pool = {0};
+static struct snd_block_list free_lists[SND_MEM_CLASSES];
+static struct snd_block_list used_hash[SND_MEM_HASH];
 static spinlock_t snd_mem_mutex = SPINLOCK_INITIALIZER;
 
+/* Totals, for snd_mem_get_stats() */
+static size_t pool_size, used_size;
+static size_t used_cnt, free_cnt;
+
+/* Is snd_mem_compact() running? */
+static int compacting;
+
+static int size_class(size_t size) {
+    int cls = 31 - __builtin_clz((uint32)(size >> 5));
+
+    return cls < SND_MEM_CLASSES ? cls : SND_MEM_CLASSES - 1;
+}
+
+#define hash_addr(addr)     (((addr) >> 5) & (SND_MEM_HASH - 1))
+
+static void free_list_add(snd_block_t *e) {
+    LIST_INSERT_HEAD(&free_lists[size_class(e->size)], e, lent);
+    ++free_cnt;
+}
+
+static void free_list_remove(snd_block_t *e) {
+    LIST_REMOVE(e, lent);
+    --free_cnt;
+}
+
+static void used_add(snd_block_t *e) {
+    LIST_INSERT_HEAD(&used_hash[hash_addr(e->addr)], e, lent);
+    used_size += e->size;
+    ++used_cnt;
+}
+
+static void used_remove(snd_block_t *e) {
+    LIST_REMOVE(e, lent);
+    used_size -= e->size;
+    --used_cnt;
+}
+
+/* Merge a free block with its next neighbour, if that is free too. The
+   block must not be on a free list. */
+static void merge_next(snd_block_t *e) {
+    snd_block_t *o = TAILQ_NEXT(e, qent);
+
+    if(o && !o->inuse) {
+        if(__is_defined(SNDMEMDEBUG))
+            dbglog(DBG_DEBUG, "   coalescing with block at %08lx\n", o->addr);
+
+        free_list_remove(o);
+        e->size += o->size;
+        TAILQ_REMOVE(&pool, o, qent);
+        free(o);
+    }
+}
+
+/* The biggest free block. */
+static size_t largest_free(void) {
+    snd_block_t *e;
+    size_t largest = 0;
+    int cls;
+
+    for(cls = SND_MEM_CLASSES - 1; cls >= 0 && !largest; --cls) {
+        LIST_FOREACH(e, &free_lists[cls], lent) {
+            if(e->size > largest)
+                largest = e->size;
+        }
+    }
+
+    return largest;
+}
 
 /* Reinitialize the pool with the given RAM base offset */
 int snd_mem_init(uint32 reserve) {
     snd_block_t *blk;
+    int i;
 
     if(initted)
         snd_mem_shutdown();
@@ -82,9 +187,17 @@ int snd_mem_init(uint32 reserve) {
     // Make sure our base is 32-byte aligned
     reserve = (reserve + 0x1f) & ~0x1f;
 
-    /* Make sure our tailq is initted */
+    /* Make sure our tailq and lists are initted */
     TAILQ_INIT(&pool);
 
+    for(i = 0; i < SND_MEM_CLASSES; i++)
+        LIST_INIT(&free_lists[i]);
+
+    for(i = 0; i < SND_MEM_HASH; i++)
+        LIST_INIT(&used_hash[i]);
+
+    used_size = used_cnt = free_cnt = 0;
+
     blk = (snd_block_t *)malloc(sizeof(snd_block_t));
 
     if(!blk) {
@@ -103,6 +216,8 @@ int snd_mem_init(uint32 reserve) {
 
     blk->inuse = 0;
     TAILQ_INSERT_HEAD(&pool, blk, qent);
+    free_list_add(blk);
+    pool_size = blk->size;
 
     if(__is_defined(SNDMEMDEBUG))
         dbglog(DBG_DEBUG, "snd_mem_init: %d bytes available\n", blk->size);
@@ -143,7 +258,7 @@ void snd_mem_shutdown(void) {
 /* Allocate a chunk of SPU RAM; we will return an offset into SPU RAM. */
 uint32 snd_mem_malloc(size_t size) {
     snd_block_t *e, *best = NULL;
-    size_t best_size = SIZE_MAX;
+    int cls;
 
     assert_msg(initted, "Use of snd_mem_malloc before snd_mem_init");
 
@@ -158,11 +273,16 @@ uint32 snd_mem_malloc(size_t size) {
     // Make sure the size is a multiple of 32 bytes to maintain alignment
     size = (size + 0x1f) & ~0x1f;
 
-    /* Look for a block */
-    TAILQ_FOREACH(e, &pool, qent) {
-        if(e->size >= size && e->size < best_size && !e->inuse) {
-            best_size = e->size;
-            best = e;
+    /* Look for the best fit in the size's own class, and if there isn't one,
+       in the first class up that has anything. Every block there fits. */
+    for(cls = size_class(size); cls < SND_MEM_CLASSES && !best; ++cls) {
+        LIST_FOREACH(e, &free_lists[cls], lent) {
+            if(e->size >= size && (!best || e->size < best->size)) {
+                best = e;
+
+                if(e->size == size)
+                    break;
+            }
         }
     }
 
@@ -179,7 +299,9 @@ uint32 snd_mem_malloc(size_t size) {
                    best->addr, best->size);
         }
 
+        free_list_remove(best);
         best->inuse = 1;
+        used_add(best);
         spinlock_unlock(&snd_mem_mutex);
         return best->addr;
     }
@@ -193,11 +315,14 @@ uint32 snd_mem_malloc(size_t size) {
         return 0;
     }
 
+    free_list_remove(best);
+
     memset(e, 0, sizeof(snd_block_t));
     e->addr = best->addr + size;
     e->size = best->size - size;
     e->inuse = 0;
     TAILQ_INSERT_AFTER(&pool, best, e, qent);
+    free_list_add(e);
 
     if(__is_defined(SNDMEMDEBUG)) {
         dbglog(DBG_DEBUG, "snd_mem_malloc: allocating block %08lx for size %d, and leaving %d at %08lx\n",
@@ -206,38 +331,34 @@ uint32 snd_mem_malloc(size_t size) {
 
     best->size = size;
     best->inuse = 1;
+    used_add(best);
 
     spinlock_unlock(&snd_mem_mutex);
     return best->addr;
 }
 
-/* Free a chunk of SPU RAM; pointer is expected to be an offset into
-   SPU RAM. */
-void snd_mem_free(uint32 addr) {
-    snd_block_t *e, *o;
-
-    assert_msg(initted, "Use of snd_mem_free before snd_mem_init");
-
-    if(addr == 0)
-        return;
-
-    if(!spinlock_lock_irqsafe(&snd_mem_mutex))
-        return;
+/* Find a used block by its address. Call with the lock held. */
+static snd_block_t *find_used(uint32 addr) {
+    snd_block_t *e;
 
-    /* Look for the block */
-    TAILQ_FOREACH(e, &pool, qent) {
+    LIST_FOREACH(e, &used_hash[hash_addr(addr)], lent) {
         if(e->addr == addr)
-            break;
+            return e;
     }
 
-    if(!e) {
-        dbglog(DBG_ERROR, "snd_mem_free: attempt to free non-existent block at %08lx\n", (uint32)e);
-        spinlock_unlock(&snd_mem_mutex);
-        return;
-    }
+    return NULL;
+}
+
+/* Free a used block, merging it with any free neighbours, and return the
+   free block it ends up in. Call with the lock held. */
+static snd_block_t *free_block(snd_block_t *e) {
+    snd_block_t *o;
 
     /* Set this block as unused */
+    used_remove(e);
     e->inuse = 0;
+    e->move = NULL;
+    e->move_data = NULL;
 
     if(__is_defined(SNDMEMDEBUG))
         dbglog(DBG_DEBUG, "snd_mem_free: freeing block at %08lx\n", e->addr);
@@ -249,6 +370,7 @@ void snd_mem_free(uint32 addr) {
         if(__is_defined(SNDMEMDEBUG))
             dbglog(DBG_DEBUG, "   coalescing with block at %08lx\n", o->addr);
 
+        free_list_remove(o);
         o->size += e->size;
         TAILQ_REMOVE(&pool, e, qent);
         free(e);
@@ -256,22 +378,44 @@ void snd_mem_free(uint32 addr) {
     }
 
     /* Can we coalesce with the block in front of us? */
-    o = TAILQ_NEXT(e, qent);
+    merge_next(e);
+    free_list_add(e);
 
-    if(o && !o->inuse) {
-        if(__is_defined(SNDMEMDEBUG))
-            dbglog(DBG_DEBUG, "   coalescing with block at %08lx\n", o->addr);
+    return e;
+}
 
-        e->size += o->size;
-        TAILQ_REMOVE(&pool, o, qent);
-        free(o);
+/* Free a chunk of SPU RAM; pointer is expected to be an offset into
+   SPU RAM. */
+void snd_mem_free(uint32 addr) {
+    snd_block_t *e;
+
+    assert_msg(initted, "Use of snd_mem_free before snd_mem_init");
+
+    if(addr == 0)
+        return;
+
+    if(!spinlock_lock_irqsafe(&snd_mem_mutex))
+        return;
+
+    /* Look for the block */
+    if(!(e = find_used(addr))) {
+        dbglog(DBG_ERROR, "snd_mem_free: attempt to free non-existent block at %08lx\n", addr);
+        spinlock_unlock(&snd_mem_mutex);
+        return;
     }
+
+    /* If it's being moved, leave it to snd_mem_compact() to free once it's
+       done with it. */
+    if(e->moving)
+        e->freed = 1;
+    else
+        free_block(e);
+
     spinlock_unlock(&snd_mem_mutex);
 }
 
 uint32 snd_mem_available(void) {
-    snd_block_t *e;
-    size_t largest = 0;
+    size_t largest;
 
     if(!initted)
         return 0;
@@ -281,11 +425,203 @@ uint32 snd_mem_available(void) {
         return 0;
     }
 
-    TAILQ_FOREACH(e, &pool, qent) {
-        if(e->size > largest)
-            largest = e->size;
-    }
+    largest = largest_free();
 
     spinlock_unlock(&snd_mem_mutex);
     return (uint32)largest;
 }
+
+int snd_mem_set_movable(uint32 addr, snd_mem_move_cb_t cb, void *data) {
+    snd_block_t *e;
+
+    assert_msg(initted, "Use of snd_mem_set_movable before snd_mem_init");
+
+    if(!spinlock_lock_irqsafe(&snd_mem_mutex)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if(!(e = find_used(addr))) {
+        spinlock_unlock(&snd_mem_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    e->move = cb;
+    e->move_data = data;
+
+    spinlock_unlock(&snd_mem_mutex);
+    return 0;
+}
+
+int snd_mem_get_stats(snd_mem_stats_t *st) {
+    snd_block_t *e;
+    int i;
+
+    memset(st, 0, sizeof(snd_mem_stats_t));
+
+    if(!initted)
+        return 0;
+
+    if(!spinlock_lock_irqsafe(&snd_mem_mutex)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    st->total = pool_size;
+    st->used = used_size;
+    st->free = pool_size - used_size;
+    st->used_blocks = used_cnt;
+    st->free_blocks = free_cnt;
+    st->largest_free = largest_free();
+
+    for(i = 0; i < SND_MEM_HASH; i++) {
+        LIST_FOREACH(e, &used_hash[i], lent) {
+            if(e->move)
+                ++st->movable_blocks;
+        }
+    }
+
+    spinlock_unlock(&snd_mem_mutex);
+
+    if(st->free)
+        st->fragmentation = 100 - (uint32)((uint64)st->largest_free * 100 /
+                                           st->free);
+
+    return 0;
+}
+
+/* Copy within SPU RAM, from a higher address to a lower one, through a
+   buffer in main RAM. Going up from the start is safe even if the two
+   overlap, since each piece has been read before anything is written over
+   it. */
+static void spu_move_down(uint32 to, uint32 from, size_t size,
+                          uint8 *buf, size_t buf_size) {
+    size_t len;
+    int rv;
+
+    while(size) {
+        len = size < buf_size ? size : buf_size;
+
+        /* There mustn't be anything in the cache to be written back over
+           what the DMA puts there. */
+        dcache_purge_range((uintptr_t)buf, len);
+
+        while((rv = g2_dma_transfer(buf, (void *)(SPU_RAM_BASE | from), len,
+                                    1, NULL, NULL, G2_DMA_TO_SH4, 0,
+                                    G2_DMA_CHAN_SPU, 0)) < 0 &&
+              errno == EINPROGRESS)
+            thd_pass();
+
+        if(rv < 0)
+            spu_memread(buf, from, len);
+
+        spu_memload_dma(to, buf, len);
+
+        to += len;
+        from += len;
+        size -= len;
+    }
+}
+
+int snd_mem_compact(void) {
+    static uint8 small_buf[256] __attribute__((aligned(32)));
+    snd_block_t *e, *n;
+    snd_mem_move_cb_t cb;
+    void *cb_data;
+    uint32 from;
+    uint8 *buf;
+    size_t buf_size = SND_MEM_BOUNCE;
+    int moved = 0;
+
+    assert_msg(initted, "Use of snd_mem_compact before snd_mem_init");
+
+    if(irq_inside_int()) {
+        errno = EPERM;
+        return -1;
+    }
+
+    spinlock_lock(&snd_mem_mutex);
+
+    if(compacting) {
+        spinlock_unlock(&snd_mem_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+
+    compacting = 1;
+    spinlock_unlock(&snd_mem_mutex);
+
+    if(!(buf = (uint8 *)memalign(32, buf_size))) {
+        buf = small_buf;
+        buf_size = sizeof(small_buf);
+    }
+
+    spinlock_lock(&snd_mem_mutex);
+
+    /* Walk up through the pool, and whenever a free block has a movable one
+       after it, swap the two. The free block then carries on up, picking up
+       any free space it runs into, until it hits something that can't be
+       moved. */
+    for(e = TAILQ_FIRST(&pool); e; e = TAILQ_NEXT(e, qent)) {
+        if(e->inuse)
+            continue;
+
+        while((n = TAILQ_NEXT(e, qent)) && n->inuse && n->move) {
+            from = n->addr;
+            cb = n->move;
+            cb_data = n->move_data;
+
+            if(__is_defined(SNDMEMDEBUG)) {
+                dbglog(DBG_DEBUG, "snd_mem_compact: moving block at %08lx (size %d) to %08lx\n",
+                       from, n->size, e->addr);
+            }
+
+            /* Keep anyone else from allocating the free block or merging
+               anything into it, and from freeing the one being moved, while
+               the lock is let go for the copy. Whoever owns the block gets
+               told it moved even if they pin it again in the meantime. */
+            free_list_remove(e);
+            e->inuse = 1;
+            n->moving = 1;
+            spinlock_unlock(&snd_mem_mutex);
+
+            spu_move_down(e->addr, from, n->size, buf, buf_size);
+
+            spinlock_lock(&snd_mem_mutex);
+            n->moving = 0;
+            used_remove(n);
+
+            n->addr = e->addr;
+            e->addr = n->addr + n->size;
+            e->inuse = 0;
+            TAILQ_REMOVE(&pool, e, qent);
+            TAILQ_INSERT_AFTER(&pool, n, e, qent);
+
+            used_add(n);
+            merge_next(e);
+            free_list_add(e);
+
+            if(n->freed) {
+                /* It was freed while it was being moved, so there's nobody
+                   to tell. It and the free block after it become one. */
+                n->freed = 0;
+                e = free_block(n);
+            }
+            else {
+                /* Still locked, so that the owner hears about the move before
+                   anyone can free or look up the block at its new address. */
+                cb(from, n->addr, cb_data);
+                ++moved;
+            }
+        }
+    }
+
+    compacting = 0;
+    spinlock_unlock(&snd_mem_mutex);
+
+    if(buf != small_buf)
+        free(buf);
+
+    return moved;
+}
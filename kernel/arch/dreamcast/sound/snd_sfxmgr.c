@@ -48,6 +48,28 @@ static int sfx_nextchan = 0;
 /* Our channel-in-use mask. */
 static uint64_t sfx_inuse = 0;
 
+/* Called by snd_mem_compact() when it moves one of an effect's buffers. */
+static void sfx_moved(uint32 from, uint32 to, void *data) {
+    snd_effect_t *t = (snd_effect_t *)data;
+
+    if(t->locl == from)
+        t->locl = to;
+
+    if(t->locr == from)
+        t->locr = to;
+}
+
+/* Add a newly loaded effect to the list. Nothing but the effect knows where
+   its samples are, so they can be moved by snd_sfx_defrag(). */
+static void sfx_add(snd_effect_t *t) {
+    snd_mem_set_movable(t->locl, sfx_moved, t);
+
+    if(t->locr && t->locr != t->locl)
+        snd_mem_set_movable(t->locr, sfx_moved, t);
+
+    LIST_INSERT_HEAD(&snd_effects, t, list);
+}
+
 /* Unload all loaded samples and free their SPU RAM */
 void snd_sfx_unload_all(void) {
     snd_effect_t *t, *n;
@@ -439,7 +461,7 @@ sfxhnd_t snd_sfx_load(const char *fn) {
 
     /* Finish up and return the sound effect handle */
     free(wav_data);
-    LIST_INSERT_HEAD(&snd_effects, effect, list);
+    sfx_add(effect);
 
     return (sfxhnd_t)effect;
 }
@@ -555,7 +577,7 @@ sfxhnd_t snd_sfx_load_fd(file_t fd, size_t len, uint32_t rate, uint16_t bitsize,
     if(tmp_buff) {
         free(tmp_buff);
     }
-    LIST_INSERT_HEAD(&snd_effects, effect, list);
+    sfx_add(effect);
     return (sfxhnd_t)effect;
 
 err_occurred:
@@ -620,7 +642,7 @@ sfxhnd_t snd_sfx_load_buf(char *buf) {
 
     /* Finish up and return the sound effect handle */
     free(wav_data);
-    LIST_INSERT_HEAD(&snd_effects, effect, list);
+    sfx_add(effect);
 
     return (sfxhnd_t)effect;
 }
@@ -703,7 +725,7 @@ sfxhnd_t snd_sfx_load_raw_buf(char *buf, size_t len, uint32_t rate, uint16_t bit
         free(tmp_buff);
     }
 
-    LIST_INSERT_HEAD(&snd_effects, effect, list);
+    sfx_add(effect);
     return (sfxhnd_t)effect;
 
 err_occurred:
@@ -843,6 +865,12 @@ void snd_sfx_stop_all(void) {
     }
 }
 
+int snd_sfx_defrag(void) {
+    snd_sfx_stop_all();
+
+    return snd_mem_compact();
+}
+
 int snd_sfx_chn_alloc(void) {
     int old, chn;
 
@@ -23,6 +23,7 @@ interface at the front of their struct.
 
 #include <kos/init_base.h>
 #include <kos/nmmgr.h>
+#include <kos/fs.h>
 #include <kos/mutex.h>
 #include <kos/exports.h>
 
@@ -74,6 +75,10 @@ int nmmgr_handler_add(nmmgr_handler_t *hnd) {
 
     mutex_unlock(&mutex);
 
+    /* A new filesystem may hide paths looked up on another one */
+    if(hnd->type == NMMGR_TYPE_VFS)
+        fs_dcache_invalidate(NULL, NULL);
+
     return 0;
 }
 
@@ -95,6 +100,9 @@ int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
 
     mutex_unlock(&mutex);
 
+    if(!rv && hnd->type == NMMGR_TYPE_VFS)
+        fs_dcache_invalidate(NULL, NULL);
+
     return rv;
 }
 
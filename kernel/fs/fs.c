@@ -24,6 +24,18 @@ something like this:
   describes which service handled the request, and its internal handle.
 - Subsequent operations go through this abstraction layer to land in the
   right place.
+- Handlers that set VFS_CACHE_MMAP and don't implement mmap themselves get
+  fs_mmap() support from the file cache (fs_cache.c). For those, we remember
+  the path of files opened read-only so the cache can find them later, and
+  drop cached copies when something opens a file for writing, unlinks it or
+  renames it.
+- Handlers that set VFS_CACHE_DENTRY get their fs_stat() results (and
+  missing paths) cached here, keyed on the full path. Anything that changes
+  a path through the VFS drops the entries for it and its parent directory
+  (and for renames and rmdir, everything below it). Files open for writing
+  get a "busy" entry, so nothing is cached about them until they're closed.
+- Asynchronous I/O (fs_aio.c) holds a reference on the file handle of each
+  request in flight, so the file descriptor can be closed before it completes.
 
 */
 
@@ -32,14 +44,21 @@ something like this:
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
 #include <limits.h>
 
 #include <kos/fs.h>
+#include <kos/fs_cache.h>
+#include <kos/fs_aio.h>
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/pool.h>
+#include <kos/once.h>
 #include <kos/nmmgr.h>
 #include <kos/dbgio.h>
 #include <kos/dbglog.h>
+#include <arch/irq.h>
 
 /* File handle structure; this is an entirely internal structure so it does
    not go in a header file. */
@@ -48,14 +67,354 @@ typedef struct fs_hnd {
     void *hnd;   /* Handler-internal */
     int refcnt;  /* Reference count */
     int idx;     /* Current index for readdir */
+    char *path;  /* Full path, if the file cache may map it or the directory
+                    entry cache must know when it's closed */
+    void *cache; /* File cache mapping, if mapped */
+    int writer;  /* Holds a busy directory entry cache entry for path */
 } fs_hnd_t;
 
 /* The global file descriptor table */
 fs_hnd_t *fd_table[FD_SETSIZE] = { NULL };
 
+/* Where file handles come from. This is set up the first time it's needed,
+   since files can be opened without fs_init() having been called. */
+static pool_t hnd_pool;
+static kthread_once_t hnd_pool_once = KTHREAD_ONCE_INIT;
+
+static void hnd_pool_init(void) {
+    pool_init(&hnd_pool, "fs handles", sizeof(fs_hnd_t), 0, NULL, NULL, NULL,
+              0);
+}
+
+static fs_hnd_t *fs_hnd_alloc(void) {
+    fs_hnd_t *hnd;
+
+    kthread_once(&hnd_pool_once, hnd_pool_init);
+
+    if((hnd = (fs_hnd_t *)pool_alloc(&hnd_pool)))
+        memset(hnd, 0, sizeof(fs_hnd_t));
+
+    return hnd;
+}
+
+/* Directory entry cache */
+#define DENT_HASH_SIZE  128
+
+#define DENT_BUSY       0   /* Open for writing, nothing cached */
+#define DENT_POSITIVE   1   /* st holds the result of fs_stat() */
+#define DENT_NEGATIVE   2   /* The path doesn't exist */
+
+typedef struct fs_dent {
+    LIST_ENTRY(fs_dent) hash;   /* Hash chain */
+    TAILQ_ENTRY(fs_dent) lru;   /* LRU list, unless busy */
+    vfs_handler_t *vfs;         /* Handler the path belongs to */
+    uint32_t hval;              /* Hash of the path */
+    uint32_t gen;               /* Value of dent_gen when cached */
+    int state;                  /* DENT_* */
+    int writers;                /* Open file handles writing to the path */
+    struct stat st;             /* Cached stat, if positive */
+    char path[];                /* Full path */
+} fs_dent_t;
+
+static LIST_HEAD(dent_chain, fs_dent) dent_hash[DENT_HASH_SIZE];
+static TAILQ_HEAD(dent_lru, fs_dent) dent_lru =
+    TAILQ_HEAD_INITIALIZER(dent_lru);
+static mutex_t dent_mutex = MUTEX_INITIALIZER;
+static fs_dcache_stats_t dent_stats;
+
+/* Bumped to drop every entry at once; this is safe to do in an interrupt. */
+static volatile uint32_t dent_gen;
+
+/* Bumped whenever anything is invalidated, so that a lookup that raced with
+   a change doesn't cache what it saw from before the change. */
+static uint32_t dent_seq;
+
+/* dent_seq and dent_gen as of the start of a lookup. If either has moved on
+   by the time its result is to be cached, something was invalidated in the
+   meantime and the result may be stale. */
+typedef struct dent_stamp {
+    uint32_t seq;
+    uint32_t gen;
+} dent_stamp_t;
+
+/* The hash (and the matching done by invalidation) ignores case, so that
+   changes through one spelling of a path on a case-insensitive filesystem
+   drop entries for the others. Lookups still need an exact match. */
+static uint32_t dent_hashstr(const char *path, size_t len) {
+    uint32_t hval = 2166136261U;
+
+    while(len--) {
+        hval ^= (uint8_t)tolower((unsigned char)*path++);
+        hval *= 16777619U;
+    }
+
+    return hval;
+}
+
+/* Only paths that fs_normalize_path() wouldn't change are cached, as that's
+   what everything that changes a path has to invalidate with. Returns the
+   length of the path, or 0 if it can't be cached. */
+static size_t dent_cacheable(const char *path) {
+    const char *p;
+
+    if(path[0] != '/' || !path[1])
+        return 0;
+
+    for(p = path; *p; p++) {
+        if(p[0] == '/' && (p[1] == '/' || !p[1] ||
+                           (p[1] == '.' && (!p[2] || p[2] == '/' ||
+                                            (p[2] == '.' &&
+                                             (!p[3] || p[3] == '/'))))))
+            return 0;
+    }
+
+    return p - path;
+}
+
+static void dent_free(fs_dent_t *e) {
+    LIST_REMOVE(e, hash);
+
+    if(e->state != DENT_BUSY)
+        TAILQ_REMOVE(&dent_lru, e, lru);
+
+    free(e);
+    dent_stats.entries--;
+}
+
+static fs_dent_t *dent_find(const char *path, uint32_t hval) {
+    fs_dent_t *e, *tmp;
+
+    LIST_FOREACH_SAFE(e, &dent_hash[hval % DENT_HASH_SIZE], hash, tmp) {
+        if(e->hval != hval || strcmp(e->path, path))
+            continue;
+
+        /* Drop leftovers from before a global invalidation. */
+        if(e->gen != dent_gen && e->state != DENT_BUSY) {
+            dent_free(e);
+            return NULL;
+        }
+
+        return e;
+    }
+
+    return NULL;
+}
+
+static fs_dent_t *dent_alloc(vfs_handler_t *vfs, const char *path,
+                             size_t len, uint32_t hval) {
+    fs_dent_t *e;
+
+    if(dent_stats.entries >= FS_DCACHE_ENTRIES &&
+       (e = TAILQ_FIRST(&dent_lru))) {
+        dent_free(e);
+        dent_stats.evictions++;
+    }
+
+    if(!(e = malloc(sizeof(fs_dent_t) + len + 1)))
+        return NULL;
+
+    e->vfs = vfs;
+    e->hval = hval;
+    e->gen = dent_gen;
+    e->state = DENT_BUSY;
+    e->writers = 0;
+    memcpy(e->path, path, len + 1);
+
+    LIST_INSERT_HEAD(&dent_hash[hval % DENT_HASH_SIZE], e, hash);
+    dent_stats.entries++;
+
+    return e;
+}
+
+/* Look up a path. Returns 1 (and fills in st) if it's cached as existing,
+   -1 if it's cached as missing and 0 if it has to be looked up. If stamp
+   isn't NULL, it's filled in for passing to dent_insert() afterwards. */
+static int dent_lookup(const char *path, size_t len, struct stat *st,
+                       dent_stamp_t *stamp) {
+    fs_dent_t *e;
+
+    mutex_lock_scoped(&dent_mutex);
+
+    if(stamp) {
+        stamp->seq = dent_seq;
+        stamp->gen = dent_gen;
+    }
+
+    e = dent_find(path, dent_hashstr(path, len));
+
+    if(!e || e->state == DENT_BUSY) {
+        dent_stats.misses++;
+        return 0;
+    }
+
+    TAILQ_REMOVE(&dent_lru, e, lru);
+    TAILQ_INSERT_TAIL(&dent_lru, e, lru);
+
+    if(e->state == DENT_NEGATIVE) {
+        dent_stats.neg_hits++;
+        return -1;
+    }
+
+    if(st)
+        *st = e->st;
+
+    dent_stats.hits++;
+    return 1;
+}
+
+/* Cache the result of a lookup that started at stamp. */
+static void dent_insert(vfs_handler_t *vfs, const char *path, size_t len,
+                        const struct stat *st, const dent_stamp_t *stamp) {
+    uint32_t hval = dent_hashstr(path, len);
+    fs_dent_t *e;
+
+    mutex_lock_scoped(&dent_mutex);
+
+    if(stamp->seq != dent_seq || stamp->gen != dent_gen)
+        return;
+
+    if((e = dent_find(path, hval))) {
+        if(e->state == DENT_BUSY)
+            return;
+
+        TAILQ_REMOVE(&dent_lru, e, lru);
+    }
+    else if(!(e = dent_alloc(vfs, path, len, hval))) {
+        return;
+    }
+
+    /* dent_gen can still be bumped from an interrupt after the check above,
+       so stamp the entry with what the lookup saw. Then it gets dropped the
+       next time it's found instead of outliving the invalidation. */
+    e->gen = stamp->gen;
+    e->state = st ? DENT_POSITIVE : DENT_NEGATIVE;
+
+    if(st)
+        e->st = *st;
+
+    TAILQ_INSERT_TAIL(&dent_lru, e, lru);
+}
+
+/* Drop the entry for a path (case-insensitively, as above), along with its
+   parent directory and, if subtree is set, everything below it. Busy entries
+   stay, as they're still needed to know when the path is closed. */
+static void dent_drop(vfs_handler_t *vfs, const char *path, int subtree) {
+    fs_dent_t *e, *tmp;
+    size_t len = strlen(path), plen;
+    uint32_t hval, phval;
+    int i;
+
+    if(!(vfs->cache & VFS_CACHE_DENTRY))
+        return;
+
+    /* Strip any trailing slashes (which only the root would have). */
+    while(len > 1 && path[len - 1] == '/')
+        len--;
+
+    for(plen = len; plen > 1 && path[plen - 1] != '/'; plen--)
+        ;
+
+    if(plen > 1)
+        plen--;
+
+    hval = dent_hashstr(path, len);
+    phval = dent_hashstr(path, plen);
+
+    mutex_lock_scoped(&dent_mutex);
+
+    dent_seq++;
+
+    for(i = 0; i < DENT_HASH_SIZE; i++) {
+        /* Without a subtree, only two chains can hold what we're after. */
+        if(!subtree && i != hval % DENT_HASH_SIZE &&
+           i != phval % DENT_HASH_SIZE)
+            continue;
+
+        LIST_FOREACH_SAFE(e, &dent_hash[i], hash, tmp) {
+            if(e->vfs != vfs || e->state == DENT_BUSY)
+                continue;
+
+            if(!((e->hval == hval && !strncasecmp(e->path, path, len) &&
+                  !e->path[len]) ||
+                 (e->hval == phval && !strncasecmp(e->path, path, plen) &&
+                  !e->path[plen]) ||
+                 (subtree && !strncasecmp(e->path, path, len) &&
+                  e->path[len] == '/')))
+                continue;
+
+            dent_free(e);
+            dent_stats.invalidations++;
+        }
+    }
+}
+
+/* Mark a path as open for writing (delta 1) or closed again (delta -1). */
+static void dent_writer(vfs_handler_t *vfs, const char *path, int delta) {
+    size_t len = strlen(path);
+    uint32_t hval = dent_hashstr(path, len);
+    fs_dent_t *e;
+
+    dent_drop(vfs, path, 0);
+
+    mutex_lock_scoped(&dent_mutex);
+
+    if(!(e = dent_find(path, hval))) {
+        if(delta < 0 || !(e = dent_alloc(vfs, path, len, hval)))
+            return;
+    }
+    else if(e->state != DENT_BUSY) {
+        TAILQ_REMOVE(&dent_lru, e, lru);
+        e->state = DENT_BUSY;
+    }
+
+    e->writers += delta;
+
+    if(e->writers <= 0)
+        dent_free(e);
+}
+
+void fs_dcache_invalidate(vfs_handler_t *vfs, const char *fn) {
+    char full[PATH_MAX];
+    fs_dent_t *e, *tmp;
+    int i;
+
+    if(!vfs || irq_inside_int()) {
+        dent_gen++;
+        return;
+    }
+
+    if(fn) {
+        if(snprintf(full, sizeof(full), "%s%s%s", vfs->nmmgr.pathname,
+                    fn[0] == '/' ? "" : "/", fn) >= (int)sizeof(full))
+            return;
+
+        dent_drop(vfs, full, 1);
+        return;
+    }
+
+    mutex_lock_scoped(&dent_mutex);
+
+    dent_seq++;
+
+    for(i = 0; i < DENT_HASH_SIZE; i++) {
+        LIST_FOREACH_SAFE(e, &dent_hash[i], hash, tmp) {
+            if(e->vfs == vfs && e->state != DENT_BUSY) {
+                dent_free(e);
+                dent_stats.invalidations++;
+            }
+        }
+    }
+}
+
+void fs_dcache_get_stats(fs_dcache_stats_t *st) {
+    mutex_lock_scoped(&dent_mutex);
+
+    *st = dent_stats;
+}
+
 /* Internal file commands for root dir reading */
 static fs_hnd_t *fs_root_opendir(void) {
-    return calloc(1, sizeof(fs_hnd_t));
+    return fs_hnd_alloc();
 }
 
 /* Not thread-safe right now */
@@ -105,6 +464,7 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
     const char  *cname;
     void        *h;
     fs_hnd_t    *hnd;
+    int         writer;
     char        rfn[PATH_MAX];
 
     if(!fs_normalize_path(fn, rfn))
@@ -139,12 +499,22 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
         return NULL;
     }
 
+    writer = (cur->cache & VFS_CACHE_DENTRY) && !(mode & O_DIR) &&
+             ((mode & O_MODE_MASK) != O_RDONLY || (mode & (O_TRUNC | O_CREAT)));
+
+    /* Don't bother the handler about paths we know aren't there. */
+    if((cur->cache & VFS_CACHE_DENTRY) && !writer &&
+       dent_lookup(rfn, strlen(rfn), NULL, NULL) < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+
     h = cur->open(cur, cname, mode);
 
     if(h == NULL) return NULL;
 
     /* Wrap it up in a structure */
-    hnd = malloc(sizeof(fs_hnd_t));
+    hnd = fs_hnd_alloc();
 
     if(hnd == NULL) {
         cur->close(h);
@@ -154,8 +524,30 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
 
     hnd->handler = cur;
     hnd->hnd = h;
-    hnd->refcnt = 0;
-    hnd->idx = 0;
+
+    /* Let the file cache know about it, if it's interested. If we can't
+       remember the path, the file just won't be mappable. */
+    if((cur->cache & VFS_CACHE_MMAP) && !(mode & O_DIR)) {
+        if((mode & O_MODE_MASK) != O_RDONLY || (mode & O_TRUNC))
+            fs_cache_invalidate(cur, cname);
+        else if(!cur->mmap)
+            hnd->path = strdup(rfn);
+    }
+
+    /* Keep the directory entry cache away from files being written. If we
+       can't remember the path, just drop whatever is cached about it. */
+    if(writer) {
+        if(!hnd->path)
+            hnd->path = strdup(rfn);
+
+        if(hnd->path) {
+            dent_writer(cur, rfn, 1);
+            hnd->writer = 1;
+        }
+        else {
+            dent_drop(cur, rfn, 0);
+        }
+    }
 
     return hnd;
 }
@@ -180,10 +572,17 @@ static int fs_hnd_unref(fs_hnd_t *ref) {
     if(--ref->refcnt > 0)
         return retval; /* Still references left, nothing to do */
 
+    if(ref->cache)
+        fs_cache_unmap(ref->cache);
+
     if(ref->handler && ref->handler->close)
         retval = ref->handler->close(ref->hnd);
 
-    free(ref);
+    if(ref->writer)
+        dent_writer(ref->handler, ref->path, -1);
+
+    free(ref->path);
+    pool_free(&hnd_pool, ref);
     return retval;
 }
 
@@ -247,7 +646,7 @@ file_t fs_open_handle(vfs_handler_t *vfs, void *vhnd) {
     fs_hnd_t * hnd;
 
     /* Wrap it up in a structure */
-    hnd = malloc(sizeof(fs_hnd_t));
+    hnd = fs_hnd_alloc();
 
     if(hnd == NULL) {
         errno = ENOMEM;
@@ -256,7 +655,6 @@ file_t fs_open_handle(vfs_handler_t *vfs, void *vhnd) {
 
     hnd->handler = vfs;
     hnd->hnd = vhnd;
-    hnd->refcnt = 0;
 
     /* Ok, that succeeded -- now look for a file descriptor. */
     return fs_hnd_assign(hnd);
@@ -332,6 +730,27 @@ static fs_hnd_t *fs_map_hnd(file_t fd) {
     return fd_table[fd];
 }
 
+void *fs_aio_hold(file_t fd, vfs_handler_t **vfs, void **hnd) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(!h) return NULL;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fs_hnd_ref(h);
+    *vfs = h->handler;
+    *hnd = h->hnd;
+
+    return h;
+}
+
+void fs_aio_release(void *ref) {
+    fs_hnd_unref((fs_hnd_t *)ref);
+}
+
 /* Close a file and clean up the handle */
 int fs_close(file_t fd) {
     int retval;
@@ -597,6 +1016,7 @@ static vfs_handler_t *fs_verify_handler(const char *fn) {
 int fs_rename(const char *fn1, const char *fn2) {
     vfs_handler_t   *fh1, *fh2;
     char        rfn1[PATH_MAX], rfn2[PATH_MAX];
+    int         rv;
 
     if(!fs_normalize_path(fn1, rfn1) || !fs_normalize_path(fn2, rfn2))
         return -1;
@@ -621,9 +1041,18 @@ int fs_rename(const char *fn1, const char *fn2) {
         return -1;
     }
 
-    if(fh1->rename)
-        return fh1->rename(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
-                           rfn2 + strlen(fh1->nmmgr.pathname));
+    if(fh1->cache & VFS_CACHE_MMAP) {
+        fs_cache_invalidate(fh1, rfn1 + strlen(fh1->nmmgr.pathname));
+        fs_cache_invalidate(fh1, rfn2 + strlen(fh1->nmmgr.pathname));
+    }
+
+    if(fh1->rename) {
+        rv = fh1->rename(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
+                         rfn2 + strlen(fh1->nmmgr.pathname));
+        dent_drop(fh1, rfn1, 1);
+        dent_drop(fh1, rfn2, 1);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -633,6 +1062,7 @@ int fs_rename(const char *fn1, const char *fn2) {
 int fs_unlink(const char *fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
+    int         rv;
 
     if(!fs_normalize_path(fn, rfn))
         return -1;
@@ -642,8 +1072,14 @@ int fs_unlink(const char *fn) {
 
     if(cur == NULL) return 1;
 
-    if(cur->unlink)
-        return cur->unlink(cur, rfn + strlen(cur->nmmgr.pathname));
+    if(cur->cache & VFS_CACHE_MMAP)
+        fs_cache_invalidate(cur, rfn + strlen(cur->nmmgr.pathname));
+
+    if(cur->unlink) {
+        rv = cur->unlink(cur, rfn + strlen(cur->nmmgr.pathname));
+        dent_drop(cur, rfn, 0);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -666,15 +1102,38 @@ const char *fs_getwd(void) {
 
 void *fs_mmap(file_t fd) {
     fs_hnd_t *h = fs_map_hnd(fd);
+    void *cookie;
+    void *rv;
 
     if(!h) return NULL;
 
-    if(h->handler == NULL || h->handler->mmap == NULL) {
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(h->handler->mmap)
+        return h->handler->mmap(h->hnd);
+
+    /* No native support, so see if the file cache can do it for us. */
+    if(!h->path || h->writer) {
         errno = EINVAL;
         return NULL;
     }
 
-    return h->handler->mmap(h->hnd);
+    if(!(rv = fs_cache_map(h->handler, h->hnd,
+                           h->path + strlen(h->handler->nmmgr.pathname),
+                           &cookie)))
+        return NULL;
+
+    /* Mapping the same descriptor twice hands back the same mapping, unless
+       the file has changed in the meantime. */
+    if(h->cache)
+        fs_cache_unmap(h->cache);
+
+    h->cache = cookie;
+
+    return rv;
 }
 
 int fs_complete(file_t fd, ssize_t *rv) {
@@ -693,6 +1152,7 @@ int fs_complete(file_t fd, ssize_t *rv) {
 int fs_mkdir(const char *fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
+    int         rv;
 
     if(!fs_normalize_path(fn, rfn))
         return -1;
@@ -702,8 +1162,11 @@ int fs_mkdir(const char *fn) {
 
     if(cur == NULL) return -1;
 
-    if(cur->mkdir)
-        return cur->mkdir(cur, rfn + strlen(cur->nmmgr.pathname));
+    if(cur->mkdir) {
+        rv = cur->mkdir(cur, rfn + strlen(cur->nmmgr.pathname));
+        dent_drop(cur, rfn, 0);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -713,6 +1176,7 @@ int fs_mkdir(const char *fn) {
 int fs_rmdir(const char *fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
+    int         rv;
 
     if(!fs_normalize_path(fn, rfn))
         return -1;
@@ -722,8 +1186,11 @@ int fs_rmdir(const char *fn) {
 
     if(cur == NULL) return -1;
 
-    if(cur->rmdir)
-        return cur->rmdir(cur, rfn + strlen(cur->nmmgr.pathname));
+    if(cur->rmdir) {
+        rv = cur->rmdir(cur, rfn + strlen(cur->nmmgr.pathname));
+        dent_drop(cur, rfn, 1);
+        return rv;
+    }
     else {
         errno = EINVAL;
         return -1;
@@ -759,6 +1226,7 @@ int fs_fcntl(file_t fd, int cmd, ...) {
 int fs_link(const char *path1, const char *path2) {
     vfs_handler_t *fh1, *fh2;
     char rfn1[PATH_MAX], rfn2[PATH_MAX];
+    int rv;
 
     if(!fs_normalize_path(path1, rfn1) || !fs_normalize_path(path2, rfn2))
         return -1;
@@ -784,8 +1252,10 @@ int fs_link(const char *path1, const char *path2) {
     }
 
     if(fh1->link) {
-        return fh1->link(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
-                         rfn2 + strlen(fh1->nmmgr.pathname));
+        rv = fh1->link(fh1, rfn1 + strlen(fh1->nmmgr.pathname),
+                       rfn2 + strlen(fh1->nmmgr.pathname));
+        dent_drop(fh1, rfn2, 0);
+        return rv;
     }
     else {
         errno = EMLINK;
@@ -796,6 +1266,7 @@ int fs_link(const char *path1, const char *path2) {
 int fs_symlink(const char *path1, const char *path2) {
     vfs_handler_t *vfs;
     char rfn[PATH_MAX];
+    int rv;
 
     if(!fs_normalize_path(path2, rfn))
         return -1;
@@ -809,7 +1280,9 @@ int fs_symlink(const char *path1, const char *path2) {
     }
 
     if(vfs->symlink) {
-        return vfs->symlink(vfs, path1, rfn + strlen(vfs->nmmgr.pathname));
+        rv = vfs->symlink(vfs, path1, rfn + strlen(vfs->nmmgr.pathname));
+        dent_drop(vfs, rfn, 0);
+        return rv;
     }
     else {
         errno = ENOSYS;
@@ -852,6 +1325,9 @@ int fs_readlink(const char *path, char *buf, size_t bufsize) {
 int fs_stat(const char *path, struct stat *buf, int flag) {
     vfs_handler_t *vfs;
     char fullpath[PATH_MAX];
+    size_t len = 0;
+    dent_stamp_t stamp;
+    int rv;
 
     /* Verify the input... */
     if(!buf || !path) {
@@ -873,6 +1349,19 @@ int fs_stat(const char *path, struct stat *buf, int flag) {
         strcat(fullpath, path);
     }
 
+    /* See if we already know the answer */
+    if(!flag && (len = dent_cacheable(fullpath))) {
+        rv = dent_lookup(fullpath, len, buf, &stamp);
+
+        if(rv > 0)
+            return 0;
+
+        if(rv < 0) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
     /* Look for the handler */
     vfs = fs_verify_handler(fullpath);
 
@@ -882,8 +1371,14 @@ int fs_stat(const char *path, struct stat *buf, int flag) {
     }
 
     if(vfs->stat) {
-        return vfs->stat(vfs, fullpath + strlen(vfs->nmmgr.pathname), buf,
-                         flag);
+        rv = vfs->stat(vfs, fullpath + strlen(vfs->nmmgr.pathname), buf,
+                       flag);
+
+        if(len && (vfs->cache & VFS_CACHE_DENTRY) &&
+           (!rv || errno == ENOENT))
+            dent_insert(vfs, fullpath, len, rv ? NULL : buf, &stamp);
+
+        return rv;
     }
     else {
         errno = ENOSYS;
@@ -936,9 +1431,16 @@ int fs_fstat(file_t fd, struct stat *st) {
 
 /* Initialize FS structures */
 int fs_init(void) {
-    return 0;
+    return fs_cache_init();
 }
 
 void fs_shutdown(void) {
+    fs_aio_shutdown();
     fs_fdtbl_destroy();
+    fs_cache_shutdown();
+
+    if(hnd_pool_once) {
+        pool_destroy(&hnd_pool);
+        hnd_pool_once = KTHREAD_ONCE_INIT;
+    }
 }
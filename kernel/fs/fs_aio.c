@@ -0,0 +1,354 @@
+/* KallistiOS ##version##
+
+   fs_aio.c
+
+*/
+
+/*
+
+This module implements asynchronous file I/O on top of the VFS.
+
+Submitting a request takes a reference on the file handle, so the file stays
+open until the request completes. If the filesystem has an aio function and
+the request has an explicit offset, the filesystem is given the first chance
+to start it (for instance by kicking off a DMA transfer). Everything else, and
+anything the filesystem declines, goes to one of a small pool of worker
+threads which just calls the handler's read or write function. The worker is
+picked from the file handle, so requests on one file are carried out in the
+order they were submitted.
+
+Filesystems may complete their requests from an interrupt. Callbacks and
+releasing the file handle can't be done from there, so in that case the
+request is handed to its worker thread to finish.
+
+Completed requests without a callback go on their queue's done list, and the
+queue's semaphore counts them. The list, the counters and the request states
+can be touched from interrupts, so they are protected by disabling them.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/fs_aio.h>
+#include <kos/worker_thread.h>
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/sem.h>
+#include <kos/opts.h>
+#include <arch/irq.h>
+
+/* Request states */
+#define AIO_IDLE        0
+#define AIO_QUEUED      1   /* Waiting for a worker */
+#define AIO_CANCELED    2   /* Canceled while waiting for a worker */
+#define AIO_RUNNING     3   /* Being carried out */
+#define AIO_DONE        4   /* Completed from an interrupt, to be finished */
+
+struct fs_aio_queue {
+    STAILQ_HEAD(aio_done, fs_aio_req) done;
+    semaphore_t ready;      /* Counts the requests on the done list */
+    int inflight;           /* Requests not retrieved yet */
+    int waitable;           /* Of those, the ones without a callback */
+};
+
+static kthread_worker_t *workers[FS_AIO_WORKERS];
+static int workers_started;
+static mutex_t aio_mutex = MUTEX_INITIALIZER;
+
+/* Hand a request's result back to its owner. Called from thread context. */
+static void aio_finish(fs_aio_req_t *req) {
+    fs_aio_queue_t *q = req->queue;
+    uint32_t flags;
+
+    fs_aio_release(req->ref);
+    req->ref = NULL;
+    req->state = AIO_IDLE;
+
+    if(req->callback) {
+        if(q) {
+            flags = irq_disable();
+            q->inflight--;
+            irq_restore(flags);
+        }
+
+        req->callback(req);
+        return;
+    }
+
+    flags = irq_disable();
+    STAILQ_INSERT_TAIL(&q->done, req, entry);
+    q->waitable--;
+    sem_signal(&q->ready);
+    irq_restore(flags);
+}
+
+void fs_aio_done(fs_aio_req_t *req, ssize_t rv, int err) {
+    req->result = rv;
+    req->error = rv < 0 ? err : 0;
+
+    if(!irq_inside_int()) {
+        aio_finish(req);
+        return;
+    }
+
+    req->state = AIO_DONE;
+    thd_worker_add_job(req->worker, &req->job);
+    thd_worker_wakeup(req->worker);
+}
+
+static int aio_seek(fs_aio_req_t *req) {
+    vfs_handler_t *vfs = req->vfs;
+
+    if(vfs->seek)
+        return vfs->seek(req->hnd, req->offset, SEEK_SET) < 0 ? -1 : 0;
+    else if(vfs->seek64)
+        return vfs->seek64(req->hnd, req->offset, SEEK_SET) < 0 ? -1 : 0;
+
+    errno = ESPIPE;
+    return -1;
+}
+
+/* Carry out a request with the handler's synchronous functions. */
+static void aio_execute(fs_aio_req_t *req) {
+    vfs_handler_t *vfs = req->vfs;
+    ssize_t rv = -1;
+    uint32_t flags;
+
+    flags = irq_disable();
+
+    if(req->state == AIO_CANCELED) {
+        irq_restore(flags);
+        fs_aio_done(req, -1, ECANCELED);
+        return;
+    }
+
+    req->state = AIO_RUNNING;
+    irq_restore(flags);
+
+    if(req->offset != FS_AIO_CUR_POS && aio_seek(req) < 0)
+        rv = -1;
+    else if(req->op == FS_AIO_READ && vfs->read)
+        rv = vfs->read(req->hnd, req->buf, req->count);
+    else if(req->op == FS_AIO_WRITE && vfs->write)
+        rv = vfs->write(req->hnd, req->buf, req->count);
+    else
+        errno = EINVAL;
+
+    fs_aio_done(req, rv, errno);
+}
+
+static void aio_worker(void *d) {
+    kthread_worker_t *worker = workers[(uintptr_t)d];
+    kthread_job_t *job;
+    fs_aio_req_t *req;
+
+    while((job = thd_worker_dequeue_job(worker))) {
+        req = (fs_aio_req_t *)job->data;
+
+        if(req->state == AIO_DONE)
+            aio_finish(req);
+        else
+            aio_execute(req);
+    }
+}
+
+static int aio_start_workers(void) {
+    kthread_attr_t attr = { 0 };
+    uintptr_t i;
+
+    mutex_lock_scoped(&aio_mutex);
+
+    if(workers_started)
+        return 0;
+
+    attr.label = "fs_aio";
+
+    for(i = 0; i < FS_AIO_WORKERS; i++) {
+        workers[i] = thd_worker_create_ex(&attr, aio_worker, (void *)i);
+
+        if(!workers[i]) {
+            while(i--)
+                thd_worker_destroy(workers[i]);
+
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    workers_started = 1;
+    return 0;
+}
+
+static int aio_submit_one(fs_aio_queue_t *q, fs_aio_req_t *req) {
+    uint32_t flags;
+
+    if((req->op != FS_AIO_READ && req->op != FS_AIO_WRITE) ||
+       (!q && !req->callback)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req->ref = fs_aio_hold(req->fd, &req->vfs, &req->hnd);
+
+    if(!req->ref)
+        return -1;
+
+    req->queue = q;
+    req->result = 0;
+    req->error = 0;
+    req->job.data = req;
+    req->worker = workers[((uintptr_t)req->ref >> 4) % FS_AIO_WORKERS];
+
+    if(q) {
+        flags = irq_disable();
+        q->inflight++;
+
+        if(!req->callback)
+            q->waitable++;
+
+        irq_restore(flags);
+    }
+
+    /* Let the filesystem have a go at it first. */
+    if(req->vfs->aio && req->offset != FS_AIO_CUR_POS) {
+        req->state = AIO_RUNNING;
+
+        if(!req->vfs->aio(req->hnd, req))
+            return 0;
+    }
+
+    req->state = AIO_QUEUED;
+    thd_worker_add_job(req->worker, &req->job);
+    thd_worker_wakeup(req->worker);
+
+    return 0;
+}
+
+int fs_aio_submit(fs_aio_queue_t *q, fs_aio_req_t *reqs[], size_t cnt) {
+    size_t i;
+
+    if(!workers_started && aio_start_workers() < 0)
+        return -1;
+
+    for(i = 0; i < cnt; i++) {
+        if(aio_submit_one(q, reqs[i]) < 0)
+            return i ? (int)i : -1;
+    }
+
+    return (int)cnt;
+}
+
+int fs_aio_read(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd, void *buf,
+                size_t count, off_t offset) {
+    fs_aio_prep_read(req, fd, buf, count, offset);
+
+    return fs_aio_submit(q, &req, 1) == 1 ? 0 : -1;
+}
+
+int fs_aio_write(fs_aio_queue_t *q, fs_aio_req_t *req, file_t fd,
+                 const void *buf, size_t count, off_t offset) {
+    fs_aio_prep_write(req, fd, buf, count, offset);
+
+    return fs_aio_submit(q, &req, 1) == 1 ? 0 : -1;
+}
+
+static fs_aio_req_t *aio_dequeue(fs_aio_queue_t *q) {
+    fs_aio_req_t *req;
+
+    irq_disable_scoped();
+
+    req = STAILQ_FIRST(&q->done);
+    STAILQ_REMOVE_HEAD(&q->done, entry);
+    q->inflight--;
+
+    return req;
+}
+
+fs_aio_req_t *fs_aio_wait(fs_aio_queue_t *q, unsigned int timeout) {
+    uint32_t flags;
+
+    flags = irq_disable();
+
+    if(!q->waitable && STAILQ_EMPTY(&q->done)) {
+        irq_restore(flags);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    irq_restore(flags);
+
+    if(sem_wait_timed(&q->ready, timeout) < 0)
+        return NULL;
+
+    return aio_dequeue(q);
+}
+
+fs_aio_req_t *fs_aio_peek(fs_aio_queue_t *q) {
+    if(sem_trywait(&q->ready) < 0)
+        return NULL;
+
+    return aio_dequeue(q);
+}
+
+int fs_aio_pending(fs_aio_queue_t *q) {
+    return q->inflight;
+}
+
+int fs_aio_cancel(fs_aio_req_t *req) {
+    irq_disable_scoped();
+
+    if(req->state != AIO_QUEUED) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    req->state = AIO_CANCELED;
+    return 0;
+}
+
+fs_aio_queue_t *fs_aio_queue_create(void) {
+    fs_aio_queue_t *q;
+
+    if(!(q = malloc(sizeof(*q)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    STAILQ_INIT(&q->done);
+    sem_init(&q->ready, 0);
+    q->inflight = 0;
+    q->waitable = 0;
+
+    return q;
+}
+
+int fs_aio_queue_destroy(fs_aio_queue_t *q) {
+    if(q->inflight) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sem_destroy(&q->ready);
+    free(q);
+
+    return 0;
+}
+
+void fs_aio_shutdown(void) {
+    int i;
+
+    mutex_lock_scoped(&aio_mutex);
+
+    if(!workers_started)
+        return;
+
+    for(i = 0; i < FS_AIO_WORKERS; i++)
+        thd_worker_destroy(workers[i]);
+
+    workers_started = 0;
+}
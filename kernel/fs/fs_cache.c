@@ -0,0 +1,506 @@
+/* KallistiOS ##version##
+
+   fs_cache.c
+
+*/
+
+/*
+
+This module implements the VFS file cache that backs fs_mmap() on filesystems
+that don't have their own mmap support (iso9660, FAT, ext2, ...).
+
+Each cached file is one malloc'd block holding the whole file, keyed on the
+handler it came from and its path within that handler. Entries are reference
+counted by the file handles that have them mapped (and by pinning). Entries
+with no references sit on an LRU list and are the only ones that can be
+evicted, either to keep the cache within its size limit or when malloc tells
+us memory is getting tight.
+
+An entry that is invalidated while it is still mapped is taken out of the
+hash table so nobody else can find it, and is freed when its last user lets
+go of it.
+
+The cache mutex is recursive: reading a file in may end up back in here (a
+filesystem invalidating on a disc change, or malloc calling our low memory
+handler), and both of those are safe at the points where we can be
+re-entered.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/fs_cache.h>
+#include <kos/mutex.h>
+#include <kos/nmmgr.h>
+#include <kos/opts.h>
+
+/* Number of hash buckets (must be a power of two) */
+#define CACHE_HASH_SIZE 64
+
+typedef struct fs_cache_ent {
+    TAILQ_ENTRY(fs_cache_ent) lru;  /* LRU list entry, if unused */
+    struct fs_cache_ent *hnext;     /* Next entry in our hash bucket */
+
+    vfs_handler_t *vfs;             /* Handler the file lives on */
+    char *path;                     /* Path within the handler */
+    uint32_t hash;                  /* Hash of vfs and path */
+
+    void *data;                     /* The file contents */
+    size_t size;                    /* Size of the file */
+    time_t mtime;                   /* Modification time when loaded */
+
+    int refcnt;                     /* Mappings (and pin) holding this */
+    int pinned;                     /* Nonzero if pinned */
+    int stale;                      /* Nonzero if no longer hashed */
+} fs_cache_ent_t;
+
+static TAILQ_HEAD(cache_lru, fs_cache_ent) lru_list;
+static fs_cache_ent_t *hash_table[CACHE_HASH_SIZE];
+
+static fs_cache_stats_t stats;
+static mutex_t cache_mutex = RECURSIVE_MUTEX_INITIALIZER;
+static int initted = 0;
+
+static uint32_t cache_hash(vfs_handler_t *vfs, const char *fn) {
+    uint32_t h = 0x811c9dc5 ^ (uint32_t)vfs;
+
+    while(*fn) {
+        h ^= (uint8_t)*fn++;
+        h *= 0x01000193;
+    }
+
+    return h;
+}
+
+/* Find a (non-stale) entry. Assumes we hold cache_mutex. */
+static fs_cache_ent_t *cache_find(vfs_handler_t *vfs, const char *fn,
+                                  uint32_t hash) {
+    fs_cache_ent_t *e;
+
+    for(e = hash_table[hash & (CACHE_HASH_SIZE - 1)]; e; e = e->hnext) {
+        if(e->hash == hash && e->vfs == vfs && !strcmp(e->path, fn))
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Take an entry out of the hash table. Assumes we hold cache_mutex. */
+static void cache_unhash(fs_cache_ent_t *e) {
+    fs_cache_ent_t **b = &hash_table[e->hash & (CACHE_HASH_SIZE - 1)];
+
+    while(*b != e)
+        b = &(*b)->hnext;
+
+    *b = e->hnext;
+    e->stale = 1;
+}
+
+/* Free an unused entry completely. Assumes we hold cache_mutex. */
+static void cache_destroy(fs_cache_ent_t *e) {
+    if(!e->stale)
+        cache_unhash(e);
+
+    stats.bytes -= e->size;
+    --stats.entries;
+
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+/* Evict unused entries until at most target bytes are cached (or there is
+   nothing left we can evict). Assumes we hold cache_mutex. */
+static void cache_trim(size_t target) {
+    fs_cache_ent_t *e;
+
+    while(stats.bytes > target && (e = TAILQ_FIRST(&lru_list))) {
+        TAILQ_REMOVE(&lru_list, e, lru);
+        ++stats.evictions;
+        cache_destroy(e);
+    }
+}
+
+/* Drop a reference to an entry. Assumes we hold cache_mutex. */
+static void cache_release(fs_cache_ent_t *e) {
+    if(--e->refcnt > 0)
+        return;
+
+    if(e->stale) {
+        cache_destroy(e);
+    }
+    else {
+        TAILQ_INSERT_TAIL(&lru_list, e, lru);
+        cache_trim(stats.limit);
+    }
+}
+
+/* Invalidate one entry. Assumes we hold cache_mutex. */
+static void cache_drop(fs_cache_ent_t *e) {
+    /* Only entries that nothing holds are on the LRU list. A pinned one isn't,
+       even once the pin is dropped below. */
+    int on_lru = !e->refcnt;
+
+    ++stats.invalidations;
+
+    if(e->pinned) {
+        e->pinned = 0;
+        --stats.pinned;
+        --e->refcnt;
+    }
+
+    if(e->refcnt) {
+        cache_unhash(e);
+    }
+    else {
+        if(on_lru)
+            TAILQ_REMOVE(&lru_list, e, lru);
+
+        cache_destroy(e);
+    }
+}
+
+/* Grab the modification time of an open file, if the handler can tell us. */
+static time_t cache_mtime(vfs_handler_t *vfs, void *hnd) {
+    struct stat st;
+
+    if(vfs->fstat && !vfs->fstat(hnd, &st))
+        return st.st_mtime;
+
+    return 0;
+}
+
+/* Read the whole of an open file into a new buffer, without disturbing its
+   file pointer. */
+static void *cache_load(vfs_handler_t *vfs, void *hnd, size_t size) {
+    uint8_t *buf;
+    _off64_t pos;
+    size_t done = 0;
+    ssize_t rv;
+
+    if(!vfs->read || (!vfs->seek && !vfs->seek64)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    if(!(buf = (uint8_t *)malloc(size ? size : 1))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(vfs->seek64) {
+        pos = vfs->tell64 ? vfs->tell64(hnd) : 0;
+        vfs->seek64(hnd, 0, SEEK_SET);
+    }
+    else {
+        pos = vfs->tell ? vfs->tell(hnd) : 0;
+        vfs->seek(hnd, 0, SEEK_SET);
+    }
+
+    while(done < size) {
+        if((rv = vfs->read(hnd, buf + done, size - done)) <= 0)
+            break;
+
+        done += rv;
+    }
+
+    if(vfs->seek64)
+        vfs->seek64(hnd, pos, SEEK_SET);
+    else
+        vfs->seek(hnd, (off_t)pos, SEEK_SET);
+
+    if(done != size) {
+        free(buf);
+        errno = EIO;
+        return NULL;
+    }
+
+    return buf;
+}
+
+void *fs_cache_map(vfs_handler_t *vfs, void *hnd, const char *fn,
+                   void **cookie) {
+    fs_cache_ent_t *e;
+    uint32_t hash = cache_hash(vfs, fn);
+    uint64_t size;
+    time_t mtime;
+
+    if(vfs->total64)
+        size = vfs->total64(hnd);
+    else if(vfs->total)
+        size = vfs->total(hnd);
+    else
+        size = SIZE_MAX;
+
+    if(!initted || size > SIZE_MAX / 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mtime = cache_mtime(vfs, hnd);
+
+    mutex_lock_scoped(&cache_mutex);
+
+    if((e = cache_find(vfs, fn, hash))) {
+        /* Make sure the file hasn't changed under us */
+        if(e->size == size && e->mtime == mtime) {
+            if(!e->refcnt++)
+                TAILQ_REMOVE(&lru_list, e, lru);
+
+            ++stats.hits;
+            *cookie = e;
+            return e->data;
+        }
+
+        cache_drop(e);
+    }
+
+    ++stats.misses;
+
+    /* Make some room for the new file before we allocate it */
+    if(stats.bytes + size > stats.limit)
+        cache_trim(size < stats.limit ? stats.limit - size : 0);
+
+    if(!(e = (fs_cache_ent_t *)malloc(sizeof(fs_cache_ent_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(!(e->path = strdup(fn))) {
+        free(e);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(!(e->data = cache_load(vfs, hnd, (size_t)size))) {
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+
+    e->vfs = vfs;
+    e->hash = hash;
+    e->size = (size_t)size;
+    e->mtime = mtime;
+    e->refcnt = 1;
+    e->pinned = 0;
+    e->stale = 0;
+
+    /* Someone may have beaten us to it while we were reading (if the read
+       blocked and dropped back in here); if so, theirs is just as good. */
+    if(cache_find(vfs, fn, hash))
+        e->stale = 1;
+    else {
+        e->hnext = hash_table[hash & (CACHE_HASH_SIZE - 1)];
+        hash_table[hash & (CACHE_HASH_SIZE - 1)] = e;
+    }
+
+    stats.bytes += e->size;
+    ++stats.entries;
+
+    *cookie = e;
+    return e->data;
+}
+
+void fs_cache_unmap(void *cookie) {
+    mutex_lock_scoped(&cache_mutex);
+    cache_release((fs_cache_ent_t *)cookie);
+}
+
+void fs_cache_invalidate(vfs_handler_t *vfs, const char *fn) {
+    fs_cache_ent_t *e, *n;
+    int i;
+
+    if(!initted)
+        return;
+
+    mutex_lock_scoped(&cache_mutex);
+
+    if(fn) {
+        if((e = cache_find(vfs, fn, cache_hash(vfs, fn))))
+            cache_drop(e);
+
+        return;
+    }
+
+    for(i = 0; i < CACHE_HASH_SIZE; ++i) {
+        for(e = hash_table[i]; e; e = n) {
+            n = e->hnext;
+
+            if(e->vfs == vfs)
+                cache_drop(e);
+        }
+    }
+}
+
+/* Split a path into its handler and the path within the handler. */
+static vfs_handler_t *cache_lookup_vfs(const char *fn, char *rfn,
+                                       const char **cname) {
+    nmmgr_handler_t *nmhnd;
+
+    if(!fs_normalize_path(fn, rfn))
+        return NULL;
+
+    nmhnd = nmmgr_lookup(rfn);
+
+    if(!nmhnd || nmhnd->type != NMMGR_TYPE_VFS) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    *cname = rfn + strlen(nmhnd->pathname);
+
+    return (vfs_handler_t *)nmhnd;
+}
+
+int fs_cache_pin(const char *fn) {
+    vfs_handler_t *vfs;
+    fs_cache_ent_t *e;
+    const char *cname;
+    char rfn[PATH_MAX];
+    void *hnd, *cookie;
+
+    if(!(vfs = cache_lookup_vfs(fn, rfn, &cname)))
+        return -1;
+
+    if(!(vfs->cache & VFS_CACHE_MMAP) || !vfs->open) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if(!(hnd = vfs->open(vfs, cname, O_RDONLY)))
+        return -1;
+
+    mutex_lock_scoped(&cache_mutex);
+
+    if(!fs_cache_map(vfs, hnd, cname, &cookie)) {
+        vfs->close(hnd);
+        return -1;
+    }
+
+    vfs->close(hnd);
+
+    /* Keep the reference from the mapping as the pin, unless we're pinned
+       already. */
+    e = (fs_cache_ent_t *)cookie;
+
+    if(e->pinned) {
+        cache_release(e);
+    }
+    else {
+        e->pinned = 1;
+        ++stats.pinned;
+    }
+
+    return 0;
+}
+
+int fs_cache_unpin(const char *fn) {
+    vfs_handler_t *vfs;
+    fs_cache_ent_t *e;
+    const char *cname;
+    char rfn[PATH_MAX];
+
+    if(!(vfs = cache_lookup_vfs(fn, rfn, &cname)))
+        return -1;
+
+    mutex_lock_scoped(&cache_mutex);
+
+    e = cache_find(vfs, cname, cache_hash(vfs, cname));
+
+    if(!e || !e->pinned) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    e->pinned = 0;
+    --stats.pinned;
+    cache_release(e);
+
+    return 0;
+}
+
+void fs_cache_set_limit(size_t bytes) {
+    mutex_lock_scoped(&cache_mutex);
+
+    stats.limit = bytes;
+    cache_trim(bytes);
+}
+
+void fs_cache_flush(void) {
+    mutex_lock_scoped(&cache_mutex);
+    cache_trim(0);
+}
+
+void fs_cache_get_stats(fs_cache_stats_t *st) {
+    mutex_lock_scoped(&cache_mutex);
+    *st = stats;
+}
+
+/* Called by malloc when memory is getting tight. If someone's in the middle
+   of using the cache on another thread, just leave it be. */
+static void fs_cache_lowmem(size_t want, void *data) {
+    (void)data;
+
+    if(mutex_trylock(&cache_mutex))
+        return;
+
+    if(want < stats.bytes)
+        cache_trim(stats.bytes - want);
+    else
+        cache_trim(0);
+
+    mutex_unlock(&cache_mutex);
+}
+
+int fs_cache_init(void) {
+    if(initted)
+        return 0;
+
+    TAILQ_INIT(&lru_list);
+    memset(hash_table, 0, sizeof(hash_table));
+    memset(&stats, 0, sizeof(stats));
+    stats.limit = FS_CACHE_DEFAULT_LIMIT;
+
+    malloc_lowmem_register(fs_cache_lowmem, NULL);
+    initted = 1;
+
+    return 0;
+}
+
+void fs_cache_shutdown(void) {
+    fs_cache_ent_t *e, *n;
+    int i;
+
+    if(!initted)
+        return;
+
+    malloc_lowmem_unregister(fs_cache_lowmem, NULL);
+
+    mutex_lock(&cache_mutex);
+
+    /* Everything should be unmapped by now, since the fd table has been torn
+       down. Anything left over is just freed. */
+    for(i = 0; i < CACHE_HASH_SIZE; ++i) {
+        for(e = hash_table[i]; e; e = n) {
+            n = e->hnext;
+            free(e->data);
+            free(e->path);
+            free(e);
+        }
+
+        hash_table[i] = NULL;
+    }
+
+    TAILQ_INIT(&lru_list);
+    initted = 0;
+
+    mutex_unlock(&cache_mutex);
+}
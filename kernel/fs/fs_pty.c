@@ -28,9 +28,11 @@ or space present.
 #include <kos/mutex.h>
 #include <kos/cond.h>
 #include <kos/fs_pty.h>
+#include <kos/ring.h>
 
 #include <string.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
@@ -55,8 +57,7 @@ typedef struct ptyhalf {
     int master;             /* Non-zero if we are master */
 
     uint8_t   buffer[PTY_BUFFER_SIZE];    /* Our _receive_ buffer */
-    int head, tail;         /* Insert at head, remove at tail */
-    size_t cnt;             /* Byte count in the queue */
+    ring_t ring;            /* The queue in buffer */
 
     int refcnt;             /* When this reaches zero, we close */
 
@@ -128,29 +129,32 @@ int fs_pty_create(char *buffer, int maxbuflen, file_t *master_out, file_t *slave
     boot = LIST_EMPTY(&ptys);
 
     /* Alloc new structs */
-    master = calloc(1, sizeof(ptyhalf_t));
+    /* The rings in them need to be cache line aligned. */
+    master = memalign(RING_CACHE_LINE, sizeof(ptyhalf_t));
     if(!master) {
         errno = ENOMEM;
         return -1;
     }
 
-    slave = calloc(1, sizeof(ptyhalf_t));
+    slave = memalign(RING_CACHE_LINE, sizeof(ptyhalf_t));
     if(!slave) {
         free(master);
         errno = ENOMEM;
         return -1;
     }
 
+    memset(master, 0, sizeof(ptyhalf_t));
+    memset(slave, 0, sizeof(ptyhalf_t));
+
     /* Hook 'em up */
     master->other = slave;
     master->master = 1;
     slave->other = master;
     slave->master = 0;
 
-    /* Reset their queue pointers */
-    master->head = master->tail = 0;
-    slave->head = slave->tail = 0;
-    master->cnt = slave->cnt = 0;
+    /* Set up their queues */
+    ring_init(&master->ring, 1, PTY_BUFFER_SIZE, master->buffer);
+    ring_init(&slave->ring, 1, PTY_BUFFER_SIZE, slave->buffer);
 
     /* Reset their refcnts (these will get increased in a minute) */
     master->refcnt = slave->refcnt = 0;
@@ -301,7 +305,7 @@ static void * pty_open_dir(const char * fn, int mode) {
         else
             sprintf(dl->items[cnt].name, "sl%02x", ph->id);
 
-        dl->items[cnt].size = ph->cnt;
+        dl->items[cnt].size = ring_count(&ph->ring);
         cnt++;
     }
 
@@ -498,7 +502,6 @@ static ssize_t pty_read_serial(pipefd_t *fdobj, ptyhalf_t *ph, void *buf, size_t
 
 /* Read from a pty endpoint */
 static ssize_t pty_read(void *h, void *buf, size_t bytes) {
-    size_t avail;
     pipefd_t *fdobj;
     ptyhalf_t *ph;
 
@@ -518,7 +521,7 @@ static ssize_t pty_read(void *h, void *buf, size_t bytes) {
     mutex_lock(&ph->mutex);
 
     /* Is there anything to read? */
-    while(!ph->cnt && ph->other->refcnt > 0) {
+    while(!ring_count(&ph->ring) && ph->other->refcnt > 0) {
         /* If we're in non-block, give up now */
         if(fdobj->mode & O_NONBLOCK) {
             errno = EAGAIN;
@@ -530,28 +533,13 @@ static ssize_t pty_read(void *h, void *buf, size_t bytes) {
     }
 
     /* If the buffer is empty and the other end is closed, return 0 */
-    if(!ph->cnt && ph->other->refcnt == 0) {
+    if(!ring_count(&ph->ring) && ph->other->refcnt == 0) {
         bytes = 0;
         goto done;
     }
 
-    /* Figure out how much to read */
-    avail = ph->cnt;
-
-    if(avail < bytes)
-        bytes = avail;
-
-    /* Copy out the data and remove it from the buffer */
-    if((ph->head + bytes) > PTY_BUFFER_SIZE) {
-        avail = PTY_BUFFER_SIZE - ph->head;
-        memcpy(buf, ph->buffer + ph->head, avail);
-        memcpy(((uint8_t *)buf) + avail, ph->buffer, bytes - avail);
-    }
-    else
-        memcpy(buf, ph->buffer + ph->head, bytes);
-
-    ph->head = (ph->head + bytes) % PTY_BUFFER_SIZE;
-    ph->cnt -= bytes;
+    /* Copy out as much of the data as we can and remove it from the buffer */
+    bytes = ring_read(&ph->ring, buf, bytes);
 
     /* Wake anyone waiting for write space */
     cond_broadcast(&ph->ready_write);
@@ -563,7 +551,6 @@ done:
 
 /* Write to a pty endpoint */
 static ssize_t pty_write(void *h, const void *buf, size_t bytes) {
-    size_t avail;
     pipefd_t *fdobj;
     ptyhalf_t *ph;
 
@@ -589,7 +576,7 @@ static ssize_t pty_write(void *h, const void *buf, size_t bytes) {
     mutex_lock(&ph->mutex);
 
     /* Is there any room to write? */
-    while(ph->cnt >= PTY_BUFFER_SIZE && ph->refcnt > 0) {
+    while(!ring_space(&ph->ring) && ph->refcnt > 0) {
         /* If we're in non-block, give up now */
         if(fdobj->mode & O_NONBLOCK) {
             errno = EAGAIN;
@@ -601,28 +588,13 @@ static ssize_t pty_write(void *h, const void *buf, size_t bytes) {
     }
 
     /* If the buffer is full and the other end is closed, return 0 */
-    if(ph->cnt >= PTY_BUFFER_SIZE && ph->refcnt == 0) {
+    if(!ring_space(&ph->ring) && ph->refcnt == 0) {
         bytes = 0;
         goto done;
     }
 
-    /* Figure out how much to write */
-    avail = PTY_BUFFER_SIZE - ph->cnt;
-    if(avail < bytes)
-        bytes = avail;
-
-    /* Copy in the data and add it from the buffer */
-    if((ph->tail + bytes) > PTY_BUFFER_SIZE) {
-        avail = PTY_BUFFER_SIZE - ph->tail;
-        memcpy(ph->buffer + ph->tail, buf, avail);
-        memcpy(ph->buffer, ((const uint8_t *)buf) + avail, bytes - avail);
-    }
-    else
-        memcpy(ph->buffer + ph->tail, buf, bytes);
-
-    ph->tail = (ph->tail + bytes) % PTY_BUFFER_SIZE;
-    ph->cnt += bytes;
-    assert(ph->cnt <= PTY_BUFFER_SIZE);
+    /* Copy in as much of the data as there is room for */
+    bytes = ring_write(&ph->ring, buf, bytes);
 
     /* Wake anyone waiting on read */
     cond_broadcast(&ph->ready_read);
@@ -645,7 +617,7 @@ static size_t pty_total(void *h) {
         return -1;
     }
 
-    return ph->cnt;
+    return ring_count(&ph->ring);
 }
 
 /* Read a directory entry */
@@ -728,7 +700,7 @@ static int pty_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
     st->st_dev = (dev_t)('p' | ('t' << 8) | ('y' << 16));
     st->st_mode = S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_nlink = 1;
-    st->st_size = ph->cnt;
+    st->st_size = ring_count(&ph->ring);
     st->st_blksize = PTY_BUFFER_SIZE;
 
     return 0;
@@ -801,7 +773,7 @@ static int pty_fstat(void *h, struct stat *st) {
     st->st_mode = (fd->mode & O_DIR) ? 
         (S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO) : 
         (S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-    st->st_size = (fd->mode & O_DIR) ? -1 : (off_t)fd->d.p->cnt;
+    st->st_size = (fd->mode & O_DIR) ? -1 : (off_t)ring_count(&fd->d.p->ring);
     st->st_blksize = (fd->mode & O_DIR) ? 0 : 1;
 
     return 0;
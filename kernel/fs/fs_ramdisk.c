@@ -29,6 +29,14 @@ in read-only mode. You'd then be safe.
 So at the moment this is mainly useful as a scratch space for temp files or to
 cache data from disk rather than as a general purpose file system.
 
+File data is always kept in one contiguous block so that mmap() keeps working
+and attach/detach can hand blocks back and forth. To keep lots of small
+appends from turning into quadratic copying, the block grows geometrically
+(by half its current size at a time), and the capacity can be reserved up
+front with the RAMDISK_IOCTL_RESERVE ioctl if the final size is known.
+Directories keep a hash table of their entries alongside the list used for
+readdir, so lookups don't have to walk every file in the directory.
+
 */
 
 #include <kos/thread.h>
@@ -38,6 +46,7 @@ cache data from disk rather than as a general purpose file system.
 
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,25 +71,41 @@ typedef struct rd_file {
     /* For the following two members:
       - In files, this is a block of allocated memory containing the
         actual file data. Each time we need to expand it beyond its
-        current capacity, we realloc() with enough to hold the new
-        data plus 4k (to avoid realloc thrashing). All files start
-        out with a 1K block of space.
+        current capacity, we realloc() it to at least one and a half
+        times its old size (to avoid realloc thrashing on appends). All
+        files start out with a 1K block of space.
       - In directories, this is just a pointer to an rd_dir struct,
         which is defined below. datasize has no meaning for a
         directory. */
     void    * data;     /* Data block pointer */
     uint32_t  datasize; /* Size of data block pointer */
 
+    size_t    namelen;  /* Length of the file name */
+    uint32_t  hash;     /* Case-insensitive hash of the file name */
+
     LIST_ENTRY(rd_file) dirlist;    /* Directory list entry */
+    struct rd_file * hnext;         /* Next file in our hash bucket */
 } rd_file_t;
 
+/* Granularity of file data blocks */
+#define RD_BLOCK_SIZE   1024
+
+/* Initial number of hash buckets in a directory (must be a power of two) */
+#define RD_HASH_INIT    16
+
 /* Lock constants */
 #define OPENFOR_NOTHING 0   /* Not opened */
 #define OPENFOR_READ    1   /* Opened read-only */
 #define OPENFOR_WRITE   2   /* Opened read-write */
 
-/* Directory definition -- just basically a list of files we contain */
-typedef LIST_HEAD(rd_dir, rd_file) rd_dir_t;
+/* Directory definition -- a list of files we contain (in readdir order), plus
+   a hash table of the same files for lookups by name. */
+typedef struct rd_dir {
+    LIST_HEAD(rd_flist, rd_file) files; /* All files in the directory */
+    rd_file_t  ** hash;                 /* Hash buckets */
+    size_t        hashsize;             /* Number of buckets (power of two) */
+    size_t        count;                /* Number of files in the directory */
+} rd_dir_t;
 
 /* Pointer to the root diretctory */
 static rd_file_t *root = NULL;
@@ -102,19 +127,139 @@ static struct {
 /* Mutex for file system structs */
 static mutex_t rd_mutex;
 
+/* Case-insensitive FNV-1a hash of a file name, since lookups in the ramdisk
+   ignore case. */
+static uint32_t ramdisk_hash(const char *name, size_t namelen) {
+    uint32_t h = 0x811c9dc5;
+    size_t i;
+
+    for(i = 0; i < namelen; ++i) {
+        h ^= (uint8_t)tolower((unsigned char)name[i]);
+        h *= 0x01000193;
+    }
+
+    return h;
+}
+
+/* Allocate and set up an empty directory. */
+static rd_dir_t *ramdisk_dir_create(void) {
+    rd_dir_t *d;
+
+    if(!(d = (rd_dir_t *)malloc(sizeof(rd_dir_t))))
+        return NULL;
+
+    if(!(d->hash = (rd_file_t **)calloc(RD_HASH_INIT, sizeof(rd_file_t *)))) {
+        free(d);
+        return NULL;
+    }
+
+    LIST_INIT(&d->files);
+    d->hashsize = RD_HASH_INIT;
+    d->count = 0;
+
+    return d;
+}
+
+static void ramdisk_dir_destroy(rd_dir_t *d) {
+    free(d->hash);
+    free(d);
+}
+
+/* Double the number of hash buckets in a directory. If we can't get the memory
+   for it, we just keep using the old table; lookups will be a bit slower, but
+   still correct. Assumes we hold rd_mutex. */
+static void ramdisk_dir_grow(rd_dir_t *d) {
+    rd_file_t **nh, *f;
+    size_t ns = d->hashsize << 1;
+
+    if(!(nh = (rd_file_t **)calloc(ns, sizeof(rd_file_t *))))
+        return;
+
+    LIST_FOREACH(f, &d->files, dirlist) {
+        f->hnext = nh[f->hash & (ns - 1)];
+        nh[f->hash & (ns - 1)] = f;
+    }
+
+    free(d->hash);
+    d->hash = nh;
+    d->hashsize = ns;
+}
+
+/* Add a file to a directory. Assumes we hold rd_mutex. */
+static void ramdisk_dir_insert(rd_dir_t *d, rd_file_t *f) {
+    rd_file_t **b = &d->hash[f->hash & (d->hashsize - 1)];
+
+    f->hnext = *b;
+    *b = f;
+    LIST_INSERT_HEAD(&d->files, f, dirlist);
+
+    if(++d->count > (d->hashsize << 1))
+        ramdisk_dir_grow(d);
+}
+
+/* Remove a file from a directory. Assumes we hold rd_mutex. */
+static void ramdisk_dir_remove(rd_dir_t *d, rd_file_t *f) {
+    rd_file_t **b = &d->hash[f->hash & (d->hashsize - 1)];
+
+    while(*b != f) {
+        assert(*b != NULL);
+        b = &(*b)->hnext;
+    }
+
+    *b = f->hnext;
+    LIST_REMOVE(f, dirlist);
+    --d->count;
+}
+
 /* Search a directory for the named file; return the struct if
    we find it. Assumes we hold rd_mutex. */
 static rd_file_t *ramdisk_find(rd_dir_t *parent, const char *name, size_t namelen) {
     rd_file_t   *f;
+    uint32_t    h = ramdisk_hash(name, namelen);
 
-    LIST_FOREACH(f, parent, dirlist) {
-        if((strlen(f->name) == namelen) && !strncasecmp(name, f->name, namelen))
+    for(f = parent->hash[h & (parent->hashsize - 1)]; f; f = f->hnext) {
+        if(f->hash == h && f->namelen == namelen &&
+           !strncasecmp(name, f->name, namelen))
             return f;
     }
 
     return NULL;
 }
 
+/* Make sure the data block of a file can hold at least size bytes. The block
+   grows by at least half of its current size each time so that appending in
+   small pieces doesn't have to copy the whole file every time. If we can't get
+   that much memory, we fall back to just what was asked for. Assumes we hold
+   rd_mutex. */
+static int ramdisk_reserve(rd_file_t *f, size_t size) {
+    size_t nsize;
+    void *np;
+
+    if(size <= f->datasize)
+        return 0;
+
+    nsize = f->datasize + (f->datasize >> 1);
+
+    if(nsize < size)
+        nsize = size;
+
+    nsize = (nsize + RD_BLOCK_SIZE - 1) & ~(RD_BLOCK_SIZE - 1);
+
+    if(!(np = realloc(f->data, nsize))) {
+        nsize = size;
+
+        if(!(np = realloc(f->data, nsize))) {
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+
+    f->data = np;
+    f->datasize = nsize;
+
+    return 0;
+}
+
 /* Find a path-named file in the ramdisk. There should not be a
    slash at the beginning, nor at the end. Assumes we hold rd_mutex. */
 static rd_file_t * ramdisk_find_path(rd_dir_t * parent, const char * fn, int dir) {
@@ -221,13 +366,15 @@ static rd_file_t * ramdisk_create_file(rd_dir_t * parent, const char * fn, int d
     f->type = dir ? STAT_TYPE_DIR : STAT_TYPE_FILE;
     f->openfor = OPENFOR_NOTHING;
     f->usage = 0;
+    f->namelen = strlen(f->name);
+    f->hash = ramdisk_hash(f->name, f->namelen);
 
     if(!dir) {
-        f->data = malloc(1024);
-        f->datasize = 1024;
+        f->data = malloc(RD_BLOCK_SIZE);
+        f->datasize = RD_BLOCK_SIZE;
     }
     else {
-        f->data = malloc(sizeof(rd_dir_t));
+        f->data = ramdisk_dir_create();
         f->datasize = 0;
     }
 
@@ -237,7 +384,7 @@ static rd_file_t * ramdisk_create_file(rd_dir_t * parent, const char * fn, int d
         return NULL;
     }
 
-    LIST_INSERT_HEAD(pdir, f, dirlist);
+    ramdisk_dir_insert(pdir, f);
 
     return f;
 }
@@ -321,9 +468,14 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
             fh[fd].ptr = f->size;
         /* If we're opening with O_TRUNC, kill the existing contents */
         else if(mode & O_TRUNC) {
-            free(f->data);
-            f->data = malloc(1024);
-            f->datasize = 1024;
+            /* Keep the block if it's small already, otherwise give the
+               memory back rather than sitting on a big empty file. */
+            if(f->datasize > RD_BLOCK_SIZE) {
+                free(f->data);
+                f->data = malloc(RD_BLOCK_SIZE);
+                f->datasize = RD_BLOCK_SIZE;
+            }
+
             f->size = 0;
             fh[fd].ptr = 0;
         }
@@ -337,7 +489,7 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
     /* If we opened a dir, then ptr is actually a pointer to the first
        file entry. */
     if(mode & O_DIR) {
-        fh[fd].ptr = (uint32_t)LIST_FIRST((rd_dir_t *)f->data);
+        fh[fd].ptr = (uint32_t)LIST_FIRST(&((rd_dir_t *)f->data)->files);
     }
 
     /* Increase the usage count */
@@ -411,17 +563,9 @@ static ssize_t ramdisk_write(void * h, const void *buf, size_t bytes) {
 
     /* Check that the fd is valid */
     if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir && fh[fd].file->openfor == OPENFOR_WRITE) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->datasize) {
-            /* We need to realloc the block */
-            void * np = realloc(fh[fd].file->data, (fh[fd].ptr + bytes) + 4096);
-
-            if(np == NULL)
-                return -1;
-
-            fh[fd].file->data = np;
-            fh[fd].file->datasize = (fh[fd].ptr + bytes) + 4096;
-        }
+        /* Make sure there's enough room */
+        if(ramdisk_reserve(fh[fd].file, fh[fd].ptr + bytes) < 0)
+            return -1;
 
         /* Copy out the requested amount */
         memcpy(((uint8_t *)fh[fd].file->data) + fh[fd].ptr, buf, bytes);
@@ -549,25 +693,30 @@ static dirent_t *ramdisk_readdir(void * h) {
 
 static int ramdisk_unlink(vfs_handler_t * vfs, const char *fn) {
     rd_file_t   * f;
+    rd_dir_t    * pdir;
+    const char  * p;
     int     rv = -1;
 
     (void)vfs;
 
+    if(fn[0] == '/')
+        fn++;
+
     mutex_lock_scoped(&rd_mutex);
 
-    /* Find the file */
+    /* Find the file and the directory it lives in */
     f = ramdisk_find_path(rootdir, fn, 0);
 
-    if(f) {
+    if(f && ramdisk_get_parent(rootdir, fn, &pdir, &p) == 0) {
         /* Make sure it's not in use */
         if(f->usage == 0) {
+            /* Remove it from the parent directory */
+            ramdisk_dir_remove(pdir, f);
+
             /* Free its data */
             free(f->name);
             free(f->data);
 
-            /* Remove it from the parent list */
-            LIST_REMOVE(f, dirlist);
-
             /* Free the entry itself */
             free(f);
             rv = 0;
@@ -621,7 +770,7 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
     st->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_mode |= (f->type == STAT_TYPE_DIR) ? 
         (S_IFDIR | S_IXUSR | S_IXGRP | S_IXOTH) : S_IFREG;
-    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->datasize;
+    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->size;
     st->st_nlink = (f->type == STAT_TYPE_DIR) ? 2 : 1;
     st->st_blksize = 1024;
     st->st_blocks = f->datasize >> 10;
@@ -632,6 +781,57 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
     return 0;
 }
 
+static int ramdisk_ioctl(void *h, int cmd, va_list ap) {
+    file_t fd = (file_t)h;
+    rd_file_t *f;
+    size_t size;
+
+    mutex_lock_scoped(&rd_mutex);
+
+    if(fd >= FS_RAMDISK_MAX_FILES || !fh[fd].file || fh[fd].dir) {
+        errno = EBADF;
+        return -1;
+    }
+
+    f = fh[fd].file;
+
+    switch(cmd) {
+        case RAMDISK_IOCTL_RESERVE:
+            if(f->openfor != OPENFOR_WRITE) {
+                errno = EBADF;
+                return -1;
+            }
+
+            return ramdisk_reserve(f, va_arg(ap, size_t));
+
+        case RAMDISK_IOCTL_TRUNCATE:
+            if(f->openfor != OPENFOR_WRITE) {
+                errno = EBADF;
+                return -1;
+            }
+
+            size = va_arg(ap, size_t);
+
+            if(ramdisk_reserve(f, size) < 0)
+                return -1;
+
+            /* Growing the file fills the new space with zeroes. */
+            if(size > f->size)
+                memset((uint8_t *)f->data + f->size, 0, size - f->size);
+
+            f->size = size;
+
+            if(fh[fd].ptr > size)
+                fh[fd].ptr = size;
+
+            return 0;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
 static int ramdisk_fcntl(void *h, int cmd, va_list ap) {
     file_t fd = (file_t)h;
 
@@ -670,7 +870,7 @@ static int ramdisk_rewinddir(void * h) {
     }
 
     /* Rewind to the first file. */
-    fh[fd].ptr = (uint32_t)LIST_FIRST((rd_dir_t *)fh[fd].file->data);
+    fh[fd].ptr = (uint32_t)LIST_FIRST(&((rd_dir_t *)fh[fd].file->data)->files);
 
     return 0;
 }
@@ -694,7 +894,7 @@ static int ramdisk_fstat(void *h, struct stat *st) {
     st->st_dev = (dev_t)('r' | ('a' << 8) | ('m' << 16));
     st->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_mode |= (f->type == STAT_TYPE_DIR) ? S_IFDIR : S_IFREG;
-    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->datasize;
+    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->size;
     st->st_nlink = (f->type == STAT_TYPE_DIR) ? 2 : 1;
     st->st_blksize = 1024;
     st->st_blocks = f->datasize >> 10;
@@ -727,7 +927,7 @@ static vfs_handler_t vh = {
     ramdisk_tell,
     ramdisk_total,
     ramdisk_readdir,
-    NULL,               /* ioctl */
+    ramdisk_ioctl,
     NULL,               /* rename XXX */
     ramdisk_unlink,
     ramdisk_mmap,
@@ -815,19 +1015,21 @@ void fs_ramdisk_init(void) {
         return;
 
     /* Create an empty root dir */
-    if(!(rootdir = (rd_dir_t *)malloc(sizeof(rd_dir_t))))
+    if(!(rootdir = ramdisk_dir_create()))
         return;
 
     root = (rd_file_t *)malloc(sizeof(rd_file_t));
     if(root == NULL) {
-        free(rootdir);
+        ramdisk_dir_destroy(rootdir);
+        rootdir = NULL;
         return;
     }
 
     root->name = strdup("/");
     if(root->name == NULL) {
         free(root);
-        free(rootdir);
+        ramdisk_dir_destroy(rootdir);
+        rootdir = NULL;
         return;
     }
 
@@ -837,8 +1039,9 @@ void fs_ramdisk_init(void) {
     root->usage = 0;
     root->data = rootdir;
     root->datasize = 0;
-
-    LIST_INIT(rootdir);
+    root->namelen = 1;
+    root->hash = 0;
+    root->hnext = NULL;
 
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
@@ -860,17 +1063,23 @@ void fs_ramdisk_shutdown(void) {
 
     /* For now assume there's only the root dir, since mkdir and
        rmdir aren't even implemented... */
-    f1 = LIST_FIRST(rootdir);
+    f1 = LIST_FIRST(&rootdir->files);
 
     while(f1) {
         f2 = LIST_NEXT(f1, dirlist);
         free(f1->name);
-        free(f1->data);
+
+        if(f1->type == STAT_TYPE_DIR)
+            ramdisk_dir_destroy((rd_dir_t *)f1->data);
+        else
+            free(f1->data);
+
         free(f1);
         f1 = f2;
     }
 
-    free(rootdir);
+    ramdisk_dir_destroy(rootdir);
+    rootdir = NULL;
     free(root->name);
     free(root);
 
@@ -588,7 +588,7 @@ static vfs_handler_t vh = {
         NMMGR_LIST_INIT         /* list */
     },
 
-    0, NULL,                    /* no caching, privdata */
+    VFS_CACHE_DENTRY, NULL,     /* stat cache, privdata */
 
     romdisk_open,
     romdisk_close,
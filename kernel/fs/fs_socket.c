@@ -16,6 +16,7 @@
 
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -30,6 +31,10 @@ static struct socket_list sockets;
 static mutex_t proto_rlock = RECURSIVE_MUTEX_INITIALIZER;
 static mutex_t list_rlock = RECURSIVE_MUTEX_INITIALIZER;
 
+/* Size of the buffer sendfile() reads through, for files that can't be sent
+   directly by the protocol. */
+#define SENDFILE_BUF_SIZE   4096
+
 static int fs_socket_close(void *hnd) {
     net_socket_t *sock = (net_socket_t *)hnd;
 
@@ -505,6 +510,227 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+/* Receive one message with recvfrom, for protocols that can't do it any other
+   way. Data for more than one buffer goes through a temporary one. */
+static ssize_t recvmsg_copy(net_socket_t *hnd, struct msghdr *msg, int flags) {
+    uint8_t *buf;
+    size_t len = 0, off = 0, n;
+    socklen_t *alen = msg->msg_name ? &msg->msg_namelen : NULL;
+    ssize_t rv;
+    int i;
+
+    msg->msg_flags = 0;
+    msg->msg_controllen = 0;
+
+    if(msg->msg_iovlen == 1)
+        return hnd->protocol->recvfrom(hnd, msg->msg_iov[0].iov_base,
+                                       msg->msg_iov[0].iov_len, flags,
+                                       msg->msg_name, alen);
+
+    for(i = 0; i < msg->msg_iovlen; ++i)
+        len += msg->msg_iov[i].iov_len;
+
+    if(!(buf = (uint8_t *)malloc(len ? len : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rv = hnd->protocol->recvfrom(hnd, buf, len, flags, msg->msg_name, alen);
+
+    for(i = 0; i < msg->msg_iovlen && off < (size_t)rv && rv > 0; ++i) {
+        n = rv - off;
+
+        if(n > msg->msg_iov[i].iov_len)
+            n = msg->msg_iov[i].iov_len;
+
+        memcpy(msg->msg_iov[i].iov_base, buf + off, n);
+        off += n;
+    }
+
+    free(buf);
+    return rv;
+}
+
+/* Send one message with sendto, putting it together in a temporary buffer if
+   it is spread over more than one. */
+static ssize_t sendmsg_copy(net_socket_t *hnd, const struct msghdr *msg,
+                            int flags) {
+    uint8_t *buf;
+    size_t len = 0;
+    ssize_t rv;
+    int i;
+
+    if(msg->msg_iovlen == 1)
+        return hnd->protocol->sendto(hnd, msg->msg_iov[0].iov_base,
+                                     msg->msg_iov[0].iov_len, flags,
+                                     msg->msg_name, msg->msg_namelen);
+
+    for(i = 0; i < msg->msg_iovlen; ++i)
+        len += msg->msg_iov[i].iov_len;
+
+    if(!(buf = (uint8_t *)malloc(len ? len : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0, len = 0; i < msg->msg_iovlen; ++i) {
+        memcpy(buf + len, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        len += msg->msg_iov[i].iov_len;
+    }
+
+    rv = hnd->protocol->sendto(hnd, buf, len, flags, msg->msg_name,
+                               msg->msg_namelen);
+    free(buf);
+    return rv;
+}
+
+ssize_t recvmsg(int sock, struct msghdr *msg, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr mmsg;
+    int rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!hnd->protocol->recvmmsg)
+        return recvmsg_copy(hnd, msg, flags);
+
+    mmsg.msg_hdr = *msg;
+    mmsg.msg_len = 0;
+
+    if((rv = hnd->protocol->recvmmsg(hnd, &mmsg, 1, flags, NULL)) < 0)
+        return -1;
+
+    *msg = mmsg.msg_hdr;
+    return rv ? (ssize_t)mmsg.msg_len : 0;
+}
+
+ssize_t sendmsg(int sock, const struct msghdr *msg, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr mmsg;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!hnd->protocol->sendmmsg)
+        return sendmsg_copy(hnd, msg, flags);
+
+    mmsg.msg_hdr = *msg;
+    mmsg.msg_len = 0;
+
+    if(hnd->protocol->sendmmsg(hnd, &mmsg, 1, flags) < 0)
+        return -1;
+
+    return mmsg.msg_len;
+}
+
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(hnd->protocol->recvmmsg)
+        return hnd->protocol->recvmmsg(hnd, msgvec, vlen, flags, timeout);
+
+    /* Do them one at a time. Without help from the protocol, there's no good
+       way to put a limit on the time, so that is left out. */
+    flags &= ~MSG_WAITFORONE;
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = recvmsg_copy(hnd, &msgvec[i].msg_hdr, flags)) <= 0)
+            return (i || !rv) ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return (int)i;
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(hnd->protocol->sendmmsg)
+        return hnd->protocol->sendmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = sendmsg_copy(hnd, &msgvec[i].msg_hdr, flags)) < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return (int)i;
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
@@ -608,3 +834,94 @@ int setsockopt(int sock, int level, int option_name, const void *option_value,
     return hnd->protocol->setsockopt(hnd, level, option_name, option_value,
                                      option_len);
 }
+
+/* Send a file the slow way: read it into a buffer and send that. */
+static ssize_t sendfile_copy(net_socket_t *hnd, int in_fd, off_t *offset,
+                             size_t count) {
+    uint8_t *buf;
+    off_t pos = 0;
+    ssize_t size = 0, rd, wr = 0;
+    int err = 0;
+
+    if(!(buf = (uint8_t *)malloc(SENDFILE_BUF_SIZE))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* With an explicit offset, the file position must be left alone. */
+    if(offset) {
+        if((pos = fs_tell(in_fd)) < 0 ||
+           fs_seek(in_fd, *offset, SEEK_SET) < 0) {
+            free(buf);
+            return -1;
+        }
+    }
+
+    while((size_t)size < count) {
+        rd = count - size;
+
+        if(rd > SENDFILE_BUF_SIZE)
+            rd = SENDFILE_BUF_SIZE;
+
+        if((rd = fs_read(in_fd, buf, rd)) <= 0) {
+            if(rd < 0)
+                err = errno;
+
+            break;
+        }
+
+        if((wr = hnd->protocol->sendto(hnd, buf, rd, 0, NULL, 0)) < 0) {
+            err = errno;
+            wr = 0;
+        }
+
+        size += wr;
+
+        /* Put back whatever we read but couldn't send. */
+        if(wr < rd) {
+            fs_seek(in_fd, wr - rd, SEEK_CUR);
+            break;
+        }
+    }
+
+    if(offset) {
+        *offset += size;
+        fs_seek(in_fd, pos, SEEK_SET);
+    }
+
+    free(buf);
+
+    if(!size && err) {
+        errno = err;
+        return -1;
+    }
+
+    return size;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    net_socket_t *hnd;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(out_fd);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(out_fd) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(hnd->protocol->sendfile) {
+        rv = hnd->protocol->sendfile(hnd, in_fd, offset, count);
+
+        if(rv >= 0 || errno != EOPNOTSUPP)
+            return rv;
+    }
+
+    return sendfile_copy(hnd, in_fd, offset, count);
+}
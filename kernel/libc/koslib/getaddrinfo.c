@@ -18,14 +18,16 @@
    The implementations of getaddrinfo() and freeaddrinfo() are new to this
    version of the code though.
 
-   Eventually, I'd like to add some sort of caching of results to this file so
-   that if you look something up more than once, it doesn't have to go back out
-   to the server to do so. But, for now, there is no local database of cached
-   addresses...
+   Results are kept in a small cache for as long as the server says that they
+   are good for, including the fact that a name doesn't exist, so looking the
+   same few hosts up over and over again doesn't go back out to the server each
+   time. Lookups can also be done without blocking, with getaddrinfo_async(),
+   and the blocking getaddrinfo() is built on top of that.
 */
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -38,6 +40,8 @@
 
 #include <kos/net.h>
 #include <kos/dbglog.h>
+#include <kos/mutex.h>
+#include <kos/timer.h>
 
 /* How many attempts to make at contacting the DNS server before giving up. */
 #define DNS_ATTEMPTS    4
@@ -45,17 +49,29 @@
 /* How long to wait between attempts. */
 #define DNS_TIMEOUT     500
 
-/*
-   This performs a simple DNS A-record query. It hasn't been tested extensively
-   but so far it seems to work fine.
+/* Most DNS servers to try, taken from the network devices. */
+#define DNS_MAX_SERVERS 4
 
-   This relies on the really sketchy UDP support in the KOS lwIP port, so it
-   can be cleaned up later once that's improved.
+/* Biggest message we'll send or receive (the most that has to be accepted over
+   UDP without EDNS). */
+#define DNS_MSG_SIZE    512
 
-   We really need to be setting errno in here too...
- */
+/* Longest name that can be looked up. */
+#define DNS_NAME_MAX    253
+
+/* Number of names kept in the cache, and addresses kept for each of them. */
+#define DNS_CACHE_SIZE  16
+#define DNS_CACHE_ADDRS 8
 
+/* Longest time to keep anything in the cache, and how long to remember that a
+   name doesn't exist if the server doesn't say, in seconds. */
+#define DNS_MAX_TTL     86400
+#define DNS_NEG_TTL     60
 
+/* Lowest local port to send questions from, and how many random ones to try
+   before settling for whatever port the stack picks. */
+#define DNS_PORT_FIRST  1024
+#define DNS_BIND_TRIES  8
 
 /* Basic query process:
 
@@ -71,7 +87,53 @@ typedef struct dnsmsg {
     uint8_t data[];      // Payload
 } dnsmsg_t;
 
-static uint16_t qnum = 0;
+/* The answer to one question: the addresses of a name in one family. */
+typedef struct dns_answer {
+    int err;                            /* 0, or the EAI_* error */
+    uint32_t ttl;                       /* Seconds it is good for */
+    int naddrs;
+    uint8_t addrs[DNS_CACHE_ADDRS][16];
+} dns_answer_t;
+
+/* One entry in the cache. A name is cached for each family separately. */
+typedef struct dns_cache_ent {
+    char name[DNS_NAME_MAX + 1];
+    int family;
+    uint64_t expires;                   /* From timer_ms_gettime64() */
+    uint64_t used;
+    dns_answer_t ans;
+} dns_cache_ent_t;
+
+static dns_cache_ent_t dns_cache[DNS_CACHE_SIZE];
+static mutex_t dns_cache_mutex = MUTEX_INITIALIZER;
+
+/* A lookup in progress. There's a question for each family being looked up,
+   which are all asked at once, in separate messages. */
+struct gai_async {
+    int sock;
+    in_port_t port;
+    struct addrinfo hints;
+    char name[DNS_NAME_MAX + 1];
+
+    int nq;
+    struct {
+        int family;
+        uint16_t id;
+        int done;
+        dns_answer_t ans;
+    } q[2];
+
+    uint32_t servers[DNS_MAX_SERVERS];  /* In network byte order */
+    int nservers;
+    int server;                         /* The one being asked now */
+    int tries;
+    uint64_t deadline;                  /* When to ask again */
+
+    int done;
+    int err;
+    int sys_errno;
+    struct addrinfo *res;
+};
 
 #define QTYPE_A         1
 #define QTYPE_AAAA      28
@@ -115,14 +177,14 @@ static uint16_t qnum = 0;
      AAAA   28
  */
 
-// Construct a DNS query for an A record by host name. "buf" should
-// be at least 1500 bytes, to make sure there's room.
-static size_t dns_make_query(const char *host, dnsmsg_t *buf, int ip4,
-                             int ip6) {
+// Construct a DNS query by host name. "buf" should be at least
+// DNS_MSG_SIZE bytes, to make sure there's room.
+static size_t dns_make_query(const char *host, uint16_t id, dnsmsg_t *buf,
+                             int ip4, int ip6) {
     int i, o = 0, ls, t;
 
     // Build up the header.
-    buf->id = htons(qnum++);
+    buf->id = htons(id);
     buf->flags = htons(0x0100);
     buf->qdcount = htons(ip4 + ip6);
     buf->ancount = htons(0);
@@ -212,311 +274,537 @@ static size_t dns_make_query(const char *host, dnsmsg_t *buf, int ip4,
    name, and the A answer contains the address.
  */
 
-// Scans through and skips a label in the data payload, starting
-// at the given offset. The new offset (after the label) will be
-// returned.
-static int dns_skip_label(dnsmsg_t *resp, int o) {
-    int cnt;
-
-    // End of the label?
-    while(resp->data[o] != 0) {
-        // Is it a pointer?
-        if((resp->data[o] & 0xc0) == 0xc0)
-            return o + 2;
-
-        // Skip this part.
-        cnt = resp->data[o++];
-        o += cnt;
-    }
-
-    // Skip the terminator
-    o++;
+/* Forward declaration... */
+static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
+                                    struct addrinfo *h, struct addrinfo *tail);
+static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
+                                    struct addrinfo *h, struct addrinfo *tail);
 
-    return o;
+static inline uint16_t dns_get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
 }
 
-// Scans through and copies out a label in the data payload,
-// starting at the given offset. The new offset (after the label)
-// will be returned as well as the label string.
-static int dns_copy_label(dnsmsg_t *resp, int o, char *outbuf) {
-    int cnt;
-    int rv = -1;
-
-    // Do each part.
-    outbuf[0] = 0;
-
-    for(;;) {
-        // Is it a pointer?
-        if((resp->data[o] & 0xc0) == 0xc0) {
-            int offs = ((resp->data[o] & ~0xc0) << 8) | resp->data[o + 1];
-
-            if(rv < 0)
-                rv = o + 2;
-
-            o = offs - sizeof(dnsmsg_t);
-        }
-        else {
-            cnt = resp->data[o++];
+static inline uint32_t dns_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
 
-            if(cnt) {
-                if(outbuf[0] != 0)
-                    strcat(outbuf, ".");
+// Scans through and skips a name in the message, starting at the given
+// offset. The new offset (after the name) will be returned, or -1 if the name
+// runs off the end of the message.
+static int dns_skip_name(const uint8_t *msg, size_t size, size_t o) {
+    while(o < size && msg[o] != 0) {
+        // Is it a pointer? If so, that's the end of it.
+        if((msg[o] & 0xc0) == 0xc0)
+            return o + 2 <= size ? (int)(o + 2) : -1;
 
-                strncat(outbuf, (char *)(resp->data + o), cnt);
-                o += cnt;
-            }
-            else {
-                break;
-            }
-        }
+        // Skip this part.
+        o += msg[o] + 1;
     }
 
-    if(rv < 0)
-        return o;
-    else
-        return rv;
+    // Skip the terminator
+    return o < size ? (int)(o + 1) : -1;
 }
 
-/* Forward declaration... */
-static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
-static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
+// Parse a response from the DNS server to a question about the addresses of a
+// name in the given family. The answer is filled in with the addresses and how
+// long they are good for, or with an error and how long that is good for.
+// Returns -1 if the message should just be ignored.
+static int dns_parse_response(const uint8_t *msg, size_t size, int family,
+                              dns_answer_t *ans) {
+    int i, o, qdcnt, ancnt, nscnt;
+    uint16_t flags, type, len, want, alen;
+    uint32_t ttl, minttl = DNS_MAX_TTL;
 
-// Parse a response packet from the DNS server. The IP address
-// will be filled in upon a successful return, otherwise the
-// return value will be <0.
-static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
-                              uint16_t port, struct addrinfo **res) {
-    int i, o, arecs;
-    uint16_t flags;
-    char tmp[64];
-    uint16_t ancnt, len;
-    struct addrinfo *ptr = NULL;
+    if(size < sizeof(dnsmsg_t))
+        return -1;
 
     /* Check the flags first to see if it was successful. */
-    flags = ntohs(resp->flags);
+    flags = dns_get16(msg + 2);
 
     if(!(flags & 0x8000)) {
-        /* Not our response! */
-        return EAI_AGAIN;
+        /* Not a response! */
+        return -1;
     }
 
+    ans->naddrs = 0;
+    ans->ttl = 0;
+
     /* Did the server report an error? */
     switch(flags & 0x000f) {
         case 0:   /* No error */
+        case 3:   /* Name error */
             break;
 
+        case 2:   /* Server failure */
+            ans->err = EAI_AGAIN;
+            return 0;
+
         case 1:   /* Format error */
         case 4:   /* Not implemented */
         case 5:   /* Refused */
         default:
-            return EAI_FAIL;
-
-        case 3:   /* Name error */
-            return EAI_NONAME;
-
-        case 2:   /* Server failure */
-            return EAI_AGAIN;
+            ans->err = EAI_FAIL;
+            return 0;
     }
 
-    /* Getting zero answers is also a failure. */
-    ancnt = ntohs(resp->ancount);
+    qdcnt = dns_get16(msg + 4);
+    ancnt = dns_get16(msg + 6);
+    nscnt = dns_get16(msg + 8);
+    o = sizeof(dnsmsg_t);
 
-    if(ancnt < 1)
-        return EAI_NONAME;
+    if(family == AF_INET) {
+        want = QTYPE_A;
+        alen = 4;
+    }
+    else {
+        want = QTYPE_AAAA;
+        alen = 16;
+    }
 
     /* If we have any query sections (should have at least one), skip 'em. */
-    o = 0;
-    len = ntohs(resp->qdcount);
-
-    for(i = 0; i < len; i++) {
-        /* Skip the label. */
-        o = dns_skip_label(resp, o);
+    for(i = 0; i < qdcnt; i++) {
+        if((o = dns_skip_name(msg, size, o)) < 0 || (size_t)o + 4 > size)
+            return -1;
 
-        /* And the two type fields. */
+        /* Skip the two type fields. */
         o += 4;
     }
 
-    /* Ok, now the answer section (what we're interested in). */
-    arecs = 0;
-
+    /* Ok, now the answer section (what we're interested in). Anything that
+       isn't an address of the right type (like a CNAME leading to it) is
+       skipped. */
     for(i = 0; i < ancnt; i++) {
-        /* Copy out the label, in case we need it. */
-        o = dns_copy_label(resp, o, tmp);
+        if((o = dns_skip_name(msg, size, o)) < 0 || (size_t)o + 10 > size)
+            return -1;
 
-        /* Get the type code. If it's not A or AAAA, skip it. */
-        if(resp->data[o] == 0 && resp->data[o + 1] == 1 &&
-           (hints->ai_family == AF_INET || hints->ai_family == AF_UNSPEC)) {
-            uint32_t addr;
+        type = dns_get16(msg + o);
+        ttl = dns_get32(msg + o + 4);
+        len = dns_get16(msg + o + 8);
+        o += 10;
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+        if((size_t)o + len > size)
+            return -1;
 
-            /* Grab the address from the response. */
-            addr = htonl((resp->data[o] << 24) | (resp->data[o + 1] << 16) |
-                         (resp->data[o + 2] << 8) | resp->data[o + 3]);
+        if(type == want && len == alen && dns_get16(msg + o - 8) == 1) {
+            if(ans->naddrs < DNS_CACHE_ADDRS)
+                memcpy(ans->addrs[ans->naddrs++], msg + o, alen);
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv4_ai(addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+            if(ttl < minttl)
+                minttl = ttl;
+        }
 
-            if(!*res)
-                *res = ptr;
+        o += len;
+    }
 
-            o += len;
-            arecs++;
-        }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 28 &&
-                (hints->ai_family == AF_INET6 || hints->ai_family == AF_UNSPEC)) {
-            struct in6_addr addr;
+    if(ans->naddrs) {
+        ans->err = 0;
+        ans->ttl = minttl;
+        return 0;
+    }
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+    /* The name doesn't exist, or doesn't have any addresses of this type. How
+       long to remember that comes from the SOA record in the authority section,
+       if there is one (RFC 2308). */
+    ans->err = EAI_NONAME;
+    ans->ttl = DNS_NEG_TTL;
 
-            /* Grab the address from the response. */
-            memcpy(addr.s6_addr, &resp->data[o], 16);
+    for(i = 0; i < nscnt; i++) {
+        if((o = dns_skip_name(msg, size, o)) < 0 || (size_t)o + 10 > size)
+            break;
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv6_ai(&addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+        type = dns_get16(msg + o);
+        ttl = dns_get32(msg + o + 4);
+        len = dns_get16(msg + o + 8);
+        o += 10;
 
-            if(!*res)
-                *res = ptr;
+        if((size_t)o + len > size)
+            break;
 
-            o += len;
-            arecs++;
-        }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 5) {
-            char tmp2[64];
+        /* The SOA's MINIMUM field is the last thing in it. */
+        if(type == 6 && len >= 22) {
+            if(dns_get32(msg + o + len - 4) < ttl)
+                ttl = dns_get32(msg + o + len - 4);
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
-            o = dns_copy_label(resp, o, tmp2);
-        }
-        else {
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2 + len;
+            ans->ttl = ttl < DNS_MAX_TTL ? ttl : DNS_MAX_TTL;
+            break;
         }
+
+        o += len;
     }
 
-    /* Did we find something? */
-    return arecs > 0 ? 0 : EAI_NONAME;
+    return 0;
 }
 
-static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
-                           uint16_t port, struct addrinfo **res) {
-    struct sockaddr_in toaddr;
-    uint8_t qb[512];
-    size_t size;
-    int sock, rv, tries;
-    in_addr_t raddr;
-    ssize_t rsize = 0;
-    struct pollfd pfd;
+/* Look for an answer in the cache that hasn't expired yet. */
+static int dns_cache_lookup(const char *name, int family, dns_answer_t *ans) {
+    uint64_t now = timer_ms_gettime64();
+    int i, rv = 0;
 
-    /* Make sure we have a network device to communicate on. */
-    if(!net_default_dev) {
-        errno = ENETDOWN;
-        return EAI_SYSTEM;
+    mutex_lock(&dns_cache_mutex);
+
+    for(i = 0; i < DNS_CACHE_SIZE; ++i) {
+        if(dns_cache[i].family == family && dns_cache[i].expires > now &&
+           !strcasecmp(dns_cache[i].name, name)) {
+            *ans = dns_cache[i].ans;
+            dns_cache[i].used = now;
+            rv = 1;
+            break;
+        }
     }
 
-    /* Do we have a DNS server specified? */
-    if(net_default_dev->dns[0] == 0 && net_default_dev->dns[1] == 0 &&
-       net_default_dev->dns[2] == 0 && net_default_dev->dns[3] == 0) {
-        return EAI_FAIL;
+    mutex_unlock(&dns_cache_mutex);
+
+    return rv;
+}
+
+/* Remember an answer for as long as it is good for, pushing out the entry that
+   was used the longest time ago if the cache is full. */
+static void dns_cache_insert(const char *name, int family,
+                             const dns_answer_t *ans) {
+    uint64_t now = timer_ms_gettime64();
+    dns_cache_ent_t *ent = NULL;
+    int i;
+
+    if(!ans->ttl)
+        return;
+
+    mutex_lock(&dns_cache_mutex);
+
+    for(i = 0; i < DNS_CACHE_SIZE; ++i) {
+        if(dns_cache[i].family == family &&
+           !strcasecmp(dns_cache[i].name, name)) {
+            ent = &dns_cache[i];
+            break;
+        }
+
+        if(!ent || dns_cache[i].expires <= now ||
+           (ent->expires > now && dns_cache[i].used < ent->used))
+            ent = &dns_cache[i];
     }
 
-    /* Setup a query */
-    if(hints->ai_family == AF_UNSPEC)
-        /* Note: This should (in theory) work, but it seems that some resolvers
-           cannot handle multiple questions in one query. So... while the code
-           here supports multiple questions in one query, this branch will never
-           actually be taken -- getaddrinfo() will always make two separate
-           calls if we need to do both IPv4 and IPv6. */
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 1);
-    else if(hints->ai_family == AF_INET)
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 0);
-    else if(hints->ai_family == AF_INET6)
-        size = dns_make_query(name, (dnsmsg_t *)qb, 0, 1);
-    else {
-        errno = EAFNOSUPPORT;
-        return EAI_SYSTEM;
+    strcpy(ent->name, name);
+    ent->family = family;
+    ent->expires = now + (uint64_t)ans->ttl * 1000;
+    ent->used = now;
+    ent->ans = *ans;
+
+    mutex_unlock(&dns_cache_mutex);
+}
+
+void getaddrinfo_cache_flush(void) {
+    mutex_lock(&dns_cache_mutex);
+    memset(dns_cache, 0, sizeof(dns_cache));
+    mutex_unlock(&dns_cache_mutex);
+}
+
+/* Add a DNS server to the list, if it isn't on it already. */
+static void dns_add_server(gai_async_t *req, const uint8_t dns[4]) {
+    uint32_t addr = htonl(net_ipv4_address(dns));
+    int i;
+
+    if(!addr || req->nservers == DNS_MAX_SERVERS)
+        return;
+
+    for(i = 0; i < req->nservers; ++i) {
+        if(req->servers[i] == addr)
+            return;
     }
 
-    /* Make a socket to talk to the DNS server. */
-    if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        return EAI_SYSTEM;
+    req->servers[req->nservers++] = addr;
+}
+
+/* Something that's hard to guess, for query IDs and the port the queries are
+   sent from. Anyone who can't see the queries then has to guess both to get a
+   forged answer accepted (RFC 5452). */
+static uint16_t dns_random16(void) {
+    uint64_t t = timer_ns_gettime64();
+
+    return (uint16_t)(rand() ^ t ^ (t >> 16) ^ (t >> 32));
+}
+
+/* Bind the socket to a random local port. If that doesn't work out, the
+   stack gives it one when the first query is sent, so this can't fail. */
+static void dns_bind(int sock) {
+    struct sockaddr_in addr;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    for(i = 0; i < DNS_BIND_TRIES; ++i) {
+        addr.sin_port = htons(DNS_PORT_FIRST +
+                              dns_random16() % (65536 - DNS_PORT_FIRST));
+
+        if(!bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+           errno != EADDRINUSE)
+            return;
+    }
+}
 
-    /* "Connect" the socket to the DNS server's address. */
-    raddr = (net_default_dev->dns[0] << 24) | (net_default_dev->dns[1] << 16) |
-            (net_default_dev->dns[2] << 8) | net_default_dev->dns[3];
+/* Send each question that hasn't been answered yet to the current server. */
+static void dns_send(gai_async_t *req) {
+    uint8_t qb[DNS_MSG_SIZE];
+    struct sockaddr_in toaddr;
+    size_t size;
+    int i;
 
     memset(&toaddr, 0, sizeof(toaddr));
     toaddr.sin_family = AF_INET;
     toaddr.sin_port = htons(53);
-    toaddr.sin_addr.s_addr = htonl(raddr);
+    toaddr.sin_addr.s_addr = req->servers[req->server];
 
-    if(connect(sock, (struct sockaddr *)&toaddr, sizeof(toaddr))) {
-        close(sock);
-        return EAI_SYSTEM;
+    for(i = 0; i < req->nq; ++i) {
+        if(req->q[i].done)
+            continue;
+
+        size = dns_make_query(req->name, req->q[i].id, (dnsmsg_t *)qb,
+                              req->q[i].family == AF_INET,
+                              req->q[i].family == AF_INET6);
+        sendto(req->sock, qb, size, 0, (struct sockaddr *)&toaddr,
+               sizeof(toaddr));
     }
 
-    /* Set up the structure we'll use to feed to the poll function. */
-    pfd.fd = sock;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
+    req->deadline = timer_ms_gettime64() + DNS_TIMEOUT;
+}
 
-    for(tries = 0; tries < DNS_ATTEMPTS; ++tries) {
-        /* Send the query to the server. */
-        if(send(sock, qb, size, 0) < 0) {
-            return EAI_SYSTEM;
+/* Turn the answers into the result of the lookup. */
+static void dns_finish(gai_async_t *req) {
+    struct addrinfo *tail = NULL;
+    struct addrinfo ihints = req->hints;
+    int i, j, err = 0;
+
+    req->done = 1;
+
+    if(req->sock >= 0) {
+        close(req->sock);
+        req->sock = -1;
+    }
+
+    for(i = 0; i < req->nq; ++i) {
+        ihints.ai_family = req->q[i].family;
+
+        if(req->q[i].ans.err && (!err || err == EAI_NONAME))
+            err = req->q[i].ans.err;
+
+        for(j = 0; j < req->q[i].ans.naddrs; ++j) {
+            if(ihints.ai_family == AF_INET) {
+                uint32_t addr;
+
+                memcpy(&addr, req->q[i].ans.addrs[j], 4);
+                tail = add_ipv4_ai(addr, req->port, &ihints, tail);
+            }
+            else {
+                struct in6_addr addr;
+
+                memcpy(addr.s6_addr, req->q[i].ans.addrs[j], 16);
+                tail = add_ipv6_ai(&addr, req->port, &ihints, tail);
+            }
+
+            /* If something goes wrong in here, it's in calling malloc, so it
+               is definitely a system error. */
+            if(!tail) {
+                freeaddrinfo(req->res);
+                req->res = NULL;
+                req->err = EAI_SYSTEM;
+                req->sys_errno = ENOMEM;
+                return;
+            }
+
+            if(!req->res)
+                req->res = tail;
         }
+    }
 
-        /* Wait for the timeout to expire or for us to get the response. */
-        if(poll(&pfd, 1, DNS_TIMEOUT) == 1) {
-            /* Get the response. */
-            if((rsize = recv(sock, qb, 512, 0)) < 0) {
-                return EAI_SYSTEM;
+    /* Finding anything at all counts as success. */
+    req->err = req->res ? 0 : err;
+}
+
+/* Take in any responses that have arrived, and ask again if it's time to. */
+static void dns_step(gai_async_t *req) {
+    uint8_t rb[DNS_MSG_SIZE];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    ssize_t size;
+    uint16_t id;
+    int i, j, pending = 0;
+
+    for(;;) {
+        fromlen = sizeof(from);
+        size = recvfrom(req->sock, rb, sizeof(rb), MSG_DONTWAIT,
+                        (struct sockaddr *)&from, &fromlen);
+
+        if(size < 0)
+            break;
+
+        /* Only listen to the servers we asked, answering from the port we
+           asked them on. */
+        if(size < (ssize_t)sizeof(dnsmsg_t) || from.sin_port != htons(53))
+            continue;
+
+        for(j = 0; j < req->nservers; ++j) {
+            if(req->servers[j] == from.sin_addr.s_addr)
+                break;
+        }
+
+        if(j == req->nservers)
+            continue;
+
+        id = dns_get16(rb);
+
+        for(i = 0; i < req->nq; ++i) {
+            if(req->q[i].done || req->q[i].id != id)
+                continue;
+
+            if(dns_parse_response(rb, size, req->q[i].family,
+                                  &req->q[i].ans) < 0)
+                break;
+
+            /* A server that's having trouble gets skipped in favour of the
+               next one, right away. */
+            if(req->q[i].ans.err == EAI_AGAIN) {
+                req->deadline = 0;
+                break;
             }
 
+            req->q[i].done = 1;
+
+            if(req->q[i].ans.err != EAI_FAIL)
+                dns_cache_insert(req->name, req->q[i].family, &req->q[i].ans);
+
             break;
         }
     }
 
-    /* Close the socket */
-    close(sock);
+    for(i = 0; i < req->nq; ++i) {
+        if(!req->q[i].done)
+            ++pending;
+    }
 
-    /* If we never actually got a response, then there's probably a problem with
-       the server on the other end. I'm not entirely sure what to return in that
-       case, to be perfectly honest. I suppose that EAI_SYSTEM + ETIMEDOUT would
-       make the most sense, since that's really what happened... */
-    if(!rsize) {
-        errno = ETIMEDOUT;
-        return EAI_SYSTEM;
+    if(!pending) {
+        dns_finish(req);
+        return;
     }
 
-    /* Parse the response. */
-    rv = dns_parse_response((dnsmsg_t *)qb, hints, port, res);
+    if(timer_ms_gettime64() < req->deadline)
+        return;
+
+    /* Nothing back in time, so ask again, going around the servers. If none of
+       them answered, there's probably a problem with the servers on the other
+       end. EAI_SYSTEM with ETIMEDOUT makes the most sense for that, since that
+       is really what happened... */
+    if(++req->tries >= DNS_ATTEMPTS * req->nservers) {
+        for(i = 0; i < req->nq; ++i) {
+            if(!req->q[i].done) {
+                req->q[i].ans.err = EAI_SYSTEM;
+                req->q[i].ans.naddrs = 0;
+            }
+        }
+
+        dns_finish(req);
 
-    /* If we got something in the result, but got an error value in the return,
-       free whatever we got. */
-    if(rv != 0 && *res) {
-        freeaddrinfo(*res);
-        *res = NULL;
+        if(!req->res && req->err == EAI_SYSTEM)
+            req->sys_errno = ETIMEDOUT;
+
+        return;
     }
 
-    return rv;
+    req->server = req->tries % req->nservers;
+    dns_send(req);
 }
 
-/* New stuff below here... */
+/* Set up a lookup of name in the DNS, answering from the cache if possible. */
+static int dns_start(gai_async_t *req, const char *name) {
+    netif_t *cur;
+    size_t len = strlen(name);
+    int i, ls = 0;
+
+    /* A trailing dot just says that the name is fully qualified, which is all
+       we do anyway. */
+    if(len && name[len - 1] == '.')
+        --len;
+
+    /* Make sure the name will actually fit in a question, with each part of it
+       between 1 and 63 characters long. */
+    if(!len || len > DNS_NAME_MAX)
+        return EAI_NONAME;
+
+    for(i = 0; i <= (int)len; ++i) {
+        if(i == (int)len || name[i] == '.') {
+            if(i == ls || i - ls > 63)
+                return EAI_NONAME;
+
+            ls = i + 1;
+        }
+    }
+
+    memcpy(req->name, name, len);
+    req->name[len] = '\0';
+
+    if(req->hints.ai_family == AF_UNSPEC) {
+        /* It seems that some resolvers really don't like multi-part questions.
+           So, make sure we only ever send one part at a time, and ask both at
+           once instead. */
+        req->q[0].family = AF_INET;
+        req->q[1].family = AF_INET6;
+        req->nq = 2;
+    }
+    else if(req->hints.ai_family == AF_INET ||
+            req->hints.ai_family == AF_INET6) {
+        req->q[0].family = req->hints.ai_family;
+        req->nq = 1;
+    }
+    else {
+        errno = EAFNOSUPPORT;
+        return EAI_SYSTEM;
+    }
+
+    for(i = 0; i < req->nq; ++i) {
+        if(dns_cache_lookup(req->name, req->q[i].family, &req->q[i].ans))
+            req->q[i].done = 1;
+    }
+
+    if(req->q[0].done && (req->nq == 1 || req->q[1].done)) {
+        dns_finish(req);
+        return 0;
+    }
+
+    /* Make sure we have a network device to communicate on. */
+    if(!net_default_dev) {
+        errno = ENETDOWN;
+        return EAI_SYSTEM;
+    }
+
+    /* Collect the DNS servers to ask, starting with the default device's. */
+    dns_add_server(req, net_default_dev->dns);
+
+    LIST_FOREACH(cur, net_get_if_list(), if_list) {
+        if(cur->flags & NETIF_RUNNING)
+            dns_add_server(req, cur->dns);
+    }
+
+    /* Do we have a DNS server specified? */
+    if(!req->nservers)
+        return EAI_FAIL;
+
+    /* Make a socket to talk to the DNS servers. */
+    if((req->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+        return EAI_SYSTEM;
+
+    dns_bind(req->sock);
+
+    /* Each question gets its own ID, so the answers can't be mixed up. */
+    for(i = 0; i < req->nq; ++i) {
+        do {
+            req->q[i].id = dns_random16();
+        } while(i && req->q[i].id == req->q[0].id);
+    }
+
+    dns_send(req);
+
+    return 0;
+}
 
 static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
                                     struct addrinfo *h, struct addrinfo *tail) {
@@ -613,23 +901,21 @@ void freeaddrinfo(struct addrinfo *ai) {
     }
 }
 
-int getaddrinfo(const char *nodename, const char *servname,
-                const struct addrinfo *hints, struct addrinfo **res) {
+int getaddrinfo_async(const char *nodename, const char *servname,
+                      const struct addrinfo *hints, gai_async_t **req) {
     in_port_t port = 0;
     unsigned long tmp;
     char *endp;
-    int old_errno;
-    struct addrinfo ihints;
+    int old_errno, rv;
+    gai_async_t *r;
+    struct addrinfo *ai = NULL;
 
-    (void)hints;
-
-    /* What to do if res is NULL?... I'll assume we should return error... */
-    if(!res) {
+    if(!req) {
         errno = EFAULT;
         return EAI_SYSTEM;
     }
 
-    *res = NULL;
+    *req = NULL;
 
     /* Check the input parameters... */
     if(!nodename && !servname)
@@ -653,122 +939,172 @@ int getaddrinfo(const char *nodename, const char *servname,
         port = htons((uint16_t)tmp);
     }
 
+    if(!(r = (gai_async_t *)malloc(sizeof(gai_async_t))))
+        return EAI_MEMORY;
+
+    memset(r, 0, sizeof(gai_async_t));
+    r->sock = -1;
+    r->port = port;
+
     /* Did the user give us any hints? */
     if(hints)
-        memcpy(&ihints, hints, sizeof(ihints));
-    else
-        memset(&ihints, 0, sizeof(ihints));
+        memcpy(&r->hints, hints, sizeof(r->hints));
 
     /* Do we want a local address or a remote one? */
     if(!nodename) {
-        struct addrinfo *r = NULL;
+        struct addrinfo *ptr = NULL;
 
         /* Is the passive flag set to indicate we want everything set up for a
            bind? */
-        if(ihints.ai_flags & AI_PASSIVE) {
-            if(ihints.ai_family == AF_INET || ihints.ai_family == AF_UNSPEC) {
-                if(!(r = add_ipv4_ai(INADDR_ANY, port, &ihints, r)))
-                    return EAI_SYSTEM;
+        if(r->hints.ai_flags & AI_PASSIVE) {
+            if(r->hints.ai_family == AF_INET || r->hints.ai_family == AF_UNSPEC) {
+                if(!(ptr = add_ipv4_ai(INADDR_ANY, port, &r->hints, ptr)))
+                    goto nomem;
 
-                *res = r;
+                ai = ptr;
             }
 
-            if(ihints.ai_family == AF_INET6 || ihints.ai_family == AF_UNSPEC) {
-                if(!(r = add_ipv6_ai(&in6addr_any, port, &ihints, r))) {
-                    freeaddrinfo(*res);
-                    return EAI_SYSTEM;
-                }
+            if(r->hints.ai_family == AF_INET6 || r->hints.ai_family == AF_UNSPEC) {
+                if(!(ptr = add_ipv6_ai(&in6addr_any, port, &r->hints, ptr)))
+                    goto nomem;
 
-                if(!*res)
-                    *res = r;
+                if(!ai)
+                    ai = ptr;
             }
         }
         else {
-            if(ihints.ai_family == AF_INET || ihints.ai_family == AF_UNSPEC) {
+            if(r->hints.ai_family == AF_INET || r->hints.ai_family == AF_UNSPEC) {
                 uint32_t addr = htonl(0x7f000001);
 
-                if(!(r = add_ipv4_ai(addr, port, &ihints, r)))
-                    return EAI_SYSTEM;
+                if(!(ptr = add_ipv4_ai(addr, port, &r->hints, ptr)))
+                    goto nomem;
 
-                *res = r;
+                ai = ptr;
             }
 
-            if(ihints.ai_family == AF_INET6 || ihints.ai_family == AF_UNSPEC) {
-                if(!(r = add_ipv6_ai(&in6addr_loopback, port, &ihints, r))) {
-                    freeaddrinfo(*res);
-                    return EAI_SYSTEM;
-                }
+            if(r->hints.ai_family == AF_INET6 || r->hints.ai_family == AF_UNSPEC) {
+                if(!(ptr = add_ipv6_ai(&in6addr_loopback, port, &r->hints, ptr)))
+                    goto nomem;
 
-                if(!*res)
-                    *res = r;
+                if(!ai)
+                    ai = ptr;
             }
         }
 
-        return 0;
+        goto done;
     }
 
     /* Try to handle input as an IPv4 address */
-    if(ihints.ai_family == AF_INET || ihints.ai_family == AF_UNSPEC) {
+    if(r->hints.ai_family == AF_INET || r->hints.ai_family == AF_UNSPEC) {
         uint32_t ip4_addr;
 
         if(inet_pton(AF_INET, nodename, &ip4_addr) > 0) {
-            ihints.ai_family = AF_INET;
-            *res = add_ipv4_ai(ip4_addr, port, &ihints, NULL);
-            return 0;
+            r->hints.ai_family = AF_INET;
+
+            if(!(ai = add_ipv4_ai(ip4_addr, port, &r->hints, NULL)))
+                goto nomem;
+
+            goto done;
         }
     }
 
     /* Try to handle input as an IPv6 address */
-    if(ihints.ai_family == AF_INET6 || ihints.ai_family == AF_UNSPEC) {
+    if(r->hints.ai_family == AF_INET6 || r->hints.ai_family == AF_UNSPEC) {
         struct in6_addr addr;
 
         if(inet_pton(AF_INET6, nodename, &addr.s6_addr) > 0) {
-            ihints.ai_family = AF_INET6;
-            *res = add_ipv6_ai(&addr, port, &ihints, NULL);
-            return 0;
+            r->hints.ai_family = AF_INET6;
+
+            if(!(ai = add_ipv6_ai(&addr, port, &r->hints, NULL)))
+                goto nomem;
+
+            goto done;
         }
     }
 
     /* If we've gotten this far, do the lookup. */
-    if(ihints.ai_family == AF_UNSPEC) {
-        /* It seems that some resolvers really don't like multi-part questions.
-           So, make sure we only ever send one part at a time... */
-        struct addrinfo *res1 = NULL, *res2 = NULL;
-        int rv;
+    if((rv = dns_start(r, nodename))) {
+        if(r->sock >= 0)
+            close(r->sock);
 
-        ihints.ai_family = AF_INET;
-        rv = getaddrinfo_dns(nodename, &ihints, port, &res1);
+        free(r);
+        return rv;
+    }
 
-        if(rv && rv != EAI_NONAME)
-            return rv;
+    *req = r;
+    return 0;
 
-        ihints.ai_family = AF_INET6;
-        getaddrinfo_dns(nodename, &ihints, port, &res2);
+nomem:
+    freeaddrinfo(ai);
+    free(r);
+    return EAI_MEMORY;
 
-        /* Figure out what to do with the result(s). */
-        if(res1 && res2) {
-            *res = res1;
+done:
+    r->done = 1;
+    r->res = ai;
+    *req = r;
+    return 0;
+}
 
-            /* Go to the end of the chain. */
-            while(res1->ai_next) {
-                res1 = res1->ai_next;
-            }
+int getaddrinfo_async_fd(const gai_async_t *req) {
+    return req->done ? -1 : req->sock;
+}
 
-            res1->ai_next = res2;
-            return 0;
-        }
-        else if(res1) {
-            *res = res1;
-            return 0;
-        }
-        else if(res2) {
-            *res = res2;
-            return 0;
-        }
-        else {
-            return EAI_NONAME;
-        }
+int getaddrinfo_async_poll(gai_async_t *req, struct addrinfo **res) {
+    int rv;
+
+    if(!req->done)
+        dns_step(req);
+
+    if(!req->done)
+        return EAI_INPROGRESS;
+
+    rv = req->err;
+
+    if(rv == EAI_SYSTEM)
+        errno = req->sys_errno;
+
+    *res = req->res;
+    free(req);
+
+    return rv;
+}
+
+void getaddrinfo_async_cancel(gai_async_t *req) {
+    if(req->sock >= 0)
+        close(req->sock);
+
+    freeaddrinfo(req->res);
+    free(req);
+}
+
+int getaddrinfo(const char *nodename, const char *servname,
+                const struct addrinfo *hints, struct addrinfo **res) {
+    gai_async_t *req;
+    struct pollfd pfd;
+    int64_t wait;
+    int rv;
+
+    /* What to do if res is NULL?... I'll assume we should return error... */
+    if(!res) {
+        errno = EFAULT;
+        return EAI_SYSTEM;
     }
 
-    return getaddrinfo_dns(nodename, &ihints, port, res);
+    *res = NULL;
+
+    if((rv = getaddrinfo_async(nodename, servname, hints, &req)))
+        return rv;
+
+    /* Wait for responses to come in until it's done. */
+    pfd.events = POLLIN;
+
+    while((rv = getaddrinfo_async_poll(req, res)) == EAI_INPROGRESS) {
+        pfd.fd = req->sock;
+        pfd.revents = 0;
+        wait = (int64_t)(req->deadline - timer_ms_gettime64());
+        poll(&pfd, 1, wait > 0 ? (int)wait : 0);
+    }
+
+    return rv;
 }
@@ -18,12 +18,18 @@
 
 #include <malloc.h>
 #include <assert.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <arch/spinlock.h>
 #include <arch/arch.h>
+#include <arch/irq.h>
+#include <arch/stack.h>
 
 #include <kos/dbglog.h>
+#include <kos/dbgio.h>
+#include <kos/exports.h>
 #include <kos/opts.h>
 
 #undef DEBUG
@@ -54,10 +60,172 @@ int malloc_irq_safe(void) {
     return !spinlock_is_locked(&mALLOC_MUTEx);
 }
 
+/* Per-thread caches of small blocks, which sit in front of the heap so that
+   most small allocations don't have to take the lock at all. They're off
+   until mallopt(M_THREAD_CACHE, n) says how many blocks of each size a thread
+   may keep. The code is down at the bottom of this file, since it needs the
+   chunk macros. */
+#ifndef KM_DBG
+#define TCACHE_MAX_REQUEST  256
+#define TCACHE_MAX_COUNT    255
+
+static volatile int tcache_limit = DEFAULT_THREAD_CACHE;
+
+static void *tcache_get(size_t bytes);
+static int tcache_put(void *m);
+static void tcache_flush_all(void);
+#endif
+
+/* Heap profiler. Off until malloc_prof_start() is called, and all it costs
+   while it is off is a test of prof_rate in each of the public functions.
+   The code is down at the bottom of this file, next to the thread caches. */
+#ifndef KM_DBG
+static volatile unsigned int prof_rate;
+
+static void prof_alloc(void *m, uintptr_t site);
+static void prof_free(void *m);
+
+#define PROF_ALLOC(m, site) do { \
+        if(__predict_false(prof_rate) && (m)) \
+            prof_alloc((m), (site)); \
+    } while(0)
+#define PROF_FREE(m) do { \
+        if(__predict_false(prof_rate)) \
+            prof_free(m); \
+    } while(0)
+#endif
+
 /* <unistd.h> doesn't define this in strict standard-compliant mode, so do so
    here instead. */
 extern void *sbrk (ptrdiff_t __incr);
 
+/* Low memory handlers. These are called (outside of the malloc lock) when an
+   allocation fails, or after the heap has grown to within the low-water mark
+   of the top of memory, so that caches get a chance to give memory back. */
+#define LOWMEM_MAX_HANDLERS 8
+
+static struct {
+    malloc_lowmem_handler_t hnd;
+    void *data;
+} lowmem_handlers[LOWMEM_MAX_HANDLERS];
+
+static spinlock_t lowmem_lock = SPINLOCK_INITIALIZER;
+static size_t lowmem_mark = 0;
+static volatile int lowmem_pending = 0;
+
+/* sbrk() wrapper that notices when we're running out of room to grow. */
+static void *kos_morecore(ptrdiff_t incr) {
+    void *rv = sbrk(incr);
+
+    if(rv == (void *)-1)
+        lowmem_pending = 1;
+    else if(lowmem_mark && incr > 0 &&
+            (uintptr_t)rv + incr + lowmem_mark >=
+            _arch_mem_top - THD_KERNEL_STACK_SIZE)
+        lowmem_pending = 1;
+
+    return rv;
+}
+
+#define MORECORE kos_morecore
+
+/* Call the registered low memory handlers. Returns the number of handlers
+   that were run, so the caller knows whether retrying is worthwhile. */
+static int malloc_lowmem_run(size_t want) {
+    int i, rv = 0;
+
+    /* Handlers are allowed to block, so don't run them in an interrupt. Also,
+       only one thread runs them at a time; anyone else just fails. */
+    if(irq_inside_int() || !spinlock_trylock(&lowmem_lock))
+        return 0;
+
+    lowmem_pending = 0;
+
+    /* Our own cached blocks are the first thing to give back. */
+    malloc_thread_cache_flush();
+
+    for(i = 0; i < LOWMEM_MAX_HANDLERS; ++i) {
+        if(lowmem_handlers[i].hnd) {
+            lowmem_handlers[i].hnd(want, lowmem_handlers[i].data);
+            ++rv;
+        }
+    }
+
+    spinlock_unlock(&lowmem_lock);
+
+    return rv;
+}
+
+int malloc_lowmem_register(malloc_lowmem_handler_t hnd, void *data) {
+    int i, rv = -1;
+
+    spinlock_lock(&lowmem_lock);
+
+    for(i = 0; i < LOWMEM_MAX_HANDLERS; ++i) {
+        if(!lowmem_handlers[i].hnd) {
+            lowmem_handlers[i].hnd = hnd;
+            lowmem_handlers[i].data = data;
+            rv = 0;
+            break;
+        }
+    }
+
+    spinlock_unlock(&lowmem_lock);
+
+    return rv;
+}
+
+int malloc_lowmem_unregister(malloc_lowmem_handler_t hnd, void *data) {
+    int i, rv = -1;
+
+    spinlock_lock(&lowmem_lock);
+
+    for(i = 0; i < LOWMEM_MAX_HANDLERS; ++i) {
+        if(lowmem_handlers[i].hnd == hnd && lowmem_handlers[i].data == data) {
+            lowmem_handlers[i].hnd = NULL;
+            lowmem_handlers[i].data = NULL;
+            rv = 0;
+            break;
+        }
+    }
+
+    spinlock_unlock(&lowmem_lock);
+
+    return rv;
+}
+
+void malloc_lowmem_set_mark(size_t bytes) {
+    lowmem_mark = bytes;
+}
+
+void *malloc_morecore(size_t size) {
+    void *rv;
+    int tries;
+
+    if((ptrdiff_t)size < 0)
+        return (void *)-1;
+
+    for(tries = 0; tries < 2; ++tries) {
+        /* Under the lock, so the heap's own sbrk() calls can't interleave. */
+        if(MALLOC_PREACTION != 0)
+            return (void *)-1;
+
+        rv = kos_morecore((ptrdiff_t)size);
+
+        (void)MALLOC_POSTACTION;
+
+        /* Same as for an allocation: tell the handlers if this took the heap
+           under the mark, and if it failed, try again once they've run. */
+        if(__predict_true(!lowmem_pending && rv != (void *)-1))
+            break;
+
+        if(!malloc_lowmem_run(size) || rv != (void *)-1)
+            break;
+    }
+
+    return rv;
+}
+
 /* Next KOS-specific mods are around line 1600... */
 
 /**************** No user servicable parts below ******************/
@@ -1785,6 +1953,15 @@ Void_t* public_mALLOc(size_t bytes) {
 #ifdef KM_DBG
     uint32_t rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     memctl_t * ctl;
+#else
+    uintptr_t site = arch_get_ret_addr();
+#endif
+
+#ifndef KM_DBG
+    if(tcache_limit && !lowmem_pending && (m = tcache_get(bytes))) {
+        PROF_ALLOC(m, site);
+        return m;
+    }
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -1833,6 +2010,18 @@ Void_t* public_mALLOc(size_t bytes) {
     if(MALLOC_POSTACTION != 0) {
     }
 
+#ifndef KM_DBG
+    if(__predict_false(lowmem_pending || !m) &&
+       malloc_lowmem_run(bytes) && !m) {
+        if(MALLOC_PREACTION == 0) {
+            m = mALLOc(bytes);
+            (void)MALLOC_POSTACTION;
+        }
+    }
+
+    PROF_ALLOC(m, site);
+#endif
+
     return m;
 }
 
@@ -1848,6 +2037,15 @@ void public_fREe(Void_t* m) {
     if(m == NULL)
         return;
 
+#ifndef KM_DBG
+    /* Before the block goes anywhere, so that nobody else can have been
+       handed it by the time the profiler forgets it. */
+    PROF_FREE(m);
+
+    if(tcache_limit && tcache_put(m))
+        return;
+#endif
+
     if(MALLOC_PREACTION != 0) {
         return;
     }
@@ -1921,6 +2119,8 @@ Void_t* public_rEALLOc(Void_t* m, size_t bytes) {
     uint32_t rv = arch_get_ret_addr(), rs, *nt, i;
     memctl_t * ctl;
     int dmg = 0;
+#else
+    uintptr_t site = arch_get_ret_addr();
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -1999,12 +2199,31 @@ Void_t* public_rEALLOc(Void_t* m, size_t bytes) {
     }
 
 #else
-    m = rEALLOc(m, bytes);
+    Void_t *old = m;
+
+    /* To the profiler, this is a free and then an allocation. */
+    if(old)
+        PROF_FREE(old);
+
+    m = rEALLOc(old, bytes);
 #endif
 
     if(MALLOC_POSTACTION != 0) {
     }
 
+#ifndef KM_DBG
+    if(__predict_false(lowmem_pending || (!m && bytes)) &&
+       malloc_lowmem_run(bytes) && !m && bytes) {
+        if(MALLOC_PREACTION == 0) {
+            m = rEALLOc(old, bytes);
+            (void)MALLOC_POSTACTION;
+        }
+    }
+
+    /* If it failed, the old block is still there. */
+    PROF_ALLOC(m ? m : (bytes ? old : NULL), site);
+#endif
+
     return m;
 }
 
@@ -2014,6 +2233,8 @@ Void_t* public_mEMALIGn(size_t alignment, size_t bytes) {
 #ifdef KM_DBG
     uint32_t rv = arch_get_ret_addr(), rs, *nt1, *nt2, i;
     memctl_t * ctl;
+#else
+    uintptr_t site = arch_get_ret_addr();
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -2062,6 +2283,18 @@ Void_t* public_mEMALIGn(size_t alignment, size_t bytes) {
     if(MALLOC_POSTACTION != 0) {
     }
 
+#ifndef KM_DBG
+    if(__predict_false(lowmem_pending || !m) &&
+       malloc_lowmem_run(bytes) && !m) {
+        if(MALLOC_PREACTION == 0) {
+            m = mEMALIGn(alignment, bytes);
+            (void)MALLOC_POSTACTION;
+        }
+    }
+
+    PROF_ALLOC(m, site);
+#endif
+
     return m;
 }
 
@@ -2088,6 +2321,8 @@ Void_t* public_cALLOc(size_t n, size_t elem_size) {
     uint32_t rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     size_t bytes = n * elem_size;
     memctl_t * ctl;
+#else
+    uintptr_t site = arch_get_ret_addr();
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -2136,6 +2371,18 @@ Void_t* public_cALLOc(size_t n, size_t elem_size) {
     if(MALLOC_POSTACTION != 0) {
     }
 
+#ifndef KM_DBG
+    if(__predict_false(lowmem_pending || !m) &&
+       malloc_lowmem_run(n * elem_size) && !m) {
+        if(MALLOC_PREACTION == 0) {
+            m = cALLOc(n, elem_size);
+            (void)MALLOC_POSTACTION;
+        }
+    }
+
+    PROF_ALLOC(m, site);
+#endif
+
     return m;
 }
 
@@ -2378,6 +2625,22 @@ struct mallinfo public_mALLINFo(void) {
 int public_mALLOPt(int p, int v) {
     int result;
 
+    if(p == M_THREAD_CACHE) {
+#ifndef KM_DBG
+        if(v < 0 || v > TCACHE_MAX_COUNT)
+            return 0;
+
+        tcache_limit = v;
+
+        if(!v)
+            tcache_flush_all();
+
+        return 1;
+#else
+        return 0;
+#endif
+    }
+
     if(MALLOC_PREACTION != 0) {
         return 0;
     }
@@ -5318,6 +5581,750 @@ int value;
 }
 
 
+/*
+  ---------------------- KOS per-thread caches ------------------------
+*/
+
+/*
+  Each thread that uses the heap while caching is on gets a set of
+  singly-linked lists of free chunks, one per chunk size up to the one for
+  TCACHE_MAX_REQUEST bytes, linked through their first word. The chunks on
+  them are still in use as far as the heap is concerned, so nothing else
+  ever touches them, and only the owning thread touches its lists (except
+  when the thread is gone), so the lists need no locking. When a list runs
+  dry, half a list's worth of chunks is taken from the heap under one lock,
+  and when one fills up, half of it is given back the same way.
+
+  The one exception is turning the caches off, which empties every thread's
+  cache at once. It does that holding the lock with interrupts disabled, so
+  no owner can run while its lists are emptied. An owner could have been
+  switched away from in the middle of changing its lists, though, so each
+  one marks its cache busy while it works on them. A busy cache is left
+  alone and flagged instead, and its owner empties it itself once it is done.
+
+  Interrupts never use the caches, and neither does anything before
+  threading is up.
+*/
+
+#ifndef KM_DBG
+
+#define TCACHE_BINS \
+    ((request2size(TCACHE_MAX_REQUEST) - MINSIZE) / MALLOC_ALIGNMENT + 1)
+
+#define tcache_index(sz)    (((sz) - MINSIZE) / MALLOC_ALIGNMENT)
+
+typedef struct tcache {
+    void *head[TCACHE_BINS];
+    uint8_t count[TCACHE_BINS];
+    volatile int busy;          /* The owner is working on the lists */
+    volatile int flush;         /* Empty the cache once no longer busy */
+} tcache_t;
+
+/* The calling thread's cache, if it may use one, setting it up if need be. */
+static tcache_t *tcache_self(void) {
+    tcache_t *tc;
+
+    if(irq_inside_int() || !thd_current)
+        return NULL;
+
+    if((tc = (tcache_t *)thd_current->malloc_cache))
+        return tc;
+
+    if(MALLOC_PREACTION != 0)
+        return NULL;
+
+    tc = (tcache_t *)mALLOc(sizeof(tcache_t));
+
+    (void)MALLOC_POSTACTION;
+
+    if(tc) {
+        memset(tc, 0, sizeof(tcache_t));
+        thd_current->malloc_cache = tc;
+    }
+
+    return tc;
+}
+
+/* Hand chunks back to the heap until a list is down to keep. Call with the
+   lock held. */
+static void tcache_drain(tcache_t *tc, size_t idx, unsigned int keep) {
+    void *m;
+
+    while(tc->count[idx] > keep && (m = tc->head[idx])) {
+        tc->head[idx] = *(void **)m;
+        --tc->count[idx];
+        fREe(m);
+    }
+}
+
+static void tcache_drain_all(tcache_t *tc) {
+    size_t i;
+
+    for(i = 0; i < TCACHE_BINS; ++i)
+        tcache_drain(tc, i, 0);
+}
+
+static inline void tcache_enter(tcache_t *tc) {
+    tc->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void tcache_leave(tcache_t *tc) {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    tc->busy = 0;
+
+    /* If this fails, the flag stays set and it's tried again next time. */
+    if(tc->flush && MALLOC_PREACTION == 0) {
+        tc->flush = 0;
+        tcache_drain_all(tc);
+
+        (void)MALLOC_POSTACTION;
+    }
+}
+
+static void *tcache_take(tcache_t *tc, size_t bytes) {
+    unsigned int i, n;
+    size_t idx;
+    void *m;
+
+    idx = tcache_index(request2size(bytes));
+
+    if(!tc->head[idx]) {
+        /* Fill half the list in one go. The heap can hand back a chunk a bit
+           bigger than asked for, which is fine for this list; it goes on the
+           right one when it is freed. */
+        n = (tcache_limit + 1) / 2;
+
+        if(MALLOC_PREACTION != 0)
+            return NULL;
+
+        for(i = 0; i < n && (m = mALLOc(bytes)); ++i) {
+            *(void **)m = tc->head[idx];
+            tc->head[idx] = m;
+            ++tc->count[idx];
+        }
+
+        (void)MALLOC_POSTACTION;
+
+        if(!tc->head[idx])
+            return NULL;
+    }
+
+    m = tc->head[idx];
+    tc->head[idx] = *(void **)m;
+    --tc->count[idx];
+
+    return m;
+}
+
+static void *tcache_get(size_t bytes) {
+    tcache_t *tc;
+    void *m;
+
+    if(bytes > TCACHE_MAX_REQUEST || !(tc = tcache_self()))
+        return NULL;
+
+    tcache_enter(tc);
+    m = tcache_take(tc, bytes);
+    tcache_leave(tc);
+
+    return m;
+}
+
+static int tcache_give(tcache_t *tc, void *m, size_t sz) {
+    unsigned int limit = tcache_limit;
+    size_t idx = tcache_index(sz);
+
+    if(tc->count[idx] >= limit) {
+        /* Give half the list back in one go. */
+        if(MALLOC_PREACTION != 0)
+            return 0;
+
+        tcache_drain(tc, idx, limit / 2);
+
+        (void)MALLOC_POSTACTION;
+    }
+
+    *(void **)m = tc->head[idx];
+    tc->head[idx] = m;
+    ++tc->count[idx];
+
+    return 1;
+}
+
+static int tcache_put(void *m) {
+    mchunkptr p = mem2chunk(m);
+    size_t sz = chunksize(p);
+    tcache_t *tc;
+    int rv;
+
+    if(sz > request2size(TCACHE_MAX_REQUEST) || chunk_is_mmapped(p) ||
+       !(tc = tcache_self()))
+        return 0;
+
+    tcache_enter(tc);
+    rv = tcache_give(tc, m, sz);
+    tcache_leave(tc);
+
+    return rv;
+}
+
+static int tcache_flush_thd(kthread_t *thd, void *data) {
+    tcache_t *tc = (tcache_t *)thd->malloc_cache;
+
+    (void)data;
+
+    if(!tc)
+        return 0;
+
+    if(tc->busy)
+        tc->flush = 1;
+    else
+        tcache_drain_all(tc);
+
+    return 0;
+}
+
+/* Empty every thread's cache, for turning the caches off. */
+static void tcache_flush_all(void) {
+    irq_mask_t old;
+
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    old = irq_disable();
+    thd_each(tcache_flush_thd, NULL);
+    irq_restore(old);
+
+    (void)MALLOC_POSTACTION;
+}
+
+#endif /* !KM_DBG */
+
+void malloc_thread_cache_flush(void) {
+#ifndef KM_DBG
+    tcache_t *tc;
+
+    if(irq_inside_int() || !thd_current ||
+       !(tc = (tcache_t *)thd_current->malloc_cache))
+        return;
+
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    tcache_drain_all(tc);
+
+    (void)MALLOC_POSTACTION;
+#endif
+}
+
+void malloc_thread_cache_release(struct kthread *thd) {
+#ifndef KM_DBG
+    tcache_t *tc = (tcache_t *)thd->malloc_cache;
+
+    if(!tc)
+        return;
+
+    thd->malloc_cache = NULL;
+
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    tcache_drain_all(tc);
+    fREe(tc);
+
+    (void)MALLOC_POSTACTION;
+#else
+    (void)thd;
+#endif
+}
+
+
+/*
+  -------------------------- KOS heap profiler --------------------------
+*/
+
+/*
+  While the profiler is running, every allocation and free that goes
+  through the public functions adds or takes away the size of its chunk
+  from the count of bytes in use, and one allocation in every prof_rate also
+  has its size and call site recorded. The sampled blocks go in a table
+  keyed on their address, so that when one is freed it can be taken off the
+  site that allocated it, and the sites go in another table keyed on their
+  return address. Both are open-addressed and fixed in size, and are taken
+  from the heap when the profiler starts. Samples that don't fit are
+  counted and dropped.
+
+  The thread cache paths don't take the malloc lock, so the profiler's
+  state is protected by disabling interrupts instead.
+*/
+
+#define PROF_SITE_BITS      9
+#define PROF_BLOCK_BITS     12
+#define PROF_SITES          (1 << PROF_SITE_BITS)
+#define PROF_BLOCKS         (1 << PROF_BLOCK_BITS)
+
+#define prof_hash(v, bits) \
+    (((uint32_t)(uintptr_t)(v) * 2654435761U) >> (32 - (bits)))
+
+#ifndef KM_DBG
+
+typedef struct prof_block {
+    uintptr_t ptr;                  /* 0 if the slot is free */
+    size_t size;
+    uint32_t site;
+} prof_block_t;
+
+static malloc_prof_site_t *prof_sites;
+static prof_block_t *prof_blocks;
+static size_t prof_nsites, prof_nblocks;
+static size_t prof_in_use, prof_peak;
+static size_t prof_sampled, prof_dropped;
+static unsigned int prof_countdown;
+
+/* The slot for a call site, claiming one if it is new. Returns -1 if the
+   table is too full to take another. */
+static int prof_site_index(uintptr_t addr) {
+    uint32_t i = prof_hash(addr, PROF_SITE_BITS);
+
+    for(;;) {
+        if(prof_sites[i].addr == addr)
+            return i;
+
+        if(!prof_sites[i].addr)
+            break;
+
+        i = (i + 1) & (PROF_SITES - 1);
+    }
+
+    /* Leave some room, or the probes get long. */
+    if(prof_nsites >= PROF_SITES * 3 / 4)
+        return -1;
+
+    ++prof_nsites;
+    prof_sites[i].addr = addr;
+
+    return i;
+}
+
+static void prof_alloc(void *m, uintptr_t site) {
+    size_t sz = chunksize(mem2chunk(m));
+    malloc_prof_site_t *s;
+    uint32_t i;
+    irq_mask_t old;
+    int si;
+
+    old = irq_disable();
+
+    if(!prof_blocks)
+        goto out;
+
+    prof_in_use += sz;
+
+    if(prof_in_use > prof_peak)
+        prof_peak = prof_in_use;
+
+    if(--prof_countdown)
+        goto out;
+
+    prof_countdown = prof_rate;
+    ++prof_sampled;
+
+    if(prof_nblocks >= PROF_BLOCKS * 3 / 4 ||
+       (si = prof_site_index(site)) < 0) {
+        ++prof_dropped;
+        goto out;
+    }
+
+    i = prof_hash(m, PROF_BLOCK_BITS);
+
+    while(prof_blocks[i].ptr)
+        i = (i + 1) & (PROF_BLOCKS - 1);
+
+    prof_blocks[i].ptr = (uintptr_t)m;
+    prof_blocks[i].size = sz;
+    prof_blocks[i].site = si;
+    ++prof_nblocks;
+
+    s = &prof_sites[si];
+    ++s->allocs;
+    s->bytes += sz;
+    ++s->live;
+    s->live_bytes += sz;
+
+out:
+    irq_restore(old);
+}
+
+static void prof_free(void *m) {
+    size_t sz = chunksize(mem2chunk(m));
+    malloc_prof_site_t *s;
+    uint32_t i, j, k;
+    irq_mask_t old;
+
+    old = irq_disable();
+
+    if(!prof_blocks)
+        goto out;
+
+    /* Blocks from before the profiler started are in the count too. */
+    prof_in_use = prof_in_use > sz ? prof_in_use - sz : 0;
+
+    for(i = prof_hash(m, PROF_BLOCK_BITS); prof_blocks[i].ptr;
+        i = (i + 1) & (PROF_BLOCKS - 1)) {
+        if(prof_blocks[i].ptr == (uintptr_t)m)
+            break;
+    }
+
+    if(!prof_blocks[i].ptr)
+        goto out;
+
+    s = &prof_sites[prof_blocks[i].site];
+    --s->live;
+    s->live_bytes -= prof_blocks[i].size;
+    --prof_nblocks;
+
+    /* Close the gap, moving up anything later in the run that can't be
+       found from its home slot past an empty one. */
+    for(j = i;;) {
+        j = (j + 1) & (PROF_BLOCKS - 1);
+
+        if(!prof_blocks[j].ptr)
+            break;
+
+        k = prof_hash(prof_blocks[j].ptr, PROF_BLOCK_BITS);
+
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        prof_blocks[i] = prof_blocks[j];
+        i = j;
+    }
+
+    prof_blocks[i].ptr = 0;
+
+out:
+    irq_restore(old);
+}
+
+static int prof_site_cmp(const void *a, const void *b) {
+    const malloc_prof_site_t *sa = (const malloc_prof_site_t *)a;
+    const malloc_prof_site_t *sb = (const malloc_prof_site_t *)b;
+
+    if(sa->live_bytes != sb->live_bytes)
+        return sa->live_bytes < sb->live_bytes ? 1 : -1;
+
+    if(sa->bytes != sb->bytes)
+        return sa->bytes < sb->bytes ? 1 : -1;
+
+    return 0;
+}
+
+/* Print to a file, or over dbgio if there isn't one. */
+static void prof_printf(FILE *f, const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+
+    va_start(ap, fmt);
+
+    if(f) {
+        vfprintf(f, fmt, ap);
+    }
+    else {
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        dbgio_write_str(buf);
+    }
+
+    va_end(ap);
+}
+
+#endif /* !KM_DBG */
+
+int malloc_prof_start(unsigned int rate) {
+#ifndef KM_DBG
+    malloc_prof_site_t *sites;
+    prof_block_t *blocks;
+    struct mallinfo mi;
+    irq_mask_t old;
+
+    if(!rate) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Already running, so just change how often it samples. */
+    if(prof_rate) {
+        old = irq_disable();
+        prof_rate = rate;
+
+        if(prof_countdown > rate)
+            prof_countdown = rate;
+
+        irq_restore(old);
+        return 0;
+    }
+
+    if(MALLOC_PREACTION != 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    sites = (malloc_prof_site_t *)mALLOc(PROF_SITES * sizeof(*sites));
+    blocks = (prof_block_t *)mALLOc(PROF_BLOCKS * sizeof(*blocks));
+
+    if(!sites || !blocks) {
+        if(sites)
+            fREe(sites);
+
+        if(blocks)
+            fREe(blocks);
+
+        (void)MALLOC_POSTACTION;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(sites, 0, PROF_SITES * sizeof(*sites));
+    memset(blocks, 0, PROF_BLOCKS * sizeof(*blocks));
+    mi = mALLINFo();
+
+    old = irq_disable();
+    prof_sites = sites;
+    prof_blocks = blocks;
+    prof_nsites = prof_nblocks = 0;
+    prof_sampled = prof_dropped = 0;
+    prof_in_use = prof_peak = mi.uordblks;
+    prof_countdown = rate;
+    prof_rate = rate;
+    irq_restore(old);
+
+    (void)MALLOC_POSTACTION;
+
+    return 0;
+#else
+    (void)rate;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void malloc_prof_stop(void) {
+#ifndef KM_DBG
+    malloc_prof_site_t *sites;
+    prof_block_t *blocks;
+    irq_mask_t old;
+
+    old = irq_disable();
+    prof_rate = 0;
+    sites = prof_sites;
+    blocks = prof_blocks;
+    prof_sites = NULL;
+    prof_blocks = NULL;
+    irq_restore(old);
+
+    if(!sites || MALLOC_PREACTION != 0)
+        return;
+
+    fREe(sites);
+    fREe(blocks);
+
+    (void)MALLOC_POSTACTION;
+#endif
+}
+
+/* Add a free chunk to the fragmentation report. */
+static void prof_count_free(malloc_prof_stats_t *st, size_t sz) {
+    size_t i;
+
+    ++st->free_chunks;
+    st->free_bytes += sz;
+
+    if(sz > st->largest_free)
+        st->largest_free = sz;
+
+    for(i = 0; i < MALLOC_PROF_HIST - 1 && sz >= (32U << i); ++i)
+        ;
+
+    ++st->free_hist[i];
+}
+
+void malloc_prof_get_stats(malloc_prof_stats_t *st) {
+    mstate av = get_malloc_state();
+    unsigned int i;
+    mbinptr b;
+    mchunkptr p;
+#ifndef KM_DBG
+    irq_mask_t old;
+#endif
+
+    memset(st, 0, sizeof(*st));
+
+#ifndef KM_DBG
+    old = irq_disable();
+
+    if(prof_blocks) {
+        st->rate = prof_rate;
+        st->in_use = prof_in_use;
+        st->peak = prof_peak;
+        st->sampled = prof_sampled;
+        st->dropped = prof_dropped;
+        st->sites = prof_nsites;
+    }
+
+    irq_restore(old);
+#endif
+
+    /* Now the free space, walking the bins like mallinfo() does. */
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    if(av->top == 0)
+        malloc_consolidate(av);
+
+    st->heap_size = av->sbrked_mem;
+    st->top_free = chunksize(av->top);
+
+    for(i = 0; i < NFASTBINS; ++i) {
+        for(p = av->fastbins[i]; p != 0; p = p->fd)
+            prof_count_free(st, chunksize(p));
+    }
+
+    for(i = 1; i < NBINS; ++i) {
+        b = bin_at(av, i);
+
+        for(p = last(b); p != b; p = p->bk)
+            prof_count_free(st, chunksize(p));
+    }
+
+    (void)MALLOC_POSTACTION;
+}
+
+size_t malloc_prof_get_sites(malloc_prof_site_t *sites, size_t max) {
+#ifndef KM_DBG
+    malloc_prof_site_t *buf = sites;
+    size_t i, n = 0;
+    irq_mask_t old;
+
+    /* Everything has to be sorted to find the biggest, so if there isn't
+       room for all of them, sort a copy. */
+    if(max < PROF_SITES &&
+       !(buf = (malloc_prof_site_t *)malloc(PROF_SITES * sizeof(*buf))))
+        return 0;
+
+    old = irq_disable();
+
+    if(prof_sites) {
+        for(i = 0; i < PROF_SITES; ++i) {
+            if(prof_sites[i].addr)
+                buf[n++] = prof_sites[i];
+        }
+    }
+
+    irq_restore(old);
+
+    qsort(buf, n, sizeof(*buf), prof_site_cmp);
+
+    if(buf != sites) {
+        if(n > max)
+            n = max;
+
+        memcpy(sites, buf, n * sizeof(*buf));
+        free(buf);
+    }
+
+    return n;
+#else
+    (void)sites;
+    (void)max;
+    return 0;
+#endif
+}
+
+int malloc_prof_dump(const char *fn) {
+#ifndef KM_DBG
+    malloc_prof_stats_t st;
+    malloc_prof_site_t *sites;
+    export_sym_t *sym;
+    size_t n, i, total, biggest;
+    unsigned int rate;
+    FILE *f = NULL;
+
+    if(fn && !(f = fopen(fn, "w")))
+        return -1;
+
+    sites = (malloc_prof_site_t *)malloc(PROF_SITES * sizeof(*sites));
+    n = sites ? malloc_prof_get_sites(sites, PROF_SITES) : 0;
+    malloc_prof_get_stats(&st);
+    rate = st.rate ? st.rate : 1;
+
+    prof_printf(f, "heap profile: %lu bytes in use, %lu at most, "
+                "%lu bytes of heap\n", (unsigned long)st.in_use,
+                (unsigned long)st.peak, (unsigned long)st.heap_size);
+    prof_printf(f, "  1 in %u allocations sampled, %lu samples, "
+                "%lu dropped, %lu sites\n", rate, (unsigned long)st.sampled,
+                (unsigned long)st.dropped, (unsigned long)st.sites);
+
+    /* How much of the free space can't be had in one piece. */
+    total = st.free_bytes + st.top_free;
+    biggest = st.largest_free > st.top_free ? st.largest_free : st.top_free;
+
+    prof_printf(f, "free: %lu bytes in %lu chunks, largest %lu, "
+                "%lu more at the top, %lu%% fragmented\n",
+                (unsigned long)st.free_bytes, (unsigned long)st.free_chunks,
+                (unsigned long)st.largest_free, (unsigned long)st.top_free,
+                total ? (unsigned long)(100 - (uint64_t)biggest * 100 / total) :
+                0UL);
+
+    for(i = 0; i < MALLOC_PROF_HIST; ++i) {
+        if(!st.free_hist[i])
+            continue;
+
+        if(i == 0)
+            prof_printf(f, "  %6s-%-6lu %lu\n", "", 31UL,
+                        (unsigned long)st.free_hist[i]);
+        else if(i == MALLOC_PROF_HIST - 1)
+            prof_printf(f, "  %6lu-%-6s %lu\n", 16UL << i, "",
+                        (unsigned long)st.free_hist[i]);
+        else
+            prof_printf(f, "  %6lu-%-6lu %lu\n", 16UL << i,
+                        (32UL << i) - 1, (unsigned long)st.free_hist[i]);
+    }
+
+    /* And the sites, most memory held first, scaled up by the rate to
+       estimate the real numbers. */
+    if(n)
+        prof_printf(f, "%10s %10s %8s %10s  %s\n", "live bytes",
+                    "live", "allocs", "bytes", "site");
+
+    for(i = 0; i < n; ++i) {
+        prof_printf(f, "%10lu %10lu %8lu %10lu %08lx",
+                    (unsigned long)(sites[i].live_bytes * rate),
+                    (unsigned long)(sites[i].live * rate),
+                    (unsigned long)(sites[i].allocs * rate),
+                    (unsigned long)(sites[i].bytes * rate),
+                    (unsigned long)sites[i].addr);
+
+        if((sym = export_lookup_addr(sites[i].addr)))
+            prof_printf(f, "  %s+0x%lx\n", sym->name,
+                        (unsigned long)(sites[i].addr - sym->ptr));
+        else
+            prof_printf(f, "\n");
+    }
+
+    free(sites);
+
+    if(f)
+        fclose(f);
+
+    return 0;
+#else
+    (void)fn;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
 /*
   -------------------- Alternative MORECORE functions --------------------
 */
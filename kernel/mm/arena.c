@@ -0,0 +1,105 @@
+/* KallistiOS ##version##
+
+   kernel/mm/arena.c
+
+*/
+
+/* Arena allocator.
+
+   An arena is just a block and how much of it has been handed out, so the
+   allocation itself is inline in the header. What's here is setting arenas
+   up and tearing them down, and the things that don't need to be fast.
+
+   The high-water mark isn't kept up to date on every allocation, to keep
+   that path short. Nothing is ever thrown away except by arena_release() and
+   arena_reset(), so it only needs catching up with before those. */
+
+#include <kos/arena.h>
+
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+
+static void arena_setup(arena_t *a, void *buf, size_t size, int owned) {
+    a->base = (uint8_t *)buf;
+    a->size = size;
+    a->used = 0;
+    a->peak = 0;
+    a->failed = 0;
+    a->owned = owned;
+}
+
+int arena_init(arena_t *a, void *buf, size_t size) {
+    int owned = 0;
+
+    if(!buf) {
+        if(!(buf = memalign(32, size))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        owned = 1;
+    }
+
+    arena_setup(a, buf, size, owned);
+
+    return 0;
+}
+
+int arena_init_sbrk(arena_t *a, size_t size) {
+    void *base;
+
+    /* Line the block up on a cache line, since whatever the heap left at the
+       top could be anywhere. Ask for the slack up front, rather than looking
+       at sbrk(0) first, so that nobody can move the top in between. This
+       goes through the heap, so that the low memory handlers hear about it. */
+    if(size > SIZE_MAX - 31 ||
+       (base = malloc_morecore(size + 31)) == (void *)-1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    arena_setup(a, (void *)(((uintptr_t)base + 31) & ~(uintptr_t)31), size, 0);
+
+    return 0;
+}
+
+void arena_destroy(arena_t *a) {
+    if(a->owned)
+        free(a->base);
+
+    arena_setup(a, NULL, 0, 0);
+}
+
+void *arena_alloc_failed(arena_t *a) {
+    ++a->failed;
+    errno = ENOMEM;
+
+    return NULL;
+}
+
+char *arena_strdup(arena_t *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *rv;
+
+    if((rv = (char *)arena_alloc_aligned(a, len, 1)))
+        memcpy(rv, s, len);
+
+    return rv;
+}
+
+void arena_release(arena_t *a, arena_mark_t mark) {
+    if(a->used > a->peak)
+        a->peak = a->used;
+
+    if(mark < a->used)
+        a->used = mark;
+}
+
+void arena_reset(arena_t *a) {
+    arena_release(a, 0);
+}
+
+size_t arena_peak(const arena_t *a) {
+    return a->used > a->peak ? a->used : a->peak;
+}
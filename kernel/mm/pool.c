@@ -0,0 +1,437 @@
+/* KallistiOS ##version##
+
+   kernel/mm/pool.c
+
+*/
+
+/* Fixed-size object pools.
+
+   A slab is a block from the heap with a header at the front and a row of
+   slots after it. Each slot is a word followed by an object. While the object
+   is allocated, the word points back at its slab, so that pool_free() can
+   find it; while it is free, the word links the slot onto the slab's list of
+   free slots. The object itself is never touched by the pool, so it stays in
+   whatever state its constructor (or its last user) left it.
+
+   Each slab is on one of three lists of the pool: the ones with some objects
+   free, the ones with none free and the ones with all free. Allocation takes
+   from a partly used slab when there is one, so that objects get packed into
+   as few slabs as possible and the empty ones can be given back. Slabs are
+   allocated, constructed, destroyed and freed with the pool unlocked, since
+   the constructor and destructor may need to block. */
+
+#include <kos/pool.h>
+#include <kos/dbglog.h>
+#include <arch/irq.h>
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* How big to try to make a slab, and the fewest objects in one. */
+#define POOL_SLAB_BYTES     4096
+#define POOL_SLAB_MIN       4
+
+/* Empty slabs a pool keeps (beyond what is reserved) before giving them back
+   to the heap, so that a pool that goes back and forth across the end of a
+   slab doesn't allocate and free it every time. */
+#define POOL_KEEP_EMPTY     1
+
+typedef struct pool_slab {
+    LIST_ENTRY(pool_slab) list;
+    pool_t *pool;
+    uint8_t *free;
+    size_t nfree;
+} pool_slab_t;
+
+#define ALIGN_UP(n, a)  (((n) + (a) - 1) & ~((a) - 1))
+
+#define SLAB_HDR_SIZE(p) \
+    ALIGN_UP(sizeof(pool_slab_t), (p)->obj_off)
+
+/* Every pool there is, for pool_print_stats() and the low memory handler. */
+static LIST_HEAD(, pool) pools = LIST_HEAD_INITIALIZER(pools);
+static mutex_t pools_lock = MUTEX_INITIALIZER;
+static int lowmem_registered;
+
+static int pool_lock(pool_t *p, irq_mask_t *old) {
+    if(p->flags & POOL_IRQ) {
+        *old = irq_disable();
+        return 0;
+    }
+
+    return mutex_lock(&p->lock);
+}
+
+static void pool_unlock(pool_t *p, irq_mask_t old) {
+    if(p->flags & POOL_IRQ)
+        irq_restore(old);
+    else
+        mutex_unlock(&p->lock);
+}
+
+/* Allocate a slab and construct its objects. This is done with the pool
+   unlocked. */
+static pool_slab_t *slab_new(pool_t *p) {
+    size_t align = p->obj_off > 8 ? p->obj_off : 8;
+    size_t i, slot = p->stats.slot_size;
+    pool_slab_t *s;
+    uint8_t *pos;
+
+    /* Interrupted code might be in the middle of using the heap. */
+    if(irq_inside_int() && !malloc_irq_safe())
+        return NULL;
+
+    if(!(s = (pool_slab_t *)memalign(align, p->slab_size)))
+        return NULL;
+
+    s->pool = p;
+    s->free = NULL;
+    s->nfree = p->stats.per_slab;
+
+    /* Link the slots up backwards, so the first one is handed out first. */
+    pos = (uint8_t *)s + SLAB_HDR_SIZE(p) + (p->stats.per_slab - 1) * slot;
+
+    for(i = 0; i < p->stats.per_slab; ++i, pos -= slot) {
+        if(p->ctor)
+            p->ctor(pos + p->obj_off, p->data);
+
+        *(uint8_t **)pos = s->free;
+        s->free = pos;
+    }
+
+    return s;
+}
+
+/* Destroy a slab's objects and give it back to the heap. This is done with
+   the pool unlocked, and the slab off of all of its lists. */
+static void slab_free(pool_t *p, pool_slab_t *s) {
+    uint8_t *pos = (uint8_t *)s + SLAB_HDR_SIZE(p);
+    size_t i;
+
+    if(p->dtor) {
+        for(i = 0; i < p->stats.per_slab; ++i, pos += p->stats.slot_size)
+            p->dtor(pos + p->obj_off, p->data);
+    }
+
+    free(s);
+}
+
+/* Account for a new slab and put it on the empty list. Call with the pool
+   locked. */
+static void slab_add(pool_t *p, pool_slab_t *s) {
+    LIST_INSERT_HEAD(&p->empty, s, list);
+    ++p->nempty;
+    ++p->stats.slabs;
+    ++p->stats.grows;
+    p->stats.slab_bytes += p->slab_size;
+    p->stats.objs += p->stats.per_slab;
+}
+
+/* Take a slab off of the empty list to be freed. Call with the pool locked. */
+static void slab_remove(pool_t *p, pool_slab_t *s) {
+    LIST_REMOVE(s, list);
+    --p->nempty;
+    --p->stats.slabs;
+    ++p->stats.shrinks;
+    p->stats.slab_bytes -= p->slab_size;
+    p->stats.objs -= p->stats.per_slab;
+}
+
+static void pool_lowmem(size_t want, void *data) {
+    pool_t *p;
+
+    (void)want;
+    (void)data;
+
+    if(mutex_trylock(&pools_lock))
+        return;
+
+    LIST_FOREACH(p, &pools, list)
+        pool_shrink(p);
+
+    mutex_unlock(&pools_lock);
+}
+
+int pool_init(pool_t *p, const char *name, size_t size, size_t align,
+              pool_ctor_t ctor, pool_ctor_t dtor, void *data, int flags) {
+    size_t hdr, n;
+
+    if(!align)
+        align = 8;
+
+    if(!size || (align & (align - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(p, 0, sizeof(pool_t));
+
+    /* The object goes after the word at the start of its slot, aligned. */
+    if(align < sizeof(void *))
+        align = sizeof(void *);
+
+    p->obj_off = ALIGN_UP(sizeof(void *), align);
+    p->stats.slot_size = ALIGN_UP(p->obj_off + size, align);
+
+    /* Fit as many as will go in a slab of the usual size, but not too few. */
+    hdr = SLAB_HDR_SIZE(p);
+    n = (POOL_SLAB_BYTES - hdr) / p->stats.slot_size;
+
+    if(n < POOL_SLAB_MIN)
+        n = POOL_SLAB_MIN;
+
+    p->slab_size = hdr + n * p->stats.slot_size;
+    p->stats.name = name;
+    p->stats.obj_size = size;
+    p->stats.per_slab = n;
+    p->flags = flags;
+    p->ctor = ctor;
+    p->dtor = dtor;
+    p->data = data;
+
+    LIST_INIT(&p->partial);
+    LIST_INIT(&p->full);
+    LIST_INIT(&p->empty);
+    mutex_init(&p->lock, MUTEX_TYPE_NORMAL);
+
+    mutex_lock(&pools_lock);
+
+    LIST_INSERT_HEAD(&pools, p, list);
+
+    if(!lowmem_registered && !malloc_lowmem_register(pool_lowmem, NULL))
+        lowmem_registered = 1;
+
+    mutex_unlock(&pools_lock);
+
+    return 0;
+}
+
+void pool_destroy(pool_t *p) {
+    struct pool_slab_list *lists[3] = { &p->partial, &p->full, &p->empty };
+    pool_slab_t *s;
+    int i;
+
+    mutex_lock(&pools_lock);
+    LIST_REMOVE(p, list);
+    mutex_unlock(&pools_lock);
+
+    if(p->stats.in_use)
+        dbglog(DBG_WARNING, "pool_destroy: %s still has %u objects in use\n",
+               p->stats.name ? p->stats.name : "pool",
+               (unsigned int)p->stats.in_use);
+
+    for(i = 0; i < 3; ++i) {
+        while((s = LIST_FIRST(lists[i]))) {
+            LIST_REMOVE(s, list);
+            slab_free(p, s);
+        }
+    }
+
+    mutex_destroy(&p->lock);
+}
+
+void *pool_alloc(pool_t *p) {
+    pool_slab_t *s;
+    irq_mask_t old;
+    uint8_t *slot;
+
+    if(pool_lock(p, &old)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ++p->stats.allocs;
+
+    while(!(s = LIST_FIRST(&p->partial))) {
+        if((s = LIST_FIRST(&p->empty))) {
+            /* It won't be empty in a moment. */
+            LIST_REMOVE(s, list);
+            LIST_INSERT_HEAD(&p->partial, s, list);
+            --p->nempty;
+            break;
+        }
+
+        pool_unlock(p, old);
+        s = slab_new(p);
+
+        if(pool_lock(p, &old)) {
+            if(s)
+                slab_free(p, s);
+
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        if(!s) {
+            ++p->stats.failed;
+            pool_unlock(p, old);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        /* Someone else may have freed something while we were out, but there's
+           no harm in having the slab anyway. */
+        slab_add(p, s);
+    }
+
+    slot = s->free;
+    s->free = *(uint8_t **)slot;
+    *(pool_slab_t **)slot = s;
+
+    if(!--s->nfree) {
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&p->full, s, list);
+    }
+
+    if(++p->stats.in_use > p->stats.peak)
+        p->stats.peak = p->stats.in_use;
+
+    pool_unlock(p, old);
+
+    return slot + p->obj_off;
+}
+
+void pool_free(pool_t *p, void *obj) {
+    pool_slab_t *s, *dead = NULL;
+    irq_mask_t old;
+    uint8_t *slot;
+
+    if(!obj)
+        return;
+
+    slot = (uint8_t *)obj - p->obj_off;
+    s = *(pool_slab_t **)slot;
+
+    assert(s->pool == p);
+
+    if(pool_lock(p, &old))
+        return;
+
+    ++p->stats.frees;
+    --p->stats.in_use;
+
+    *(uint8_t **)slot = s->free;
+    s->free = slot;
+
+    if(++s->nfree == p->stats.per_slab) {
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&p->empty, s, list);
+        ++p->nempty;
+
+        /* Freeing to the heap from an interrupt isn't safe, so leave it for
+           later if we're in one. */
+        if(p->nempty > POOL_KEEP_EMPTY && p->stats.slabs > p->reserve &&
+           !irq_inside_int()) {
+            slab_remove(p, s);
+            dead = s;
+        }
+    }
+    else if(s->nfree == 1) {
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&p->partial, s, list);
+    }
+
+    pool_unlock(p, old);
+
+    if(dead)
+        slab_free(p, dead);
+}
+
+int pool_reserve(pool_t *p, size_t count) {
+    size_t slabs = (count + p->stats.per_slab - 1) / p->stats.per_slab;
+    pool_slab_t *s;
+    irq_mask_t old;
+
+    if(pool_lock(p, &old))
+        return -1;
+
+    p->reserve = slabs;
+
+    while(p->stats.slabs < slabs) {
+        pool_unlock(p, old);
+
+        if(!(s = slab_new(p))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if(pool_lock(p, &old)) {
+            slab_free(p, s);
+            return -1;
+        }
+
+        slab_add(p, s);
+    }
+
+    pool_unlock(p, old);
+
+    return 0;
+}
+
+size_t pool_shrink(pool_t *p) {
+    size_t rv = 0;
+    pool_slab_t *s;
+    irq_mask_t old;
+
+    if(irq_inside_int())
+        return 0;
+
+    for(;;) {
+        if(pool_lock(p, &old))
+            break;
+
+        if(p->stats.slabs <= p->reserve || !(s = LIST_FIRST(&p->empty))) {
+            pool_unlock(p, old);
+            break;
+        }
+
+        slab_remove(p, s);
+        pool_unlock(p, old);
+
+        slab_free(p, s);
+        rv += p->slab_size;
+    }
+
+    return rv;
+}
+
+void pool_get_stats(pool_t *p, pool_stats_t *st) {
+    irq_mask_t old;
+
+    if(pool_lock(p, &old)) {
+        *st = p->stats;
+        return;
+    }
+
+    *st = p->stats;
+    pool_unlock(p, old);
+}
+
+int pool_print_stats(int (*pf)(const char *fmt, ...)) {
+    pool_stats_t st;
+    pool_t *p;
+
+    if(mutex_lock(&pools_lock))
+        return -1;
+
+    pf("NAME                 SIZE SLAB SLABS  IN USE  OBJS  PEAK   BYTES  USED\n");
+
+    LIST_FOREACH(p, &pools, list) {
+        pool_get_stats(p, &st);
+
+        pf("%-20s %4u %4u %5u %7u %5u %5u %7u %4u%%\n",
+           st.name ? st.name : "?", (unsigned int)st.obj_size,
+           (unsigned int)st.per_slab, (unsigned int)st.slabs,
+           (unsigned int)st.in_use, (unsigned int)st.objs,
+           (unsigned int)st.peak, (unsigned int)st.slab_bytes,
+           st.slab_bytes ? (unsigned int)(st.in_use * st.obj_size * 100 /
+                                          st.slab_bytes) : 0);
+    }
+
+    mutex_unlock(&pools_lock);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_cksum.c
+
+*/
+
+/* The Internet checksum, as used by IPv4, ICMP, UDP and TCP. These are kept
+   apart from the rest of net_ipv4.c so that they don't depend on anything else
+   in KOS, which lets utils/nettest build them on the host. */
+
+#include <string.h>
+
+#include "net_cksum.h"
+
+/* Fold a sum back down to 16 bits, adding the carries back in. */
+static inline uint32_t checksum_fold64(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint32_t)sum;
+}
+
+/* Add up a block of data the way the IP checksum does. Since the one's
+   complement sum of 16-bit words comes out the same when it is done 32 bits at
+   a time, as long as the carries are added back in at the end, the words are
+   loaded 32 bits at a time into a 64-bit accumulator and the carries are only
+   folded in once, on the way out. */
+uint32_t __pure net_ipv4_checksum_partial(const uint8_t *data, size_t bytes,
+                                          uint32_t sum) {
+    uint64_t acc = sum;
+    const uint32_t *ptr;
+    uint16_t w;
+
+    if(((uintptr_t)data) & 0x01) {
+        /* The words aren't aligned, so let the compiler put each one together
+           from its bytes rather than doing unaligned memory accesses. */
+        while(bytes > 1) {
+            memcpy(&w, data, 2);
+            acc += w;
+            data += 2;
+            bytes -= 2;
+        }
+    }
+    else {
+        if((((uintptr_t)data) & 0x02) && bytes > 1) {
+            acc += *(const uint16_t *)data;
+            data += 2;
+            bytes -= 2;
+        }
+
+        ptr = (const uint32_t *)data;
+
+        while(bytes >= 16) {
+            acc += ptr[0];
+            acc += ptr[1];
+            acc += ptr[2];
+            acc += ptr[3];
+            ptr += 4;
+            bytes -= 16;
+        }
+
+        while(bytes >= 4) {
+            acc += *ptr++;
+            bytes -= 4;
+        }
+
+        data = (const uint8_t *)ptr;
+
+        if(bytes > 1) {
+            acc += *(const uint16_t *)data;
+            data += 2;
+            bytes -= 2;
+        }
+    }
+
+    /* Handle the last byte, if we have an odd byte count. It is padded out to a
+       word with a zero byte after it. */
+    if(bytes) {
+        w = 0;
+        memcpy(&w, data, 1);
+        acc += w;
+    }
+
+    return checksum_fold64(acc);
+}
+
+/* Copy a block of data, adding it up along the way, so that it only has to be
+   read once. */
+uint32_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint32_t sum) {
+    uint64_t acc = sum;
+    const uint32_t *s;
+    uint32_t *d, a, b;
+    uint16_t w;
+
+    /* Word at a time copying needs the two to line up with each other. */
+    if((((uintptr_t)dst ^ (uintptr_t)src) & 0x03) ||
+       (((uintptr_t)src) & 0x01)) {
+        memcpy(dst, src, bytes);
+        return net_ipv4_checksum_partial(dst, bytes, sum);
+    }
+
+    if((((uintptr_t)src) & 0x02) && bytes > 1) {
+        w = *(const uint16_t *)src;
+        *(uint16_t *)dst = w;
+        acc += w;
+        src += 2;
+        dst += 2;
+        bytes -= 2;
+    }
+
+    s = (const uint32_t *)src;
+    d = (uint32_t *)dst;
+
+    while(bytes >= 8) {
+        a = s[0];
+        b = s[1];
+        d[0] = a;
+        d[1] = b;
+        acc += a;
+        acc += b;
+        s += 2;
+        d += 2;
+        bytes -= 8;
+    }
+
+    if(bytes >= 4) {
+        a = *s++;
+        *d++ = a;
+        acc += a;
+        bytes -= 4;
+    }
+
+    src = (const uint8_t *)s;
+    dst = (uint8_t *)d;
+
+    if(bytes > 1) {
+        w = *(const uint16_t *)src;
+        *(uint16_t *)dst = w;
+        acc += w;
+        src += 2;
+        dst += 2;
+        bytes -= 2;
+    }
+
+    if(bytes) {
+        w = 0;
+        *dst = *src;
+        memcpy(&w, src, 1);
+        acc += w;
+    }
+
+    return checksum_fold64(acc);
+}
+
+uint16_t __pure net_ipv4_checksum_fold(uint32_t sum) {
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+/* Perform an IP-style checksum on a block of data */
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start) {
+    return net_ipv4_checksum_fold(net_ipv4_checksum_partial(data, bytes, start));
+}
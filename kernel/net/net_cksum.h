@@ -0,0 +1,37 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_cksum.h
+
+*/
+
+#ifndef __LOCAL_NET_CKSUM_H
+#define __LOCAL_NET_CKSUM_H
+
+#include <kos/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
+
+/* Checksums of packets that are put together a piece at a time. A partial sum
+   is the one's complement sum of a piece of data, folded to 16 bits but not
+   inverted, taking the piece to start at an even offset into the packet. They
+   can be added together with net_ipv4_checksum_add(), and the total is turned
+   into the value for the checksum field with net_ipv4_checksum_fold(). */
+uint32_t __pure net_ipv4_checksum_partial(const uint8_t *data, size_t bytes,
+                                          uint32_t sum);
+uint32_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint32_t sum);
+uint16_t __pure net_ipv4_checksum_fold(uint32_t sum);
+
+/* Add the partial sum of a piece that starts off bytes into the packet. A
+   piece at an odd offset has its bytes in the other halves of the words. */
+static inline uint32_t net_ipv4_checksum_add(uint32_t sum, uint32_t part,
+                                             size_t off) {
+    if(off & 1)
+        part = ((part & 0xFF) << 8) | (part >> 8);
+
+    return sum + part;
+}
+
+#endif /* __LOCAL_NET_CKSUM_H */
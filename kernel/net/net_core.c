@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <arpa/inet.h>
 
 #include <kos/net.h>
 #include <kos/fs_socket.h>
@@ -19,6 +20,10 @@
 #include "net_thd.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_pbuf.h"
+#include "net_loop.h"
+#include "net_neigh.h"
+#include "net_frag.h"
 
 /*
 
@@ -110,6 +115,59 @@ netif_t *net_set_default(netif_t *n) {
     return olddev;
 }
 
+/* Is an address on a device's network? */
+static int on_network(const netif_t *dev, const uint8_t ip[4]) {
+    int i;
+
+    if(!(dev->flags & NETIF_RUNNING) || (dev->flags & NETIF_LOOPBACK) ||
+       !dev->netmask[0])
+        return 0;
+
+    for(i = 0; i < 4; ++i) {
+        if((ip[i] & dev->netmask[i]) != (dev->ip_addr[i] & dev->netmask[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Pick the device to send to an address through */
+netif_t *net_route(const struct in6_addr *dst) {
+    netif_t *cur;
+    uint8_t ip[4];
+    int ours = 0;
+
+    if(IN6_IS_ADDR_LOOPBACK(dst))
+        return net_loopback_dev;
+
+    if(!IN6_IS_ADDR_V4MAPPED(dst))
+        return net_default_dev;
+
+    net_ipv4_parse_address(ntohl(dst->__s6_addr.__s6_addr32[3]), ip);
+
+    if(ip[0] == 127)
+        return net_loopback_dev;
+
+    /* Prefer the default device, if the address is on its network. */
+    if(net_default_dev && on_network(net_default_dev, ip) &&
+       memcmp(net_default_dev->ip_addr, ip, 4))
+        return net_default_dev;
+
+    LIST_FOREACH(cur, &net_if_list, if_list) {
+        /* Sending to a device's own address through it would only go out
+           onto the network, so look for another way there. */
+        if(!memcmp(cur->ip_addr, ip, 4)) {
+            ours = 1;
+            continue;
+        }
+
+        if(on_network(cur, ip))
+            return cur;
+    }
+
+    return ours ? net_loopback_dev : net_default_dev;
+}
+
 /* Device detect / init */
 int net_dev_init(void) {
     int detected = 0;
@@ -130,13 +188,17 @@ int net_dev_init(void) {
             continue;
         }
 
-        /* Set the first detected device to be the default */
-        if(net_default_dev == NULL)
+        /* Set the first detected device to be the default, leaving the
+           loopback device for if there are no others. */
+        if(net_default_dev == NULL && !(cur->flags & NETIF_LOOPBACK))
             net_set_default(cur);
 
         detected++;
     }
 
+    if(net_default_dev == NULL)
+        net_set_default(net_loopback_dev);
+
     dbglog(DBG_DEBUG, "net_dev_init: detected %d usable network device(s)\n", detected);
 
     if(detected)
@@ -153,12 +215,21 @@ int net_init(uint32_t ip) {
     if(net_initted)
         return 0;
 
+    /* Initialize the packet buffer pool */
+    net_pbuf_init();
+
+    /* Initialize the network thread. */
+    net_thd_init();
+
+    /* Register the loopback device, so that it's started with the rest */
+    net_loop_init();
+
     /* Detect and potentially initialize devices */
     if(net_dev_init() < 0)
         return -1;
 
-    /* Initialize the network thread. */
-    net_thd_init();
+    /* Initialize the neighbor table that ARP and NDP keep their caches in */
+    net_neigh_init();
 
     /* Initialize the ARP cache */
     net_arp_init();
@@ -166,8 +237,8 @@ int net_init(uint32_t ip) {
     /* Initialize the NDP cache */
     net_ndp_init();
 
-    /* Initialize IPv4 fragmentation support */
-    net_ipv4_frag_init();
+    /* Initialize fragment reassembly for IPv4 and IPv6 */
+    net_frag_init();
 
     /* Initialize multicast support */
     net_multicast_init();
@@ -239,8 +310,8 @@ void net_shutdown(void) {
     /* Shut down multicast support */
     net_multicast_shutdown();
 
-    /* Shut down IPv4 fragmentation support */
-    net_ipv4_frag_shutdown();
+    /* Shut down fragment reassembly */
+    net_frag_shutdown();
 
     /* Shut down the NDP cache */
     net_ndp_shutdown();
@@ -248,9 +319,18 @@ void net_shutdown(void) {
     /* Shut down the ARP cache */
     net_arp_shutdown();
 
+    /* Shut down the neighbor table */
+    net_neigh_shutdown();
+
+    /* Get rid of any pipes */
+    net_loop_shutdown();
+
     /* Shut down the network thread */
     net_thd_shutdown();
 
+    /* Free the packet buffer pool */
+    net_pbuf_shutdown();
+
     /* Shut down all activated network devices */
     LIST_FOREACH(cur, &net_if_list, if_list) {
         if(cur->flags & NETIF_RUNNING && cur->if_stop)
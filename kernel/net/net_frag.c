@@ -0,0 +1,357 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_frag.c
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <kos/timer.h>
+
+#include "net_frag.h"
+#include "net_thd.h"
+
+/* Fragment reassembly.
+
+   Each datagram being put back together has one buffer that its fragments
+   are copied straight into. Once the last fragment has arrived, the length of
+   the datagram is known and the buffer is made exactly that big. Until then,
+   it doubles in size whenever a fragment doesn't fit, so a datagram that
+   arrives in order is only moved a few times, rather than once per fragment.
+   What has arrived is kept as a short list of ranges, rather than a bit per
+   8 bytes of the largest datagram there could be.
+
+   Datagrams are found by hashing what identifies them. All of them together
+   are only allowed to use so much memory, and when more is needed, the oldest
+   ones are thrown out first, since they're the ones that are least likely to
+   ever be finished. Datagrams that aren't finished in time are thrown out
+   from the network thread, which is only woken up for it when one is due. */
+
+#define FRAG_HASH_BITS  5
+#define FRAG_HASH_SIZE  (1 << FRAG_HASH_BITS)
+
+/* Most memory used by all of the datagrams being put back together. */
+#define FRAG_MEM_MAX    (256 * 1024)
+
+/* Largest datagram there can be. */
+#define FRAG_MAX_DATA   65535
+
+/* How long a datagram has to arrive, in ms. RFC 8200 says 60 seconds for
+   IPv6, and RFC 791 leaves it up to us for IPv4. */
+#define FRAG_TIMEOUT4   30000
+#define FRAG_TIMEOUT6   60000
+
+#define FAMILY_IDX(f)   ((f) == AF_INET6)
+
+LIST_HEAD(frag_list, net_frag);
+TAILQ_HEAD(frag_queue, net_frag);
+
+static struct frag_list table[FRAG_HASH_SIZE];
+static struct frag_queue by_age;
+static size_t mem_used;
+static net_frag_counts_t counts[2];
+static mutex_t frag_mutex = MUTEX_INITIALIZER;
+static int cbid = -1;
+
+static inline unsigned int frag_hash(const net_frag_key_t *key) {
+    uint32_t h = key->id ^ key->src.__s6_addr.__s6_addr32[3] ^
+                 key->dst.__s6_addr.__s6_addr32[3] ^ key->proto;
+
+    return (h * 2654435761U) >> (32 - FRAG_HASH_BITS);
+}
+
+static inline int frag_match(const net_frag_key_t *a, const net_frag_key_t *b) {
+    return a->id == b->id && a->proto == b->proto && a->family == b->family &&
+           !memcmp(&a->src, &b->src, sizeof(struct in6_addr)) &&
+           !memcmp(&a->dst, &b->dst, sizeof(struct in6_addr));
+}
+
+static void frag_remove(net_frag_t *f) {
+    LIST_REMOVE(f, hash);
+    TAILQ_REMOVE(&by_age, f, age);
+    mem_used -= f->mem;
+}
+
+static void frag_drop(net_frag_t *f) {
+    frag_remove(f);
+    ++counts[FAMILY_IDX(f->key.family)].dropped;
+    net_frag_free(f);
+}
+
+/* Throw out the oldest datagram other than f, returning 0 if there wasn't
+   one. */
+static int frag_evict(net_frag_t *f) {
+    net_frag_t *old = TAILQ_FIRST(&by_age);
+
+    if(old && old == f)
+        old = TAILQ_NEXT(f, age);
+
+    if(!old)
+        return 0;
+
+    frag_drop(old);
+    return 1;
+}
+
+static net_frag_t *frag_new(const net_frag_key_t *key, unsigned int h,
+                            uint64_t now) {
+    net_frag_t *f;
+
+    while(mem_used + sizeof(net_frag_t) > FRAG_MEM_MAX && frag_evict(NULL))
+        ;
+
+    if(!(f = (net_frag_t *)calloc(1, sizeof(net_frag_t))))
+        return NULL;
+
+    f->key = *key;
+    f->mem = sizeof(net_frag_t);
+    f->expires = now + (key->family == AF_INET6 ? FRAG_TIMEOUT6 :
+                        FRAG_TIMEOUT4);
+    mem_used += f->mem;
+
+    LIST_INSERT_HEAD(&table[h], f, hash);
+    TAILQ_INSERT_TAIL(&by_age, f, age);
+
+    if(cbid >= 0)
+        net_thd_schedule(cbid, f->expires);
+
+    return f;
+}
+
+/* Make room for cap bytes of data in a datagram. */
+static int frag_grow(net_frag_t *f, size_t cap) {
+    size_t extra = cap - f->cap;
+    uint8_t *buf;
+
+    while(mem_used + extra > FRAG_MEM_MAX) {
+        if(!frag_evict(f))
+            return -1;
+    }
+
+    if(!(buf = (uint8_t *)realloc(f->buf, NET_FRAG_HDR_ROOM + cap)))
+        return -1;
+
+    f->buf = buf;
+    f->cap = cap;
+    f->mem += extra;
+    mem_used += extra;
+
+    return 0;
+}
+
+/* Record that the data from start to end has arrived. Returns 1 if all of it
+   already had, 0 if it has been added, or -1 if it can't be: there are too
+   many pieces, or it overlaps what's there for IPv6 (which RFC 5722 says
+   means the whole datagram has to be thrown out). */
+static int frag_add_range(net_frag_t *f, uint32_t start, uint32_t end) {
+    uint32_t s = start, e = end;
+    int i, j, n = f->nranges;
+
+    /* Skip the pieces that end before this starts. */
+    for(i = 0; i < n && f->ranges[i].end < start; ++i)
+        ;
+
+    if(i < n && f->ranges[i].start <= start && f->ranges[i].end >= end)
+        return 1;
+
+    /* Merge it with any pieces that it overlaps or touches. */
+    for(j = i; j < n && f->ranges[j].start <= end; ++j) {
+        if(f->key.family == AF_INET6 && f->ranges[j].start < end &&
+           f->ranges[j].end > start)
+            return -1;
+
+        if(f->ranges[j].start < s)
+            s = f->ranges[j].start;
+
+        if(f->ranges[j].end > e)
+            e = f->ranges[j].end;
+    }
+
+    if(j == i) {
+        if(n == NET_FRAG_MAX_RANGES)
+            return -1;
+
+        memmove(&f->ranges[i + 1], &f->ranges[i],
+                (n - i) * sizeof(f->ranges[0]));
+        ++f->nranges;
+    }
+    else if(j > i + 1) {
+        memmove(&f->ranges[i + 1], &f->ranges[j],
+                (n - j) * sizeof(f->ranges[0]));
+        f->nranges -= j - i - 1;
+    }
+
+    f->ranges[i].start = s;
+    f->ranges[i].end = e;
+
+    return 0;
+}
+
+int net_frag_add(const net_frag_key_t *key, size_t off, const uint8_t *data,
+                 size_t len, int more, const void *hdr, size_t hlen,
+                 net_frag_t **done) {
+    unsigned int h = frag_hash(key);
+    net_frag_counts_t *cnt = &counts[FAMILY_IDX(key->family)];
+    size_t end = off + len, cap;
+    net_frag_t *f;
+    int rv;
+
+    *done = NULL;
+
+    /* This is usually called inside an interrupt, so try to safely lock the
+       mutex, and bail if we can't. */
+    if(mutex_lock_irqsafe(&frag_mutex))
+        return -1;
+
+    ++cnt->recv;
+
+    /* Every fragment but the last has to be a multiple of 8 bytes long, and
+       none of them can go past the end of the largest possible datagram. */
+    if(!len || (more && (len & 7)) || end > FRAG_MAX_DATA ||
+       hlen > NET_FRAG_HDR_ROOM) {
+        mutex_unlock(&frag_mutex);
+        return -1;
+    }
+
+    LIST_FOREACH(f, &table[h], hash) {
+        if(frag_match(&f->key, key))
+            break;
+    }
+
+    if(!f && !(f = frag_new(key, h, timer_ms_gettime64()))) {
+        ++cnt->dropped;
+        mutex_unlock(&frag_mutex);
+        return -1;
+    }
+
+    /* Once the length of the datagram is known, nothing can disagree with
+       it. */
+    if((f->total && (end > f->total || (!more && end != f->total))) ||
+       (!more && f->nranges && end < f->ranges[f->nranges - 1].end))
+        goto drop;
+
+    if(!more)
+        f->total = end;
+
+    /* Once the length is known, that's exactly how much room the datagram
+       needs. Until then, double the room each time it runs out. */
+    if(end > f->cap) {
+        if(f->total) {
+            cap = f->total;
+        }
+        else {
+            cap = f->cap ? f->cap * 2 : end * 2;
+
+            if(cap < end)
+                cap = end;
+
+            if(cap > FRAG_MAX_DATA)
+                cap = FRAG_MAX_DATA;
+        }
+
+        if(frag_grow(f, cap))
+            goto drop;
+    }
+
+    if((rv = frag_add_range(f, off, end)) < 0)
+        goto drop;
+    else if(!rv)
+        memcpy(f->buf + NET_FRAG_HDR_ROOM + off, data, len);
+
+    if(hdr && !f->hlen) {
+        memcpy(f->buf + NET_FRAG_HDR_ROOM - hlen, hdr, hlen);
+        f->hlen = hlen;
+    }
+
+    /* Is that everything? */
+    if(f->total && f->hlen && f->nranges == 1 && !f->ranges[0].start &&
+       f->ranges[0].end == f->total) {
+        frag_remove(f);
+        ++cnt->reasm;
+        *done = f;
+        mutex_unlock(&frag_mutex);
+        return 1;
+    }
+
+    mutex_unlock(&frag_mutex);
+    return 0;
+
+drop:
+    frag_drop(f);
+    mutex_unlock(&frag_mutex);
+    return -1;
+}
+
+void net_frag_free(net_frag_t *f) {
+    free(f->buf);
+    free(f);
+}
+
+net_frag_counts_t net_frag_get_counts(int family) {
+    return counts[FAMILY_IDX(family)];
+}
+
+/* Throw out any datagrams that have run out of time, and have this run again
+   when the next one will. */
+static void frag_timer(void *data) {
+    net_frag_t *f, *n;
+    uint64_t now = timer_ms_gettime64(), next = UINT64_MAX;
+
+    (void)data;
+
+    mutex_lock(&frag_mutex);
+
+    f = TAILQ_FIRST(&by_age);
+
+    while(f) {
+        n = TAILQ_NEXT(f, age);
+
+        if(f->expires <= now)
+            frag_drop(f);
+        else if(f->expires < next)
+            next = f->expires;
+
+        f = n;
+    }
+
+    mutex_unlock(&frag_mutex);
+
+    if(next != UINT64_MAX)
+        net_thd_schedule(cbid, next);
+}
+
+int net_frag_init(void) {
+    int i;
+
+    for(i = 0; i < FRAG_HASH_SIZE; ++i)
+        LIST_INIT(&table[i]);
+
+    TAILQ_INIT(&by_age);
+    mem_used = 0;
+    cbid = net_thd_add_callback(&frag_timer, NULL, 0);
+
+    return cbid < 0 ? -1 : 0;
+}
+
+void net_frag_shutdown(void) {
+    net_frag_t *f;
+
+    if(cbid >= 0) {
+        net_thd_del_callback(cbid);
+        cbid = -1;
+    }
+
+    mutex_lock(&frag_mutex);
+
+    while((f = TAILQ_FIRST(&by_age))) {
+        frag_remove(f);
+        net_frag_free(f);
+    }
+
+    mutex_unlock(&frag_mutex);
+}
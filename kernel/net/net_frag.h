@@ -0,0 +1,99 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_frag.h
+
+*/
+
+#ifndef __LOCAL_NET_FRAG_H
+#define __LOCAL_NET_FRAG_H
+
+#include <kos/cdefs.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+__BEGIN_DECLS
+
+/* Reassembly of fragmented IPv4 and IPv6 datagrams. The two only differ in
+   how the fragments are described, which is left to the callers. */
+
+/* Room kept in front of the data of a datagram for the header of its first
+   fragment, which is enough for an IPv4 header with options. */
+#define NET_FRAG_HDR_ROOM   60
+
+/* Most separate pieces a datagram can be in while it is being put back
+   together. A datagram that needs more than this is dropped. */
+#define NET_FRAG_MAX_RANGES 16
+
+/* What identifies the fragments of one datagram. IPv4 addresses are stored
+   as IPv4-mapped IPv6 addresses. */
+typedef struct net_frag_key {
+    struct in6_addr src;
+    struct in6_addr dst;
+    uint32_t id;
+    uint8_t proto;
+    uint8_t family;
+} net_frag_key_t;
+
+typedef struct net_frag {
+    LIST_ENTRY(net_frag) hash;
+    TAILQ_ENTRY(net_frag) age;
+
+    net_frag_key_t key;
+
+    /* NET_FRAG_HDR_ROOM bytes, then room for cap bytes of data. Once the
+       datagram is complete, the header of its first fragment is the hlen
+       bytes just in front of the data. */
+    uint8_t *buf;
+    size_t cap;
+    size_t hlen;
+
+    /* Length of the data, once the last fragment has arrived. */
+    size_t total;
+
+    /* The parts of the data that have arrived so far, in order. */
+    int nranges;
+    struct {
+        uint32_t start;
+        uint32_t end;
+    } ranges[NET_FRAG_MAX_RANGES];
+
+    uint64_t expires;
+    size_t mem;
+} net_frag_t;
+
+/* Counters for one family. */
+typedef struct net_frag_counts {
+    uint32_t recv;                  /* Fragments received */
+    uint32_t reasm;                 /* Datagrams put back together */
+    uint32_t dropped;               /* Datagrams given up on */
+} net_frag_counts_t;
+
+/* Add len bytes of data, starting off bytes into the datagram identified by
+   key. more is set if this isn't the last fragment. hdr is the header to use
+   for the whole datagram, and must be given for the fragment at offset 0.
+
+   Returns 0 if the datagram is still waiting for more fragments and -1 if it
+   (or this fragment) was dropped. If this completes it, returns 1 and sets
+   done to the datagram, which has been removed from the table, and which the
+   caller should pass on and then free with net_frag_free(). */
+int net_frag_add(const net_frag_key_t *key, size_t off, const uint8_t *data,
+                 size_t len, int more, const void *hdr, size_t hlen,
+                 net_frag_t **done);
+
+/* The whole datagram, header and all. */
+static inline uint8_t *net_frag_packet(const net_frag_t *f) {
+    return f->buf + NET_FRAG_HDR_ROOM - f->hlen;
+}
+
+void net_frag_free(net_frag_t *f);
+
+net_frag_counts_t net_frag_get_counts(int family);
+
+int net_frag_init(void);
+void net_frag_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_FRAG_H */
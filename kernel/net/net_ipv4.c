@@ -22,50 +22,11 @@
 
 #include "net_ipv4.h"
 #include "net_icmp.h"
+#include "net_loop.h"
+#include "net_frag.h"
 
 static net_ipv4_stats_t ipv4_stats = { 0 };
 
-/* Perform an IP-style checksum on a block of data */
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start) {
-    uint32_t sum = start;
-    size_t i = bytes;
-
-    /* Make sure we don't do any unaligned memory accesses */
-    if(((uint32_t)data) & 0x01) {
-        const uint8_t *ptr = data;
-
-        while(i > 1) {
-            sum += *ptr | ((*ptr + 1) << 8);
-            ptr += 2;
-            i -= 2;
-
-            while(sum >> 16)
-                sum = (sum >> 16) + (sum & 0xFFFF);
-        }
-    }
-    else {
-        const uint16_t *ptr = (const uint16_t *)data;
-
-        while(i > 1) {
-            sum += *ptr++;
-            i -= 2;
-
-            while(sum >> 16)
-                sum = (sum >> 16) + (sum & 0xFFFF);
-        }
-    }
-
-    /* Handle the last byte, if we have an odd byte count */
-    if(i)
-        sum += data[bytes - 1];
-
-    /* Take care of any carry bits */
-    while(sum >> 16)
-        sum = (sum >> 16) + (sum & 0xFFFF);
-
-    return sum ^ 0xFFFF;
-}
-
 /* Determine if a given IP is in the current network */
 static int __pure is_in_network(const uint8_t src[4], const uint8_t dest[4],
                          const uint8_t netmask[4]) {
@@ -91,49 +52,60 @@ static int __pure is_broadcast(const uint8_t dest[4], const uint8_t bc[4]) {
     return 1;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
-                         size_t size) {
+/* Send a packet on the specified network adapter. This takes over the buffer
+   holding the data, which is freed once it has been sent. The IP and Ethernet
+   headers are put in the space in front of the data. */
+int net_ipv4_output(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *p) {
     uint8_t dest_ip[4];
     uint8_t dest_mac[6];
-    uint8_t pkt[size + sizeof(ip_hdr_t) + sizeof(eth_hdr_t)];
+    size_t hlen = 4 * (hdr->version_ihl & 0x0f);
     eth_hdr_t *ehdr;
+    uint8_t *iphdr;
     int err;
 
-    if(net == NULL) {
+    net_ipv4_parse_address(ntohl(hdr->dest), dest_ip);
+
+    /* Loopback addresses (127/8) never go anywhere else. */
+    if(dest_ip[0] == 0x7F)
+        net = net_loopback_dev;
+    else if(net == NULL)
         net = net_default_dev;
 
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
+    if(!net) {
+        net_pbuf_free(p);
+        errno = ENETDOWN;
+        return -1;
     }
 
-    net_ipv4_parse_address(ntohl(hdr->dest), dest_ip);
-
-    /* Is this a loopback address (127/8)? */
-    if(dest_ip[0] == 0x7F) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
+    /* Make sure the data is all in one place, with room for the headers. */
+    if(!(p = net_pbuf_flatten(p))) {
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
 
-        ++ipv4_stats.pkt_sent;
+    /* Put the IP header in front of the data */
+    if(!(iphdr = net_pbuf_push(p, hlen))) {
+        net_pbuf_free(p);
+        errno = EMSGSIZE;
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
 
-        /* Send it "away" */
-        net_ipv4_input(NULL, pkt, 4 * (hdr->version_ihl & 0x0f) + size, NULL);
+    memcpy(iphdr, hdr, hlen);
 
-        return 0;
+    if(net->flags & NETIF_LOOPBACK) {
+        /* Hand the buffer itself to the loopback device */
+        ++ipv4_stats.pkt_sent;
+        return net_loop_output(net, p);
     }
     else if(net->flags & NETIF_NOETH) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
-
+        /* Non-Ethernet devices don't need to know where the packet is going
+           any more precisely than that, so send it away. */
         ++ipv4_stats.pkt_sent;
+        err = net->if_tx(net, p->data, p->len, NETIF_BLOCK);
+        net_pbuf_free(p);
 
-        /* Send it away */
-        return net->if_tx(net, pkt, 4 * (hdr->version_ihl & 0x0f) + size,
-                          NETIF_BLOCK);
+        return err;
     }
 
     /* Are we sending a broadcast packet? */
@@ -147,46 +119,57 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
             memcpy(dest_ip, net->gateway, 4);
         }
 
-        /* Get our destination's MAC address. If we do not have the MAC address
-           cached, return a distinguished error to the upper-level protocol so
-           that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+        /* Get our destination's MAC address. If we do not have the MAC
+           address cached, the packet is queued until the ARP reply comes in
+           (assuming one does), so return success. */
+        err = net_arp_resolve(net, dest_ip, dest_mac, p);
 
-        if(err == -1) {
-            errno = ENETUNREACH;
+        if(err == -3) {
+            errno = ENOBUFS;
             ++ipv4_stats.pkt_send_failed;
             return -1;
         }
-        else if(err == -2) {
-            /* It'll send when the ARP reply comes in (assuming one does), so
-               return success. */
+        else if(err < 0) {
+            ++ipv4_stats.pkt_sent;
             return 0;
         }
     }
 
+    ++ipv4_stats.pkt_sent;
+
     /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    if(!(ehdr = (eth_hdr_t *)net_pbuf_push(p, sizeof(eth_hdr_t)))) {
+        net_pbuf_free(p);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
     memcpy(ehdr->dest, dest_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x08;
     ehdr->type[1] = 0x00;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, 4 * (hdr->version_ihl & 0x0f));
-    memcpy(pkt + sizeof(eth_hdr_t) + 4 * (hdr->version_ihl & 0x0f), data,
-           size);
-
-    ++ipv4_stats.pkt_sent;
-
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ip_hdr_t) + size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net->if_tx(net, p->data, p->len, NETIF_BLOCK);
+    net_pbuf_free(p);
 
     return 0;
 }
 
-int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
-                  int proto, uint32_t src, uint32_t dst) {
+int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
+                         size_t size) {
+    net_pbuf_t *p;
+
+    if(!(p = net_pbuf_from(data, size))) {
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
+
+    return net_ipv4_output(net, hdr, p);
+}
+
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *p, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst) {
     ip_hdr_t hdr;
 
     /* If the ID is -1, generate a random ID value that can be used in case the
@@ -198,7 +181,7 @@ int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int tt
     /* Fill in the IPv4 Header */
     hdr.version_ihl = 0x45;
     hdr.tos = 0;
-    hdr.length = htons(size + 20);
+    hdr.length = htons(p->tot_len + 20);
     hdr.packet_id = id;
     hdr.flags_frag_offs = 0;
     hdr.ttl = ttl;
@@ -209,7 +192,19 @@ int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int tt
 
     hdr.checksum = net_ipv4_checksum((uint8_t *)&hdr, sizeof(ip_hdr_t), 0);
 
-    return net_ipv4_frag_send(net, &hdr, data, size);
+    return net_ipv4_frag_send(net, &hdr, p);
+}
+
+int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
+                  int proto, uint32_t src, uint32_t dst) {
+    net_pbuf_t *p;
+
+    if(!(p = net_pbuf_from(data, size))) {
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
+
+    return net_ipv4_send_pbuf(net, p, id, ttl, proto, src, dst);
 }
 
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
@@ -300,5 +295,12 @@ uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t p
 }
 
 net_ipv4_stats_t net_ipv4_get_stats(void) {
-    return ipv4_stats;
+    net_ipv4_stats_t rv = ipv4_stats;
+    net_frag_counts_t fc = net_frag_get_counts(AF_INET);
+
+    rv.frag_recv = fc.recv;
+    rv.frag_reasm = fc.reasm;
+    rv.frag_dropped = fc.dropped;
+
+    return rv;
 }
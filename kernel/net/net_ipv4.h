@@ -10,6 +10,9 @@
 
 #include <kos/net.h>
 
+#include "net_cksum.h"
+#include "net_pbuf.h"
+
 /* These structs are from AndrewK's dcload-ip. */
 typedef struct {
     uint8_t   dest[6];
@@ -25,9 +28,11 @@ typedef struct {
     uint16_t length;
 } __packed ipv4_pseudo_hdr_t;
 
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
+int net_ipv4_output(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *p);
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *p, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int proto, uint32_t src, uint32_t dst);
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
@@ -37,12 +42,16 @@ int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
 uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
                                 uint16_t len);
 
+/* In net_arp.c. Look up where to send an IPv4 packet (with its header on) on
+   the local network, queueing it until the answer comes in if that isn't known
+   yet. Returns 0 and fills in mac_out, or takes over p and returns <0 as
+   net_arp_lookup() does. */
+int net_arp_resolve(netif_t *nif, const uint8_t ip[4], uint8_t mac_out[6],
+                    net_pbuf_t *p);
+
 /* In net_ipv4_frag.c */
-int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
-                       size_t size);
+int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *p);
 int net_ipv4_reassemble(netif_t *net, const ip_hdr_t *hdr, const uint8_t *data,
                         size_t size);
-int net_ipv4_frag_init(void);
-void net_ipv4_frag_shutdown(void);
 
 #endif /* __LOCAL_NET_IPV4_H */
@@ -15,6 +15,8 @@
 #include "net_ipv6.h"
 #include "net_icmp6.h"
 #include "net_ipv4.h"
+#include "net_loop.h"
+#include "net_frag.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -60,46 +62,53 @@ static int __pure is_in_network(netif_t *net, const struct in6_addr *ip) {
     return 0;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
-                         size_t data_size) {
-    uint8_t pkt[data_size + sizeof(ipv6_hdr_t) + sizeof(eth_hdr_t)];
+/* Send a packet on the specified network adapter. This takes over the buffer
+   holding the data, which is freed once it has been sent. The IP and Ethernet
+   headers are put in the space in front of the data. */
+int net_ipv6_output(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *p) {
     uint8_t dst_mac[6];
     int err;
     struct in6_addr dst = hdr->dst_addr;
     eth_hdr_t *ehdr;
+    uint8_t *iphdr;
 
-    if(!net) {
+    /* The loopback address never goes anywhere else. */
+    if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr))
+        net = net_loopback_dev;
+    else if(!net)
         net = net_default_dev;
 
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
+    if(!net) {
+        net_pbuf_free(p);
+        errno = ENETDOWN;
+        return -1;
     }
 
-    /* Are we sending a packet to loopback? */
-    if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr)) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
+    /* Make sure the data is all in one place, with room for the headers. */
+    if(!(p = net_pbuf_flatten(p))) {
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
+    }
 
-        ++ipv6_stats.pkt_sent;
+    /* Put the IP header in front of the data */
+    iphdr = net_pbuf_push(p, sizeof(ipv6_hdr_t));
+    memcpy(iphdr, hdr, sizeof(ipv6_hdr_t));
 
-        /* Send the packet "away" */
-        net_ipv6_input(NULL, pkt, sizeof(ipv6_hdr_t) + data_size, NULL);
-        return 0;
+    if(net->flags & NETIF_LOOPBACK) {
+        /* Hand the buffer itself to the loopback device */
+        ++ipv6_stats.pkt_sent;
+        return net_loop_output(net, p);
     }
     else if(net->flags & NETIF_NOETH) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
-
+        /* Non-Ethernet devices don't need a destination MAC, so send the
+           packet away. */
         ++ipv6_stats.pkt_sent;
-
-        /* Send the packet away */
-        return net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size,
-                          NETIF_BLOCK);
+        err = net->if_tx(net, p->data, p->len, NETIF_BLOCK);
+        net_pbuf_free(p);
+        return err;
     }
-    else if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
+
+    if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
         dst_mac[0] = dst_mac[1] = 0x33;
         dst_mac[2] = hdr->dst_addr.__s6_addr.__s6_addr8[12];
         dst_mac[3] = hdr->dst_addr.__s6_addr.__s6_addr8[13];
@@ -111,47 +120,58 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
             dst = net->ip6_gateway;
         }
 
-        err = net_ndp_lookup(net, &dst, dst_mac, hdr, data, data_size);
+        /* If we don't know where it's going yet, the packet is queued until
+           the neighbor advertisement comes in. */
+        err = net_ndp_resolve(net, &dst, dst_mac, p);
 
-        if(err == -1) {
-            errno = ENETUNREACH;
+        if(err == -3) {
+            errno = ENOBUFS;
             ++ipv6_stats.pkt_send_failed;
-            return err;
+            return -1;
         }
-        else if(err == -2) {
+        else if(err < 0) {
+            ++ipv6_stats.pkt_sent;
             return 0;
         }
     }
 
+    ++ipv6_stats.pkt_sent;
+
     /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    ehdr = (eth_hdr_t *)net_pbuf_push(p, sizeof(eth_hdr_t));
     memcpy(ehdr->dest, dst_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x86;
     ehdr->type[1] = 0xDD;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, sizeof(ipv6_hdr_t));
-    memcpy(pkt + sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t), data, data_size);
-
-    ++ipv6_stats.pkt_sent;
-
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net->if_tx(net, p->data, p->len, NETIF_BLOCK);
+    net_pbuf_free(p);
 
     return 0;
 }
 
-int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
-                  int hop_limit, int proto, const struct in6_addr *src,
-                  const struct in6_addr *dst) {
+int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
+                         size_t data_size) {
+    net_pbuf_t *p;
+
+    if(!(p = net_pbuf_from(data, data_size))) {
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
+    }
+
+    return net_ipv6_output(net, hdr, p);
+}
+
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *p, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst) {
     ipv6_hdr_t hdr;
 
     if(!net) {
-        net = net_default_dev;
+        net = net_route(dst);
 
         if(!net) {
+            net_pbuf_free(p);
             errno = ENETDOWN;
             return -1;
         }
@@ -171,26 +191,39 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
        send function to do the rest. Note that only V4-mapped addresses are
        supported here (::ffff:x.y.z.w) */
     if(IN6_IS_ADDR_V4MAPPED(src) && IN6_IS_ADDR_V4MAPPED(dst)) {
-        return net_ipv4_send(net, data, data_size, -1, hop_limit, proto,
-                             src->__s6_addr.__s6_addr32[3],
-                             dst->__s6_addr.__s6_addr32[3]);
+        return net_ipv4_send_pbuf(net, p, -1, hop_limit, proto,
+                                  src->__s6_addr.__s6_addr32[3],
+                                  dst->__s6_addr.__s6_addr32[3]);
     }
     else if(IN6_IS_ADDR_V4MAPPED(src) || IN6_IS_ADDR_V4MAPPED(dst) ||
             IN6_IS_ADDR_V4COMPAT(src) || IN6_IS_ADDR_V4COMPAT(dst)) {
+        net_pbuf_free(p);
         return -1;
     }
 
     hdr.version_lclass = 0x60;
     hdr.hclass_lflow = 0;
     hdr.lclass = 0;
-    hdr.length = ntohs(data_size);
+    hdr.length = ntohs(p->tot_len);
     hdr.next_header = proto;
     hdr.hop_limit = hop_limit;
     hdr.src_addr = *src;
     hdr.dst_addr = *dst;
 
-    /* XXXX: Handle fragmentation... */
-    return net_ipv6_send_packet(net, &hdr, data, data_size);
+    return net_ipv6_frag_send(net, &hdr, p);
+}
+
+int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
+                  int hop_limit, int proto, const struct in6_addr *src,
+                  const struct in6_addr *dst) {
+    net_pbuf_t *p;
+
+    if(!(p = net_pbuf_from(data, data_size))) {
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
+    }
+
+    return net_ipv6_send_pbuf(net, p, hop_limit, proto, src, dst);
 }
 
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
@@ -199,7 +232,6 @@ int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
     uint8_t next_hdr;
     //int pos;
     size_t len;
-    int rv;
 
     if(pktsize < sizeof(ipv6_hdr_t)) {
         /* This is obviously a bad packet, drop it */
@@ -224,13 +256,26 @@ int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
     if(eth)
         net_ndp_insert(src, eth->src, &ip->src_addr, 1);
 
-    /* XXXX: Parse options and deal with fragmentation */
-    switch(next_hdr) {
+    /* XXXX: Parse options */
+    if(next_hdr == IPV6_HDR_EXT_FRAGMENT)
+        return net_ipv6_reassemble(src, pkt);
+
+    return net_ipv6_input_proto(src, pkt, pktsize);
+}
+
+/* Pass a whole packet on to whatever handles the protocol in it. */
+int net_ipv6_input_proto(netif_t *src, const uint8_t *pkt, size_t pktsize) {
+    const ipv6_hdr_t *ip = (const ipv6_hdr_t *)pkt;
+    size_t len = ntohs(ip->length);
+    int rv;
+
+    switch(ip->next_header) {
         case IPV6_HDR_ICMP:
-            return net_icmp6_input(src, ip, pkt + sizeof(ipv6_hdr_t), len);
+            return net_icmp6_input(src, (ipv6_hdr_t *)ip,
+                                   pkt + sizeof(ipv6_hdr_t), len);
 
         default:
-            rv = fs_socket_input(src, AF_INET6, next_hdr, pkt,
+            rv = fs_socket_input(src, AF_INET6, ip->next_header, pkt,
                                  pkt + sizeof(ipv6_hdr_t), len);
 
             if(rv == -2) {
@@ -245,12 +290,17 @@ int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
             ++ipv6_stats.pkt_recv;
             return rv;
     }
-
-    return 0;
 }
 
 net_ipv6_stats_t net_ipv6_get_stats(void) {
-    return ipv6_stats;
+    net_ipv6_stats_t rv = ipv6_stats;
+    net_frag_counts_t fc = net_frag_get_counts(AF_INET6);
+
+    rv.frag_recv = fc.recv;
+    rv.frag_reasm = fc.reasm;
+    rv.frag_dropped = fc.dropped;
+
+    return rv;
 }
 
 uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
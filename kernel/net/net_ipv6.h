@@ -35,17 +35,29 @@ typedef struct ipv6_pseudo_hdr_s {
 #define IPV6_HDR_NONE               59
 #define IPV6_HDR_EXT_DESTINATION    60
 
+int net_ipv6_output(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *p);
 int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
                          size_t data_size);
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *p, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst);
 int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
                   int hop_limit, int proto, const struct in6_addr *src,
                   const struct in6_addr *dst);
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
+int net_ipv6_input_proto(netif_t *src, const uint8_t *pkt, size_t pktsize);
 uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
                                 const struct in6_addr *dst,
                                 uint32_t upper_len, uint8_t next_hdr);
 
+/* In net_ndp.c. The IPv6 counterpart of net_arp_resolve(). */
+int net_ndp_resolve(netif_t *net, const struct in6_addr *ip,
+                    uint8_t mac_out[6], net_pbuf_t *p);
+
+/* In net_ipv6_frag.c */
+int net_ipv6_frag_send(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *p);
+int net_ipv6_reassemble(netif_t *src, const uint8_t *pkt);
+
 extern const struct in6_addr in6addr_linklocal_allnodes;
 extern const struct in6_addr in6addr_linklocal_allrouters;
 
@@ -0,0 +1,150 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_ipv6_frag.c
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include <kos/net.h>
+
+#include "net_ipv6.h"
+#include "net_frag.h"
+
+/* The Fragment header, RFC 8200 section 4.5. */
+typedef struct ipv6_frag_hdr_s {
+    uint8_t  next_header;
+    uint8_t  reserved;
+    uint16_t offs_flags;
+    uint32_t id;
+} __packed ipv6_frag_hdr_t;
+
+static uint32_t frag_id;
+
+/* IPv6 fragmentation procedure. Only the source of a packet is allowed to
+   fragment it, so this is only ever done here. Every fragment gets a buffer
+   of its own, with a copy of the IPv6 header, then a Fragment header, then
+   its part of the data. */
+int net_ipv6_frag_send(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *p) {
+    size_t size = p->tot_len, off = 0, ds, len;
+    ipv6_frag_hdr_t *fh;
+    net_pbuf_t *f;
+    uint8_t proto = hdr->next_header;
+    uint32_t id;
+    int rv = 0;
+
+    if(net == NULL)
+        net = net_default_dev;
+
+    /* If the packet doesn't need to be fragmented, send it away as is. */
+    if(!net || size + sizeof(ipv6_hdr_t) <= net->mtu6)
+        return net_ipv6_output(net, hdr, p);
+
+    /* Every fragment but the last has to carry a multiple of 8 bytes. */
+    ds = (net->mtu6 - sizeof(ipv6_hdr_t) - sizeof(ipv6_frag_hdr_t)) & ~7;
+
+    /* The fragments are copied out of the packet, so it has to be in one
+       piece. */
+    if(!(p = net_pbuf_flatten(p)))
+        return -1;
+
+    if(!frag_id)
+        frag_id = (uint32_t)rand();
+
+    id = htonl(++frag_id);
+
+    while(off < size) {
+        len = size - off > ds ? ds : size - off;
+
+        if(!(f = net_pbuf_alloc(sizeof(ipv6_frag_hdr_t) + len))) {
+            rv = -1;
+            break;
+        }
+
+        fh = (ipv6_frag_hdr_t *)f->data;
+        fh->next_header = proto;
+        fh->reserved = 0;
+        fh->offs_flags = htons(off | (off + len < size ? 1 : 0));
+        fh->id = id;
+        net_pbuf_copy_in(f, sizeof(ipv6_frag_hdr_t), p->data + off, len);
+
+        off += len;
+
+        /* net_ipv6_output() copies the header, so the same one can be used
+           for every fragment. */
+        hdr->next_header = IPV6_HDR_EXT_FRAGMENT;
+        hdr->length = htons(sizeof(ipv6_frag_hdr_t) + len);
+
+        if((rv = net_ipv6_output(net, hdr, f)))
+            break;
+    }
+
+    net_pbuf_free(p);
+
+    return rv;
+}
+
+/* IPv6 fragment reassembly procedure. pkt is the whole packet, IPv6 header
+   and all, with a Fragment header right after the IPv6 header. */
+int net_ipv6_reassemble(netif_t *src, const uint8_t *pkt) {
+    const ipv6_hdr_t *ip = (const ipv6_hdr_t *)pkt;
+    const ipv6_frag_hdr_t *fh;
+    size_t len = ntohs(ip->length), off;
+    uint16_t offs_flags;
+    net_frag_key_t key;
+    net_frag_t *f;
+    ipv6_hdr_t *hdr;
+    int rv;
+
+    if(len < sizeof(ipv6_frag_hdr_t))
+        return -1;
+
+    fh = (const ipv6_frag_hdr_t *)(pkt + sizeof(ipv6_hdr_t));
+    offs_flags = ntohs(fh->offs_flags);
+    off = offs_flags & 0xFFF8;
+    len -= sizeof(ipv6_frag_hdr_t);
+    pkt += sizeof(ipv6_hdr_t) + sizeof(ipv6_frag_hdr_t);
+
+    key.src = ip->src_addr;
+    key.dst = ip->dst_addr;
+    key.id = fh->id;
+    key.proto = fh->next_header;
+    key.family = AF_INET6;
+
+    /* An atomic fragment (offset 0, no more to come) is a whole packet, which
+       RFC 6946 says to handle as such, not mixed in with any others. */
+    if(!off && !(offs_flags & 1)) {
+        if(!(f = (net_frag_t *)calloc(1, sizeof(net_frag_t))))
+            return -1;
+
+        if(!(f->buf = (uint8_t *)malloc(NET_FRAG_HDR_ROOM + len))) {
+            free(f);
+            return -1;
+        }
+
+        memcpy(f->buf + NET_FRAG_HDR_ROOM - sizeof(ipv6_hdr_t), ip,
+               sizeof(ipv6_hdr_t));
+        memcpy(f->buf + NET_FRAG_HDR_ROOM, pkt, len);
+        f->hlen = sizeof(ipv6_hdr_t);
+        f->total = len;
+    }
+    else if(net_frag_add(&key, off, pkt, len, offs_flags & 1,
+                         off ? NULL : ip, sizeof(ipv6_hdr_t), &f) <= 0) {
+        return -1;
+    }
+
+    /* Make the saved IPv6 header describe the whole packet, as if it had
+       never been fragmented, and pass it on. */
+    hdr = (ipv6_hdr_t *)net_frag_packet(f);
+    hdr->next_header = key.proto;
+    hdr->length = htons(f->total);
+
+    rv = net_ipv6_input_proto(src, (uint8_t *)hdr,
+                              sizeof(ipv6_hdr_t) + f->total);
+    net_frag_free(f);
+
+    return rv;
+}
@@ -0,0 +1,525 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_loop.c
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <kos/timer.h>
+#include <kos/dbglog.h>
+#include <arch/irq.h>
+
+#include "net_loop.h"
+#include "net_thd.h"
+#include "net_ipv4.h"
+#include "net_ipv6.h"
+
+/* Virtual network devices.
+
+   There are two kinds of these: the loopback device, which takes IP packets
+   and gives them back to the stack as if they had arrived from somewhere else,
+   and pipes, which are a pair of Ethernet devices with a cable between them,
+   so anything sent on one end arrives on the other. Neither kind delivers
+   anything from inside if_tx. Frames are queued with the time that they are
+   due to arrive and handed to the stack from the network thread, which keeps
+   the protocols from being re-entered while they are sending, and gives a place
+   to model a link that is slower, further away or less reliable than the real
+   thing. That's what makes these useful for testing: the link parameters of
+   each device can be set to add latency, limit the bandwidth, or drop or
+   reorder some of the frames sent on it.
+*/
+
+/* Frames that can be waiting on a device when its queue_len is 0. */
+#define LINK_QUEUE_LEN          256
+
+/* Extra delay for reordered frames when their reorder_delay is 0 (us). */
+#define LINK_REORDER_DELAY      1000
+
+typedef struct vframe {
+    TAILQ_ENTRY(vframe) queue;
+    uint64_t due;                       /* When it arrives (us) */
+    net_pbuf_t *p;
+} vframe_t;
+
+TAILQ_HEAD(vframe_queue, vframe);
+
+/* A virtual device. The netif has to come first, so that the netif_t pointers
+   the stack hands around can be turned back into one of these. */
+typedef struct vdev {
+    netif_t nif;
+    LIST_ENTRY(vdev) list;
+    struct vdev *peer;                  /* Other end of a pipe */
+    net_link_params_t params;
+    uint64_t busy_until;                /* When the last frame is sent (us) */
+    struct vframe_queue frames;         /* Queued frames, by due time */
+    int count;
+} vdev_t;
+
+LIST_HEAD(vdev_list, vdev);
+
+/* Both ends of a pipe are allocated together. */
+typedef struct vpipe {
+    vdev_t ends[2];
+} vpipe_t;
+
+static struct vdev_list vdevs = LIST_HEAD_INITIALIZER(0);
+static vdev_t loop_dev;
+static int link_cbid = -1;
+static int pipe_index;
+
+/* Held while frames are being delivered, so that a pipe isn't destroyed out
+   from under the network thread. */
+static mutex_t link_mutex = MUTEX_INITIALIZER;
+
+netif_t *net_loopback_dev = NULL;
+
+static int vdev_tx(netif_t *self, const uint8_t *data, int len, int blocking);
+
+static int is_vdev(netif_t *dev) {
+    return dev && dev->if_tx == vdev_tx;
+}
+
+/* Queue a frame to arrive after the link has had time to carry it. This takes
+   over the buffer, whether the frame is queued or not. */
+static int vdev_queue(vdev_t *vd, net_pbuf_t *p) {
+    net_link_params_t *lp = &vd->params;
+    vframe_t *f, *i;
+    uint64_t now, delay = 0;
+    uint32_t qlen = lp->queue_len ? lp->queue_len : LINK_QUEUE_LEN;
+    irq_mask_t old;
+
+    ++vd->nif.stats.tx_packets;
+    vd->nif.stats.tx_bytes += p->len;
+
+    if(lp->loss && (uint32_t)(rand() % 1000) < lp->loss) {
+        ++vd->nif.stats.tx_dropped;
+        net_pbuf_free(p);
+        return NETIF_TX_OK;
+    }
+
+    if(lp->reorder && (uint32_t)(rand() % 1000) < lp->reorder)
+        delay = lp->reorder_delay ? lp->reorder_delay : LINK_REORDER_DELAY;
+
+    if(!(f = (vframe_t *)malloc(sizeof(vframe_t)))) {
+        ++vd->nif.stats.tx_dropped;
+        net_pbuf_free(p);
+        return NETIF_TX_ERROR;
+    }
+
+    f->p = p;
+    now = timer_us_gettime64();
+
+    old = irq_disable();
+
+    /* Anything that doesn't fit in the queue is dropped, like a real device
+       would when it runs out of transmit buffers. */
+    if((uint32_t)vd->count >= qlen) {
+        ++vd->nif.stats.tx_dropped;
+        irq_restore(old);
+        net_pbuf_free(p);
+        free(f);
+        return NETIF_TX_OK;
+    }
+
+    /* Each frame has to wait for the ones in front of it to be sent. */
+    if(vd->busy_until < now)
+        vd->busy_until = now;
+
+    if(lp->bandwidth)
+        vd->busy_until += (uint64_t)p->len * 8000000 / lp->bandwidth;
+
+    f->due = vd->busy_until + lp->latency + delay;
+
+    /* Keep the queue in the order the frames arrive in. */
+    TAILQ_FOREACH(i, &vd->frames, queue) {
+        if(i->due > f->due)
+            break;
+    }
+
+    if(i)
+        TAILQ_INSERT_BEFORE(i, f, queue);
+    else
+        TAILQ_INSERT_TAIL(&vd->frames, f, queue);
+
+    ++vd->count;
+    irq_restore(old);
+
+    net_thd_schedule(link_cbid, (f->due + 999) / 1000);
+
+    return NETIF_TX_OK;
+}
+
+/* Hand a frame that has arrived to the stack. */
+static void vdev_deliver(vdev_t *vd, net_pbuf_t *p) {
+    if(vd == &loop_dev) {
+        ++vd->nif.stats.rx_packets;
+        vd->nif.stats.rx_bytes += p->len;
+
+        /* The loopback device carries bare IP packets. */
+        if((p->data[0] >> 4) == 4)
+            net_ipv4_input(&vd->nif, p->data, p->len, NULL);
+        else if((p->data[0] >> 4) == 6)
+            net_ipv6_input(&vd->nif, p->data, p->len, NULL);
+    }
+    else if(vd->peer->nif.flags & NETIF_RUNNING) {
+        ++vd->peer->nif.stats.rx_packets;
+        vd->peer->nif.stats.rx_bytes += p->len;
+        net_input(&vd->peer->nif, p->data, p->len);
+    }
+    else {
+        ++vd->peer->nif.stats.rx_dropped;
+    }
+}
+
+/* Deliver everything that is due, and have the network thread come back when
+   the next frame is. */
+static void vdev_callback(void *data) {
+    struct vframe_queue ready = TAILQ_HEAD_INITIALIZER(ready);
+    vdev_t *vd;
+    vframe_t *f;
+    uint64_t now, next = 0;
+    irq_mask_t old;
+
+    (void)data;
+
+    mutex_lock(&link_mutex);
+    now = timer_us_gettime64();
+
+    LIST_FOREACH(vd, &vdevs, list) {
+        /* Take the frames that are due off the queue, then deliver them with
+           interrupts enabled again. Sending in reply to them can queue more
+           frames, which will be picked up on the next pass. */
+        old = irq_disable();
+
+        while((f = TAILQ_FIRST(&vd->frames)) && f->due <= now) {
+            TAILQ_REMOVE(&vd->frames, f, queue);
+            TAILQ_INSERT_TAIL(&ready, f, queue);
+            --vd->count;
+        }
+
+        irq_restore(old);
+
+        while((f = TAILQ_FIRST(&ready))) {
+            TAILQ_REMOVE(&ready, f, queue);
+            vdev_deliver(vd, f->p);
+            net_pbuf_free(f->p);
+            free(f);
+        }
+    }
+
+    LIST_FOREACH(vd, &vdevs, list) {
+        old = irq_disable();
+
+        if((f = TAILQ_FIRST(&vd->frames)) && (!next || f->due < next))
+            next = f->due;
+
+        irq_restore(old);
+    }
+
+    mutex_unlock(&link_mutex);
+
+    if(next)
+        net_thd_schedule(link_cbid, (next + 999) / 1000);
+}
+
+/* Drop everything queued on a device. */
+static void vdev_flush(vdev_t *vd) {
+    struct vframe_queue dead = TAILQ_HEAD_INITIALIZER(dead);
+    vframe_t *f;
+    irq_mask_t old;
+
+    old = irq_disable();
+
+    while((f = TAILQ_FIRST(&vd->frames))) {
+        TAILQ_REMOVE(&vd->frames, f, queue);
+        TAILQ_INSERT_TAIL(&dead, f, queue);
+    }
+
+    vd->count = 0;
+    irq_restore(old);
+
+    while((f = TAILQ_FIRST(&dead))) {
+        TAILQ_REMOVE(&dead, f, queue);
+        net_pbuf_free(f->p);
+        free(f);
+    }
+}
+
+/****************************************************************************/
+/* netif_t interface */
+
+static int vdev_detect(netif_t *self) {
+    self->flags |= NETIF_DETECTED;
+    return 0;
+}
+
+static int vdev_init(netif_t *self) {
+    self->flags |= NETIF_INITIALIZED;
+    return 0;
+}
+
+static int vdev_shutdown(netif_t *self) {
+    vdev_flush((vdev_t *)self);
+    self->flags &= ~(NETIF_DETECTED | NETIF_INITIALIZED | NETIF_RUNNING);
+    return 0;
+}
+
+static int vdev_start(netif_t *self) {
+    if(!(self->flags & NETIF_INITIALIZED))
+        return -1;
+
+    self->flags |= NETIF_RUNNING;
+    return 0;
+}
+
+static int vdev_stop(netif_t *self) {
+    self->flags &= ~NETIF_RUNNING;
+    vdev_flush((vdev_t *)self);
+    return 0;
+}
+
+static int vdev_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
+    net_pbuf_t *p;
+
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    if(!(p = net_pbuf_from(data, len)))
+        return NETIF_TX_ERROR;
+
+    return vdev_queue((vdev_t *)self, p);
+}
+
+static int vdev_tx_commit(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int vdev_rx_poll(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int vdev_set_flags(netif_t *self, uint32_t flags_and,
+                          uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int vdev_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+
+    /* Everything sent on a pipe arrives at the other end anyway. */
+    return 0;
+}
+
+static void vdev_setup(vdev_t *vd, const char *name, const char *descr,
+                       int index) {
+    netif_t *nif = &vd->nif;
+
+    memset(vd, 0, sizeof(vdev_t));
+
+    nif->name = name;
+    nif->descr = descr;
+    nif->index = index;
+    nif->dev_id = 0;
+    nif->flags = NETIF_NO_FLAGS;
+    nif->mtu = 1500;
+    nif->mtu6 = 1500;
+    nif->if_detect = vdev_detect;
+    nif->if_init = vdev_init;
+    nif->if_shutdown = vdev_shutdown;
+    nif->if_start = vdev_start;
+    nif->if_stop = vdev_stop;
+    nif->if_tx = vdev_tx;
+    nif->if_tx_commit = vdev_tx_commit;
+    nif->if_rx_poll = vdev_rx_poll;
+    nif->if_set_flags = vdev_set_flags;
+    nif->if_set_mc = vdev_set_mc;
+
+    TAILQ_INIT(&vd->frames);
+}
+
+/****************************************************************************/
+/* Public interface */
+
+int net_loop_output(netif_t *net, net_pbuf_t *p) {
+    if(!(net->flags & NETIF_RUNNING)) {
+        net_pbuf_free(p);
+        errno = ENETDOWN;
+        return -1;
+    }
+
+    return vdev_queue((vdev_t *)net, p);
+}
+
+int net_link_set_params(netif_t *dev, const net_link_params_t *params) {
+    irq_mask_t old;
+
+    if(!is_vdev(dev) || !params || params->loss > 1000 ||
+       params->reorder > 1000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    old = irq_disable();
+    ((vdev_t *)dev)->params = *params;
+    irq_restore(old);
+
+    return 0;
+}
+
+int net_link_get_params(netif_t *dev, net_link_params_t *params) {
+    if(!is_vdev(dev) || !params) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *params = ((vdev_t *)dev)->params;
+    return 0;
+}
+
+int net_pipe_create(netif_t *ends[2]) {
+    vpipe_t *pipe;
+    int i;
+
+    if(link_cbid < 0) {
+        errno = ENETDOWN;
+        return -1;
+    }
+
+    if(!(pipe = (vpipe_t *)malloc(sizeof(vpipe_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mutex_lock(&link_mutex);
+
+    for(i = 0; i < 2; ++i) {
+        vdev_setup(&pipe->ends[i], "pipe", "Virtual Ethernet pipe",
+                   pipe_index++);
+        pipe->ends[i].peer = &pipe->ends[!i];
+
+        /* A locally administered address, with the index to tell them apart */
+        pipe->ends[i].nif.mac_addr[0] = 0x02;
+        pipe->ends[i].nif.mac_addr[1] = 'K';
+        pipe->ends[i].nif.mac_addr[2] = 'O';
+        pipe->ends[i].nif.mac_addr[3] = 'S';
+        pipe->ends[i].nif.mac_addr[4] = (pipe->ends[i].nif.index >> 8) & 0xFF;
+        pipe->ends[i].nif.mac_addr[5] = pipe->ends[i].nif.index & 0xFF;
+
+        vdev_detect(&pipe->ends[i].nif);
+        vdev_init(&pipe->ends[i].nif);
+        vdev_start(&pipe->ends[i].nif);
+
+        LIST_INSERT_HEAD(&vdevs, &pipe->ends[i], list);
+        net_reg_device(&pipe->ends[i].nif);
+        ends[i] = &pipe->ends[i].nif;
+    }
+
+    mutex_unlock(&link_mutex);
+
+    return 0;
+}
+
+int net_pipe_destroy(netif_t *end) {
+    vdev_t *vd = (vdev_t *)end;
+    vpipe_t *pipe;
+    int i;
+
+    if(!is_vdev(end) || vd == &loop_dev) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The first end is the start of the pipe. */
+    pipe = (vpipe_t *)(vd < vd->peer ? vd : vd->peer);
+
+    mutex_lock(&link_mutex);
+
+    for(i = 0; i < 2; ++i) {
+        LIST_REMOVE(&pipe->ends[i], list);
+
+        if(pipe->ends[i].nif.flags & NETIF_REGISTERED)
+            net_unreg_device(&pipe->ends[i].nif);
+
+        vdev_shutdown(&pipe->ends[i].nif);
+
+        if(net_default_dev == &pipe->ends[i].nif)
+            net_set_default(NULL);
+    }
+
+    mutex_unlock(&link_mutex);
+    free(pipe);
+
+    return 0;
+}
+
+int net_loop_init(void) {
+    netif_t *nif = &loop_dev.nif;
+
+    if(link_cbid < 0 &&
+       (link_cbid = net_thd_add_callback(vdev_callback, NULL, 0)) < 0) {
+        dbglog(DBG_ERROR, "net_loop: can't add network thread callback\n");
+        return -1;
+    }
+
+    vdev_setup(&loop_dev, "lo", "Loopback", 0);
+
+    /* The loopback device carries bare IP packets, as there's nobody on the
+       other end of it to address them to. */
+    nif->flags = NETIF_NOETH | NETIF_LOOPBACK;
+    nif->ip_addr[0] = 127;
+    nif->ip_addr[3] = 1;
+    nif->netmask[0] = 255;
+    nif->broadcast[0] = 127;
+    nif->broadcast[1] = nif->broadcast[2] = nif->broadcast[3] = 255;
+
+    LIST_INSERT_HEAD(&vdevs, &loop_dev, list);
+    net_loopback_dev = nif;
+
+    return net_reg_device(nif);
+}
+
+void net_loop_shutdown(void) {
+    vdev_t *vd, *next;
+
+    /* Pipes go away entirely. The loopback device is shut down along with the
+       rest of the devices. */
+    vd = LIST_FIRST(&vdevs);
+
+    while(vd) {
+        next = LIST_NEXT(vd, list);
+
+        /* Don't leave next pointing at the other end of a pipe that's about
+           to be freed. */
+        if(next && next == vd->peer)
+            next = LIST_NEXT(next, list);
+
+        if(vd == &loop_dev)
+            vdev_flush(vd);
+        else
+            net_pipe_destroy(&vd->nif);
+
+        vd = next;
+    }
+
+    LIST_INIT(&vdevs);
+
+    if(link_cbid >= 0) {
+        net_thd_del_callback(link_cbid);
+        link_cbid = -1;
+    }
+
+    net_loopback_dev = NULL;
+    pipe_index = 0;
+}
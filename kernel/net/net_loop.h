@@ -0,0 +1,30 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_loop.h
+
+*/
+
+#ifndef __LOCAL_NET_LOOP_H
+#define __LOCAL_NET_LOOP_H
+
+#include <kos/cdefs.h>
+#include <kos/net.h>
+
+#include "net_pbuf.h"
+
+__BEGIN_DECLS
+
+/* Queue an IP packet on the loopback device, taking over the buffer it is in
+   rather than copying it like if_tx would. */
+int net_loop_output(netif_t *net, net_pbuf_t *p);
+
+/* Register the loopback device. This needs the network thread running, and
+   has to be done before the devices are detected. */
+int net_loop_init(void);
+
+/* Destroy any pipes and drop any frames still queued. */
+void net_loop_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_LOOP_H */
@@ -0,0 +1,488 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_neigh.c
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <kos/timer.h>
+
+#include "net_ipv4.h"
+#include "net_neigh.h"
+#include "net_thd.h"
+
+/* The neighbor table.
+
+   This maps the IP addresses of hosts on the local network to their Ethernet
+   addresses, for both ARP and NDP. Every packet sent to another machine looks
+   its next hop up in here, so the table is hashed on the address rather than
+   being one long list.
+
+   Entries go through the states of RFC 4861 for both protocols: a new entry
+   is incomplete until the query for it is answered, and is then reachable for
+   a while. Once it hasn't been confirmed for long enough, it is stale, which
+   means that it's still used, but the next packet sent to it sends another
+   query (moving it to probe) to make sure the host is still there. If that
+   doesn't get answered, the entry is thrown out. Anything heard from a host
+   confirms its entry, so one that is busy talking to us never gets probed.
+
+   Packets sent to a host while its entry is incomplete are queued on the
+   entry, up to a limit, and sent when the answer comes in, so that a burst of
+   packets to a new host doesn't lose all but one of them.
+
+   Queries are resent and old entries expired from the network thread, which
+   is only woken up for it when there's something to do, rather than the table
+   being swept on every lookup. */
+
+/* Buckets in the hash table. */
+#define NEIGH_HASH_BITS         6
+#define NEIGH_HASH_SIZE         (1 << NEIGH_HASH_BITS)
+
+/* Most entries in the table. */
+#define NEIGH_MAX_ENTRIES       512
+
+/* Most packets queued on an incomplete entry. When there are more, the oldest
+   ones are dropped. */
+#define NEIGH_PENDING_MAX       8
+
+/* How long an entry stays reachable after it was confirmed, in ms. */
+#define NEIGH_REACHABLE_TIME    30000
+
+/* Time between queries for the same address, in ms. */
+#define NEIGH_RETRANS_TIME      1000
+
+/* Queries sent for an address before giving up on it. */
+#define NEIGH_MAX_PROBES        3
+
+/* How long an entry that isn't used or confirmed stays around, in ms. */
+#define NEIGH_GC_TIME           120000
+
+/* Shortest time between sweeps that only expire entries, in ms. */
+#define NEIGH_GC_INTERVAL       10000
+
+/* Most queries sent in one sweep. Any more wait for the next one. */
+#define NEIGH_MAX_QUERIES       16
+
+typedef struct neigh {
+    LIST_ENTRY(neigh)   list;
+
+    netif_t             *nif;
+    struct in6_addr     addr;
+    int                 family;
+    int                 state;
+    uint8_t             mac[6];
+
+    /* Queries sent since the entry became incomplete or started probing */
+    int                 probes;
+
+    /* Last time the entry was confirmed, used, and when to query again */
+    uint64_t            confirmed;
+    uint64_t            used;
+    uint64_t            next_probe;
+
+    /* Packets waiting for the entry to be filled in, oldest first */
+    net_pbuf_t          *pending[NEIGH_PENDING_MAX];
+    int                 pending_head;
+    int                 pending_cnt;
+} neigh_t;
+
+LIST_HEAD(neigh_list, neigh);
+
+static struct neigh_list table[NEIGH_HASH_SIZE];
+static int entries;
+static int neigh_cbid = -1;
+
+/* Protects the table. Lookups and updates happen from interrupts too, where
+   this is only tried, so nothing that sends a packet is done with it held. */
+static mutex_t neigh_mutex = MUTEX_INITIALIZER;
+
+static inline unsigned int neigh_hash(const struct in6_addr *addr) {
+    uint32_t h = addr->__s6_addr.__s6_addr32[0] ^
+                 addr->__s6_addr.__s6_addr32[1] ^
+                 addr->__s6_addr.__s6_addr32[2] ^
+                 addr->__s6_addr.__s6_addr32[3];
+
+    return (h * 2654435761U) >> (32 - NEIGH_HASH_BITS);
+}
+
+static neigh_t *neigh_find(netif_t *nif, const struct in6_addr *addr,
+                           unsigned int h) {
+    neigh_t *n;
+
+    LIST_FOREACH(n, &table[h], list) {
+        if(n->nif == nif && !memcmp(&n->addr, addr, sizeof(struct in6_addr)))
+            return n;
+    }
+
+    return NULL;
+}
+
+static neigh_t *neigh_new(netif_t *nif, int family,
+                          const struct in6_addr *addr, unsigned int h) {
+    neigh_t *n;
+
+    if(entries >= NEIGH_MAX_ENTRIES)
+        return NULL;
+
+    if(!(n = (neigh_t *)calloc(1, sizeof(neigh_t))))
+        return NULL;
+
+    n->nif = nif;
+    n->addr = *addr;
+    n->family = family;
+    n->state = NEIGH_INCOMPLETE;
+
+    LIST_INSERT_HEAD(&table[h], n, list);
+    ++entries;
+
+    return n;
+}
+
+/* Remove an entry and drop anything queued on it. */
+static void neigh_free(neigh_t *n) {
+    int i;
+
+    for(i = 0; i < n->pending_cnt; ++i)
+        net_pbuf_free(n->pending[(n->pending_head + i) % NEIGH_PENDING_MAX]);
+
+    LIST_REMOVE(n, list);
+    free(n);
+    --entries;
+}
+
+/* Queue a packet on an incomplete entry, returning the one to drop to make
+   room for it, if any. */
+static net_pbuf_t *neigh_enqueue(neigh_t *n, net_pbuf_t *p) {
+    net_pbuf_t *old = NULL;
+
+    if(!p)
+        return NULL;
+
+    if(n->pending_cnt == NEIGH_PENDING_MAX) {
+        old = n->pending[n->pending_head];
+        n->pending_head = (n->pending_head + 1) % NEIGH_PENDING_MAX;
+        --n->pending_cnt;
+    }
+
+    n->pending[(n->pending_head + n->pending_cnt) % NEIGH_PENDING_MAX] = p;
+    ++n->pending_cnt;
+
+    return old;
+}
+
+static void neigh_query(netif_t *nif, int family,
+                        const struct in6_addr *addr) {
+    if(family == AF_INET)
+        net_arp_query(nif, addr->s6_addr + 12);
+    else
+        net_ndp_solicit(nif, addr);
+}
+
+/* Send a queued IP packet, now that we know where it's going. */
+static void neigh_xmit(netif_t *nif, int family, const uint8_t mac[6],
+                       net_pbuf_t *p) {
+    eth_hdr_t *ehdr;
+
+    if((ehdr = (eth_hdr_t *)net_pbuf_push(p, sizeof(eth_hdr_t)))) {
+        memcpy(ehdr->dest, mac, 6);
+        memcpy(ehdr->src, nif->mac_addr, 6);
+
+        if(family == AF_INET) {
+            ehdr->type[0] = 0x08;
+            ehdr->type[1] = 0x00;
+        }
+        else {
+            ehdr->type[0] = 0x86;
+            ehdr->type[1] = 0xDD;
+        }
+
+        nif->if_tx(nif, p->data, p->len, NETIF_BLOCK);
+    }
+
+    net_pbuf_free(p);
+}
+
+static void neigh_schedule(uint64_t when) {
+    if(neigh_cbid >= 0)
+        net_thd_schedule(neigh_cbid, when);
+}
+
+int net_neigh_resolve(netif_t *nif, int family, const struct in6_addr *addr,
+                      uint8_t mac_out[6], net_pbuf_t *p) {
+    unsigned int h = neigh_hash(addr);
+    uint64_t now = timer_ms_gettime64();
+    net_pbuf_t *drop = NULL;
+    neigh_t *n;
+    int rv = 0, query = 0;
+
+    if(mutex_lock_irqsafe(&neigh_mutex)) {
+        if(p)
+            net_pbuf_free(p);
+
+        memset(mac_out, 0, 6);
+        return NEIGH_NOMEM;
+    }
+
+    if((n = neigh_find(nif, addr, h))) {
+        n->used = now;
+
+        if(n->state == NEIGH_INCOMPLETE) {
+            drop = neigh_enqueue(n, p);
+            rv = NEIGH_PENDING;
+        }
+        else {
+            /* An entry that hasn't been confirmed in a while is still used,
+               but we make sure that it is still right. */
+            if((n->state == NEIGH_REACHABLE &&
+                now >= n->confirmed + NEIGH_REACHABLE_TIME) ||
+               n->state == NEIGH_STALE) {
+                n->state = NEIGH_PROBE;
+                n->probes = 1;
+                n->next_probe = now + NEIGH_RETRANS_TIME;
+                query = 1;
+            }
+
+            memcpy(mac_out, n->mac, 6);
+        }
+    }
+    else if((n = neigh_new(nif, family, addr, h))) {
+        n->used = now;
+        n->probes = 1;
+        n->next_probe = now + NEIGH_RETRANS_TIME;
+        neigh_enqueue(n, p);
+        rv = NEIGH_QUERIED;
+        query = 1;
+    }
+    else {
+        drop = p;
+        rv = NEIGH_NOMEM;
+    }
+
+    mutex_unlock(&neigh_mutex);
+
+    if(drop)
+        net_pbuf_free(drop);
+
+    if(query) {
+        neigh_query(nif, family, addr);
+        neigh_schedule(now + NEIGH_RETRANS_TIME);
+    }
+
+    if(rv)
+        memset(mac_out, 0, 6);
+
+    return rv;
+}
+
+int net_neigh_update(netif_t *nif, int family, const struct in6_addr *addr,
+                     const uint8_t mac[6], int how) {
+    net_pbuf_t *send[NEIGH_PENDING_MAX];
+    unsigned int h = neigh_hash(addr);
+    uint64_t now = timer_ms_gettime64();
+    neigh_t *n;
+    int i, cnt = 0;
+
+    if(mutex_lock_irqsafe(&neigh_mutex))
+        return -1;
+
+    if(!(n = neigh_find(nif, addr, h))) {
+        if(!(n = neigh_new(nif, family, addr, h))) {
+            mutex_unlock(&neigh_mutex);
+            return -1;
+        }
+
+        n->used = now;
+    }
+
+    if(how == NEIGH_UPDATE_PERMANENT) {
+        n->state = NEIGH_PERMANENT;
+    }
+    else if(n->state == NEIGH_PERMANENT) {
+        /* Leave entries added by hand alone. */
+        mutex_unlock(&neigh_mutex);
+        return 0;
+    }
+    else if(how == NEIGH_UPDATE_UNSOL && memcmp(n->mac, mac, 6)) {
+        /* Something we didn't ask for that doesn't match what we had isn't
+           enough to say the host is reachable, but it's all we have. */
+        n->state = NEIGH_STALE;
+    }
+    else {
+        n->state = NEIGH_REACHABLE;
+        n->confirmed = now;
+    }
+
+    memcpy(n->mac, mac, 6);
+    n->probes = 0;
+
+    /* Send anything that was waiting for this. */
+    for(; n->pending_cnt; --n->pending_cnt) {
+        send[cnt++] = n->pending[n->pending_head];
+        n->pending_head = (n->pending_head + 1) % NEIGH_PENDING_MAX;
+    }
+
+    n->pending_head = 0;
+    mutex_unlock(&neigh_mutex);
+
+    for(i = 0; i < cnt; ++i)
+        neigh_xmit(nif, family, mac, send[i]);
+
+    return 0;
+}
+
+int net_neigh_revlookup(netif_t *nif, int family, const uint8_t mac[6],
+                        struct in6_addr *addr_out) {
+    neigh_t *n;
+    int i;
+
+    (void)nif;
+
+    if(mutex_lock_irqsafe(&neigh_mutex))
+        return -1;
+
+    for(i = 0; i < NEIGH_HASH_SIZE; ++i) {
+        LIST_FOREACH(n, &table[i], list) {
+            if(n->family == family && n->state != NEIGH_INCOMPLETE &&
+               !memcmp(n->mac, mac, 6)) {
+                *addr_out = n->addr;
+                n->used = timer_ms_gettime64();
+                mutex_unlock(&neigh_mutex);
+                return 0;
+            }
+        }
+    }
+
+    mutex_unlock(&neigh_mutex);
+    return -1;
+}
+
+void net_neigh_gc(void) {
+    struct {
+        netif_t *nif;
+        int family;
+        struct in6_addr addr;
+    } q[NEIGH_MAX_QUERIES];
+    uint64_t now = timer_ms_gettime64();
+    uint64_t probe_next = UINT64_MAX, gc_next = UINT64_MAX, expires;
+    neigh_t *n, *tmp;
+    int i, nq = 0;
+
+    if(mutex_lock_irqsafe(&neigh_mutex))
+        return;
+
+    for(i = 0; i < NEIGH_HASH_SIZE; ++i) {
+        n = LIST_FIRST(&table[i]);
+
+        while(n) {
+            tmp = LIST_NEXT(n, list);
+
+            switch(n->state) {
+                case NEIGH_INCOMPLETE:
+                case NEIGH_PROBE:
+                    if(now >= n->next_probe && nq < NEIGH_MAX_QUERIES) {
+                        if(n->probes >= NEIGH_MAX_PROBES) {
+                            neigh_free(n);
+                            break;
+                        }
+
+                        q[nq].nif = n->nif;
+                        q[nq].family = n->family;
+                        q[nq++].addr = n->addr;
+                        ++n->probes;
+                        n->next_probe = now + NEIGH_RETRANS_TIME;
+                    }
+
+                    if(n->next_probe < probe_next)
+                        probe_next = n->next_probe;
+
+                    break;
+
+                case NEIGH_REACHABLE:
+                case NEIGH_STALE:
+                    expires = (n->used > n->confirmed ? n->used :
+                               n->confirmed) + NEIGH_GC_TIME;
+
+                    if(now >= expires)
+                        neigh_free(n);
+                    else if(expires < gc_next)
+                        gc_next = expires;
+
+                    break;
+            }
+
+            n = tmp;
+        }
+    }
+
+    mutex_unlock(&neigh_mutex);
+
+    for(i = 0; i < nq; ++i)
+        neigh_query(q[i].nif, q[i].family, &q[i].addr);
+
+    /* Entries only expiring can wait a bit, so that they're done in batches
+       rather than each on its own. */
+    if(gc_next != UINT64_MAX && gc_next < now + NEIGH_GC_INTERVAL)
+        gc_next = now + NEIGH_GC_INTERVAL;
+
+    if(probe_next < gc_next)
+        gc_next = probe_next;
+
+    if(gc_next != UINT64_MAX)
+        neigh_schedule(gc_next);
+}
+
+static void neigh_timer(void *data) {
+    (void)data;
+
+    net_neigh_gc();
+}
+
+void net_neigh_flush(int family) {
+    neigh_t *n, *tmp;
+    int i;
+
+    mutex_lock(&neigh_mutex);
+
+    for(i = 0; i < NEIGH_HASH_SIZE; ++i) {
+        n = LIST_FIRST(&table[i]);
+
+        while(n) {
+            tmp = LIST_NEXT(n, list);
+
+            if(family == AF_UNSPEC || n->family == family)
+                neigh_free(n);
+
+            n = tmp;
+        }
+    }
+
+    mutex_unlock(&neigh_mutex);
+}
+
+int net_neigh_init(void) {
+    int i;
+
+    for(i = 0; i < NEIGH_HASH_SIZE; ++i)
+        LIST_INIT(&table[i]);
+
+    entries = 0;
+    neigh_cbid = net_thd_add_callback(&neigh_timer, NULL, 0);
+
+    return neigh_cbid < 0 ? -1 : 0;
+}
+
+void net_neigh_shutdown(void) {
+    if(neigh_cbid >= 0) {
+        net_thd_del_callback(neigh_cbid);
+        neigh_cbid = -1;
+    }
+
+    net_neigh_flush(AF_UNSPEC);
+}
@@ -0,0 +1,70 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_neigh.h
+
+*/
+
+#ifndef __LOCAL_NET_NEIGH_H
+#define __LOCAL_NET_NEIGH_H
+
+#include <kos/cdefs.h>
+#include <kos/net.h>
+
+#include "net_pbuf.h"
+
+__BEGIN_DECLS
+
+/* The neighbor table, which ARP (for IPv4) and NDP (for IPv6) both keep their
+   caches in. IPv4 addresses are stored as IPv4-mapped IPv6 addresses. */
+
+/* States of an entry, roughly as in RFC 4861. */
+#define NEIGH_INCOMPLETE    0   /* Queried, no answer yet */
+#define NEIGH_REACHABLE     1   /* Answered recently */
+#define NEIGH_STALE         2   /* Not confirmed for a while, still usable */
+#define NEIGH_PROBE         3   /* Stale and in use, being queried again */
+#define NEIGH_PERMANENT     4   /* Added by hand, never expires */
+
+/* How net_neigh_update() should treat the address it was given. */
+#define NEIGH_UPDATE_CONFIRM    0   /* The neighbor answered us */
+#define NEIGH_UPDATE_UNSOL      1   /* Heard from it without asking */
+#define NEIGH_UPDATE_PERMANENT  2   /* Make a permanent entry */
+
+/* Return values of net_neigh_resolve(), which are the same as those of
+   net_arp_lookup() and net_ndp_lookup(). */
+#define NEIGH_PENDING       -1  /* A query was already outstanding */
+#define NEIGH_QUERIED       -2  /* No entry, a query has been sent */
+#define NEIGH_NOMEM         -3  /* No room for an entry */
+
+/* Find the link layer address of addr on nif. Returns 0 and fills in mac_out
+   if it is known. Otherwise, the packet in p (an IP packet with its header
+   on, or NULL) is taken over and queued to be sent when the answer comes in,
+   or dropped if it can't be, and one of the values above is returned. */
+int net_neigh_resolve(netif_t *nif, int family, const struct in6_addr *addr,
+                      uint8_t mac_out[6], net_pbuf_t *p);
+
+/* Add or update the entry for addr on nif, sending anything that was waiting
+   for it. how is one of the NEIGH_UPDATE_* values. */
+int net_neigh_update(netif_t *nif, int family, const struct in6_addr *addr,
+                     const uint8_t mac[6], int how);
+
+/* Find the address that has the given link layer address. */
+int net_neigh_revlookup(netif_t *nif, int family, const uint8_t mac[6],
+                        struct in6_addr *addr_out);
+
+/* Send any queries that are due and throw out expired entries now, rather
+   than waiting for the network thread to get around to it. */
+void net_neigh_gc(void);
+
+/* Throw out every entry of the given family. */
+void net_neigh_flush(int family);
+
+/* Send an NDP neighbor solicitation for ip (in net_ndp.c). */
+void net_ndp_solicit(netif_t *net, const struct in6_addr *ip);
+
+/* Init needs the network thread running. */
+int net_neigh_init(void);
+void net_neigh_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_NEIGH_H */
@@ -0,0 +1,197 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.c
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <kos/net.h>
+#include <kos/pool.h>
+#include <arch/irq.h>
+
+#include "net_pbuf.h"
+#include "net_ipv4.h"
+
+/* Packet buffers.
+
+   Everything that is sent is built in one of these, with space left in front
+   of it for the headers of the layers below, so that each layer only has to
+   fill in its own header instead of copying the whole packet into a bigger
+   buffer. Buffers big enough for a full sized frame come from an object
+   pool, so that sending a packet doesn't normally need to call malloc() at
+   all. Buffers are allocated and freed from interrupts, so the pool is one
+   that can be used from them, and a few buffers are kept in reserve so that
+   an interrupt doesn't have to find room for more.
+
+   The pool is only set up once, and never torn down, since buffers can
+   still be queued on sockets after the network is shut down.
+*/
+
+/* Full sized buffers kept ready while the network is up. */
+#define NET_PBUF_RESERVE    8
+
+#define POOL_BUF_SIZE   (NET_PBUF_HEADROOM + NET_PBUF_POOL_DATA)
+
+static pool_t buf_pool;
+static int pools_ready;
+static net_pbuf_stats_t pbuf_stats;
+
+net_pbuf_t *net_pbuf_alloc(size_t len) {
+    net_pbuf_t *p;
+    size_t size = NET_PBUF_HEADROOM + len;
+
+    ++pbuf_stats.allocated;
+
+    if(size <= POOL_BUF_SIZE) {
+        size = POOL_BUF_SIZE;
+        p = (net_pbuf_t *)pool_alloc(&buf_pool);
+    }
+    else {
+        ++pbuf_stats.malloced;
+        p = (net_pbuf_t *)malloc(sizeof(net_pbuf_t) + size);
+    }
+
+    if(!p) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    p->next = NULL;
+    p->data = p->buf + NET_PBUF_HEADROOM;
+    p->len = p->tot_len = len;
+    p->size = size;
+    p->ref = 1;
+
+    return p;
+}
+
+net_pbuf_t *net_pbuf_from(const void *data, size_t len) {
+    net_pbuf_t *p;
+
+    if((p = net_pbuf_alloc(len)))
+        net_pbuf_copy_in(p, 0, data, len);
+
+    return p;
+}
+
+void net_pbuf_ref(net_pbuf_t *p) {
+    irq_disable_scoped();
+    ++p->ref;
+}
+
+static void pbuf_release(net_pbuf_t *p) {
+    if(p->size == POOL_BUF_SIZE)
+        pool_free(&buf_pool, p);
+    else
+        free(p);
+}
+
+void net_pbuf_free(net_pbuf_t *p) {
+    net_pbuf_t *next;
+    irq_mask_t old;
+    int ref;
+
+    while(p) {
+        old = irq_disable();
+        ref = --p->ref;
+        irq_restore(old);
+
+        if(ref)
+            return;
+
+        next = p->next;
+        pbuf_release(p);
+        p = next;
+    }
+}
+
+void net_pbuf_cat(net_pbuf_t *head, net_pbuf_t *tail) {
+    for(;;) {
+        head->tot_len += tail->tot_len;
+
+        if(!head->next)
+            break;
+
+        head = head->next;
+    }
+
+    head->next = tail;
+}
+
+void net_pbuf_trim(net_pbuf_t *p, size_t len) {
+    p->len = p->tot_len = len;
+}
+
+uint8_t *net_pbuf_push(net_pbuf_t *p, size_t n) {
+    if((size_t)(p->data - p->buf) < n)
+        return NULL;
+
+    p->data -= n;
+    p->len += n;
+    p->tot_len += n;
+
+    return p->data;
+}
+
+net_pbuf_t *net_pbuf_flatten(net_pbuf_t *p) {
+    net_pbuf_t *n, *i;
+    size_t off = 0;
+
+    if(!p->next && p->data - p->buf >= NET_PBUF_HEADROOM)
+        return p;
+
+    if(!(n = net_pbuf_alloc(p->tot_len))) {
+        net_pbuf_free(p);
+        return NULL;
+    }
+
+    for(i = p; i; i = i->next) {
+        memcpy(n->data + off, i->data, i->len);
+        off += i->len;
+    }
+
+    ++pbuf_stats.copies;
+    pbuf_stats.bytes_copied += off;
+    net_pbuf_free(p);
+
+    return n;
+}
+
+void net_pbuf_copy_in(net_pbuf_t *p, size_t off, const void *src,
+                      size_t len) {
+    memcpy(p->data + off, src, len);
+
+    ++pbuf_stats.copies;
+    pbuf_stats.bytes_copied += len;
+}
+
+uint32_t net_pbuf_copy_in_cksum(net_pbuf_t *p, size_t off, const void *src,
+                                size_t len) {
+    ++pbuf_stats.copies;
+    pbuf_stats.bytes_copied += len;
+
+    return net_ipv4_checksum_copy(p->data + off, (const uint8_t *)src, len, 0);
+}
+
+net_pbuf_stats_t net_pbuf_get_stats(void) {
+    return pbuf_stats;
+}
+
+int net_pbuf_init(void) {
+    if(!pools_ready) {
+        if(pool_init(&buf_pool, "net buffers", sizeof(net_pbuf_t) +
+                     POOL_BUF_SIZE, 0, NULL, NULL, NULL, POOL_IRQ))
+            return -1;
+
+        pools_ready = 1;
+    }
+
+    return pool_reserve(&buf_pool, NET_PBUF_RESERVE);
+}
+
+void net_pbuf_shutdown(void) {
+    pool_reserve(&buf_pool, 0);
+    pool_shrink(&buf_pool);
+}
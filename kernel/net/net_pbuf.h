@@ -0,0 +1,82 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.h
+
+*/
+
+#ifndef __LOCAL_NET_PBUF_H
+#define __LOCAL_NET_PBUF_H
+
+#include <kos/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/* Space left in front of the data of a newly allocated buffer, so that the
+   network and link layer headers can be put in front of it without copying.
+   This is enough for an Ethernet header and an IPv6 header, and is chosen so
+   that the frame ends up starting on a 4-byte boundary with either IPv4 or
+   IPv6, which is what the drivers need to use their fastest copies. */
+#define NET_PBUF_HEADROOM   66
+
+/* Largest payload that a buffer from the pool holds. Anything bigger (such as
+   a UDP datagram that will be fragmented) is allocated on its own. */
+#define NET_PBUF_POOL_DATA  1536
+
+/* A packet buffer. A packet is a chain of these linked with next, though most
+   of the time it is only one. Buffers are reference counted, so that one can
+   be queued in more than one place at once. */
+typedef struct net_pbuf {
+    struct net_pbuf *next;      /* Next buffer of the packet */
+    uint8_t *data;              /* Start of the data in this buffer */
+    size_t len;                 /* Bytes of data in this buffer */
+    size_t tot_len;             /* Bytes of data here and in the rest */
+    size_t size;                /* Size of buf */
+    int ref;                    /* Reference count */
+    uint8_t buf[];
+} net_pbuf_t;
+
+/* Allocate a buffer with len bytes of data, with NET_PBUF_HEADROOM bytes
+   free in front of it. Returns NULL and sets errno to ENOBUFS on failure. */
+net_pbuf_t *net_pbuf_alloc(size_t len);
+
+/* Allocate a buffer and copy len bytes of data into it. */
+net_pbuf_t *net_pbuf_from(const void *data, size_t len);
+
+/* Take or drop a reference to a packet. Dropping the last reference frees
+   it, along with the rest of the chain. */
+void net_pbuf_ref(net_pbuf_t *p);
+void net_pbuf_free(net_pbuf_t *p);
+
+/* Add tail to the end of the chain at head. */
+void net_pbuf_cat(net_pbuf_t *head, net_pbuf_t *tail);
+
+/* Cut a single buffer down to len bytes of data. */
+void net_pbuf_trim(net_pbuf_t *p, size_t len);
+
+/* Make room for n bytes of header in front of the data of p, returning a
+   pointer to them, or NULL if p doesn't have the headroom. */
+uint8_t *net_pbuf_push(net_pbuf_t *p, size_t n);
+
+/* Make sure that a packet is in one buffer of its own, with headroom in front
+   of it, copying it into a new one if it is a chain. The packet
+   passed in is freed if it is copied, and on failure, in which case this
+   returns NULL. */
+net_pbuf_t *net_pbuf_flatten(net_pbuf_t *p);
+
+/* Copy len bytes into a buffer, starting off bytes into its data. Every copy
+   of packet data into a buffer goes through here, so that it is counted. */
+void net_pbuf_copy_in(net_pbuf_t *p, size_t off, const void *src, size_t len);
+
+/* Copy data in like net_pbuf_copy_in(), returning the partial IP checksum of
+   it (see net_ipv4_checksum_partial()) worked out along the way. */
+uint32_t net_pbuf_copy_in_cksum(net_pbuf_t *p, size_t off, const void *src,
+                                size_t len);
+
+int net_pbuf_init(void);
+void net_pbuf_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_PBUF_H */
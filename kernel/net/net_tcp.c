@@ -18,6 +18,7 @@
 #include <kos/net.h>
 #include <kos/cond.h>
 #include <kos/mutex.h>
+#include <kos/pool.h>
 #include <kos/rwsem.h>
 #include <kos/fs_socket.h>
 
@@ -52,15 +53,11 @@
    always acquire the read lock. The second level of locking is on the
    individual socket level. This is done with a standard mutex. When looking at
    an individual socket, grab that mutex in addition to the read or write lock,
-   as is appropriate. The only function that is somewhat counter-intuitive in
-   its locking is bind(). The bind() function, even though it does not modify
-   the list itself, does grab the write lock. The reason for this is fairly
-   simple. If bind() were to grab the read lock, then iterate through the list
-   of sockets looking for duplicate binds, there is a possibility that a second
-   call to bind() in another thread could cause a deadlock due to the locking
-   and unlocking of the mutexes on the individual sockets. To prevent this
-   problem, I have it grab the write lock instead. That way, no two bind() calls
-   can be active at a time.
+   as is appropriate. The lookup tables described below count as part of the
+   list, so bind() and connect(), which move a socket around in them, take the
+   write lock. The local port of a socket is only ever changed with the write
+   lock held, so checking whether a port is in use doesn't need the mutexes of
+   the other sockets.
 
    On listening:
    When a connection comes in for a socket that is in the listening state, that
@@ -73,22 +70,81 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Incoming segments aren't matched by walking the list of sockets, since that
+   gets slow with a lot of them. Every socket with a local port is also kept in
+   one of two hash tables: tcp_ehash, by remote address and both ports, if it
+   has a remote end, or tcp_lhash, by local port, if it doesn't (which means it
+   is listening). A segment is looked up in tcp_ehash first and only then in
+   tcp_lhash, so a fully-created socket is always found ahead of the listening
+   socket (which only partially creates connections) on the same port. A third
+   table, tcp_bhash, has every socket with a local port by that port, so bind()
+   and connect() can tell whether a port is in use. Sockets move between the
+   tables (with the write lock held) as their addresses change.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   Beyond RFC 793, this implements the extensions described below, as well as
+   window scaling and timestamps (RFC 7323), which are only used if the other
+   side offers them in its SYN too. Everything in here works just fine over
+   IPv4 or IPv6, and can be used just fine to communicate with "normal" TCP/IP
+   implementations.
+
+   On buffer sizes:
+   SO_RCVBUF and SO_SNDBUF can be set up to TCP_MAX_BUFFER. Before a socket is
+   connected they just set the size of the buffers it will get, and after that
+   the buffers are reallocated with their contents moved over. The receive
+   buffer never shrinks once connected, since that would take back window we
+   have already offered. Unless SO_RCVBUF has been set, the receive buffer is
+   autotuned: once per round trip (timed with timestamps, or by how long a
+   window's worth of data takes to arrive) we look at how much the
+   application read, and if that's more than last time, grow the buffer to
+   twice that, up to TCP_MAX_AUTO_RCVBUF. The window scale sent in our SYN is
+   picked for the largest the buffer can get, since it can't change later.
+
+   On retransmission and congestion control:
+   The retransmission timeout is estimated from round-trip time samples as in
+   RFC 6298 (one segment is timed at a time, and never a retransmitted one,
+   unless timestamps are in use, in which case every ACK gives a sample), and
+   doubles every time it expires. Sending is limited by a congestion window as
+   well as by the peer's window, with slow start and congestion avoidance as in
+   RFC 5681 and NewReno fast retransmit and fast recovery as in RFC 6582, plus
+   limited transmit (RFC 3042) to help small windows get enough duplicate ACKs
+   to trigger it. When the timer expires, the window drops to one segment and
+   everything not yet acknowledged is sent again from there. snd.max keeps
+   track of the highest sequence number sent, since snd.nxt gets pulled back
+   when that happens.
+
+   On delayed ACKs and coalescing:
+   Received data isn't acknowledged straight away. The ACK waits for a second
+   segment, for the application to send something it can ride along on, or
+   for TCP_DELACK_TIME to pass, whichever comes first. Going the other way,
+   small writes are coalesced with Nagle's algorithm: a segment that isn't
+   full is only sent when nothing else is waiting to be acknowledged. The
+   TCP_NODELAY option turns that off, and TCP_CORK holds back partial segments
+   altogether until it is turned off again, the socket is closed, or
+   TCP_CORK_TIME passes.
+
+   On timers:
+   Nothing here polls every socket. Each socket that has something to do on a
+   timer (a retransmission, a delayed ACK, a corked segment, TIME-WAIT running
+   out, a keepalive probe, or being freed after it's closed) sits in a slot of
+   the timer wheel for when that is due, worked out by tcp_timer_due() from
+   the state of the socket. Anything that might make that sooner calls
+   tcp_timer_update(), and the net_thd callback is scheduled for the earliest
+   time anything on the wheel is due, so it only wakes up when there is work
+   to do and only looks at the sockets that have some. A zero window is probed
+   by sending one byte past it and letting the retransmission timer resend it,
+   so it doesn't need a timer of its own. Keepalives (SO_KEEPALIVE) are sent
+   after TCP_KEEPALIVE_IDLE without hearing from the other side.
+
+   On out-of-order data and SACK:
+   A segment that arrives ahead of a hole is copied straight into the receive
+   buffer where it belongs (it's in the window, so there's room for it), and
+   the sequence space it covers is remembered in a short list of blocks. Those
+   blocks are sent back as SACK options (RFC 2018) when the other side has
+   agreed to it, and when the hole is filled rcv.nxt jumps forward over them.
+   On the sending side, SACK blocks from the other side are kept in a similar
+   list, and retransmissions during recovery fill in the holes between them
+   rather than resending data that has already arrived.
 */
 
 typedef struct tcp_hdr {
@@ -103,6 +159,16 @@ typedef struct tcp_hdr {
     uint8_t options[];
 } __packed tcp_hdr_t;
 
+/* A block of sequence space [left, right), used for selective acknowledgment.
+   Lists of these are kept sorted and never overlap. */
+struct tcp_sack {
+    uint32_t left;
+    uint32_t right;
+};
+
+/* Most SACK blocks we keep track of (and the most that fit in a segment). */
+#define TCP_MAX_SACK    4
+
 /* Listening socket. Each one of these is an incoming connection from a socket
    that is in the listen state */
 struct lsock {
@@ -112,12 +178,17 @@ struct lsock {
     uint32_t isn;
     uint32_t wnd;
     uint16_t mss;
+    uint8_t sack_ok;
+    uint8_t ts_ok;
+    int8_t wscale;
+    uint32_t ts_recent;
 };
 
 /* Send/receive variables... */
 struct sndrec {
     uint32_t una;
     uint32_t nxt;
+    uint32_t max;
     uint32_t wnd;
     uint32_t up;
     uint32_t wl1;
@@ -135,8 +206,14 @@ struct rcvrec {
 
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) hash_list;
+    LIST_ENTRY(tcp_sock) bind_list;
+    LIST_ENTRY(tcp_sock) timer_list;
+    LIST_ENTRY(tcp_sock) run_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
+    uint8_t hashed;
+    uint64_t timer_due;
 
     uint32_t flags;
     uint32_t intflags;
@@ -171,6 +248,42 @@ struct tcp_sock {
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
             uint64_t timer;
+            uint32_t rto;
+            uint32_t srtt;
+            uint32_t rttvar;
+            uint32_t rtt_seq;
+            uint64_t rtt_time;
+            uint32_t cwnd;
+            uint32_t ssthresh;
+            uint32_t recover;
+            uint8_t dupacks;
+            uint8_t rtt_timing;
+            uint8_t recovering;
+            uint8_t sack_ok;
+            uint8_t ooo_cnt;
+            uint8_t sacked_cnt;
+            uint32_t ooo_last;
+            uint32_t high_rxt;
+            struct tcp_sack ooo[TCP_MAX_SACK];
+            struct tcp_sack sacked[TCP_MAX_SACK];
+            uint8_t snd_wscale;
+            uint8_t rcv_wscale;
+            uint8_t ws_ok;
+            uint8_t ts_ok;
+            uint32_t ts_recent;
+            uint32_t last_ack_sent;
+            uint32_t rcv_adv;
+            uint32_t rcv_rtt;
+            uint32_t rcv_rtt_seq;
+            uint64_t rcv_rtt_time;
+            uint32_t rcv_space;
+            uint32_t rcv_copied;
+            uint64_t rcv_space_time;
+            uint8_t delack;
+            uint64_t delack_time;
+            uint64_t cork_time;
+            uint64_t last_rcv;
+            uint8_t ka_probes;
             condvar_t send_cv;
             condvar_t recv_cv;
         } data;
@@ -182,11 +295,25 @@ LIST_HEAD(tcp_sock_list, tcp_sock);
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 static int thd_cb_id = 0;
+static net_tcp_stats_t tcp_stats = { 0 };
+
+/* Where sockets come from. Sockets can still be open after the protocol is
+   shut down, so this is only set up once, and never torn down. */
+static pool_t tcp_sock_pool;
+static int tcp_sock_pool_ready;
 
 /* Default starting window size for connections. This should be big enough as a
-   starting point, in general. If you need to adjust it, you can do so... */
+   starting point, in general. If you need to adjust it, you can do so with
+   SO_RCVBUF/SO_SNDBUF, or let the receive buffer grow by itself... */
 #define TCP_DEFAULT_WINDOW  8192
 
+/* Largest buffer size that can be set with SO_RCVBUF or SO_SNDBUF. */
+#define TCP_MAX_BUFFER      (1024 * 1024)
+
+/* Largest size the receive buffer will grow to by itself, when SO_RCVBUF hasn't
+   been set. */
+#define TCP_MAX_AUTO_RCVBUF (256 * 1024)
+
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
@@ -194,12 +321,59 @@ static int thd_cb_id = 0;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Retransmission timeout before any round-trip time has been measured, and
+   the bounds it is kept within (all in milliseconds). RFC 6298 asks for a 1
+   second minimum, but that is far too long on a LAN; this is what most other
+   stacks use instead. */
+#define TCP_INITIAL_RTO     1000
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* How long an ACK for received data may be held back, in the hope of sending it
+   along with some data (in milliseconds). RFC 1122 allows up to 500. */
+#define TCP_DELACK_TIME     40
+
+/* Longest that a partial segment is held back on a corked socket (in
+   milliseconds), as on Linux. */
+#define TCP_CORK_TIME       200
+
+/* With SO_KEEPALIVE, how long a connection can sit idle before it is probed,
+   how long to wait between probes, and how many unanswered probes it takes to
+   give up on it (RFC 1122, section 4.2.3.6, and what most systems use). */
+#define TCP_KEEPALIVE_IDLE      7200000
+#define TCP_KEEPALIVE_INTVL     75000
+#define TCP_KEEPALIVE_PROBES    9
+
+/* The timer wheel has TCP_WHEEL_SLOTS slots (a power of two), each of which
+   covers TCP_WHEEL_TICK milliseconds. */
+#define TCP_WHEEL_SLOTS     256
+#define TCP_WHEEL_TICK      10
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
 
+/* Number of buckets in the socket lookup tables. These must be powers of two.
+   The first is for connected sockets, the second for sockets by port. */
+#define TCP_EHASH_SIZE      128
+#define TCP_PHASH_SIZE      64
+
+/* Range that ports are picked from for sockets that connect without binding */
+#define TCP_PORT_FIRST      1024
+#define TCP_PORT_LAST       65535
+
+/* Lookup tables for incoming segments, on top of the list of sockets. See the
+   comment at the top of the file for how these are used. */
+static struct tcp_sock_list tcp_ehash[TCP_EHASH_SIZE];
+static struct tcp_sock_list tcp_lhash[TCP_PHASH_SIZE];
+static struct tcp_sock_list tcp_bhash[TCP_PHASH_SIZE];
+static uint16_t tcp_next_port = TCP_PORT_FIRST;
+
+/* Sockets with a timer running, by when it is due, and the tick the wheel has
+   been turned up to. Protected by disabling interrupts, since these are
+   touched with all sorts of locks held (or none at all). */
+static struct tcp_sock_list tcp_wheel[TCP_WHEEL_SLOTS];
+static uint64_t tcp_wheel_tick;
+
 /* Flags that can be set in the off_flags field of the above struct */
 #define TCP_FLAG_FIN    0x01
 #define TCP_FLAG_SYN    0x02
@@ -230,10 +404,48 @@ static int thd_cb_id = 0;
 #define TCP_IFLAG_CANBEDEL      0x00000001
 #define TCP_IFLAG_QUEUEDCLOSE   0x00000002
 #define TCP_IFLAG_ACCEPTWAIT    0x00000004
+#define TCP_IFLAG_RCVBUFLOCK    0x00000008
+#define TCP_IFLAG_NODELAY       0x00000010
+#define TCP_IFLAG_CORK          0x00000020
+#define TCP_IFLAG_KEEPALIVE     0x00000040
+
+/* Which lookup tables a socket is in (the hashed field of the socket) */
+#define TCP_HASHED_LOOKUP       0x01    /* tcp_ehash or tcp_lhash */
+#define TCP_HASHED_BIND         0x02    /* tcp_bhash */
+
+/* What tcp_send_data() should send */
+#define TCP_SEND_NEW            0   /* New data, if the windows allow */
+#define TCP_SEND_RESEND         1   /* One segment of old data again */
+#define TCP_SEND_PUSH           2   /* New data, even partial segments */
 
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERM       4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TIMESTAMP       8
+
+/* Space taken up by the timestamp option (padded with two NOPs) */
+#define TCP_TS_LEN              12
+
+/* Most option space a header can have */
+#define TCP_MAX_OPTS_LEN        40
+
+/* Largest window scale allowed (RFC 7323, section 2.3) */
+#define TCP_MAX_WSCALE          14
+
+/* Options parsed out of an incoming segment */
+struct tcp_opts {
+    uint16_t mss;
+    uint8_t sack_ok;
+    uint8_t nsack;
+    int8_t wscale;
+    uint8_t ts;
+    uint32_t tsval;
+    uint32_t tsecr;
+    struct tcp_sack sack[TCP_MAX_SACK];
+};
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -242,6 +454,11 @@ static int thd_cb_id = 0;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
+
+/* Amount of data put in each segment. */
+#define TCP_SMSS(s)     ((s)->data.snd.mss - sizeof(tcp_hdr_t) - \
+                         ((s)->data.ts_ok ? TCP_TS_LEN : 0))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -251,17 +468,546 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
                     uint32_t ack);
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
-static void tcp_send_data(struct tcp_sock *sock, int resend);
+static void tcp_send_data(struct tcp_sock *sock, int how);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
+static void tcp_queue_fin(struct tcp_sock *sock);
+extern void __poll_event_trigger(int fd, short event);
+
+/* Number of bytes in the send buffer that have been sent, but not yet
+   acknowledged. Our SYN takes up sequence space, but not buffer space... */
+static inline uint32_t tcp_unacked(const struct tcp_sock *sock) {
+    uint32_t n = sock->data.snd.nxt - sock->data.snd.una;
+
+    if(sock->state == TCP_STATE_SYN_RECEIVED)
+        --n;
+
+    /* Neither does our FIN. */
+    return MIN(n, sock->data.sndbuf_cur_sz);
+}
+
+/* Our timestamp clock ticks once a millisecond. */
+static inline uint32_t tcp_ts_now(void) {
+    return (uint32_t)timer_ms_gettime64();
+}
+
+/* Window to put in the header of an outgoing segment, other than a SYN. */
+static inline uint16_t tcp_adv_wnd(const struct tcp_sock *sock) {
+    return (uint16_t)MIN(sock->data.rcv.wnd >> sock->data.rcv_wscale, 65535);
+}
+
+/* Remember what we've told the other side about our receive window. Every
+   segment we send carries an ACK, so this also covers any delayed ACK. */
+static inline void tcp_note_ack(struct tcp_sock *sock) {
+    sock->data.delack = 0;
+    sock->data.last_ack_sent = sock->data.rcv.nxt;
+    sock->data.rcv_adv = sock->data.rcv.nxt +
+                         (tcp_adv_wnd(sock) << sock->data.rcv_wscale);
+}
+
+/* Set up the congestion and retransmission state of a connection, once the
+   peer's MSS is known. The initial window is the one from RFC 5681. */
+static void tcp_cc_init(struct tcp_sock *sock) {
+    uint32_t smss = TCP_SMSS(sock);
+
+    if(smss > 2190)
+        sock->data.cwnd = 2 * smss;
+    else if(smss > 1095)
+        sock->data.cwnd = 3 * smss;
+    else
+        sock->data.cwnd = 4 * smss;
+
+    sock->data.ssthresh = 0xFFFFFFFF;
+    sock->data.recover = sock->data.snd.iss;
+    sock->data.dupacks = 0;
+    sock->data.recovering = 0;
+    sock->data.srtt = 0;
+    sock->data.rttvar = 0;
+    sock->data.rtt_timing = 0;
+    sock->data.rto = TCP_INITIAL_RTO;
+}
+
+static inline uint32_t tcp_get32(const uint8_t *p) {
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Parse the options on an incoming segment. Anything we don't know about is
+   skipped. Returns -1 if the options are malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *opts) {
+    int j = 0, end_of_opts = TCP_GET_OFFSET(flags) - 20, len, i;
+    const uint8_t *o = tcp->options;
+
+    opts->mss = 0;
+    opts->sack_ok = 0;
+    opts->nsack = 0;
+    opts->wscale = -1;
+    opts->ts = 0;
+
+    while(j < end_of_opts) {
+        if(o[j] == TCP_OPT_EOL)
+            break;
+
+        if(o[j] == TCP_OPT_NOP) {
+            ++j;
+            continue;
+        }
+
+        if(j + 1 >= end_of_opts || (len = o[j + 1]) < 2 ||
+           j + len > end_of_opts)
+            return -1;
+
+        switch(o[j]) {
+            case TCP_OPT_MSS:
+                if(len != 4)
+                    return -1;
+
+                opts->mss = (o[j + 2] << 8) | o[j + 3];
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(len != 3)
+                    return -1;
+
+                opts->wscale = MIN(o[j + 2], TCP_MAX_WSCALE);
+                break;
+
+            case TCP_OPT_SACK_PERM:
+                if(len != 2)
+                    return -1;
+
+                opts->sack_ok = 1;
+                break;
+
+            case TCP_OPT_TIMESTAMP:
+                if(len != 10)
+                    return -1;
+
+                opts->ts = 1;
+                opts->tsval = tcp_get32(o + j + 2);
+                opts->tsecr = tcp_get32(o + j + 6);
+                break;
+
+            case TCP_OPT_SACK:
+                if((len - 2) % 8)
+                    return -1;
+
+                for(i = j + 2; i < j + len && opts->nsack < TCP_MAX_SACK;
+                    i += 8) {
+                    opts->sack[opts->nsack].left = tcp_get32(o + i);
+                    opts->sack[opts->nsack].right = tcp_get32(o + i + 4);
+                    ++opts->nsack;
+                }
+
+                break;
+        }
+
+        j += len;
+    }
+
+    return 0;
+}
+
+/* Add the block [left, right) to a sorted list of SACK blocks, merging it with
+   any blocks it overlaps or touches. Returns -1 if there's no room for it. */
+static int tcp_sack_add(struct tcp_sack *blks, uint8_t *cnt, uint32_t left,
+                        uint32_t right) {
+    int i, j;
+
+    for(i = 0; i < *cnt && SEQ_LT(blks[i].right, left); ++i) ;
+
+    for(j = i; j < *cnt && SEQ_LE(blks[j].left, right); ++j) {
+        if(SEQ_LT(blks[j].left, left))
+            left = blks[j].left;
+
+        if(SEQ_GT(blks[j].right, right))
+            right = blks[j].right;
+    }
+
+    if(i == j) {
+        if(*cnt == TCP_MAX_SACK)
+            return -1;
+
+        memmove(blks + i + 1, blks + i, (*cnt - i) * sizeof(struct tcp_sack));
+        ++*cnt;
+    }
+    else if(j > i + 1) {
+        memmove(blks + i + 1, blks + j, (*cnt - j) * sizeof(struct tcp_sack));
+        *cnt -= j - i - 1;
+    }
+
+    blks[i].left = left;
+    blks[i].right = right;
+    return i;
+}
+
+/* Drop everything before seq from a sorted list of SACK blocks. */
+static void tcp_sack_trim(struct tcp_sack *blks, uint8_t *cnt, uint32_t seq) {
+    int i;
+
+    for(i = 0; i < *cnt && SEQ_LE(blks[i].right, seq); ++i) ;
+
+    if(i) {
+        memmove(blks, blks + i, (*cnt - i) * sizeof(struct tcp_sack));
+        *cnt -= i;
+    }
+
+    if(*cnt && SEQ_LT(blks[0].left, seq))
+        blks[0].left = seq;
+}
+
+/* Window scale we need to be able to advertise a window of size bytes. */
+static uint8_t tcp_wscale_for(uint32_t size) {
+    uint8_t shift = 0;
+
+    while(shift < TCP_MAX_WSCALE && (65535U << shift) < size)
+        ++shift;
+
+    return shift;
+}
+
+/* Does the socket have send and receive buffers allocated? Listening sockets
+   don't, and nor do sockets that haven't connected yet. */
+static inline int tcp_has_bufs(const struct tcp_sock *sock) {
+    return (sock->state & ~TCP_STATE_ACCEPTING) != TCP_STATE_LISTEN &&
+           sock->data.rcvbuf;
+}
+
+/* Largest the receive buffer can get without a call to setsockopt(). */
+static inline uint32_t tcp_rcvbuf_max(const struct tcp_sock *sock) {
+    if(sock->intflags & TCP_IFLAG_RCVBUFLOCK)
+        return sock->rcvbuf_sz;
+
+    return MAX(sock->rcvbuf_sz, TCP_MAX_AUTO_RCVBUF);
+}
+
+/* Grow the receive buffer of a connected socket to sz bytes. Everything that's
+   in it, including out-of-order data, is moved to the start of the new buffer
+   and the window opens up by however much the buffer grew. */
+static int tcp_rcvbuf_grow(struct tcp_sock *sock, uint32_t sz) {
+    uint32_t used = sock->data.rcvbuf_cur_sz, tmp;
+    uint8_t *buf;
+
+    if(sz <= sock->rcvbuf_sz)
+        return 0;
+
+    if(sock->data.ooo_cnt)
+        used += sock->data.ooo[sock->data.ooo_cnt - 1].right -
+                sock->data.rcv.nxt;
+
+    if(!(buf = (uint8_t *)malloc(sz)))
+        return -1;
+
+    if(sock->data.rcvbuf_head + used <= sock->rcvbuf_sz) {
+        memcpy(buf, sock->data.rcvbuf + sock->data.rcvbuf_head, used);
+    }
+    else {
+        tmp = sock->rcvbuf_sz - sock->data.rcvbuf_head;
+        memcpy(buf, sock->data.rcvbuf + sock->data.rcvbuf_head, tmp);
+        memcpy(buf + tmp, sock->data.rcvbuf, used - tmp);
+    }
+
+    free(sock->data.rcvbuf);
+    sock->data.rcvbuf = buf;
+    sock->data.rcvbuf_head = 0;
+    sock->data.rcvbuf_tail = sock->data.rcvbuf_cur_sz;
+    sock->data.rcv.wnd += sz - sock->rcvbuf_sz;
+    sock->rcvbuf_sz = sz;
+
+    return 0;
+}
+
+/* Resize the send buffer of a connected socket. It can't get any smaller than
+   the data that's queued in it. */
+static int tcp_sndbuf_resize(struct tcp_sock *sock, uint32_t sz) {
+    uint32_t used = sock->data.sndbuf_cur_sz, sent = tcp_unacked(sock), tmp;
+    uint8_t *buf;
+
+    if(sz < used)
+        sz = used;
+
+    if(sz == sock->sndbuf_sz)
+        return 0;
+
+    if(!(buf = (uint8_t *)malloc(sz)))
+        return -1;
+
+    if(sock->data.sndbuf_acked + used <= sock->sndbuf_sz) {
+        memcpy(buf, sock->data.sndbuf + sock->data.sndbuf_acked, used);
+    }
+    else {
+        tmp = sock->sndbuf_sz - sock->data.sndbuf_acked;
+        memcpy(buf, sock->data.sndbuf + sock->data.sndbuf_acked, tmp);
+        memcpy(buf + tmp, sock->data.sndbuf, used - tmp);
+    }
+
+    free(sock->data.sndbuf);
+    sock->data.sndbuf = buf;
+    sock->data.sndbuf_acked = 0;
+    sock->data.sndbuf_head = sent == sz ? 0 : sent;
+    sock->data.sndbuf_tail = used == sz ? 0 : used;
+    sock->sndbuf_sz = sz;
+
+    __poll_event_trigger(sock->sock, POLLWRNORM | POLLWRBAND);
+    cond_broadcast(&sock->data.send_cv);
+
+    return 0;
+}
+
+/* Take a sample of how long it takes the other side to fill our window. Only
+   the smallest recent samples matter, since the sender may well have been
+   waiting on its application for some of the time. */
+static void tcp_rcv_rtt_sample(struct tcp_sock *sock, uint32_t rtt) {
+    if(!rtt)
+        rtt = 1;
+
+    if(!sock->data.rcv_rtt || rtt < sock->data.rcv_rtt)
+        sock->data.rcv_rtt = rtt;
+    else
+        sock->data.rcv_rtt += (rtt - sock->data.rcv_rtt) >> 3;
+}
+
+/* Receive buffer autotuning. Once per round trip, look at how much the
+   application has read in that time. That's how much the other side managed
+   to send in a round trip, so if it's more than last time, the sender might be
+   limited by our window: make room for twice as much, so that the window
+   isn't what holds it back next time around. */
+static void tcp_rcvbuf_tune(struct tcp_sock *sock, uint32_t copied) {
+    uint64_t now = timer_ms_gettime64();
+    uint32_t sz;
+
+    sock->data.rcv_copied += copied;
+
+    if(!sock->data.rcv_rtt ||
+       now - sock->data.rcv_space_time < sock->data.rcv_rtt)
+        return;
+
+    if(sock->data.rcv_copied > sock->data.rcv_space) {
+        sock->data.rcv_space = sock->data.rcv_copied;
+        sz = MIN(2 * sock->data.rcv_copied, TCP_MAX_AUTO_RCVBUF);
+
+        /* If we can't get the memory, just stay where we are. */
+        tcp_rcvbuf_grow(sock, sz);
+    }
+
+    sock->data.rcv_copied = 0;
+    sock->data.rcv_space_time = now;
+}
 
 /* Sockets interface... */
+static inline uint32_t tcp_ehashfn(const struct in6_addr *raddr,
+                                   uint16_t rport, uint16_t lport) {
+    uint32_t h = raddr->__s6_addr.__s6_addr32[0] ^
+                 raddr->__s6_addr.__s6_addr32[1] ^
+                 raddr->__s6_addr.__s6_addr32[2] ^
+                 raddr->__s6_addr.__s6_addr32[3];
+
+    h ^= ((uint32_t)rport << 16) | lport;
+    h ^= h >> 16;
+    h ^= h >> 8;
+
+    return h & (TCP_EHASH_SIZE - 1);
+}
+
+static inline uint32_t tcp_phashfn(uint16_t port) {
+    return ntohs(port) & (TCP_PHASH_SIZE - 1);
+}
+
+static void tcp_hash_remove(struct tcp_sock *sock) {
+    if(sock->hashed & TCP_HASHED_LOOKUP)
+        LIST_REMOVE(sock, hash_list);
+
+    if(sock->hashed & TCP_HASHED_BIND)
+        LIST_REMOVE(sock, bind_list);
+
+    sock->hashed = 0;
+}
+
+/* Put a socket in the lookup tables its addresses call for. This must be
+   called, with the write lock on tcp_sem held, whenever the local port or the
+   remote address of a socket in the list of sockets changes. */
+static void tcp_hash_update(struct tcp_sock *sock) {
+    const struct sockaddr_in6 *raddr = &sock->remote_addr;
+    uint16_t lport = sock->local_addr.sin6_port;
+
+    tcp_hash_remove(sock);
+
+    if(!lport)
+        return;
+
+    LIST_INSERT_HEAD(&tcp_bhash[tcp_phashfn(lport)], sock, bind_list);
+
+    if(IN6_IS_ADDR_UNSPECIFIED(&raddr->sin6_addr))
+        LIST_INSERT_HEAD(&tcp_lhash[tcp_phashfn(lport)], sock, hash_list);
+    else
+        LIST_INSERT_HEAD(&tcp_ehash[tcp_ehashfn(&raddr->sin6_addr,
+                                                raddr->sin6_port, lport)],
+                         sock, hash_list);
+
+    sock->hashed = TCP_HASHED_LOOKUP | TCP_HASHED_BIND;
+}
+
+/* Is any socket other than the one given using this local port? Local ports
+   are only ever changed with the write lock on tcp_sem held, so holding either
+   lock is enough to call this. */
+static int tcp_port_in_use(uint16_t port, const struct tcp_sock *sock) {
+    struct tcp_sock *iter;
+
+    LIST_FOREACH(iter, &tcp_bhash[tcp_phashfn(port)], bind_list) {
+        if(iter != sock && iter->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Pick an unused local port. Ports are handed out round-robin rather than
+   always taking the lowest free one, so that this doesn't have to step over
+   every port in use each time. Returns the port in network byte order, or 0 if
+   they're all taken. Call with the write lock on tcp_sem held. */
+static uint16_t tcp_pick_port(const struct tcp_sock *sock) {
+    uint32_t i;
+    uint16_t port;
+
+    for(i = TCP_PORT_FIRST; i <= TCP_PORT_LAST; ++i) {
+        port = htons(tcp_next_port);
+
+        if(tcp_next_port++ == TCP_PORT_LAST)
+            tcp_next_port = TCP_PORT_FIRST;
+
+        if(!tcp_port_in_use(port, sock))
+            return port;
+    }
+
+    return 0;
+}
+
+static inline uint64_t tcp_due_min(uint64_t due, uint64_t t) {
+    return (!due || t < due) ? t : due;
+}
+
+/* When does something next need doing for this socket on a timer? Returns 0
+   if nothing does, or 1 if something needs doing right away. This must agree
+   with tcp_timer_run(), which is what ends up doing it. */
+static uint64_t tcp_timer_due(const struct tcp_sock *sock) {
+    uint64_t due = 0;
+
+    /* Once closed, all that's left is to free the socket, if it's been closed
+       on our end too. */
+    if((sock->state & 0x0F) == TCP_STATE_CLOSED)
+        return (sock->intflags & TCP_IFLAG_CANBEDEL) ? 1 : 0;
+
+    if((sock->state & 0x0F) == TCP_STATE_LISTEN)
+        return 0;
+
+    if((sock->state == TCP_STATE_ESTABLISHED ||
+        sock->state == TCP_STATE_FIN_WAIT_1 ||
+        sock->state == TCP_STATE_FIN_WAIT_2) && sock->data.delack)
+        due = sock->data.delack_time + TCP_DELACK_TIME;
+
+    switch(sock->state) {
+        case TCP_STATE_SYN_SENT:
+        case TCP_STATE_SYN_RECEIVED:
+            return tcp_due_min(due, sock->data.timer + sock->data.rto);
+
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_CLOSING:
+
+            if(sock->data.snd.una != sock->data.snd.nxt)
+                due = tcp_due_min(due, sock->data.timer + sock->data.rto);
+
+            break;
+
+        case TCP_STATE_TIME_WAIT:
+            return sock->data.timer + 2 * TCP_DEFAULT_MSL;
+
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+
+            if(!sock->data.sndbuf_cur_sz &&
+               (sock->intflags & TCP_IFLAG_QUEUEDCLOSE))
+                return 1;
+
+            if(tcp_unacked(sock))
+                due = tcp_due_min(due, sock->data.timer + sock->data.rto);
+            else if(sock->intflags & TCP_IFLAG_KEEPALIVE)
+                due = tcp_due_min(due, sock->data.last_rcv +
+                                  TCP_KEEPALIVE_IDLE +
+                                  sock->data.ka_probes * TCP_KEEPALIVE_INTVL);
+
+            if((sock->intflags & TCP_IFLAG_CORK) && sock->data.cork_time)
+                due = tcp_due_min(due, sock->data.cork_time + TCP_CORK_TIME);
+
+            break;
+    }
+
+    return due;
+}
+
+/* Put a socket on the timer wheel to be looked at again by the given time, if
+   it isn't going to be already. */
+static void tcp_timer_arm(struct tcp_sock *sock, uint64_t due) {
+    uint64_t tick = due / TCP_WHEEL_TICK;
+
+    irq_disable_scoped();
+
+    if(sock->timer_due) {
+        if(sock->timer_due <= due)
+            return;
+
+        LIST_REMOVE(sock, timer_list);
+    }
+
+    /* Anything that is already due goes in the slot the wheel is on now, so
+       that it doesn't have to wait for the wheel to come back around. */
+    if(tick < tcp_wheel_tick)
+        tick = tcp_wheel_tick;
+
+    sock->timer_due = due;
+    LIST_INSERT_HEAD(&tcp_wheel[tick & (TCP_WHEEL_SLOTS - 1)], sock,
+                     timer_list);
+    net_thd_schedule(thd_cb_id, due);
+}
+
+static void tcp_timer_cancel(struct tcp_sock *sock) {
+    irq_disable_scoped();
+
+    if(sock->timer_due) {
+        LIST_REMOVE(sock, timer_list);
+        sock->timer_due = 0;
+    }
+}
+
+/* Make sure a socket will be looked at in time for whatever it has to do on a
+   timer next. Call this after anything that might have made that sooner. */
+static void tcp_timer_update(struct tcp_sock *sock) {
+    uint64_t due = tcp_timer_due(sock);
+
+    if(due)
+        tcp_timer_arm(sock, due);
+}
+
+/* Take a socket out of the list of sockets and everything else it could be in,
+   before freeing it. Call with the write lock on tcp_sem held. */
+static void tcp_sock_unlink(struct tcp_sock *sock) {
+    tcp_timer_cancel(sock);
+    tcp_hash_remove(sock);
+    LIST_REMOVE(sock, sock_list);
+}
+
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     struct tcp_sock *sock;
 
     (void)type;
     (void)proto;
 
-    if(!(sock = (struct tcp_sock *)malloc(sizeof(struct tcp_sock)))) {
+    if(!(sock = (struct tcp_sock *)pool_alloc(&tcp_sock_pool))) {
         errno = ENOMEM;
         return -1;
     }
@@ -270,7 +1016,7 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
     if(mutex_init(&sock->mutex, MUTEX_TYPE_NORMAL)) {
         errno = ENOMEM;
-        free(sock);
+        pool_free(&tcp_sock_pool, sock);
         return -1;
     }
 
@@ -281,7 +1027,7 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     sock->sndbuf_sz = TCP_DEFAULT_WINDOW;
 
     if(rwsem_write_lock_irqsafe(&tcp_sem)) {
-        free(sock);
+        pool_free(&tcp_sock_pool, sock);
         return -1;
     }
 
@@ -395,8 +1141,10 @@ retry:
 
         case TCP_STATE_ESTABLISHED:
 
-            /* See if all sends have finished... */
+            /* See if all sends have finished... If not, don't let anything
+               hold back the last of the data. */
             if(sock->data.sndbuf_cur_sz) {
+                tcp_send_data(sock, TCP_SEND_PUSH);
                 goto ret_no_remove;
             }
 
@@ -406,8 +1154,7 @@ retry:
         case TCP_STATE_SYN_RECEIVED:
             /* Don't have to worry about queued packets, since we don't allow
                any queueing until after the connection is established. */
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            tcp_queue_fin(sock);
             sock->state = TCP_STATE_FIN_WAIT_1;
             goto ret_no_remove;
 
@@ -415,11 +1162,11 @@ retry:
 
             /* See if all sends have finished... */
             if(sock->data.sndbuf_cur_sz) {
+                tcp_send_data(sock, TCP_SEND_PUSH);
                 goto ret_no_remove;
             }
 
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            tcp_queue_fin(sock);
             sock->state = TCP_STATE_CLOSING;
             goto ret_no_remove;
 
@@ -439,10 +1186,10 @@ retry:
     }
 
 ret_remove:
-    LIST_REMOVE(sock, sock_list);
+    tcp_sock_unlink(sock);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
-    free(sock);
+    pool_free(&tcp_sock_pool, sock);
 
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -459,6 +1206,7 @@ ret_no_remove:
 
     /* Don't free anything here, it will be dealt with later on in the
        net_thd callback. */
+    tcp_timer_update(sock);
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -514,10 +1262,10 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             mutex_lock(&sock->mutex);
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
-            LIST_REMOVE(sock, sock_list);
+            tcp_sock_unlink(sock);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
-            free(sock);
+            pool_free(&tcp_sock_pool, sock);
 
             rwsem_write_unlock(&tcp_sem);
 
@@ -535,7 +1283,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         sock->listen.head = 0;
 
     /* Allocate the memory we will need... */
-    if(!(sock2 = (struct tcp_sock *)malloc(sizeof(struct tcp_sock)))) {
+    if(!(sock2 = (struct tcp_sock *)pool_alloc(&tcp_sock_pool))) {
         mutex_unlock(&sock->mutex);
         errno = ENOMEM;
         return -1;
@@ -546,7 +1294,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     if(mutex_init(&sock2->mutex, MUTEX_TYPE_NORMAL)) {
         mutex_unlock(&sock->mutex);
         errno = ENOMEM;
-        free(sock2);
+        pool_free(&tcp_sock_pool, sock2);
         return -1;
     }
 
@@ -554,7 +1302,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         errno = ENOMEM;
         mutex_unlock(&sock->mutex);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        pool_free(&tcp_sock_pool, sock2);
         return -1;
     }
 
@@ -563,7 +1311,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         mutex_unlock(&sock->mutex);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        pool_free(&tcp_sock_pool, sock2);
         return -1;
     }
 
@@ -573,7 +1321,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        pool_free(&tcp_sock_pool, sock2);
         return -1;
     }
 
@@ -584,7 +1332,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        pool_free(&tcp_sock_pool, sock2);
         return -1;
     }
 
@@ -596,7 +1344,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        pool_free(&tcp_sock_pool, sock2);
         return -1;
     }
 
@@ -607,9 +1355,15 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->local_addr = lsock.local_addr;
     sock2->remote_addr = lsock.remote_addr;
     sock2->hop_limit = sock->hop_limit;
+    sock2->intflags = sock->intflags & (TCP_IFLAG_RCVBUFLOCK |
+                                        TCP_IFLAG_NODELAY | TCP_IFLAG_CORK |
+                                        TCP_IFLAG_KEEPALIVE);
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
+    sock2->data.rcv_space = sock->rcvbuf_sz / 2;
+    sock2->data.rcv_space_time = timer_ms_gettime64();
+    sock2->data.last_rcv = sock2->data.rcv_space_time;
 
     /* Fill in the address, if they asked for it. */
     if(addr != NULL) {
@@ -660,7 +1414,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             free(sock2->data.sndbuf);
             free(sock2->data.rcvbuf);
             mutex_destroy(&sock2->mutex);
-            free(sock2);
+            pool_free(&tcp_sock_pool, sock2);
             errno = EWOULDBLOCK;
             return -1;
         }
@@ -704,10 +1458,22 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
        by the wording of the RFC... */
     sock2->data.snd.iss = (uint32_t)(timer_us_gettime64() >> 2);
     sock2->data.snd.nxt = sock2->data.snd.iss + 1;
+    sock2->data.snd.max = sock2->data.snd.nxt;
     sock2->data.snd.una = sock2->data.snd.iss;
     sock2->data.snd.wnd = lsock.wnd;
     sock2->data.snd.wl1 = sock2->data.snd.iss;
     sock2->data.snd.mss = lsock.mss;
+    sock2->data.sack_ok = lsock.sack_ok;
+    sock2->data.ts_ok = lsock.ts_ok;
+    sock2->data.ts_recent = lsock.ts_recent;
+
+    if(lsock.wscale >= 0) {
+        sock2->data.ws_ok = 1;
+        sock2->data.snd_wscale = lsock.wscale;
+        sock2->data.rcv_wscale = tcp_wscale_for(tcp_rcvbuf_max(sock2));
+    }
+
+    tcp_cc_init(sock2);
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
 
@@ -719,6 +1485,8 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.timer = timer_ms_gettime64();
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
+    tcp_hash_update(sock2);
+    tcp_timer_update(sock2);
     mutex_unlock(&sock2->mutex);
 
     sock->state &= ~TCP_STATE_ACCEPTING;
@@ -730,7 +1498,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -817,82 +1585,42 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &tcp_socks, sock_list) {
-            if(iter == sock)
-                continue;
-
-            if(mutex_lock_irqsafe(&iter->mutex)) {
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                return -1;
-            }
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&iter->mutex);
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                errno = EADDRINUSE;
-                return -1;
-            }
-
-            mutex_unlock(&iter->mutex);
+        if(tcp_port_in_use(realaddr6.sin6_port, sock)) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        sock->local_addr = realaddr6;
     }
-    else {
-        uint16_t port = 1024, tmp = 0;
+    else if(!(realaddr6.sin6_port = tcp_pick_port(sock))) {
+        mutex_unlock(&sock->mutex);
+        rwsem_write_unlock(&tcp_sem);
+        errno = EADDRINUSE;
+        return -1;
+    }
 
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
+    sock->local_addr = realaddr6;
+    tcp_hash_update(sock);
 
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
-        }
-
-        sock->local_addr = realaddr6;
-        sock->local_addr.sin6_port = htons(port);
-    }
-
-    /* Release the locks, we're done */
-    mutex_unlock(&sock->mutex);
-    rwsem_write_unlock(&tcp_sem);
+    /* Release the locks, we're done */
+    mutex_unlock(&sock->mutex);
+    rwsem_write_unlock(&tcp_sem);
 
     return 0;
 }
 
 static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                            socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    netif_t *net;
 
     if(addr == NULL) {
         errno = EDESTADDRREQ;
         return -1;
     }
 
-    if(!net_default_dev) {
-        errno = ENETDOWN;
-        return -1;
-    }
-
     switch(addr->sa_family) {
         case AF_INET:
 
@@ -932,6 +1660,12 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
+    /* Figure out which device the connection goes through */
+    if(!(net = net_route(&realaddr6.sin6_addr))) {
+        errno = ENETDOWN;
+        return -1;
+    }
+
     if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
         return -1;
 
@@ -972,43 +1706,24 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
 
     /* See if the socket is already bound to a local port */
     if(!sock->local_addr.sin6_port) {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
+        if(!(sock->local_addr.sin6_port = tcp_pick_port(sock))) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRNOTAVAIL;
+            return -1;
         }
 
-        sock->local_addr.sin6_port = htons(port);
-
         if(addr->sa_family == AF_INET) {
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3] =
-                htonl(net_ipv4_address(net_default_dev->ip_addr));
+                htonl(net_ipv4_address(net->ip_addr));
         }
     }
 
     /* Set the remote address on the socket and go to the SYN-SENT state (this
        includes setting up all the data we need for that). */
     sock->remote_addr = realaddr6;
+    tcp_hash_update(sock);
 
     if(!(sock->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOBUFS;
@@ -1045,11 +1760,18 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     }
 
     sock->data.rcv.wnd = sock->rcvbuf_sz;
+    sock->data.rcv_space = sock->rcvbuf_sz / 2;
+    sock->data.rcv_space_time = timer_ms_gettime64();
+    sock->data.last_rcv = sock->data.rcv_space_time;
+    sock->data.rcv_wscale = tcp_wscale_for(tcp_rcvbuf_max(sock));
     sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
-    sock->data.net = net_default_dev;
+    sock->data.net = net;
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.snd.max = sock->data.snd.nxt;
+    sock->data.rto = TCP_INITIAL_RTO;
+    sock->data.timer = timer_ms_gettime64();
     sock->state = TCP_STATE_SYN_SENT;
 
     /* Send a <SYN> packet */
@@ -1059,6 +1781,8 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    tcp_timer_update(sock);
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1276,11 +2000,30 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
             sock->data.rcvbuf_head = size - tmp;
     }
 
-    /* If we've got nothing left, move the pointers back to the beginning */
-    if(!sock->data.rcvbuf_cur_sz) {
+    /* If we've got nothing left, move the pointers back to the beginning,
+       unless there's out-of-order data waiting past the end. */
+    if(!sock->data.rcvbuf_cur_sz && !sock->data.ooo_cnt) {
         sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     }
 
+    if(!(flags & MSG_PEEK)) {
+        if(!(sock->intflags & TCP_IFLAG_RCVBUFLOCK))
+            tcp_rcvbuf_tune(sock, size);
+
+        /* Let the other side know if the window has opened up by a good bit
+           since we last told it (RFC 1122, section 4.2.3.3). */
+        if(sock->state == TCP_STATE_ESTABLISHED ||
+           sock->state == TCP_STATE_FIN_WAIT_1 ||
+           sock->state == TCP_STATE_FIN_WAIT_2) {
+            tmp = sock->data.rcv.nxt + (tcp_adv_wnd(sock) <<
+                                        sock->data.rcv_wscale) -
+                  sock->data.rcv_adv;
+
+            if(tmp >= (int)MIN(sock->rcvbuf_sz / 2, TCP_SMSS(sock)))
+                tcp_send_ack(sock);
+        }
+    }
+
     if(addr != NULL) {
         if(sock->domain == AF_INET) {
             struct sockaddr_in realaddr;
@@ -1322,47 +2065,25 @@ out:
     return size;
 }
 
-static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
-    struct tcp_sock *sock;
-    ssize_t size;
-    uint32_t bsz, tmp;
-    uint8_t *sb, *buf = (uint8_t *)message;
-
-    /* Check the parameters first */
-    if(message == NULL || (addr != NULL && addr_len == 0)) {
-        errno = EFAULT;
-        return -1;
-    }
-
-    /* Lock the socket's mutex, since we're going to be manipulating its state
-       in here... */
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
-        return -1;
-
-    rwsem_read_unlock(&tcp_sem);
-
+/* Make sure data can be sent on a socket. Returns -1 and sets errno if not. */
+static int tcp_check_send(struct tcp_sock *sock) {
     /* Check if the socket has been shut down for writing. */
     if(sock->flags & (SHUT_WR << 24)) {
         errno = EPIPE;
-        size = -1;
-        goto out;
+        return -1;
     }
 
     /* Check to make sure the socket is connected. */
     switch(sock->state) {
         case TCP_STATE_CLOSED | TCP_STATE_RESET:
             errno = ECONNRESET;
-            size = -1;
-            goto out;
+            return -1;
 
         case TCP_STATE_CLOSED:
         case TCP_STATE_LISTEN:
         case TCP_STATE_SYN_SENT:
             errno = ENOTCONN;
-            size = -1;
-            goto out;
+            return -1;
 
         case TCP_STATE_FIN_WAIT_1:
         case TCP_STATE_FIN_WAIT_2:
@@ -1370,8 +2091,72 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
         case TCP_STATE_LAST_ACK:
         case TCP_STATE_TIME_WAIT:
             errno = EPIPE;
-            size = -1;
-            goto out;
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Copy as much of the data as fits into the send buffer. Returns the number of
+   bytes copied. */
+static uint32_t tcp_sndbuf_append(struct tcp_sock *sock, const uint8_t *buf,
+                                  uint32_t length) {
+    uint32_t size, tmp;
+    uint8_t *sb;
+
+    /* Reset the pointers if there's nothing in the buffer */
+    if(sock->data.sndbuf_cur_sz == 0)
+        sock->data.sndbuf_head = sock->data.sndbuf_acked =
+                                     sock->data.sndbuf_tail = 0;
+
+    /* Figure out how much we can copy in */
+    size = sock->sndbuf_sz - sock->data.sndbuf_cur_sz;
+
+    if(length < size)
+        size = length;
+
+    sb = sock->data.sndbuf + sock->data.sndbuf_tail;
+    sock->data.sndbuf_cur_sz += size;
+
+    if(sock->data.sndbuf_tail + size <= sock->sndbuf_sz) {
+        memcpy(sb, buf, size);
+        sock->data.sndbuf_tail += size;
+
+        if(sock->data.sndbuf_tail == sock->sndbuf_sz)
+            sock->data.sndbuf_tail = 0;
+    }
+    else {
+        tmp = sock->sndbuf_sz - sock->data.sndbuf_tail;
+        memcpy(sb, buf, tmp);
+        memcpy(sock->data.sndbuf, buf + tmp, size - tmp);
+        sock->data.sndbuf_tail = size - tmp;
+    }
+
+    return size;
+}
+
+static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct tcp_sock *sock;
+    ssize_t size;
+
+    /* Check the parameters first */
+    if(message == NULL || (addr != NULL && addr_len == 0)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    /* Lock the socket's mutex, since we're going to be manipulating its state
+       in here... */
+    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+        return -1;
+
+    rwsem_read_unlock(&tcp_sem);
+
+    if(tcp_check_send(sock) < 0) {
+        size = -1;
+        goto out;
     }
 
     /* Check if there was an address specified, if so, return error. */
@@ -1409,41 +2194,97 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
         }
     }
 
-    /* Reset the pointers if there's nothing in the buffer */
-    if(sock->data.sndbuf_cur_sz == 0)
-        sock->data.sndbuf_head = sock->data.sndbuf_acked =
-                                     sock->data.sndbuf_tail = 0;
+    size = tcp_sndbuf_append(sock, (const uint8_t *)message, length);
 
-    /* Figure out how much we can copy in */
-    bsz = sock->sndbuf_sz - sock->data.sndbuf_cur_sz;
+    /* Send some data! */
+    tcp_send_data(sock, TCP_SEND_NEW);
 
-    if(length > bsz)
-        size = bsz;
-    else
-        size = length;
+out:
+    mutex_unlock(&sock->mutex);
+    return size;
+}
 
-    sb = sock->data.sndbuf + sock->data.sndbuf_tail;
-    sock->data.sndbuf_cur_sz += size;
+/* The file is mapped and copied straight from the mapping into the send buffer,
+   rather than being read into a user buffer and then copied again by send().
+   Files that can't be mapped are left to the generic code in fs_socket. */
+static ssize_t net_tcp_sendfile(net_socket_t *hnd, file_t fd, off_t *offset,
+                                size_t count) {
+    struct tcp_sock *sock;
+    const uint8_t *map;
+    ssize_t size = 0;
+    size_t total;
+    off_t pos;
+    uint32_t n;
 
-    if(sock->data.sndbuf_tail + size <= sock->sndbuf_sz) {
-        memcpy(sb, buf, size);
-        sock->data.sndbuf_tail += size;
+    if(!(map = (const uint8_t *)fs_mmap(fd))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
 
-        if(sock->data.sndbuf_tail == sock->sndbuf_sz)
-            sock->data.sndbuf_tail = 0;
+    if((pos = offset ? *offset : fs_tell(fd)) < 0) {
+        errno = EINVAL;
+        return -1;
     }
-    else {
-        tmp = sock->sndbuf_sz - sock->data.sndbuf_tail;
-        memcpy(sb, buf, tmp);
-        memcpy(sock->data.sndbuf, buf + tmp, size - tmp);
-        sock->data.sndbuf_tail = size - tmp;
+
+    total = fs_total(fd);
+
+    if((size_t)pos >= total)
+        return 0;
+
+    if(count > total - pos)
+        count = total - pos;
+
+    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+        return -1;
+
+    rwsem_read_unlock(&tcp_sem);
+
+    if(tcp_check_send(sock) < 0) {
+        mutex_unlock(&sock->mutex);
+        return -1;
     }
 
-    /* Send some data! */
-    tcp_send_data(sock, 0);
+    while((size_t)size < count) {
+        if(sock->data.sndbuf_cur_sz == sock->sndbuf_sz) {
+            /* Only wait if nothing has been sent yet on a non-blocking
+               socket. */
+            if((sock->flags & FS_SOCKET_NONBLOCK) || irq_inside_int()) {
+                if(!size) {
+                    errno = EWOULDBLOCK;
+                    size = -1;
+                }
+
+                break;
+            }
+
+            cond_wait(&sock->data.send_cv, &sock->mutex);
+
+            /* The connection may have gone away while we were waiting. */
+            if(tcp_check_send(sock) < 0) {
+                if(!size)
+                    size = -1;
+
+                break;
+            }
+
+            continue;
+        }
+
+        n = tcp_sndbuf_append(sock, map + pos + size, count - size);
+        size += n;
+
+        tcp_send_data(sock, TCP_SEND_NEW);
+    }
 
-out:
     mutex_unlock(&sock->mutex);
+
+    if(size > 0) {
+        if(offset)
+            *offset = pos + size;
+        else
+            fs_seek(fd, pos + size, SEEK_SET);
+    }
+
     return size;
 }
 
@@ -1504,6 +2345,10 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_STREAM;
                     goto copy_int;
+
+                case SO_KEEPALIVE:
+                    tmp = !!(sock->intflags & TCP_IFLAG_KEEPALIVE);
+                    goto copy_int;
             }
 
             break;
@@ -1539,7 +2384,11 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
         case IPPROTO_TCP:
             switch(option_name) {
                 case TCP_NODELAY:
-                    tmp = 1;
+                    tmp = !!(sock->intflags & TCP_IFLAG_NODELAY);
+                    goto copy_int;
+
+                case TCP_CORK:
+                    tmp = !!(sock->intflags & TCP_IFLAG_CORK);
                     goto copy_int;
             }
 
@@ -1577,7 +2426,6 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                               const void *option_value, socklen_t option_len) {
     struct tcp_sock *sock;
     int tmp;
-    uint8_t *new_ptr;
 
     if(!option_value || !option_len) {
         errno = EFAULT;
@@ -1600,18 +2448,23 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 -
+                       TCP_MAX_BUFFER. Setting it turns off automatic growth. */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_BUFFER)
+                        tmp = TCP_MAX_BUFFER;
 
-                    new_ptr = realloc(sock->data.rcvbuf, tmp);
-                    if(!new_ptr)
+                    sock->intflags |= TCP_IFLAG_RCVBUFLOCK;
+
+                    /* Without a connection, there's no buffer yet. Once there
+                       is one, it can only grow, since we can't take back
+                       window we've already offered. */
+                    if(!tcp_has_bufs(sock))
+                        sock->rcvbuf_sz = tmp;
+                    else if(tcp_rcvbuf_grow(sock, tmp))
                         goto ret_nomem;
 
-                    sock->data.rcvbuf = new_ptr;
-                    sock->rcvbuf_sz = tmp;
                     goto ret_success;
 
                 case SO_SNDBUF:
@@ -1619,19 +2472,32 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Send buffer size must be in the range 2048 - 65535 */
+                    /* Send buffer size must be in the range 2048 -
+                       TCP_MAX_BUFFER */
                     if(tmp < 2048)
                         tmp = 2048;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_BUFFER)
+                        tmp = TCP_MAX_BUFFER;
 
-                    new_ptr = realloc(sock->data.sndbuf, tmp);
-                    if(!new_ptr) {
+                    if(!tcp_has_bufs(sock))
+                        sock->sndbuf_sz = tmp;
+                    else if(tcp_sndbuf_resize(sock, tmp))
                         goto ret_nomem;
-                    }
 
-                    sock->data.sndbuf = new_ptr;
-                    sock->sndbuf_sz = tmp;
+                    goto ret_success;
+
+                case SO_KEEPALIVE:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    if(*((int *)option_value))
+                        sock->intflags |= TCP_IFLAG_KEEPALIVE;
+                    else
+                        sock->intflags &= ~TCP_IFLAG_KEEPALIVE;
+
+                    if(tcp_has_bufs(sock))
+                        tcp_timer_update(sock);
+
                     goto ret_success;
             }
 
@@ -1699,13 +2565,25 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
         case IPPROTO_TCP:
             switch(option_name) {
                 case TCP_NODELAY:
+                case TCP_CORK:
                     if(option_len != sizeof(int))
                         goto ret_inval;
 
-                    tmp = *((int *)option_value);
+                    tmp = option_name == TCP_NODELAY ? TCP_IFLAG_NODELAY :
+                          TCP_IFLAG_CORK;
 
-                    if(tmp == 0)
-                        goto ret_inval;
+                    if(*((int *)option_value))
+                        sock->intflags |= tmp;
+                    else
+                        sock->intflags &= ~tmp;
+
+                    /* Turning on TCP_NODELAY or off TCP_CORK sends anything
+                       that was being held back. */
+                    if((sock->state == TCP_STATE_ESTABLISHED ||
+                        sock->state == TCP_STATE_CLOSE_WAIT) &&
+                       !(sock->intflags & TCP_IFLAG_CORK) &&
+                       tcp_unacked(sock) < sock->data.sndbuf_cur_sz)
+                        tcp_send_data(sock, TCP_SEND_PUSH);
 
                     goto ret_success;
             }
@@ -2012,6 +2890,7 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
 
     net_ipv6_send(net, (const uint8_t *)&pkt, sizeof(tcp_hdr_t), 0, IPPROTO_TCP,
                   src, dst);
+    ++tcp_stats.pkt_sent;
 }
 
 static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
@@ -2053,179 +2932,526 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
 
     net_ipv6_send(net, (const uint8_t *)&pkt, sizeof(tcp_hdr_t), 0, IPPROTO_TCP,
                   dst, src);
+    ++tcp_stats.pkt_sent;
+}
+
+static void tcp_put_ts(uint8_t *opts, uint32_t tsecr) {
+    opts[0] = TCP_OPT_NOP;
+    opts[1] = TCP_OPT_NOP;
+    opts[2] = TCP_OPT_TIMESTAMP;
+    opts[3] = 10;
+    tcp_put32(opts + 4, tcp_ts_now());
+    tcp_put32(opts + 8, tsecr);
 }
 
 static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 24];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    uint8_t *opts = hdr->options;
+    int sz = sizeof(tcp_hdr_t);
     uint16_t cs;
 
-    /* Fill in the base packet */
+    /* Fill in the base packet. The window in a SYN is never scaled. */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
     hdr->seq = htonl(sock->data.snd.iss);
     hdr->ack = htonl(sock->data.rcv.nxt);
 
-    if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+    hdr->wnd = htons(MIN(sock->data.rcv.wnd, 65535));
+    hdr->checksum = 0;
+    hdr->urg = 0;
+
+    /* Fill in our SYN options: the MSS, and that we can do SACK, window
+       scaling and timestamps. We always offer the extensions on a SYN, but only
+       agree to them on a SYN,ACK if the other side offered them first. */
+    opts[0] = TCP_OPT_MSS;
+    opts[1] = 4;
+    opts[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    opts[3] = TCP_DEFAULT_MSS & 0xFF;
+    sz += 4;
+
+    if(!ack || sock->data.sack_ok) {
+        opts[4] = TCP_OPT_NOP;
+        opts[5] = TCP_OPT_NOP;
+        opts[6] = TCP_OPT_SACK_PERM;
+        opts[7] = 2;
+        opts += 4;
+        sz += 4;
     }
-    else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+
+    if(!ack || sock->data.ws_ok) {
+        opts[4] = TCP_OPT_NOP;
+        opts[5] = TCP_OPT_WSCALE;
+        opts[6] = 3;
+        opts[7] = sock->data.rcv_wscale;
+        opts += 4;
+        sz += 4;
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->checksum = 0;
-    hdr->urg = 0;
+    if(!ack || sock->data.ts_ok) {
+        tcp_put_ts(opts + 4, sock->data.ts_recent);
+        sz += TCP_TS_LEN;
+    }
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+    if(ack) {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(sz >> 2));
+    }
+    else {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(sz >> 2));
+    }
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  sz, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
+    ++tcp_stats.pkt_sent;
+
+    return net_ipv6_send(sock->data.net, rawpkt, sz,
                          sock->hop_limit, IPPROTO_TCP,
                          &sock->local_addr.sin6_addr,
                          &sock->remote_addr.sin6_addr);
 }
 
+/* Fill in the options for a segment other than a SYN: a timestamp, if we're
+   using them, and if sack is set, a SACK option describing the out-of-order
+   data we're holding. The SACK blocks go with the block holding the most
+   recently received segment first (RFC 2018, section 4). Returns the length of
+   the options. */
+static int tcp_fill_opts(const struct tcp_sock *sock, uint8_t *opts, int sack) {
+    const struct tcp_sack *blks = sock->data.ooo;
+    int i, first = -1, n = 0, len = 0, max = TCP_MAX_SACK;
+
+    if(sock->data.ts_ok) {
+        tcp_put_ts(opts, sock->data.ts_recent);
+        opts += TCP_TS_LEN;
+        len = TCP_TS_LEN;
+        max = 3;
+    }
+
+    if(!sack || !sock->data.sack_ok || !sock->data.ooo_cnt)
+        return len;
+
+    for(i = 0; i < sock->data.ooo_cnt; ++i) {
+        if(SEQ_LE(blks[i].left, sock->data.ooo_last) &&
+           SEQ_LT(sock->data.ooo_last, blks[i].right))
+            first = i;
+    }
+
+    if(first >= 0) {
+        tcp_put32(opts + 4, blks[first].left);
+        tcp_put32(opts + 8, blks[first].right);
+        ++n;
+    }
+
+    for(i = 0; i < sock->data.ooo_cnt && n < max; ++i) {
+        if(i == first)
+            continue;
+
+        tcp_put32(opts + 4 + n * 8, blks[i].left);
+        tcp_put32(opts + 8 + n * 8, blks[i].right);
+        ++n;
+    }
+
+    opts[0] = TCP_OPT_NOP;
+    opts[1] = TCP_OPT_NOP;
+    opts[2] = TCP_OPT_SACK;
+    opts[3] = 2 + n * 8;
+
+    return len + 4 + n * 8;
+}
+
 static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_TS_LEN];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    int sz;
     uint16_t cs;
 
     /* Fill in the base packet */
+    sz = sizeof(tcp_hdr_t) + tcp_fill_opts(sock, hdr->options, 0);
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
     hdr->seq = htonl(sock->data.snd.nxt);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(sz >> 2));
+    hdr->wnd = htons(tcp_adv_wnd(sock));
+    tcp_note_ack(sock);
     hdr->checksum = 0;
     hdr->urg = 0;
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+                                  sz, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
+    net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit,
                   IPPROTO_TCP, &sock->local_addr.sin6_addr,
                   &sock->remote_addr.sin6_addr);
+    ++tcp_stats.pkt_sent;
 }
 
-static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
-    uint16_t c;
-
-    /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
-
-    /* Calculate the real checksum */
-    c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                 &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+/* Fill in the checksum of the segment built in p and send it off. Only the
+   first hlen bytes of it are added up here, anything after that has already
+   been added up into sum as it was copied in. */
+static void tcp_output(struct tcp_sock *sock, net_pbuf_t *p, size_t hlen,
+                       uint32_t sum) {
+    tcp_hdr_t *hdr = (tcp_hdr_t *)p->data;
+    uint16_t cs;
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                  &sock->remote_addr.sin6_addr, p->len,
+                                  IPPROTO_TCP);
+    sum = net_ipv4_checksum_partial(p->data, hlen, sum + cs);
+    hdr->checksum = net_ipv4_checksum_fold(sum);
+
+    net_ipv6_send_pbuf(sock->data.net, p, sock->hop_limit, IPPROTO_TCP,
+                       &sock->local_addr.sin6_addr,
+                       &sock->remote_addr.sin6_addr);
+    ++tcp_stats.pkt_sent;
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
-    uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
+static void tcp_send_ack(struct tcp_sock *sock) {
+    net_pbuf_t *p;
+    tcp_hdr_t *hdr;
+    int sz;
 
-    if(!resend) {
-        seq = sock->data.snd.nxt;
-        unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
-        head = sock->data.sndbuf_head;
-    }
-    else {
-        seq = sock->data.snd.una;
-        unacked = 0;
-        head = sock->data.sndbuf_acked;
-    }
+    /* If there's no buffer for it, the ACK will just have to be sent later. */
+    if(!(p = net_pbuf_alloc(sizeof(tcp_hdr_t) + TCP_MAX_OPTS_LEN)))
+        return;
 
-    if(!wnd)
-        wnd = 1;
+    /* Fill in the base packet */
+    hdr = (tcp_hdr_t *)p->data;
+    sz = sizeof(tcp_hdr_t) + tcp_fill_opts(sock, hdr->options, 1);
+    net_pbuf_trim(p, sz);
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(sz >> 2));
+    hdr->wnd = htons(tcp_adv_wnd(sock));
+    tcp_note_ack(sock);
+    hdr->checksum = 0;
+    hdr->urg = 0;
+
+    tcp_output(sock, p, sz, 0);
+}
+
+/* Send our FIN, which takes up one sequence number, and start timing it. */
+static void tcp_queue_fin(struct tcp_sock *sock) {
+    tcp_send_fin_ack(sock);
+    sock->data.snd.max = ++sock->data.snd.nxt;
+    sock->data.timer = timer_ms_gettime64();
+    tcp_timer_update(sock);
+}
+
+/* Send one segment with len bytes of data from the send buffer, starting at
+   position head in the buffer. */
+static void tcp_send_segment(struct tcp_sock *sock, uint32_t seq, uint32_t head,
+                             uint32_t len) {
+    net_pbuf_t *p;
+    tcp_hdr_t *hdr;
+    uint32_t hlen, sz, sum;
+
+    /* The data is still in the send buffer, so if there's no packet buffer to
+       put it in, it'll go out when it is retransmitted. */
+    if(!(p = net_pbuf_alloc(sizeof(tcp_hdr_t) + TCP_MAX_OPTS_LEN + len)))
+        return;
 
     /* Fill in the base packet */
+    hdr = (tcp_hdr_t *)p->data;
+    hlen = sizeof(tcp_hdr_t) + tcp_fill_opts(sock, hdr->options, 0);
+    net_pbuf_trim(p, hlen + len);
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(seq);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(hlen >> 2));
+    hdr->wnd = htons(tcp_adv_wnd(sock));
+    tcp_note_ack(sock);
+    hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
+    /* Copy in the data, straight from the send buffer to where it goes in the
+       frame, adding it up for the checksum on the way. */
+    if(head + len <= sock->sndbuf_sz) {
+        sum = net_pbuf_copy_in_cksum(p, hlen, sock->data.sndbuf + head, len);
+    }
+    else {
+        sz = sock->sndbuf_sz - head;
+        sum = net_pbuf_copy_in_cksum(p, hlen, sock->data.sndbuf + head, sz);
+        sum = net_ipv4_checksum_add(sum,
+                                    net_pbuf_copy_in_cksum(p, hlen + sz,
+                                                           sock->data.sndbuf,
+                                                           len - sz), sz);
+    }
 
-        if(snd > sock->data.snd.mss - sizeof(tcp_hdr_t))
-            snd = sock->data.snd.mss - sizeof(tcp_hdr_t);
+    tcp_output(sock, p, hlen, sum);
+}
 
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
-            snd = sock->data.sndbuf_cur_sz - unacked;
+/* Find the first hole in what the other side has told us it has with SACK,
+   skipping anything we've already resent in this recovery. Returns the length
+   of the hole, or 0 if there isn't one. */
+static uint32_t tcp_sack_hole(const struct tcp_sock *sock, uint32_t *seq) {
+    uint32_t s = sock->data.snd.una;
+    int i;
 
-        /* Copy in the data */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+    if(SEQ_GT(sock->data.high_rxt, s))
+        s = sock->data.high_rxt;
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
+    for(i = 0; i < sock->data.sacked_cnt; ++i) {
+        if(SEQ_LT(s, sock->data.sacked[i].left)) {
+            *seq = s;
+            return sock->data.sacked[i].left - s;
         }
-        else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+
+        if(SEQ_LT(s, sock->data.sacked[i].right))
+            s = sock->data.sacked[i].right;
+    }
+
+    return 0;
+}
+
+/* Send as much new data as the windows allow or, for TCP_SEND_RESEND, send a
+   segment again: the first hole SACK has told us about, or the oldest
+   unacknowledged segment without SACK. */
+static void tcp_send_data(struct tcp_sock *sock, int how) {
+    uint32_t smss = TCP_SMSS(sock);
+    uint32_t flight = tcp_unacked(sock);
+    uint32_t wnd, len, seq, head, off;
+    uint64_t now = timer_ms_gettime64();
+
+    if(how == TCP_SEND_RESEND) {
+        seq = sock->data.snd.nxt - flight;
+        len = flight;
+
+        if(sock->data.sacked_cnt) {
+            if(!(len = tcp_sack_hole(sock, &seq)))
+                return;
         }
 
-        sz = snd + sizeof(tcp_hdr_t);
-        wnd -= snd;
-        seq += snd;
-        unacked += snd;
+        /* Don't go past the end of the buffered data (i.e, into our FIN). */
+        off = seq - (sock->data.snd.nxt - flight);
+
+        if(off >= flight)
+            return;
+
+        len = MIN(MIN(len, flight - off), smss);
+        head = sock->data.sndbuf_acked + off;
+
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+        tcp_send_segment(sock, seq, head, len);
 
-        net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
-                      &sock->local_addr.sin6_addr,
-                      &sock->remote_addr.sin6_addr);
+        if(SEQ_GT(seq + len, sock->data.high_rxt))
+            sock->data.high_rxt = seq + len;
+
+        if(sock->data.sacked_cnt)
+            ++tcp_stats.sack_retransmits;
+
+        /* Karn's algorithm: don't time a segment that has been resent. */
+        sock->data.rtt_timing = 0;
+        sock->data.timer = now;
+        ++tcp_stats.retransmits;
+        tcp_timer_update(sock);
+        return;
+    }
+
+    /* Limited transmit (RFC 3042): each of the first two duplicate ACKs lets
+       one more segment out, so that small windows still see three of them. */
+    wnd = sock->data.cwnd;
+
+    if(!sock->data.recovering)
+        wnd += MIN(sock->data.dupacks, 2) * smss;
+
+    wnd = MIN(sock->data.snd.wnd, wnd);
+
+    /* Probe a zero window with a single byte. */
+    if(!sock->data.snd.wnd && !flight)
+        wnd = 1;
+
+    /* The retransmission timer starts when data goes out with nothing else
+       outstanding. */
+    if(!flight)
+        sock->data.timer = now;
+
+    seq = sock->data.snd.nxt;
+    head = sock->data.sndbuf_head;
+
+    while(flight < sock->data.sndbuf_cur_sz && flight < wnd) {
+        len = MIN(sock->data.sndbuf_cur_sz - flight, wnd - flight);
+
+        if(len > smss)
+            len = smss;
+
+        /* Nagle's algorithm (RFC 1122, section 4.2.3.4): while anything is
+           unacknowledged, hold back a segment that's short because there's
+           no more data to put in it, so that small writes get coalesced. A
+           corked socket holds it back regardless, for a little while. */
+        if(how != TCP_SEND_PUSH &&
+           sock->data.sndbuf_cur_sz - flight < smss &&
+           ((sock->intflags & TCP_IFLAG_CORK) ||
+            (flight && !(sock->intflags & TCP_IFLAG_NODELAY)))) {
+            if((sock->intflags & TCP_IFLAG_CORK) && !sock->data.cork_time)
+                sock->data.cork_time = now;
+
+            break;
+        }
+
+        tcp_send_segment(sock, seq, head, len);
+        sock->data.cork_time = 0;
+
+        if(SEQ_LT(seq, sock->data.snd.max)) {
+            ++tcp_stats.retransmits;
+        }
+        else if(!sock->data.rtt_timing) {
+            sock->data.rtt_timing = 1;
+            sock->data.rtt_seq = seq;
+            sock->data.rtt_time = now;
+        }
+
+        head += len;
+
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
+
+        seq += len;
+        flight += len;
     }
 
-    sock->data.timer = timer_ms_gettime64();
     sock->data.sndbuf_head = head;
     sock->data.snd.nxt = seq;
+
+    if(SEQ_GT(seq, sock->data.snd.max))
+        sock->data.snd.max = seq;
+
+    tcp_timer_update(sock);
+}
+
+/* Update the round-trip time estimate with a new sample and recalculate the
+   retransmission timeout (RFC 6298, section 2). srtt is kept scaled by 8 and
+   rttvar by 4, so that 4 * RTTVAR is just rttvar. */
+static void tcp_rtt_update(struct tcp_sock *sock, uint32_t rtt) {
+    int32_t delta;
+    uint32_t rto;
+
+    if(!rtt)
+        rtt = 1;
+
+    if(!sock->data.srtt) {
+        sock->data.srtt = rtt << 3;
+        sock->data.rttvar = rtt << 1;
+    }
+    else {
+        delta = rtt - (sock->data.srtt >> 3);
+        sock->data.srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        sock->data.rttvar += delta - (sock->data.rttvar >> 2);
+    }
+
+    rto = (sock->data.srtt >> 3) + sock->data.rttvar;
+    sock->data.rto = MAX(TCP_MIN_RTO, MIN(rto, TCP_MAX_RTO));
+}
+
+/* The retransmission timer went off. Collapse the congestion window, back off
+   the timer and start sending again from the oldest unacknowledged byte. */
+static void tcp_rto_expired(struct tcp_sock *sock) {
+    uint32_t smss = TCP_SMSS(sock);
+    uint32_t flight = tcp_unacked(sock);
+
+    ++tcp_stats.timeouts;
+
+    sock->data.ssthresh = MAX(flight / 2, 2 * smss);
+    sock->data.cwnd = smss;
+    sock->data.dupacks = 0;
+    sock->data.recovering = 0;
+    sock->data.recover = sock->data.snd.max;
+    sock->data.rtt_timing = 0;
+    sock->data.rto = MIN(sock->data.rto * 2, TCP_MAX_RTO);
+
+    /* The other side is allowed to throw away data it has SACKed, so forget
+       about all of that and start over (RFC 2018, section 8). */
+    sock->data.sacked_cnt = 0;
+    sock->data.high_rxt = sock->data.snd.una;
+
+    sock->data.snd.nxt -= flight;
+    sock->data.sndbuf_head = sock->data.sndbuf_acked;
+    tcp_send_data(sock, TCP_SEND_NEW);
+}
+
+/* Grow (or, in fast recovery, deflate) the congestion window for an ACK of
+   new data. */
+static void tcp_cc_ack(struct tcp_sock *sock, uint32_t ack, uint32_t acked) {
+    uint32_t smss = TCP_SMSS(sock);
+
+    sock->data.dupacks = 0;
+
+    if(sock->data.recovering) {
+        if(SEQ_GE(ack, sock->data.recover)) {
+            /* Everything outstanding when we entered recovery is acked. */
+            sock->data.cwnd = MIN(sock->data.ssthresh,
+                                  tcp_unacked(sock) + smss);
+            sock->data.recovering = 0;
+        }
+        else {
+            /* A partial ACK means the next segment was lost as well. */
+            tcp_send_data(sock, TCP_SEND_RESEND);
+            sock->data.cwnd -= MIN(acked, sock->data.cwnd);
+
+            if(acked >= smss)
+                sock->data.cwnd += smss;
+        }
+
+        if(sock->data.cwnd < smss)
+            sock->data.cwnd = smss;
+    }
+    else if(sock->data.cwnd < sock->data.ssthresh) {
+        /* Slow start */
+        sock->data.cwnd += MIN(acked, smss);
+    }
+    else {
+        /* Congestion avoidance */
+        sock->data.cwnd += MAX(smss * smss / sock->data.cwnd, 1);
+    }
+}
+
+/* Count a duplicate ACK, doing a fast retransmit on the third one. */
+static void tcp_cc_dupack(struct tcp_sock *sock, uint32_t ack) {
+    uint32_t smss = TCP_SMSS(sock), seq;
+
+    if(sock->data.dupacks < 0xFF)
+        ++sock->data.dupacks;
+
+    if(sock->data.dupacks == 3 && !sock->data.recovering) {
+        /* Don't go into recovery again for losses from before the last time
+           (RFC 6582, section 3.2). */
+        if(!SEQ_GT(ack, sock->data.recover))
+            return;
+
+        sock->data.ssthresh = MAX(tcp_unacked(sock) / 2, 2 * smss);
+        sock->data.recover = sock->data.snd.max;
+        sock->data.recovering = 1;
+        sock->data.high_rxt = sock->data.snd.una;
+        ++tcp_stats.fast_retransmits;
+        tcp_send_data(sock, TCP_SEND_RESEND);
+        sock->data.cwnd = sock->data.ssthresh + 3 * smss;
+    }
+    else if(sock->data.recovering) {
+        /* Each duplicate ACK means another segment has left the network, so
+           fill in another hole if SACK says there is one, or send new data. */
+        sock->data.cwnd += smss;
+        tcp_send_data(sock, tcp_sack_hole(sock, &seq) ? TCP_SEND_RESEND :
+                                                        TCP_SEND_NEW);
+    }
+    else if(sock->data.dupacks < 3) {
+        tcp_send_data(sock, TCP_SEND_NEW);
+    }
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2234,6 +3460,37 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
      ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
      ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
 
+/* Does an incoming packet belong to this socket? */
+static inline int sock_matches(const struct tcp_sock *i,
+                               const struct in6_addr *src,
+                               const struct in6_addr *dst,
+                               uint16_t sport, uint16_t dport, int domain) {
+    /* Ignore any closed sockets */
+    if(i->state == TCP_STATE_CLOSED)
+        return 0;
+
+    /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+       packet, or any that are IPv4 only when we have an incoming IPv6
+       packet. */
+    if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+            (domain == AF_INET6 && i->domain == AF_INET))
+        return 0;
+
+    /* See if the remote end matches what's in the socket */
+    if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
+            (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
+             i->remote_addr.sin6_port != sport))
+        return 0;
+
+    /* See if it matches the local end */
+    if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
+            !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
+            i->local_addr.sin6_port != dport)
+        return 0;
+
+    return 1;
+}
+
 /* Match a socket to an incoming packet. If an actual socket is returned, it is
    the caller's responsibility  to release the socket's mutex when they're done
    with it. */
@@ -2242,43 +3499,27 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                                   uint16_t sport, uint16_t dport, int domain) {
     struct tcp_sock *i;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        /* Ignore any closed sockets */
-        if(i->state == TCP_STATE_CLOSED)
-            continue;
-
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
-
-        /* See if the remote end matches what's in the socket */
-        if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
-                (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
-                 i->remote_addr.sin6_port != sport))
-            continue;
-
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
-            continue;
-
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+    /* A connected socket always takes precedence over one that is listening on
+       the same port. See the comment at the top of the file for more
+       discussion of this, if you're interested. */
+    LIST_FOREACH(i, &tcp_ehash[tcp_ehashfn(src, sport, dport)], hash_list) {
+        if(sock_matches(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
+    LIST_FOREACH(i, &tcp_lhash[tcp_phashfn(dport)], hash_list) {
+        if(sock_matches(i, src, dst, sport, dport, domain))
+            goto found;
     }
 
     return NULL;
-}
 
-extern void __poll_event_trigger(int fd, short event);
+found:
+    if(mutex_lock_irqsafe(&i->mutex))
+        return (struct tcp_sock *) -1;
+
+    return i;
+}
 
 /* This function is basically a direct implementation of the first two and a
    half steps of the SEGMENT ARRIVES event processing defined in RFC 793 on
@@ -2287,9 +3528,9 @@ extern void __poll_event_trigger(int fd, short event);
 static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
+    int j;
     uint16_t mss = 576;
+    struct tcp_opts opts;
 
     (void)size;
 
@@ -2302,35 +3543,11 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
         return -1;
 
     /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
-
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return -1;
 
-            default:
-
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
-
-                j += tcp->options[j + 1];
-        }
-    }
+    if(opts.mss)
+        mss = opts.mss;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
@@ -2346,6 +3563,10 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
             s->listen.queue[j].isn = ntohl(tcp->seq);
             s->listen.queue[j].mss = mss;
+            s->listen.queue[j].sack_ok = opts.sack_ok;
+            s->listen.queue[j].wscale = opts.wscale;
+            s->listen.queue[j].ts_ok = opts.ts;
+            s->listen.queue[j].ts_recent = opts.tsval;
             return 0;
         }
     }
@@ -2363,6 +3584,10 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->listen.queue[s->listen.tail].local_addr.sin6_port = tcp->dst_port;
     s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
     s->listen.queue[s->listen.tail].mss = mss;
+    s->listen.queue[s->listen.tail].sack_ok = opts.sack_ok;
+    s->listen.queue[s->listen.tail].wscale = opts.wscale;
+    s->listen.queue[s->listen.tail].ts_ok = opts.ts;
+    s->listen.queue[s->listen.tail].ts_recent = opts.tsval;
     s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
     ++s->listen.count;
     ++s->listen.tail;
@@ -2385,7 +3610,8 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    int mss = 536;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2421,40 +3647,28 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
-
-                case TCP_OPT_MSS:
-
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
-
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
-
-                default:
+        if(tcp_parse_opts(tcp, flags, &opts))
+            return -1;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        if(opts.mss)
+            mss = opts.mss;
 
-                    j += tcp->options[j + 1];
-            }
+        s->data.snd.mss = mss > 1460 ? 1460 : mss;
+        s->data.sack_ok = opts.sack_ok;
+        s->data.ts_ok = opts.ts;
+        s->data.ts_recent = opts.tsval;
+
+        /* Window scaling only happens if both sides asked for it. */
+        if(opts.wscale >= 0) {
+            s->data.ws_ok = 1;
+            s->data.snd_wscale = opts.wscale;
+        }
+        else {
+            s->data.rcv_wscale = 0;
         }
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
         s->data.snd.wnd = htons(tcp->wnd);
+        tcp_cc_init(s);
 
         if(gotack) {
             s->data.snd.una = ack;
@@ -2479,22 +3693,150 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
     return 0;
 }
 
+/* Update what we know the other side has from the SACK blocks on an incoming
+   segment. */
+static void tcp_sack_update(struct tcp_sock *s, uint32_t ack,
+                            const struct tcp_opts *opts) {
+    uint32_t left, right;
+    int i;
+
+    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max))
+        tcp_sack_trim(s->data.sacked, &s->data.sacked_cnt, ack);
+
+    for(i = 0; i < opts->nsack; ++i) {
+        left = opts->sack[i].left;
+        right = opts->sack[i].right;
+
+        /* Ignore anything that's already acked or that we haven't sent. */
+        if(!SEQ_LT(left, right) || !SEQ_LT(ack, right) ||
+           SEQ_GT(right, s->data.snd.max))
+            continue;
+
+        if(SEQ_LT(left, ack))
+            left = ack;
+
+        tcp_sack_add(s->data.sacked, &s->data.sacked_cnt, left, right);
+    }
+}
+
+/* Copy data into the receive buffer, starting at position pos. */
+static void tcp_rcvbuf_write(struct tcp_sock *s, uint32_t pos,
+                             const uint8_t *buf, uint32_t sz) {
+    uint32_t tmp;
+
+    if(pos + sz <= s->rcvbuf_sz) {
+        memcpy(s->data.rcvbuf + pos, buf, sz);
+    }
+    else {
+        tmp = s->rcvbuf_sz - pos;
+        memcpy(s->data.rcvbuf + pos, buf, tmp);
+        memcpy(s->data.rcvbuf, buf + tmp, sz - tmp);
+    }
+}
+
+/* Move rcv.nxt forward over sz bytes that are now in the receive buffer. */
+static void tcp_rcv_advance(struct tcp_sock *s, uint32_t sz) {
+    s->data.rcv.nxt += sz;
+    s->data.rcv.wnd -= sz;
+    s->data.rcvbuf_cur_sz += sz;
+    s->data.rcvbuf_tail += sz;
+
+    if(s->data.rcvbuf_tail >= s->rcvbuf_sz)
+        s->data.rcvbuf_tail -= s->rcvbuf_sz;
+}
+
+/* Acknowledge data we've just taken in. RFC 1122 (section 4.2.3.2) lets us
+   hold off on that for a little while, in the hope that the ACK can go out
+   along with some data or a window update, as long as at least every second
+   segment gets one. An ACK for data that filled in a hole goes out right away,
+   so that the sender can get on with recovery (RFC 5681, section 4.2). */
+static void tcp_delay_ack(struct tcp_sock *s, int now) {
+    if(now || s->data.delack) {
+        tcp_send_ack(s);
+        return;
+    }
+
+    s->data.delack = 1;
+    s->data.delack_time = timer_ms_gettime64();
+}
+
+/* Keep track of how long a round trip takes, as seen from the receiving end,
+   for receive buffer autotuning. With timestamps, the other side echoes back
+   the time of the ACK that let it send this segment. Without them, time how
+   long it takes for a window's worth of data to come in. */
+static void tcp_rcv_rtt_measure(struct tcp_sock *s,
+                                const struct tcp_opts *opts) {
+    uint64_t now = timer_ms_gettime64();
+
+    if(s->data.ts_ok) {
+        if(opts->ts && opts->tsecr)
+            tcp_rcv_rtt_sample(s, (uint32_t)now - opts->tsecr);
+
+        return;
+    }
+
+    if(!s->data.rcv_rtt_time) {
+        s->data.rcv_rtt_seq = s->data.rcv.nxt + s->data.rcv.wnd;
+        s->data.rcv_rtt_time = now;
+    }
+    else if(SEQ_GE(s->data.rcv.nxt, s->data.rcv_rtt_seq)) {
+        tcp_rcv_rtt_sample(s, now - s->data.rcv_rtt_time);
+        s->data.rcv_rtt_seq = s->data.rcv.nxt + s->data.rcv.wnd;
+        s->data.rcv_rtt_time = now;
+    }
+}
+
+/* Queue a segment that arrived out of order. Since it's in the window, there's
+   room for it in the receive buffer, so it goes straight where it will be once
+   the data before it shows up. Only the sequence space it covers is tracked,
+   in the same blocks that we send back as SACK. If there are too many holes
+   already, the segment is dropped. */
+static void tcp_ooo_queue(struct tcp_sock *s, uint32_t seq, const uint8_t *buf,
+                          uint32_t sz) {
+    uint32_t pos;
+
+    if(!sz || tcp_sack_add(s->data.ooo, &s->data.ooo_cnt, seq, seq + sz) < 0)
+        return;
+
+    pos = s->data.rcvbuf_tail + (seq - s->data.rcv.nxt);
+
+    if(pos >= s->rcvbuf_sz)
+        pos -= s->rcvbuf_sz;
+
+    tcp_rcvbuf_write(s, pos, buf, sz);
+    s->data.ooo_last = seq;
+    ++tcp_stats.pkt_recv_ooo;
+}
+
 /* This implements the processing described for the synchronized states, as
    described in pages 69-76 of the RFC. */
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+    uint32_t seq, ack, up, acked, wnd;
     size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    int bad_pkt = 0, tmp, acksyn = 0, ooo = 0;
     const uint8_t *buf = (const uint8_t *)tcp;
-    uint8_t *rb;
+    struct tcp_opts opts;
 
     (void)src;
 
-    /* Grab the seq and ack values from the header. */
+    /* Grab the seq, ack and window values from the header. */
     seq = ntohl(tcp->seq);
     ack = ntohl(tcp->ack);
+    wnd = (uint32_t)ntohs(tcp->wnd) << s->data.snd_wscale;
+
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return 0;
+
+    /* Protect against wrapped sequence numbers (RFC 7323, section 5): a
+       timestamp older than the last one we saw means this is an old duplicate
+       segment. */
+    if(s->data.ts_ok && opts.ts && !(flags & TCP_FLAG_RST) &&
+       SEQ_LT(opts.tsval, s->data.ts_recent)) {
+        tcp_send_ack(s);
+        return 0;
+    }
 
     /* Check the validity of the incoming segment's sequence number */
     sz = size - TCP_GET_OFFSET(flags);
@@ -2511,9 +3853,21 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 bad_pkt = 1;
         }
         else {
+            /* Trim off the front of a retransmission that overlaps data we
+               already have. */
+            if(SEQ_LT(seq, s->data.rcv.nxt) &&
+               SEQ_GT(seq + sz, s->data.rcv.nxt)) {
+                tmp = s->data.rcv.nxt - seq;
+                buf += tmp;
+                sz -= tmp;
+                seq = s->data.rcv.nxt;
+            }
+
             if(!(SEQ_GE(seq, s->data.rcv.nxt) &&
                     SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)))
                 bad_pkt = 1;
+            else if(seq != s->data.rcv.nxt)
+                ooo = 1;
         }
     }
 
@@ -2529,6 +3883,16 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Anything acceptable from the other side shows the connection is still
+       alive, as far as keepalives are concerned. */
+    s->data.last_rcv = timer_ms_gettime64();
+    s->data.ka_probes = 0;
+
+    /* Remember the timestamp to echo back, if this segment covers the spot
+       we last acknowledged (RFC 7323, section 4.3). */
+    if(s->data.ts_ok && opts.ts && SEQ_LE(seq, s->data.last_ack_sent))
+        s->data.ts_recent = opts.tsval;
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2578,10 +3942,17 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
-    /* Check the ack number for validity */
-    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
+    /* Take note of anything the other side says it has with SACK. */
+    if(s->data.sack_ok)
+        tcp_sack_update(s, ack, &opts);
+
+    /* Check the ack number for validity. Since snd.nxt is pulled back after a
+       retransmission timeout, anything up to snd.max is fine. */
+    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max)) {
+        /* Our SYN and FIN aren't in the send buffer. */
+        acked = MIN(ack - s->data.snd.una - acksyn, s->data.sndbuf_cur_sz);
+        s->data.sndbuf_acked += acked;
+        s->data.sndbuf_cur_sz -= acked;
         s->data.snd.una = ack;
         __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
         cond_signal(&s->data.send_cv);
@@ -2589,19 +3960,52 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
 
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
+        if(SEQ_LT(s->data.snd.nxt, ack)) {
+            s->data.snd.nxt = ack;
+            s->data.sndbuf_head = s->data.sndbuf_acked;
         }
+
+        /* With timestamps, every ACK gives a round-trip time sample, even
+           for segments that were resent (RFC 7323, section 4.1). */
+        if(s->data.ts_ok && opts.ts && opts.tsecr) {
+            tcp_rtt_update(s, tcp_ts_now() - opts.tsecr);
+            s->data.rtt_timing = 0;
+        }
+        else if(s->data.rtt_timing && SEQ_GT(ack, s->data.rtt_seq)) {
+            tcp_rtt_update(s, timer_ms_gettime64() - s->data.rtt_time);
+            s->data.rtt_timing = 0;
+        }
+
+        /* Restart the retransmission timer for whatever is still out. */
+        s->data.timer = timer_ms_gettime64();
+        tcp_cc_ack(s, ack, acked);
     }
-    else if(SEQ_GT(ack, s->data.snd.nxt)) {
+    else if(SEQ_GT(ack, s->data.snd.max)) {
         /* This ACKs something we haven't sent, so try to correct the other side
            and return */
         tcp_send_ack(s);
         return 0;
     }
+    else if(ack == s->data.snd.una && !sz &&
+            !(flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) &&
+            wnd == s->data.snd.wnd && tcp_unacked(s)) {
+        tcp_cc_dupack(s, ack);
+    }
+
+    /* Take the window from the most recent segment (RFC 793, page 72). */
+    if(SEQ_LE(s->data.snd.una, ack) &&
+       (SEQ_LT(s->data.snd.wl1, seq) ||
+        (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = wnd;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+    }
+
+    /* The ACK may have opened up the window, so send whatever we can. */
+    if((s->state == TCP_STATE_ESTABLISHED ||
+        s->state == TCP_STATE_CLOSE_WAIT) &&
+       tcp_unacked(s) < s->data.sndbuf_cur_sz)
+        tcp_send_data(s, TCP_SEND_NEW);
 
     /* We need to do a bit more processing in certain states... */
     switch(s->state) {
@@ -2657,35 +4061,38 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             s->state == TCP_STATE_FIN_WAIT_2) {
         /* Next, check the data size versus our window. If its more than the
            window, truncate the data and copy out what we can. */
-        if(sz > s->data.rcv.wnd) {
-            sz = s->data.rcv.wnd;
+        if(sz > s->data.rcv.wnd - (seq - s->data.rcv.nxt)) {
+            sz = s->data.rcv.wnd - (seq - s->data.rcv.nxt);
             bad_pkt = 1;
         }
 
-        /* Copy the data out */
-        if(sz) {
-            rb = s->data.rcvbuf + s->data.rcvbuf_tail;
-            s->data.rcv.nxt += sz;
-            s->data.rcv.wnd -= sz;
-            s->data.rcvbuf_cur_sz += sz;
+        if(ooo) {
+            /* Hold on to it and let the other side know what we've got. */
+            tcp_ooo_queue(s, seq, buf, sz);
+            tcp_send_ack(s);
+        }
+        else if(sz) {
+            tcp_rcv_rtt_measure(s, &opts);
 
-            if(s->data.rcvbuf_tail + sz <= s->rcvbuf_sz) {
-                memcpy(rb, buf, sz);
-                s->data.rcvbuf_tail += sz;
-            }
-            else {
-                tmp = s->rcvbuf_sz - s->data.rcvbuf_tail;
-                memcpy(rb, buf, tmp);
-                sz -= tmp;
-                buf += tmp;
-                memcpy(s->data.rcvbuf, buf, sz);
-                s->data.rcvbuf_tail = sz;
+            /* Copy the data out */
+            tcp_rcvbuf_write(s, s->data.rcvbuf_tail, buf, sz);
+            tcp_rcv_advance(s, sz);
+            tmp = s->data.ooo_cnt;
+
+            /* See if that filled the hole before any out-of-order data. */
+            while(s->data.ooo_cnt &&
+                  SEQ_LE(s->data.ooo[0].left, s->data.rcv.nxt)) {
+                if(SEQ_GT(s->data.ooo[0].right, s->data.rcv.nxt))
+                    tcp_rcv_advance(s, s->data.ooo[0].right - s->data.rcv.nxt);
+
+                tcp_sack_trim(s->data.ooo, &s->data.ooo_cnt, s->data.rcv.nxt);
             }
 
-            /* Signal any waiting thread and send an ack for what we read */
+            /* Signal any waiting thread and acknowledge what we read, right
+               away if it filled in a hole. */
             __poll_event_trigger(s->sock, POLLRDNORM);
             cond_signal(&s->data.recv_cv);
-            tcp_send_ack(s);
+            tcp_delay_ack(s, tmp);
         }
     }
     else if(sz) {
@@ -2695,8 +4102,8 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     }
 
     /* Finally, check the FIN bit. We don't try to ack it if the packet had too
-       much data. */
-    if(!bad_pkt && (flags & TCP_FLAG_FIN)) {
+       much data, or if it came in out of order. */
+    if(!bad_pkt && !ooo && (flags & TCP_FLAG_FIN)) {
         /* ACK the FIN */
         ++s->data.rcv.nxt;
         tcp_send_ack(s);
@@ -2777,11 +4184,18 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     if(c) {
         /* The checksum should be 0 on success, so discard the packet if it does
            not match that expectation. */
+        ++tcp_stats.pkt_recv_bad_chksum;
         return 0;
     }
 
+    ++tcp_stats.pkt_recv;
     flags = ntohs(tcp->off_flags);
 
+    /* Make sure the header (and its options) actually fit in the packet. */
+    if(size < sizeof(tcp_hdr_t) || TCP_GET_OFFSET(flags) < sizeof(tcp_hdr_t) ||
+       TCP_GET_OFFSET(flags) > size)
+        return 0;
+
     if(rwsem_read_lock_irqsafe(&tcp_sem))
         return -1;
 
@@ -2821,6 +4235,7 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
                 break;
         }
 
+        tcp_timer_update(s);
         mutex_unlock(&s->mutex);
     }
 
@@ -2834,105 +4249,236 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     return 0;
 }
 
-static void tcp_thd_cb(void *arg) {
-    struct tcp_sock *i, *tmp;
-    uint64_t timer;
+/* Do whatever is due on a timer for a socket. Call with the socket's mutex
+   held. */
+static void tcp_timer_run(struct tcp_sock *i, uint64_t timer) {
+    /* Send any ACK that has been held back for long enough. */
+    if((i->state == TCP_STATE_ESTABLISHED ||
+        i->state == TCP_STATE_FIN_WAIT_1 ||
+        i->state == TCP_STATE_FIN_WAIT_2) && i->data.delack &&
+       i->data.delack_time + TCP_DELACK_TIME <= timer)
+        tcp_send_ack(i);
+
+    switch(i->state) {
+        case TCP_STATE_SYN_SENT:
 
-    (void)arg;
+            /* If our last <SYN> was sent more than one  retransmission
+               timeout period ago and we are still in the SYN-SENT state,
+               send another one. */
+            if(i->data.timer + i->data.rto <= timer) {
+                tcp_send_syn(i, 0);
+                i->data.timer = timer;
+                i->data.rto = MIN(i->data.rto * 2, TCP_MAX_RTO);
+                ++tcp_stats.timeouts;
+            }
 
-    rwsem_read_lock(&tcp_sem);
+            break;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        mutex_lock_scoped(&i->mutex);
-        timer = timer_ms_gettime64();
+        case TCP_STATE_SYN_RECEIVED:
 
-        switch(i->state) {
-            case TCP_STATE_LISTEN:
-                break;
+            /* If our last <SYN,ACK> was sent more than one  retransmission
+               timeout period ago and we are still in the SYN-RECEIVED
+               state, send another one. */
+            if(i->data.timer + i->data.rto <= timer) {
+                tcp_send_syn(i, 1);
+                i->data.timer = timer;
+                i->data.rto = MIN(i->data.rto * 2, TCP_MAX_RTO);
+                ++tcp_stats.timeouts;
+            }
 
-            case TCP_STATE_SYN_SENT:
+            break;
 
-                /* If our last <SYN> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-SENT state,
-                   send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 0);
-                    i->data.timer = timer;
-                }
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_CLOSING:
 
-                break;
+            /* Send our FIN again if it hasn't been acked in time. */
+            if(i->data.snd.una != i->data.snd.nxt &&
+                    i->data.timer + i->data.rto <= timer) {
+                --i->data.snd.nxt;
+                tcp_send_fin_ack(i);
+                ++i->data.snd.nxt;
+                i->data.timer = timer;
+                i->data.rto = MIN(i->data.rto * 2, TCP_MAX_RTO);
+                ++tcp_stats.timeouts;
+            }
 
-            case TCP_STATE_SYN_RECEIVED:
+            break;
+
+        case TCP_STATE_TIME_WAIT:
 
-                /* If our last <SYN,ACK> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-RECEIVED
-                   state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 1);
-                    i->data.timer = timer;
+            /* If the TIME-WAIT timer has expired, then clean up the rest of
+               the connection (the fd was already taken care of by a close()
+               call earlier that ended up putting us in this state). */
+            if(i->data.timer + 2 * TCP_DEFAULT_MSL <= timer)
+                i->state = TCP_STATE_CLOSED;
+
+            break;
+
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+
+            if(tcp_unacked(i) &&
+                    i->data.timer + i->data.rto <= timer) {
+                tcp_rto_expired(i);
+            }
+            else if(!i->data.sndbuf_cur_sz &&
+                    (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
+                if(i->state == TCP_STATE_ESTABLISHED) {
+                    i->state = TCP_STATE_FIN_WAIT_1;
+                }
+                else {
+                    i->state = TCP_STATE_CLOSING;
                 }
 
-                break;
+                tcp_queue_fin(i);
+            }
+            else if((i->intflags & TCP_IFLAG_CORK) && i->data.cork_time &&
+                    i->data.cork_time + TCP_CORK_TIME <= timer) {
+                /* Don't hold on to a corked partial segment forever. */
+                tcp_send_data(i, TCP_SEND_PUSH);
+            }
+            else if((i->intflags & TCP_IFLAG_KEEPALIVE) && !tcp_unacked(i) &&
+                    i->data.last_rcv + TCP_KEEPALIVE_IDLE +
+                    i->data.ka_probes * TCP_KEEPALIVE_INTVL <= timer) {
+                if(i->data.ka_probes == TCP_KEEPALIVE_PROBES) {
+                    /* Nobody's there anymore. */
+                    i->state = TCP_STATE_RESET | TCP_STATE_CLOSED;
+                    __poll_event_trigger(i->sock, POLLHUP);
+                    cond_signal(&i->data.recv_cv);
+                    cond_signal(&i->data.send_cv);
+                    break;
+                }
 
-            case TCP_STATE_TIME_WAIT:
+                /* Send an ACK for the byte before the next one, which the
+                   other side has to answer. */
+                --i->data.snd.nxt;
+                tcp_send_ack(i);
+                ++i->data.snd.nxt;
+                ++i->data.ka_probes;
+            }
 
-                /* If the TIME-WAIT timer has expired, then clean up the rest of
-                   the connection (the fd was already taken care of by a close()
-                   call earlier that ended up putting us in this state). */
-                if(i->data.timer + 2 * TCP_DEFAULT_MSL <= timer)
-                    i->state = TCP_STATE_CLOSED;
+            break;
+    }
+}
 
-                break;
+/* Take every socket that is due by now off the wheel and put it on the list to
+   be run. */
+static void tcp_wheel_expire(struct tcp_sock_list *run, uint64_t now) {
+    struct tcp_sock *i, *tmp;
+    uint64_t tick, end = now / TCP_WHEEL_TICK;
+    int n;
 
-            case TCP_STATE_ESTABLISHED:
-            case TCP_STATE_CLOSE_WAIT:
+    irq_disable_scoped();
 
-                if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
-                }
-                else if(!i->data.sndbuf_cur_sz &&
-                        (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
-                    if(i->state == TCP_STATE_ESTABLISHED) {
-                        i->state = TCP_STATE_FIN_WAIT_1;
-                    }
-                    else {
-                        i->state = TCP_STATE_CLOSING;
-                    }
-
-                    tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
-                }
+    for(tick = tcp_wheel_tick, n = 0; tick <= end && n < TCP_WHEEL_SLOTS;
+        ++tick, ++n) {
+        i = LIST_FIRST(&tcp_wheel[tick & (TCP_WHEEL_SLOTS - 1)]);
 
-                break;
+        while(i) {
+            tmp = LIST_NEXT(i, timer_list);
+
+            if(i->timer_due <= now) {
+                LIST_REMOVE(i, timer_list);
+                i->timer_due = 0;
+                LIST_INSERT_HEAD(run, i, run_list);
+            }
+
+            i = tmp;
+        }
+    }
+
+    /* Stay on this tick, since there may be more due later on in it. */
+    tcp_wheel_tick = end;
+}
+
+/* When is the next socket on the wheel due? Returns 0 if there aren't any. */
+static uint64_t tcp_wheel_next(void) {
+    struct tcp_sock *i;
+    uint64_t next = 0, end;
+    int n;
+
+    irq_disable_scoped();
+
+    /* Up until the wheel wraps around, the slots are in the order they come
+       due, so the first one with anything due before then has the earliest.
+       Anything else is due after that. */
+    end = (tcp_wheel_tick + TCP_WHEEL_SLOTS) * TCP_WHEEL_TICK;
+
+    for(n = 0; n < TCP_WHEEL_SLOTS; ++n) {
+        LIST_FOREACH(i, &tcp_wheel[(tcp_wheel_tick + n) &
+                                   (TCP_WHEEL_SLOTS - 1)], timer_list) {
+            next = tcp_due_min(next, i->timer_due);
         }
+
+        if(next && next < end)
+            break;
+    }
+
+    return next;
+}
+
+static void tcp_thd_cb(void *arg) {
+    struct tcp_sock_list run = LIST_HEAD_INITIALIZER(0);
+    struct tcp_sock *i, *tmp;
+    uint64_t next;
+    int reap = 0;
+
+    (void)arg;
+
+    rwsem_read_lock(&tcp_sem);
+
+    /* Only the sockets that have something due get looked at. */
+    tcp_wheel_expire(&run, timer_ms_gettime64());
+
+    while((i = LIST_FIRST(&run))) {
+        LIST_REMOVE(i, run_list);
+        mutex_lock(&i->mutex);
+        tcp_timer_run(i, timer_ms_gettime64());
+
+        if((i->intflags & TCP_IFLAG_CANBEDEL) &&
+                (i->state & 0x0F) == TCP_STATE_CLOSED)
+            reap = 1;
+        else
+            tcp_timer_update(i);
+
+        mutex_unlock(&i->mutex);
     }
 
     rwsem_read_unlock(&tcp_sem);
 
     /* Go through and clean up any sockets that need to be destroyed. */
-    rwsem_write_lock(&tcp_sem);
+    if(reap) {
+        rwsem_write_lock(&tcp_sem);
 
-    i = LIST_FIRST(&tcp_socks);
+        i = LIST_FIRST(&tcp_socks);
 
-    while(i) {
-        tmp = LIST_NEXT(i, sock_list);
+        while(i) {
+            tmp = LIST_NEXT(i, sock_list);
 
-        if((i->intflags & TCP_IFLAG_CANBEDEL) &&
-                (i->state & 0x0F) == TCP_STATE_CLOSED) {
-            LIST_REMOVE(i, sock_list);
-            cond_destroy(&i->data.send_cv);
-            cond_destroy(&i->data.recv_cv);
-            mutex_destroy(&i->mutex);
-            free(i->data.sndbuf);
-            free(i->data.rcvbuf);
-            free(i);
+            if((i->intflags & TCP_IFLAG_CANBEDEL) &&
+                    (i->state & 0x0F) == TCP_STATE_CLOSED) {
+                tcp_sock_unlink(i);
+                cond_destroy(&i->data.send_cv);
+                cond_destroy(&i->data.recv_cv);
+                mutex_destroy(&i->mutex);
+                free(i->data.sndbuf);
+                free(i->data.rcvbuf);
+                pool_free(&tcp_sock_pool, i);
+            }
+
+            i = tmp;
         }
 
-        i = tmp;
+        rwsem_write_unlock(&tcp_sem);
     }
 
-    rwsem_write_unlock(&tcp_sem);
+    /* Come back when the next one is due. */
+    if((next = tcp_wheel_next()))
+        net_thd_schedule(thd_cb_id, next);
+}
+
+net_tcp_stats_t net_tcp_get_stats(void) {
+    return tcp_stats;
 }
 
 /* Protocol handler for fs_socket. */
@@ -2956,11 +4502,23 @@ static fs_socket_proto_t proto = {
     net_tcp_getsockname,                /* getsockname */
     net_tcp_getpeername,                /* getpeername */
     net_tcp_fcntl,                      /* fcntl */
-    net_tcp_poll                        /* poll */
+    net_tcp_poll,                       /* poll */
+    net_tcp_sendfile                    /* sendfile */
 };
 
 int net_tcp_init(void) {
-    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
+    if(!tcp_sock_pool_ready) {
+        if(pool_init(&tcp_sock_pool, "tcp sockets", sizeof(struct tcp_sock),
+                     0, NULL, NULL, NULL, 0))
+            return -1;
+
+        tcp_sock_pool_ready = 1;
+    }
+
+    tcp_wheel_tick = timer_ms_gettime64() / TCP_WHEEL_TICK;
+
+    /* The callback only runs when a socket on the timer wheel is due. */
+    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 0)) < 0)
         return -1;
 
     return fs_socket_proto_add(&proto);
@@ -2968,6 +4526,7 @@ int net_tcp_init(void) {
 
 void net_tcp_shutdown(void) {
     struct tcp_sock *i, *tmp;
+    int j;
 
     /* Kill the thread and make sure we can grab the lock */
     if(thd_cb_id >= 0)
@@ -2986,13 +4545,13 @@ void net_tcp_shutdown(void) {
             close(i->sock);
         }
         else {
-            LIST_REMOVE(i, sock_list);
+            tcp_sock_unlink(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
             free(i->data.sndbuf);
             free(i->data.rcvbuf);
-            free(i);
+            pool_free(&tcp_sock_pool, i);
         }
 
         i = tmp;
@@ -3000,6 +4559,17 @@ void net_tcp_shutdown(void) {
 
     LIST_INIT(&tcp_socks);
 
+    for(j = 0; j < TCP_EHASH_SIZE; ++j)
+        LIST_INIT(&tcp_ehash[j]);
+
+    for(j = 0; j < TCP_PHASH_SIZE; ++j) {
+        LIST_INIT(&tcp_lhash[j]);
+        LIST_INIT(&tcp_bhash[j]);
+    }
+
+    for(j = 0; j < TCP_WHEEL_SLOTS; ++j)
+        LIST_INIT(&tcp_wheel[j]);
+
     /* Remove us from fs_socket and clean up the semaphore */
     fs_socket_proto_remove(&proto);
 }
@@ -12,8 +12,12 @@
 
 #include <kos/thread.h>
 #include <kos/timer.h>
+#include <kos/sem.h>
 #include "net_thd.h"
 
+/* A callback that only runs when asked to with net_thd_schedule(). */
+#define NEVER   UINT64_MAX
+
 struct thd_cb {
     TAILQ_ENTRY(thd_cb) thds;
 
@@ -31,30 +35,65 @@ static kthread_t *thd;
 static int done = 0;
 static int cbid_top;
 
+/* The thread sleeps on this until the next callback is due, and it is
+   signalled when one is wanted sooner than that. */
+static semaphore_t wake;
+static uint64_t wake_time;
+
 static void *net_thd_thd(void *data) {
     struct thd_cb *cb;
-    uint64_t now;
+    uint64_t now, next;
+    irq_mask_t old;
 
     (void)data;
 
     while(!done) {
         now = timer_ms_gettime64();
 
-        /* Run any callbacks that need to be run now. */
+        /* Run any callbacks that need to be run now. Each one is set up for
+           its next run first, so that it can ask to be run sooner. */
         TAILQ_FOREACH(cb, &cbs, thds) {
             if(now >= cb->nextrun) {
+                cb->nextrun = cb->timeout ? now + cb->timeout : NEVER;
                 cb->cb(cb->data);
-                cb->nextrun = now + cb->timeout;
             }
         }
 
+        /* Work out when the next one is due. Anything scheduled after this
+           will see wake_time and wake us up if it needs to. */
+        next = NEVER;
+        old = irq_disable();
+
+        TAILQ_FOREACH(cb, &cbs, thds) {
+            if(cb->nextrun < next)
+                next = cb->nextrun;
+        }
+
+        wake_time = next;
+        irq_restore(old);
+
         /* Go to sleep til we need to be run again. */
-        thd_sleep(50);
+        now = timer_ms_gettime64();
+
+        if(next > now + 0x7FFFFFFF)
+            sem_wait(&wake);
+        else if(next > now)
+            sem_wait_timed(&wake, (unsigned int)(next - now));
+
+        wake_time = 0;
     }
 
     return NULL;
 }
 
+/* Call with interrupts disabled. */
+static void wake_up(uint64_t when) {
+    if(when < wake_time) {
+        wake_time = when;
+        sem_signal(&wake);
+    }
+}
+
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
     struct thd_cb *newcb;
 
@@ -70,16 +109,35 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
     newcb->cb = cb;
     newcb->data = data;
     newcb->timeout = timeout;
-    newcb->nextrun = timer_ms_gettime64() + timeout;
+    newcb->nextrun = timeout ? timer_ms_gettime64() + timeout : NEVER;
 
     /* Disable interrupts, insert, and re-enable interrupts */
     irq_disable_scoped();
 
     TAILQ_INSERT_TAIL(&cbs, newcb, thds);
+    wake_up(newcb->nextrun);
 
     return newcb->cbid;
 }
 
+int net_thd_schedule(int cbid, uint64_t when) {
+    struct thd_cb *cb;
+
+    irq_disable_scoped();
+
+    TAILQ_FOREACH(cb, &cbs, thds) {
+        if(cb->cbid == cbid) {
+            if(when < cb->nextrun)
+                cb->nextrun = when;
+
+            wake_up(when);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 int net_thd_del_callback(int cbid) {
     struct thd_cb *cb;
 
@@ -107,6 +165,7 @@ int net_thd_is_current(void) {
 void net_thd_kill(void) {
     /* Do things gracefully, if we can... Otherwise, punt. */
     done = 1;
+    sem_signal(&wake);
 
     if(!irq_inside_int()) {
         thd_join(thd, NULL);
@@ -122,6 +181,8 @@ int net_thd_init(void) {
     TAILQ_INIT(&cbs);
     done = 0;
     cbid_top = 1;
+    wake_time = 0;
+    sem_init(&wake, 0);
 
     thd = thd_create(0, &net_thd_thd, NULL);
 
@@ -146,4 +207,5 @@ void net_thd_shutdown(void) {
     }
 
     TAILQ_INIT(&cbs);
+    sem_destroy(&wake);
 }
@@ -13,9 +13,16 @@
 
 __BEGIN_DECLS
 
+/* Add a callback to be run from the network thread every timeout milliseconds,
+   or only when asked for with net_thd_schedule() if timeout is 0. Returns an
+   id for the callback, or -1 on error. */
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout);
 int net_thd_del_callback(int cbid);
 
+/* Have a callback run at the given time (from timer_ms_gettime64()), if that
+   is sooner than it was going to run anyway. Safe to call in an interrupt. */
+int net_thd_schedule(int cbid, uint64_t when);
+
 int net_thd_is_current(void);
 
 void net_thd_kill(void);
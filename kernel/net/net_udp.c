@@ -14,7 +14,9 @@
 #include <arpa/inet.h>
 #include <kos/net.h>
 #include <kos/mutex.h>
-#include <kos/genwait.h>
+#include <kos/pool.h>
+#include <kos/cond.h>
+#include <kos/timer.h>
 #include <sys/queue.h>
 #include <kos/fs_socket.h>
 #include <arch/irq.h>
@@ -24,6 +26,7 @@
 
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_pbuf.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -33,6 +36,20 @@
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define UDP_DEFAULT_HOPS    64
 
+/* Number of buckets in the table of bound sockets. Must be a power of two. */
+#define UDP_HASH_SIZE       64
+
+/* Range that ports are picked from for sockets that don't bind to one. */
+#define UDP_PORT_FIRST      1024
+#define UDP_PORT_LAST       65535
+
+/* Default and largest amount of buffer space that datagrams waiting to be
+   received on a socket can take up, in bytes, and the smallest that can be set
+   with SO_RCVBUF. */
+#define UDP_DEFAULT_RCVBUF  (64 * 1024)
+#define UDP_MAX_RCVBUF      (1024 * 1024)
+#define UDP_MIN_RCVBUF      2048
+
 typedef struct {
     uint16_t src_port __packed;
     uint16_t dst_port __packed;
@@ -40,13 +57,19 @@ typedef struct {
     uint16_t checksum __packed;
 } udp_hdr_t;
 
+/* A datagram waiting to be received. This lives in the headroom of the buffer
+   that the datagram is in (see udp_pkt_alloc()). */
 struct udp_pkt {
     TAILQ_ENTRY(udp_pkt) pkt_queue;
     struct sockaddr_in6 from;
-    uint8_t *data;
+    net_pbuf_t *buf;
     uint16_t datasize;
 };
 
+_Static_assert(sizeof(struct udp_pkt) + __alignof__(struct udp_pkt) - 1 <=
+               NET_PBUF_HEADROOM,
+               "struct udp_pkt doesn't fit in the headroom of a buffer");
+
 TAILQ_HEAD(udp_pkt_queue, udp_pkt);
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
@@ -54,6 +77,7 @@ TAILQ_HEAD(udp_pkt_queue, udp_pkt);
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) hash_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -69,7 +93,12 @@ struct udp_sock {
         uint16_t recv_cscov;
     } udp_lite;
 
+    mutex_t mutex;
+    condvar_t recv_cv;
+
     struct udp_pkt_queue packets;
+    size_t rcvbuf;                      /* Most buffer space to queue */
+    size_t rcv_queued;                  /* Buffer space queued now */
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
@@ -78,10 +107,114 @@ static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
 static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Where sockets come from. Sockets can still be open after the protocol is
+   shut down, so this is only set up once, and never torn down. */
+static pool_t udp_sock_pool;
+static int udp_sock_pool_ready;
+
+/* Sockets that have a local port, hashed by that port. Since no two sockets
+   can share a port, incoming datagrams only ever have to look at one (usually
+   very short) chain instead of every socket there is.
+
+   udp_mutex protects the list of sockets and this table, and is only held long
+   enough to find a socket. Everything else about a socket is protected by its
+   own mutex, so threads using different sockets don't wait on each other. The
+   addresses and ports that incoming datagrams are matched against are only
+   changed with both held. When both are needed, udp_mutex is locked first. */
+static struct udp_sock_list udp_hash[UDP_HASH_SIZE];
+static uint16_t udp_next_port = UDP_PORT_FIRST;
+
+static inline struct udp_sock_list *udp_hash_chain(uint16_t port) {
+    /* Ports handed out automatically are sequential, so the low bits of the
+       port spread them evenly enough. */
+    return &udp_hash[ntohs(port) & (UDP_HASH_SIZE - 1)];
+}
+
+static struct udp_sock *udp_hash_find(uint16_t port) {
+    struct udp_sock *iter;
+
+    LIST_FOREACH(iter, udp_hash_chain(port), hash_list) {
+        if(iter->local_addr.sin6_port == port)
+            return iter;
+    }
+
+    return NULL;
+}
+
+/* Give a socket that doesn't have a port yet one that isn't in use. Ports are
+   handed out round-robin rather than always taking the lowest free one, so
+   that this doesn't have to step over every port in use each time. Returns
+   the port in network byte order, or 0 if they're all taken. Call with
+   udp_mutex held. */
+static uint16_t udp_pick_port(void) {
+    uint32_t i;
+    uint16_t port;
+
+    for(i = UDP_PORT_FIRST; i <= UDP_PORT_LAST; ++i) {
+        port = htons(udp_next_port);
+
+        if(udp_next_port++ == UDP_PORT_LAST)
+            udp_next_port = UDP_PORT_FIRST;
+
+        if(!udp_hash_find(port))
+            return port;
+    }
+
+    return 0;
+}
+
+/* Copy the payload of an incoming datagram into a new packet to be queued on
+   a socket. The caller fills in where it came from. The data goes in a packet
+   buffer, which for anything that fits in a frame comes from the pool instead
+   of needing a malloc() of its own. Nothing gets put in front of a datagram on
+   the way in, so the packet itself goes in the headroom of the same buffer. */
+static struct udp_pkt *udp_pkt_alloc(const uint8_t *data, size_t size,
+                                      uint32_t *sum) {
+    struct udp_pkt *pkt;
+    net_pbuf_t *p;
+
+    if(!(p = net_pbuf_alloc(size - sizeof(udp_hdr_t)))) {
+        ++udp_stats.pkt_recv_no_buf;
+        return NULL;
+    }
+
+    pkt = (struct udp_pkt *)(((uintptr_t)p->buf + __alignof__(struct udp_pkt) -
+                              1) & ~(uintptr_t)(__alignof__(struct udp_pkt) - 1));
+    memset(pkt, 0, sizeof(struct udp_pkt));
+
+    pkt->buf = p;
+    pkt->datasize = size - sizeof(udp_hdr_t);
+
+    /* If the caller wants the checksum of the datagram, work it out while it
+       is being copied rather than reading it all twice. */
+    if(sum) {
+        *sum = net_pbuf_copy_in_cksum(pkt->buf, 0, data + sizeof(udp_hdr_t),
+                                      pkt->datasize);
+        *sum = net_ipv4_checksum_partial(data, sizeof(udp_hdr_t), *sum);
+    }
+    else {
+        net_pbuf_copy_in(pkt->buf, 0, data + sizeof(udp_hdr_t), pkt->datasize);
+    }
+
+    return pkt;
+}
+
+static inline void udp_pkt_free(struct udp_pkt *pkt) {
+    net_pbuf_free(pkt->buf);
+}
+
+/* How much of the socket's receive buffer space a packet takes up. This is the
+   whole buffer it is in, not just the datagram, since that's what it really
+   costs to keep it. */
+static inline size_t udp_pkt_space(const struct udp_pkt *pkt) {
+    return sizeof(net_pbuf_t) + pkt->buf->size;
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov);
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt, size_t size,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov);
 
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
@@ -94,7 +227,7 @@ static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct udp_sock *udpsock, *iter;
+    struct udp_sock *udpsock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -163,44 +296,36 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    /* A socket that picked up a port by sending already has one. */
+    if(udpsock->local_addr.sin6_port != 0) {
+        mutex_unlock(&udp_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
     /* See if we requested a specific port or not */
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(udp_hash_find(realaddr6.sin6_port)) {
+            mutex_unlock(&udp_mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        udpsock->local_addr = realaddr6;
     }
-    else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+    else if(!(realaddr6.sin6_port = udp_pick_port())) {
+        mutex_unlock(&udp_mutex);
+        errno = EADDRINUSE;
+        return -1;
     }
 
+    mutex_lock(&udpsock->mutex);
+    udpsock->local_addr = realaddr6;
+    LIST_INSERT_HEAD(udp_hash_chain(realaddr6.sin6_port), udpsock, hash_list);
+
     udpsock->sock = hnd->fd;
 
+    mutex_unlock(&udpsock->mutex);
     mutex_unlock(&udp_mutex);
 
     return 0;
@@ -291,7 +416,9 @@ static int net_udp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     }
 
     /* "Connect" to the specified address */
+    mutex_lock(&udpsock->mutex);
     udpsock->remote_addr = realaddr6;
+    mutex_unlock(&udpsock->mutex);
 
     mutex_unlock(&udp_mutex);
 
@@ -305,242 +432,435 @@ static int net_udp_listen(net_socket_t *hnd, int backlog) {
     return -1;
 }
 
+/* Fill in the address that a datagram came from, in the form that the socket
+   uses. */
+static void udp_copy_addr(int domain, const struct sockaddr_in6 *from,
+                          struct sockaddr *addr, socklen_t *addr_len) {
+    if(domain == AF_INET) {
+        struct sockaddr_in realaddr;
+
+        memset(&realaddr, 0, sizeof(struct sockaddr_in));
+        realaddr.sin_family = AF_INET;
+        realaddr.sin_addr.s_addr = from->sin6_addr.__s6_addr.__s6_addr32[3];
+        realaddr.sin_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in)) {
+            memcpy(addr, &realaddr, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
+            *addr_len = sizeof(struct sockaddr_in);
+        }
+    }
+    else if(domain == AF_INET6) {
+        struct sockaddr_in6 realaddr6;
+
+        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6.sin6_family = AF_INET6;
+        realaddr6.sin6_addr = from->sin6_addr;
+        realaddr6.sin6_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in6)) {
+            memcpy(addr, &realaddr6, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
+            *addr_len = sizeof(struct sockaddr_in6);
+        }
+    }
+}
+
+/* Wait for a datagram to be queued on a socket, with its mutex held. A timeout
+   of 0 waits for as long as it takes. Returns 0 once there is one, 1 if the
+   socket has been shut down for reading, or -1 with errno set. */
+static int udp_wait(struct udp_sock *udpsock, int flags, int timeout) {
+    for(;;) {
+        if(udpsock->flags & (SHUT_RD << 24))
+            return 1;
+
+        if(!TAILQ_EMPTY(&udpsock->packets))
+            return 0;
+
+        if((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
+           irq_inside_int()) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+
+        if(cond_wait_timed(&udpsock->recv_cv, &udpsock->mutex, timeout)) {
+            if(errno == ETIMEDOUT)
+                errno = EAGAIN;
+
+            return -1;
+        }
+    }
+}
+
+/* Copy the first datagram on the queue out into a message, removing it from
+   the queue unless peeking. Returns the number of bytes copied. */
+static size_t udp_recv_one(struct udp_sock *udpsock, struct msghdr *msg,
+                           int flags) {
+    struct udp_pkt *pkt = TAILQ_FIRST(&udpsock->packets);
+    size_t off = 0, len;
+    int i;
+
+    for(i = 0; i < msg->msg_iovlen && off < pkt->datasize; ++i) {
+        len = pkt->datasize - off;
+
+        if(len > msg->msg_iov[i].iov_len)
+            len = msg->msg_iov[i].iov_len;
+
+        memcpy(msg->msg_iov[i].iov_base, pkt->buf->data + off, len);
+        off += len;
+    }
+
+    msg->msg_flags = off < pkt->datasize ? MSG_TRUNC : 0;
+    msg->msg_controllen = 0;
+
+    if(msg->msg_name)
+        udp_copy_addr(udpsock->domain, &pkt->from,
+                      (struct sockaddr *)msg->msg_name, &msg->msg_namelen);
+
+    /* Remove the packet if we're pulling data out of the queue. */
+    if(!(flags & MSG_PEEK)) {
+        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
+        udpsock->rcv_queued -= udp_pkt_space(pkt);
+        udp_pkt_free(pkt);
+    }
+
+    return off;
+}
+
 static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
                                 int flags, struct sockaddr *addr,
                                 socklen_t *addr_len) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t rv;
 
     udpsock = (struct udp_sock *)hnd->data;
 
     if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return -1;
     }
 
-    if(udpsock->flags & (SHUT_RD << 24)) {
-        mutex_unlock(&udp_mutex);
-        return 0;
-    }
-
     if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
-        mutex_unlock(&udp_mutex);
         errno = EFAULT;
         return -1;
     }
 
-    if(TAILQ_EMPTY(&udpsock->packets) &&
-       ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
-        irq_inside_int())) {
-        mutex_unlock(&udp_mutex);
-        errno = EWOULDBLOCK;
+    if(mutex_lock_irqsafe(&udpsock->mutex))
         return -1;
-    }
 
-    while(TAILQ_EMPTY(&udpsock->packets)) {
-        mutex_unlock(&udp_mutex);
-        genwait_wait(udpsock, "net_udp_recvfrom", 0, NULL);
-        mutex_lock(&udp_mutex);
-    }
+    if(!(rv = udp_wait(udpsock, flags, 0))) {
+        iov.iov_base = buffer;
+        iov.iov_len = length;
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_name = addr;
+        msg.msg_namelen = addr ? *addr_len : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
 
-    if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
+        rv = udp_recv_one(udpsock, &msg, flags);
+
+        if(addr)
+            *addr_len = msg.msg_namelen;
     }
-    else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
+    else if(rv > 0) {
+        rv = 0;
     }
 
-    if(addr != NULL) {
-        if(udpsock->domain == AF_INET) {
-            struct sockaddr_in realaddr;
+    mutex_unlock(&udpsock->mutex);
 
-            memset(&realaddr, 0, sizeof(struct sockaddr_in));
-            realaddr.sin_family = AF_INET;
-            realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
+    return rv;
+}
 
-            if(*addr_len < sizeof(struct sockaddr_in)) {
-                memcpy(addr, &realaddr, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
-                *addr_len = sizeof(struct sockaddr_in);
-            }
-        }
-        else if(udpsock->domain == AF_INET6) {
-            struct sockaddr_in6 realaddr6;
+/* Receive a batch of datagrams, taking the socket's mutex once for all of them
+   instead of once each. Without MSG_WAITFORONE, this waits for all of them
+   (unless the socket doesn't block), and with it only for the first. The
+   timeout is for the whole batch. */
+static int net_udp_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags,
+                            const struct timespec *timeout) {
+    struct udp_sock *udpsock;
+    uint64_t deadline = 0, now;
+    unsigned int cnt = 0;
+    int rv, wait = 0;
 
-            memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-            realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
+    udpsock = (struct udp_sock *)hnd->data;
 
-            if(*addr_len < sizeof(struct sockaddr_in6)) {
-                memcpy(addr, &realaddr6, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
-                *addr_len = sizeof(struct sockaddr_in6);
-            }
-        }
+    if(udpsock == NULL) {
+        errno = EBADF;
+        return -1;
     }
 
-    /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
     }
 
-    mutex_unlock(&udp_mutex);
+    if(timeout)
+        deadline = timer_ms_gettime64() + timeout->tv_sec * 1000 +
+            timeout->tv_nsec / 1000000;
 
-    return length;
-}
+    if(mutex_lock_irqsafe(&udpsock->mutex))
+        return -1;
 
-static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
-    struct udp_sock *udpsock;
-    struct sockaddr_in *realaddr;
-    struct sockaddr_in6 realaddr6;
-    uint32_t sflags, iflags;
-    int hops, proto;
-    uint16_t cscov;
-    struct sockaddr_in6 local_addr;
+    while(cnt < vlen) {
+        if(cnt && (flags & MSG_WAITFORONE))
+            flags |= MSG_DONTWAIT;
 
-    (void)flags;
+        if(timeout) {
+            now = timer_ms_gettime64();
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
+            if(now >= deadline)
+                flags |= MSG_DONTWAIT;
+            else
+                wait = (int)(deadline - now);
+        }
 
-    udpsock = (struct udp_sock *)hnd->data;
+        if((rv = udp_wait(udpsock, flags, wait))) {
+            /* Anything that was already received gets returned. */
+            if(cnt || rv > 0)
+                break;
 
-    if(udpsock == NULL) {
-        errno = EBADF;
-        goto err;
-    }
+            mutex_unlock(&udpsock->mutex);
+            return -1;
+        }
 
-    if(udpsock->flags & (SHUT_WR << 24)) {
-        errno = EPIPE;
-        goto err;
+        msgvec[cnt].msg_len = udp_recv_one(udpsock, &msgvec[cnt].msg_hdr,
+                                           flags);
+        ++cnt;
+
+        /* Peeking would just see the same one over and over again. */
+        if(flags & MSG_PEEK)
+            break;
     }
 
-    if(!IN6_IS_ADDR_UNSPECIFIED(&udpsock->remote_addr.sin6_addr) &&
-       udpsock->remote_addr.sin6_port != 0) {
+    mutex_unlock(&udpsock->mutex);
+
+    return (int)cnt;
+}
+
+/* Work out where a datagram is going to, from the address given to send it to
+   and the one that the socket is connected to. */
+static int udp_dest(int domain, const struct sockaddr_in6 *remote,
+                    const struct sockaddr *addr, socklen_t addr_len,
+                    struct sockaddr_in6 *dst) {
+    const struct sockaddr_in *realaddr;
+
+    if(!IN6_IS_ADDR_UNSPECIFIED(&remote->sin6_addr) && remote->sin6_port != 0) {
         if(addr) {
             errno = EISCONN;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = udpsock->remote_addr;
+        *dst = *remote;
     }
     else if(addr == NULL) {
         errno = EDESTADDRREQ;
-        goto err;
+        return -1;
     }
-    else if(addr->sa_family != udpsock->domain) {
+    else if(addr->sa_family != domain) {
         errno = EAFNOSUPPORT;
-        goto err;
+        return -1;
     }
-    else if(udpsock->domain == AF_INET6) {
+    else if(domain == AF_INET6) {
         if(addr_len != sizeof(struct sockaddr_in6)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = *((struct sockaddr_in6 *)addr);
+        *dst = *((const struct sockaddr_in6 *)addr);
     }
-    else if(udpsock->domain == AF_INET) {
+    else if(domain == AF_INET) {
         if(addr_len != sizeof(struct sockaddr_in)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr = (struct sockaddr_in *)addr;
-        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-        realaddr6.sin6_family = AF_INET6;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr32[3] =
-            realaddr->sin_addr.s_addr;
-        realaddr6.sin6_port = realaddr->sin_port;
+        realaddr = (const struct sockaddr_in *)addr;
+        memset(dst, 0, sizeof(struct sockaddr_in6));
+        dst->sin6_family = AF_INET6;
+        dst->sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        dst->sin6_addr.__s6_addr.__s6_addr32[3] = realaddr->sin_addr.s_addr;
+        dst->sin6_port = realaddr->sin_port;
     }
     else {
         /* Shouldn't be able to get here... */
         errno = EBADF;
-        goto err;
+        return -1;
     }
 
-    if(message == NULL) {
-        errno = EFAULT;
-        goto err;
+    return 0;
+}
+
+/* Give a socket that sends without having been bound a port of its own. */
+static int udp_autobind(net_socket_t *hnd, struct udp_sock *udpsock) {
+    uint16_t port;
+    int rv = 0;
+
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return -1;
+
+    if(mutex_lock_irqsafe(&udpsock->mutex)) {
+        mutex_unlock(&udp_mutex);
+        return -1;
     }
 
     if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
+        if((port = udp_pick_port())) {
+            udpsock->local_addr.sin6_port = port;
+            LIST_INSERT_HEAD(udp_hash_chain(port), udpsock, hash_list);
+            udpsock->sock = hnd->fd;
+        }
+        else {
+            errno = EAGAIN;
+            rv = -1;
         }
+    }
+
+    mutex_unlock(&udpsock->mutex);
+    mutex_unlock(&udp_mutex);
+
+    return rv;
+}
+
+/* Send a batch of datagrams. Everything needed from the socket is copied out
+   of it once, so that it doesn't stay locked while they are sent. */
+static int net_udp_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
+    struct udp_sock *udpsock;
+    struct sockaddr_in6 local_addr, remote_addr, dst;
+    struct msghdr *msg;
+    uint32_t sflags, iflags;
+    int hops, proto, domain, j;
+    uint16_t cscov;
+    unsigned int i;
+    size_t size;
+    ssize_t rv;
+
+    (void)flags;
+
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(udpsock->local_addr.sin6_port == 0 && udp_autobind(hnd, udpsock))
+        return -1;
 
-        udpsock->local_addr.sin6_port = htons(port);
+    if(mutex_lock_irqsafe(&udpsock->mutex))
+        return -1;
+
+    if(udpsock->flags & (SHUT_WR << 24)) {
+        mutex_unlock(&udpsock->mutex);
+        errno = EPIPE;
+        return -1;
     }
 
     local_addr = udpsock->local_addr;
+    remote_addr = udpsock->remote_addr;
+    domain = udpsock->domain;
     sflags = udpsock->flags;
     iflags = udpsock->int_flags;
     hops = udpsock->hop_limit;
     proto = udpsock->proto;
     cscov = udpsock->udp_lite.send_cscov;
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8_t *)message, length, sflags, hops,
-                            iflags, proto, cscov);
-err:
-    mutex_unlock(&udp_mutex);
-    return -1;
+    for(i = 0; i < vlen; ++i) {
+        msg = &msgvec[i].msg_hdr;
+
+        if(udp_dest(domain, &remote_addr, (const struct sockaddr *)msg->msg_name,
+                    msg->msg_namelen, &dst))
+            goto out;
+
+        for(j = 0, size = 0; j < msg->msg_iovlen; ++j) {
+            if(msg->msg_iov[j].iov_base == NULL && msg->msg_iov[j].iov_len) {
+                errno = EFAULT;
+                goto out;
+            }
+
+            size += msg->msg_iov[j].iov_len;
+        }
+
+        if((rv = net_udp_send_raw(NULL, &local_addr, &dst, msg->msg_iov,
+                                  msg->msg_iovlen, size, sflags, hops, iflags,
+                                  proto, cscov)) < 0)
+            goto out;
+
+        msgvec[i].msg_len = (unsigned int)rv;
+    }
+
+    return (int)i;
+
+out:
+    /* Only report the error if nothing at all was sent. */
+    return i ? (int)i : -1;
 }
 
-static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
-    struct udp_sock *udpsock;
+static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct mmsghdr msg;
+    struct iovec iov;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(message == NULL) {
+        errno = EFAULT;
         return -1;
+    }
+
+    iov.iov_base = (void *)message;
+    iov.iov_len = length;
+
+    memset(&msg, 0, sizeof(struct mmsghdr));
+    msg.msg_hdr.msg_name = (void *)addr;
+    msg.msg_hdr.msg_namelen = addr_len;
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+
+    if(net_udp_sendmmsg(hnd, &msg, 1, flags) < 0)
+        return -1;
+
+    return msg.msg_len;
+}
+
+static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
+    struct udp_sock *udpsock;
 
     udpsock = (struct udp_sock *)hnd->data;
 
     if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return -1;
     }
 
     if(how & 0xFFFFFFFC) {
-        mutex_unlock(&udp_mutex);
         errno = EINVAL;
         return -1;
     }
 
+    if(mutex_lock_irqsafe(&udpsock->mutex))
+        return -1;
+
     udpsock->flags |= (how << 24);
 
-    mutex_unlock(&udp_mutex);
+    /* Let anyone waiting to receive know that nothing more is coming. */
+    if(how & SHUT_RD)
+        cond_broadcast(&udpsock->recv_cv);
+
+    mutex_unlock(&udpsock->mutex);
 
     return 0;
 }
@@ -551,7 +871,7 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     (void)type;
     (void)proto;
 
-    udpsock = (struct udp_sock *)malloc(sizeof(struct udp_sock));
+    udpsock = (struct udp_sock *)pool_alloc(&udp_sock_pool);
 
     if(udpsock == NULL) {
         errno = ENOMEM;
@@ -562,7 +882,7 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
         proto = IPPROTO_UDP;
     }
     else if(proto != IPPROTO_UDP && proto != IPPROTO_UDPLITE) {
-        free(udpsock);
+        pool_free(&udp_sock_pool, udpsock);
         errno = EPROTONOSUPPORT;
         return -1;
     }
@@ -572,9 +892,19 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
+    udpsock->rcvbuf = UDP_DEFAULT_RCVBUF;
+
+    if(mutex_init(&udpsock->mutex, MUTEX_TYPE_NORMAL)) {
+        pool_free(&udp_sock_pool, udpsock);
+        return -1;
+    }
+
+    cond_init(&udpsock->recv_cv);
 
     if(mutex_lock_irqsafe(&udp_mutex)) {
-        free(udpsock);
+        cond_destroy(&udpsock->recv_cv);
+        mutex_destroy(&udpsock->mutex);
+        pool_free(&udp_sock_pool, udpsock);
         return -1;
     }
 
@@ -588,33 +918,38 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
     struct udp_pkt *pkt;
-    struct udp_pkt *it;
-
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return;
 
     udpsock = (struct udp_sock *)hnd->data;
 
     if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return;
     }
 
-    it = udpsock->packets.tqh_first;
-    while(it) {
-        pkt = it;
-        it = it->pkt_queue.tqe_next;
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return;
+
+    /* Once it's out of the table, nothing more can be queued on it. */
+    LIST_REMOVE(udpsock, sock_list);
+
+    if(udpsock->local_addr.sin6_port != 0)
+        LIST_REMOVE(udpsock, hash_list);
+
+    mutex_unlock(&udp_mutex);
 
-        free(pkt->data);
+    /* Wait for anything that found it before then to finish with it. */
+    mutex_lock(&udpsock->mutex);
+
+    while((pkt = TAILQ_FIRST(&udpsock->packets))) {
         TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
+        udp_pkt_free(pkt);
     }
 
-    LIST_REMOVE(udpsock, sock_list);
+    mutex_unlock(&udpsock->mutex);
 
-    free(udpsock);
-    mutex_unlock(&udp_mutex);
+    cond_destroy(&udpsock->recv_cv);
+    mutex_destroy(&udpsock->mutex);
+    pool_free(&udp_sock_pool, udpsock);
 }
 
 static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
@@ -622,15 +957,14 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
     struct udp_sock *sock;
     int tmp;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
     if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return -1;
     }
 
+    if(mutex_lock_irqsafe(&sock->mutex))
+        return -1;
+
     switch(level) {
         case SOL_SOCKET:
             switch(option_name) {
@@ -641,6 +975,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
+
+                case SO_RCVBUF:
+                    tmp = sock->rcvbuf;
+                    goto copy_int;
             }
 
             break;
@@ -709,12 +1047,12 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
     }
 
     /* If it wasn't handled, return that error. */
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOPROTOOPT;
     return -1;
 
 ret_inval:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = EINVAL;
     return -1;
 
@@ -727,7 +1065,7 @@ copy_int:
         memcpy(option_value, &tmp, *option_len);
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -736,15 +1074,14 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
     struct udp_sock *sock;
     int tmp;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
     if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return -1;
     }
 
+    if(mutex_lock_irqsafe(&sock->mutex))
+        return -1;
+
     switch(level) {
         case SOL_SOCKET:
             switch(option_name) {
@@ -752,6 +1089,22 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    /* This counts the whole buffer that each datagram is in,
+                       so it has to leave room for at least one of them. */
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    sock->rcvbuf = tmp;
+                    goto ret_success;
             }
 
             break;
@@ -879,17 +1232,17 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
     }
 
     /* If it wasn't handled, return that error. */
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOPROTOOPT;
     return -1;
 
 ret_inval:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = EINVAL;
     return -1;
 
 ret_success:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -904,15 +1257,14 @@ static int net_udp_getsockname(net_socket_t *hnd, struct sockaddr *name,
         return -1;
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
     if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return -1;
     }
 
+    if(mutex_lock_irqsafe(&sock->mutex))
+        return -1;
+
     if(sock->domain == AF_INET) {
         memset(&realaddr, 0, sizeof(struct sockaddr_in));
         realaddr.sin_family = AF_INET;
@@ -949,12 +1301,12 @@ static int net_udp_getsockname(net_socket_t *hnd, struct sockaddr *name,
         goto ret_success;
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOTSOCK;
     return -1;
 
 ret_success:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -968,20 +1320,19 @@ static int net_udp_getpeername(net_socket_t *hnd, struct sockaddr *name, socklen
         return -1;
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex)) {
-        errno = EWOULDBLOCK;
+    if(!(sock = (struct udp_sock *)hnd->data)) {
+        errno = EBADF;
         return -1;
     }
 
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
+    if(mutex_lock_irqsafe(&sock->mutex)) {
+        errno = EWOULDBLOCK;
         return -1;
     }
 
     /* If the socket is not connected, return an error */
     if(IN6_IS_ADDR_UNSPECIFIED(&sock->remote_addr.sin6_addr) || sock->remote_addr.sin6_port == 0) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&sock->mutex);
         errno = ENOTCONN;
         return -1;
     }
@@ -1019,12 +1370,12 @@ static int net_udp_getpeername(net_socket_t *hnd, struct sockaddr *name, socklen
         }
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOTSOCK;
     return -1;
 
 ret_success:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -1033,15 +1384,14 @@ static int net_udp_fcntl(net_socket_t *hnd, int cmd, va_list ap) {
     long val;
     int rv = -1;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
     if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
         errno = EBADF;
         return -1;
     }
 
+    if(mutex_lock_irqsafe(&sock->mutex))
+        return -1;
+
     switch(cmd) {
         case F_SETFL:
             val = va_arg(ap, long);
@@ -1071,7 +1421,7 @@ static int net_udp_fcntl(net_socket_t *hnd, int cmd, va_list ap) {
     errno = EINVAL;
 
 out:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return rv;
 }
 
@@ -1079,31 +1429,97 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
     struct udp_sock *sock;
     short rv = POLLWRNORM;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return 0;
-
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
+    if(!(sock = (struct udp_sock *)hnd->data))
         return POLLNVAL;
-    }
+
+    if(mutex_lock_irqsafe(&sock->mutex))
+        return 0;
 
     if(!TAILQ_EMPTY(&sock->packets))
         rv |= POLLRDNORM;
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
 
     return rv & events;
 }
 
 extern void __poll_event_trigger(int fd, short event);
 
+/* Queue up a datagram on the socket it is for, which was found with udp_mutex
+   held. The mutex is released once the socket itself is locked, and only then
+   is the datagram copied, so nothing is allocated for datagrams that nobody
+   is listening for, and the copy doesn't hold up other sockets. If check is
+   set, the checksum is verified along the way, starting from cs. */
+static int udp_queue(struct udp_sock *sock, const struct sockaddr_in6 *from,
+                     const uint8_t *data, size_t size, int check, uint16_t cs,
+                     int partial, uint16_t cscov) {
+    struct udp_pkt *pkt;
+    uint32_t sum = 0;
+    size_t space;
+
+    if(mutex_lock_irqsafe(&sock->mutex)) {
+        mutex_unlock(&udp_mutex);
+        ++udp_stats.pkt_recv_dropped;
+        return -1;
+    }
+
+    mutex_unlock(&udp_mutex);
+
+    /* If this packet is UDP-Lite, make sure the checksum coverage is valid
+       for the socket. We have to be careful here not to reject packets with
+       full coverage that just happen to be smaller than the coverage set by
+       the userspace program. Note that failing this check DOES NOT change
+       any of the statistics counters at all, by design. */
+    if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
+       cscov < sock->udp_lite.recv_cscov) {
+        /* Silently drop packets that fail the partial coverage check. */
+        mutex_unlock(&sock->mutex);
+        return 0;
+    }
+
+    if(!(pkt = udp_pkt_alloc(data, size, check ? &sum : NULL))) {
+        mutex_unlock(&sock->mutex);
+        return -1;
+    }
+
+    if(check && net_ipv4_checksum_fold(sum + cs)) {
+        /* The checksum was wrong, bail out */
+        mutex_unlock(&sock->mutex);
+        ++udp_stats.pkt_recv_bad_chksum;
+        udp_pkt_free(pkt);
+        return -1;
+    }
+
+    pkt->from = *from;
+    space = udp_pkt_space(pkt);
+
+    /* Drop it if the socket already has all that it is allowed to queue. One
+       datagram is always let in, whatever its size. */
+    if(sock->rcv_queued && sock->rcv_queued + space > sock->rcvbuf) {
+        mutex_unlock(&sock->mutex);
+        ++udp_stats.pkt_recv_dropped;
+        udp_pkt_free(pkt);
+        return -1;
+    }
+
+    TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
+    sock->rcv_queued += space;
+
+    ++udp_stats.pkt_recv;
+    __poll_event_trigger(sock->sock, POLLRDNORM);
+    cond_signal(&sock->recv_cv);
+    mutex_unlock(&sock->mutex);
+
+    return 0;
+}
+
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, check = 0;
+    struct sockaddr_in6 from;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
 
     (void)src;
 
@@ -1120,14 +1536,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
            as 0xFFFF. We pretty much have to assume the former option though. */
         if(hdr->checksum != 0) {
             cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDP, size);
-
-            /* If the checksum is right, we'll get zero back from the checksum
-               function */
-            if(net_ipv4_checksum(data, size, cs)) {
-                /* The checksum was wrong, bail out */
-                ++udp_stats.pkt_recv_bad_chksum;
-                return -1;
-            }
+            check = 1;
         }
     }
     else {
@@ -1149,18 +1558,28 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDPLITE, size);
 
         /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, cscov, cs)) {
+           function. With full coverage, it's checked as the datagram is
+           copied onto the socket's queue instead. */
+        if(!partial)
+            check = 1;
+        else if(net_ipv4_checksum(data, cscov, cs)) {
             ++udp_stats.pkt_recv_bad_chksum;
             return -1;
         }
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    memset(&from, 0, sizeof(from));
+    from.sin6_family = AF_INET6;
+    from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+    from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
+    from.sin6_port = hdr->src_port;
+
+    if(mutex_lock_irqsafe(&udp_mutex)) {
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
+    }
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_hash_chain(hdr->dst_port), hash_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1186,48 +1605,8 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         if(sock->proto != ip->protocol)
             continue;
 
-        /* If this packet is UDP-Lite, make sure the checksum coverage is valid
-           for the socket. We have to be careful here not to reject packets with
-           full coverage that just happen to be smaller than the coverage set by
-           the userspace program. Note that failing this check DOES NOT change
-           any of the statistics counters at all, by design. */
-        if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
-           cscov < sock->udp_lite.recv_cscov) {
-            /* Silently drop packets that fail the partial coverage check. */
-            mutex_unlock(&udp_mutex);
-            return 0;
-        }
-
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
-        ++udp_stats.pkt_recv;
-        __poll_event_trigger(sock->sock, POLLRDNORM);
-        genwait_wake_one(sock);
-        mutex_unlock(&udp_mutex);
-
-        return 0;
+        return udp_queue(sock, &from, data, size, check, cs, partial,
+                         cscov);
     }
 
     ++udp_stats.pkt_recv_no_sock;
@@ -1239,10 +1618,10 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
 static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, check = 0;
+    struct sockaddr_in6 from;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
 
     (void)src;
 
@@ -1257,14 +1636,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
            IPv4 but required for IPv6. */
         cs = net_ipv6_checksum_pseudo(&ip->src_addr, &ip->dst_addr, size,
                                       IPPROTO_UDP);
-
-        /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, size, cs)) {
-            /* The checksum was wrong, bail out */
-            ++udp_stats.pkt_recv_bad_chksum;
-            return -1;
-        }
+        check = 1;
     }
     else {
         cscov = ntohs(hdr->length);
@@ -1286,18 +1658,27 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
                                       IPPROTO_UDPLITE);
 
         /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, cscov, cs)) {
+           function. With full coverage, it's checked as the datagram is
+           copied onto the socket's queue instead. */
+        if(!partial)
+            check = 1;
+        else if(net_ipv4_checksum(data, cscov, cs)) {
             ++udp_stats.pkt_recv_bad_chksum;
             return -1;
         }
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    memset(&from, 0, sizeof(from));
+    from.sin6_family = AF_INET6;
+    from.sin6_addr = ip->src_addr;
+    from.sin6_port = hdr->src_port;
+
+    if(mutex_lock_irqsafe(&udp_mutex)) {
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
+    }
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_hash_chain(hdr->dst_port), hash_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1323,47 +1704,8 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         if(sock->proto != ip->next_header)
             continue;
 
-        /* If this packet is UDP-Lite, make sure the checksum coverage is valid
-           for the socket. We have to be careful here not to reject packets with
-           full coverage that just happen to be smaller than the coverage set by
-           the userspace program. Note that failing this check DOES NOT change
-           any of the statistics counters at all, by design. */
-        if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
-           cscov < sock->udp_lite.recv_cscov) {
-            /* Silently drop packets that fail the partial coverage check. */
-            mutex_unlock(&udp_mutex);
-            return 0;
-        }
-
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr = ip->src_addr;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
-        ++udp_stats.pkt_recv;
-        __poll_event_trigger(sock->sock, POLLRDNORM);
-        genwait_wake_one(sock);
-        mutex_unlock(&udp_mutex);
-
-        return 0;
+        return udp_queue(sock, &from, data, size, check, cs, partial,
+                         cscov);
     }
 
     ++udp_stats.pkt_recv_no_sock;
@@ -1387,19 +1729,22 @@ static int net_udp_input(netif_t *src, int domain, const void *hdr,
 
 /* XXX */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt, size_t size,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov) {
+    net_pbuf_t *p;
+    udp_hdr_t *hdr;
     uint16_t cs;
-    int err;
+    uint32_t sum = 0;
+    size_t off = sizeof(udp_hdr_t);
+    int err, i, docsum;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
 
     if(!net) {
-        net = net_default_dev;
+        net = net_route(&dst->sin6_addr);
 
         if(!net) {
             errno = ENETDOWN;
@@ -1434,8 +1779,30 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
+    /* Build the datagram in a packet buffer, so that the layers below can put
+       their headers in front of it without copying it again. */
+    if(!(p = net_pbuf_alloc(size + sizeof(udp_hdr_t)))) {
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
+
+    /* Unless only part of it is covered by the checksum, or it doesn't have
+       one, add up the data for the checksum as it is copied in. */
+    hdr = (udp_hdr_t *)p->data;
     size += sizeof(udp_hdr_t);
+    docsum = proto == IPPROTO_UDP ? !(iflags & UDPSOCK_NO_CHECKSUM) :
+        !(cscov && cscov < size);
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(docsum)
+            sum = net_ipv4_checksum_add(sum,
+                      net_pbuf_copy_in_cksum(p, off, iov[i].iov_base,
+                                             iov[i].iov_len), off);
+        else
+            net_pbuf_copy_in(p, off, iov[i].iov_base, iov[i].iov_len);
+
+        off += iov[i].iov_len;
+    }
 
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
@@ -1448,25 +1815,32 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
             cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
                                           proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
+            sum = net_ipv4_checksum_partial(p->data, sizeof(udp_hdr_t),
+                                            sum + cs);
+            hdr->checksum = net_ipv4_checksum_fold(sum);
         }
     }
     else {
-        if(cscov <= size) {
-            hdr->length = htons(cscov);
+        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
+
+        if(cscov > size)
+            cscov = 0;
+
+        hdr->length = htons(cscov);
+
+        /* Only the first cscov bytes are covered by the checksum. */
+        if(cscov && cscov < size) {
+            hdr->checksum = net_ipv4_checksum(p->data, cscov, cs);
         }
         else {
-            hdr->length = 0;
-            cscov = size;
+            sum = net_ipv4_checksum_partial(p->data, sizeof(udp_hdr_t),
+                                            sum + cs);
+            hdr->checksum = net_ipv4_checksum_fold(sum);
         }
-
-        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
-        hdr->checksum = net_ipv4_checksum(buf, size, cs);
     }
 
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, proto, &srcaddr,
-                        &dst->sin6_addr);
+    err = net_ipv6_send_pbuf(net, p, hops, proto, &srcaddr, &dst->sin6_addr);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -1503,7 +1877,10 @@ static fs_socket_proto_t proto = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    NULL,                               /* sendfile */
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1526,10 +1903,21 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    NULL,                               /* sendfile */
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 int net_udp_init(void) {
+    if(!udp_sock_pool_ready) {
+        if(pool_init(&udp_sock_pool, "udp sockets", sizeof(struct udp_sock),
+                     0, NULL, NULL, NULL, 0))
+            return -1;
+
+        udp_sock_pool_ready = 1;
+    }
+
     return fs_socket_proto_add(&proto) | fs_socket_proto_add(&proto_lite);
 }
 
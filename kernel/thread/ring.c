@@ -0,0 +1,197 @@
+/* KallistiOS ##version##
+
+   ring.c
+
+*/
+
+/* Single-producer, single-consumer ring buffers.
+
+   The head and tail are free-running counts of the elements that have been
+   written and read, so the ring is empty when they're equal and full when
+   they're the capacity apart, and every element gets used. Each side only
+   ever writes its own count, and only after it is done with the elements,
+   with release ordering so that the other side (which reads it with acquire
+   ordering) sees them. On a single CPU, that boils down to keeping the
+   compiler from moving the copies past the store, which is all it takes for
+   an interrupt handler to be either side safely. */
+
+#include <kos/ring.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define LOAD_ACQ(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static size_t round_pow2(size_t n) {
+    size_t p = 1;
+
+    while(p < n)
+        p <<= 1;
+
+    return p;
+}
+
+int ring_init(ring_t *r, size_t elem_size, size_t count, void *buf) {
+    size_t cap;
+
+    /* Anything over the biggest power of two can't be rounded up to one. */
+    if(!elem_size || !count || count > SIZE_MAX / 2 + 1 ||
+       (buf && (count & (count - 1)))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cap = round_pow2(count);
+    memset(r, 0, sizeof(ring_t));
+
+    if(!buf) {
+        if(cap > SIZE_MAX / elem_size ||
+           !(buf = malloc(cap * elem_size))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        r->own_buf = 1;
+    }
+
+    r->buf = (uint8_t *)buf;
+    r->elem_size = elem_size;
+    r->mask = cap - 1;
+
+    return 0;
+}
+
+void ring_destroy(ring_t *r) {
+    if(r->own_buf)
+        free(r->buf);
+
+    r->buf = NULL;
+    r->own_buf = 0;
+}
+
+void ring_clear(ring_t *r) {
+    r->head = r->tail = 0;
+    r->tail_cache = r->head_cache = 0;
+}
+
+/* Free elements as the producer sees them, only looking at the consumer's
+   count if the last look says there aren't enough. */
+static inline size_t prod_space(ring_t *r, size_t want) {
+    size_t space = r->mask + 1 - (r->head - r->tail_cache);
+
+    if(space < want) {
+        r->tail_cache = LOAD_ACQ(&r->tail);
+        space = r->mask + 1 - (r->head - r->tail_cache);
+    }
+
+    return space;
+}
+
+/* Waiting elements as the consumer sees them, likewise. */
+static inline size_t cons_avail(ring_t *r, size_t want) {
+    size_t avail = r->head_cache - r->tail;
+
+    if(avail < want) {
+        r->head_cache = LOAD_ACQ(&r->head);
+        avail = r->head_cache - r->tail;
+    }
+
+    return avail;
+}
+
+size_t ring_write(ring_t *r, const void *src, size_t count) {
+    size_t space = prod_space(r, count);
+    size_t pos = r->head & r->mask, first;
+    size_t es = r->elem_size;
+
+    if(count > space)
+        count = space;
+
+    if(!count)
+        return 0;
+
+    /* Copy up to the end of the buffer, then the rest from the start. */
+    first = r->mask + 1 - pos;
+
+    if(first > count)
+        first = count;
+
+    memcpy(r->buf + pos * es, src, first * es);
+
+    if(count > first)
+        memcpy(r->buf, (const uint8_t *)src + first * es,
+               (count - first) * es);
+
+    STORE_REL(&r->head, r->head + count);
+
+    return count;
+}
+
+size_t ring_read(ring_t *r, void *dst, size_t count) {
+    size_t avail = cons_avail(r, count);
+    size_t pos = r->tail & r->mask, first;
+    size_t es = r->elem_size;
+
+    if(count > avail)
+        count = avail;
+
+    if(!count)
+        return 0;
+
+    first = r->mask + 1 - pos;
+
+    if(first > count)
+        first = count;
+
+    memcpy(dst, r->buf + pos * es, first * es);
+
+    if(count > first)
+        memcpy((uint8_t *)dst + first * es, r->buf, (count - first) * es);
+
+    STORE_REL(&r->tail, r->tail + count);
+
+    return count;
+}
+
+void *ring_reserve(ring_t *r, size_t *count) {
+    size_t pos = r->head & r->mask;
+    size_t n = r->mask + 1 - pos;
+    size_t space = prod_space(r, *count < n ? *count : n);
+
+    if(n > space)
+        n = space;
+
+    if(n > *count)
+        n = *count;
+
+    *count = n;
+
+    return n ? r->buf + pos * r->elem_size : NULL;
+}
+
+void ring_commit(ring_t *r, size_t count) {
+    STORE_REL(&r->head, r->head + count);
+}
+
+const void *ring_peek(ring_t *r, size_t *count) {
+    size_t pos = r->tail & r->mask;
+    size_t n = r->mask + 1 - pos;
+    size_t avail = cons_avail(r, *count < n ? *count : n);
+
+    if(n > avail)
+        n = avail;
+
+    if(n > *count)
+        n = *count;
+
+    *count = n;
+
+    return n ? r->buf + pos * r->elem_size : NULL;
+}
+
+void ring_consume(ring_t *r, size_t count) {
+    STORE_REL(&r->tail, r->tail + count);
+}
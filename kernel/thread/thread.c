@@ -534,6 +534,9 @@ int thd_destroy(kthread_t *thd) {
         i = i2;
     }
 
+    /* Give back any blocks it had cached from the heap. */
+    malloc_thread_cache_release(thd);
+
     /* Free its stack (if we're managing it). */
     if(thd->flags & THD_OWNS_STACK)
         free(thd->stack);
@@ -0,0 +1,281 @@
+/* KallistiOS ##version##
+
+   frag.c
+
+   Tests of the fragment reassembly in kernel/net/net_frag.c: how the list of
+   ranges that have arrived is kept, putting datagrams back together, and
+   throwing them out when they break the rules, run out of time, or need
+   memory that isn't there.
+
+*/
+
+#include "host.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../kernel/net/net_frag.c"
+#include "nettest.h"
+
+#define HDR_LEN     20
+
+static uint8_t data[FRAG_MAX_DATA];
+static uint8_t hdr[HDR_LEN];
+
+static net_frag_key_t frag_key(int family, uint32_t id) {
+    net_frag_key_t key;
+
+    memset(&key, 0, sizeof(key));
+    key.src.__s6_addr.__s6_addr32[3] = 0x0100000A;
+    key.dst.__s6_addr.__s6_addr32[3] = 0x0200000A;
+    key.id = id;
+    key.proto = IPPROTO_UDP;
+    key.family = family;
+
+    return key;
+}
+
+/* Is a datagram with this key waiting for more fragments? */
+static int frag_waiting(const net_frag_key_t *key) {
+    net_frag_t *f;
+
+    LIST_FOREACH(f, &table[frag_hash(key)], hash) {
+        if(frag_match(&f->key, key))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int ranges_are(const net_frag_t *f, int n, const uint32_t *want) {
+    int i;
+
+    if(f->nranges != n)
+        return 0;
+
+    for(i = 0; i < n; ++i) {
+        if(f->ranges[i].start != want[2 * i] ||
+           f->ranges[i].end != want[2 * i + 1])
+            return 0;
+    }
+
+    return 1;
+}
+
+static void test_ranges(void) {
+    static const uint32_t one[] = { 0, 16 };
+    static const uint32_t two[] = { 0, 16, 24, 32 };
+    static const uint32_t joined[] = { 0, 32 };
+    static const uint32_t spread[] = { 0, 56 };
+    static const uint32_t v4[] = { 0, 40 };
+    net_frag_t f;
+    int i;
+
+    /* Pieces that touch end up as one. */
+    memset(&f, 0, sizeof(f));
+    f.key.family = AF_INET6;
+    check(frag_add_range(&f, 0, 8) == 0, "frag: first range not added\n");
+    check(frag_add_range(&f, 8, 16) == 0, "frag: touching range not added\n");
+    check(ranges_are(&f, 1, one), "frag: touching ranges not merged\n");
+    check(frag_add_range(&f, 8, 16) == 1 && frag_add_range(&f, 0, 16) == 1,
+          "frag: range that had all arrived not seen as covered\n");
+
+    /* And ones that don't stay apart, in order. */
+    check(frag_add_range(&f, 24, 32) == 0 && ranges_are(&f, 2, two),
+          "frag: separate range not kept apart\n");
+
+    /* IPv6 fragments can't overlap at all (RFC 5722). */
+    check(frag_add_range(&f, 8, 24) == -1,
+          "frag: IPv6 range overlapping the one before it accepted\n");
+    check(frag_add_range(&f, 20, 28) == -1,
+          "frag: IPv6 range overlapping the one after it accepted\n");
+    check(ranges_are(&f, 2, two), "frag: rejected range changed the list\n");
+
+    /* Filling in a gap joins the pieces on both sides of it. */
+    check(frag_add_range(&f, 16, 24) == 0 && ranges_are(&f, 1, joined),
+          "frag: gap between two ranges not filled in\n");
+
+    /* Over several, with IPv4, where they're allowed to overlap. */
+    memset(&f, 0, sizeof(f));
+    f.key.family = AF_INET;
+
+    for(i = 0; i < 4; ++i)
+        frag_add_range(&f, i * 16, i * 16 + 8);
+
+    check(f.nranges == 4, "frag: %d ranges, wanted 4\n", f.nranges);
+    check(frag_add_range(&f, 4, 52) == 0 && ranges_are(&f, 1, spread),
+          "frag: overlapping range not merged with all of them\n");
+
+    memset(&f, 0, sizeof(f));
+    f.key.family = AF_INET;
+    frag_add_range(&f, 0, 24);
+    check(frag_add_range(&f, 16, 40) == 0 && ranges_are(&f, 1, v4),
+          "frag: overlapping IPv4 range not merged\n");
+
+    /* There's only room for so many pieces. */
+    memset(&f, 0, sizeof(f));
+    f.key.family = AF_INET6;
+
+    for(i = 0; i < NET_FRAG_MAX_RANGES; ++i)
+        check(frag_add_range(&f, (NET_FRAG_MAX_RANGES - i) * 16,
+                             (NET_FRAG_MAX_RANGES - i) * 16 + 8) == 0,
+              "frag: range %d of %d not added\n", i + 1, NET_FRAG_MAX_RANGES);
+
+    check(frag_add_range(&f, 0, 8) == -1,
+          "frag: more than NET_FRAG_MAX_RANGES ranges\n");
+    check(f.nranges == NET_FRAG_MAX_RANGES && f.ranges[0].start == 16,
+          "frag: range list changed when full\n");
+
+    /* Though one that joins onto one that's there still fits. */
+    check(frag_add_range(&f, 8, 16) == 0 &&
+          f.nranges == NET_FRAG_MAX_RANGES && f.ranges[0].start == 8,
+          "frag: touching range not merged when full\n");
+
+    for(i = 1; i < f.nranges; ++i)
+        check(f.ranges[i - 1].end < f.ranges[i].start,
+              "frag: ranges out of order at %d\n", i);
+}
+
+/* Send a datagram of len bytes in fragments of fsize, in the order given. */
+static int frag_send(const net_frag_key_t *key, size_t len, size_t fsize,
+                     const int *order, int n, net_frag_t **done) {
+    size_t off, flen;
+    int i, rv = -1;
+
+    for(i = 0; i < n; ++i) {
+        off = order[i] * fsize;
+        flen = off + fsize > len ? len - off : fsize;
+        rv = net_frag_add(key, off, data + off, flen, off + flen < len,
+                          off ? NULL : hdr, HDR_LEN, done);
+
+        if(rv)
+            break;
+    }
+
+    return rv;
+}
+
+static int frag_right(const net_frag_t *f, size_t len) {
+    return f && f->total == len && f->hlen == HDR_LEN &&
+           !memcmp(net_frag_packet(f), hdr, HDR_LEN) &&
+           !memcmp(net_frag_packet(f) + HDR_LEN, data, len);
+}
+
+static void test_reasm(void) {
+    static const int in_order[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+    static const int mixed[] = { 8, 3, 1, 1, 0, 5, 2, 7, 4, 6 };
+    net_frag_counts_t c4 = net_frag_get_counts(AF_INET);
+    net_frag_counts_t c6 = net_frag_get_counts(AF_INET6);
+    net_frag_key_t key;
+    net_frag_t *f;
+    int rv;
+
+    key = frag_key(AF_INET6, 1);
+    rv = frag_send(&key, 10000, 1232, in_order, 9, &f);
+    check(rv == 1 && frag_right(f, 10000),
+          "frag: datagram sent in order not put back together\n");
+
+    if(f)
+        net_frag_free(f);
+
+    /* Out of order, with one sent twice. */
+    key = frag_key(AF_INET, 2);
+    rv = frag_send(&key, 10000, 1232, mixed, 10, &f);
+    check(rv == 1 && frag_right(f, 10000),
+          "frag: datagram sent out of order not put back together\n");
+
+    if(f)
+        net_frag_free(f);
+
+    /* An IPv6 fragment that overlaps another throws the datagram out. */
+    key = frag_key(AF_INET6, 3);
+    net_frag_add(&key, 0, data, 800, 1, hdr, HDR_LEN, &f);
+    check(net_frag_add(&key, 400, data + 400, 800, 1, NULL, HDR_LEN, &f) ==
+          -1, "frag: overlapping IPv6 fragment accepted\n");
+    check(!frag_waiting(&key), "frag: overlapping IPv6 datagram kept\n");
+
+    /* Every fragment but the last is a multiple of 8 bytes. */
+    key = frag_key(AF_INET, 4);
+    check(net_frag_add(&key, 0, data, 7, 1, hdr, HDR_LEN, &f) == -1,
+          "frag: fragment of 7 bytes with more to come accepted\n");
+    check(net_frag_add(&key, 65528, data, 16, 0, NULL, HDR_LEN, &f) == -1,
+          "frag: fragment past the largest datagram accepted\n");
+
+    c4.reasm = net_frag_get_counts(AF_INET).reasm - c4.reasm;
+    c6.reasm = net_frag_get_counts(AF_INET6).reasm - c6.reasm;
+    c6.dropped = net_frag_get_counts(AF_INET6).dropped - c6.dropped;
+    check(c4.reasm == 1 && c6.reasm == 1 && c6.dropped == 1,
+          "frag: counted %u + %u put back together and %u dropped\n",
+          c4.reasm, c6.reasm, c6.dropped);
+    check(mem_used == 0, "frag: %zu bytes still in use\n", mem_used);
+}
+
+static void test_evict(void) {
+    net_frag_counts_t c = net_frag_get_counts(AF_INET);
+    net_frag_key_t key;
+    net_frag_t *f;
+    int i, n = FRAG_MEM_MAX / 60000 + 1;
+
+    /* Start more 60000-byte datagrams than there's room for. The first and
+       last fragments make each take up the whole 60000. */
+    for(i = 0; i < n; ++i) {
+        key = frag_key(AF_INET, 100 + i);
+        check(net_frag_add(&key, 0, data, 8, 1, hdr, HDR_LEN, &f) == 0 &&
+              net_frag_add(&key, 59992, data + 59992, 8, 0, NULL, HDR_LEN,
+                           &f) == 0,
+              "frag: fragments of datagram %d not taken\n", i);
+        check(mem_used <= FRAG_MEM_MAX, "frag: %zu bytes in use\n",
+              mem_used);
+    }
+
+    /* The oldest one made room for the newest. */
+    key = frag_key(AF_INET, 100);
+    check(!frag_waiting(&key), "frag: oldest datagram not thrown out\n");
+    check(net_frag_get_counts(AF_INET).dropped - c.dropped == 1,
+          "frag: %u datagrams dropped, wanted 1\n",
+          net_frag_get_counts(AF_INET).dropped - c.dropped);
+
+    for(i = 1; i < n; ++i) {
+        key = frag_key(AF_INET, 100 + i);
+        check(frag_waiting(&key), "frag: datagram %d thrown out\n", i);
+    }
+
+    /* And the newest can still be finished. */
+    key = frag_key(AF_INET, 100 + n - 1);
+    check(net_frag_add(&key, 8, data + 8, 59984, 1, NULL, HDR_LEN, &f) == 1 &&
+          frag_right(f, 60000), "frag: newest datagram not finished\n");
+
+    if(f)
+        net_frag_free(f);
+
+    /* A datagram is never thrown out to make room for itself. */
+    f = TAILQ_FIRST(&by_age);
+
+    while(frag_evict(f))
+        ;
+
+    check(TAILQ_FIRST(&by_age) == f && !TAILQ_NEXT(f, age),
+          "frag: datagram thrown out to make room for itself\n");
+
+    /* Nor do the rest outlast their time. */
+    test_now += FRAG_TIMEOUT4;
+    frag_timer(NULL);
+    check(TAILQ_EMPTY(&by_age) && mem_used == 0,
+          "frag: datagrams kept after they ran out of time\n");
+}
+
+void test_frag(void) {
+    size_t i;
+
+    for(i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    memset(hdr, 0x45, sizeof(hdr));
+    net_frag_init();
+
+    test_ranges();
+    test_reasm();
+    test_evict();
+
+    net_frag_shutdown();
+}
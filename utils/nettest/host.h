@@ -0,0 +1,67 @@
+/* KallistiOS ##version##
+
+   host.h
+
+   Just enough of KOS for parts of the network stack to build on a PC. This
+   has to come before anything else in the files that build kernel code. It
+   keeps out the KOS headers that would drag in the rest of the kernel, and
+   declares the few things from them that the network code uses instead,
+   which stubs.c provides.
+
+*/
+
+#ifndef __NETTEST_HOST_H
+#define __NETTEST_HOST_H
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* newlib's <sys/cdefs.h> has these, but glibc's doesn't. */
+#ifndef __pure
+#define __pure __attribute__((pure))
+#endif
+
+#ifndef __packed
+#define __packed __attribute__((packed))
+#endif
+
+/* newlib and glibc call the parts of struct in6_addr different things. */
+#define __s6_addr   __in6_u
+#define __s6_addr16 __u6_addr16
+#define __s6_addr32 __u6_addr32
+
+/* Nothing here runs on more than one thread, so a mutex only has to keep
+   track of whether it is locked, to check that it's used in pairs. */
+#define __KOS_MUTEX_H
+#define __KOS_COND_H
+#define __KOS_TIMER_H
+
+typedef struct mutex {
+    int locked;
+} mutex_t;
+
+typedef struct condvar {
+    int unused;
+} condvar_t;
+
+#define MUTEX_INITIALIZER   { 0 }
+#define MUTEX_TYPE_NORMAL   1
+#define COND_INITIALIZER    { 0 }
+
+int mutex_init(mutex_t *m, unsigned int mtype);
+int mutex_destroy(mutex_t *m);
+int mutex_lock(mutex_t *m);
+int mutex_lock_irqsafe(mutex_t *m);
+int mutex_unlock(mutex_t *m);
+
+int cond_init(condvar_t *cv);
+int cond_destroy(condvar_t *cv);
+int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout);
+int cond_signal(condvar_t *cv);
+int cond_broadcast(condvar_t *cv);
+
+uint64_t timer_ms_gettime64(void);
+
+#endif /* !__NETTEST_HOST_H */
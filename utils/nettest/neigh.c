@@ -0,0 +1,228 @@
+/* KallistiOS ##version##
+
+   neigh.c
+
+   Tests of the neighbor table in kernel/net/net_neigh.c: queueing packets
+   until an address is resolved, and entries going stale, being probed, and
+   expiring when they aren't answered or used.
+
+*/
+
+#include "host.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../kernel/net/net_neigh.c"
+#include "nettest.h"
+
+static const uint8_t peer_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x42 };
+
+static int queries, sent;
+static uint8_t sent_tags[NEIGH_PENDING_MAX * 2];
+
+int net_arp_query(netif_t *nif, const uint8_t ip[4]) {
+    (void)nif;
+    (void)ip;
+
+    ++queries;
+    return 0;
+}
+
+void net_ndp_solicit(netif_t *net, const struct in6_addr *ip) {
+    (void)net;
+    (void)ip;
+
+    ++queries;
+}
+
+/* Each packet queued has a tag in its first byte, so that the order they're
+   sent in can be checked. */
+static int neigh_tx(netif_t *self, const uint8_t *data, int len,
+                    int blocking) {
+    const eth_hdr_t *ehdr = (const eth_hdr_t *)data;
+
+    (void)self;
+    (void)blocking;
+
+    check(len == sizeof(eth_hdr_t) + 20 && !memcmp(ehdr->dest, peer_mac, 6) &&
+          ehdr->type[0] == 0x08 && ehdr->type[1] == 0x00,
+          "neigh: bad frame sent\n");
+
+    if(sent < (int)sizeof(sent_tags))
+        sent_tags[sent] = data[sizeof(eth_hdr_t)];
+
+    ++sent;
+    return NETIF_TX_OK;
+}
+
+static netif_t dev = {
+    .mac_addr = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 },
+    .if_tx = neigh_tx
+};
+
+static void v4_addr(struct in6_addr *addr, uint32_t ip) {
+    memset(addr, 0, sizeof(struct in6_addr));
+    addr->__s6_addr.__s6_addr16[5] = 0xFFFF;
+    addr->__s6_addr.__s6_addr32[3] = htonl(ip);
+}
+
+static net_pbuf_t *tagged_pkt(uint8_t tag) {
+    net_pbuf_t *p = net_pbuf_alloc(20);
+
+    memset(p->data, 0, 20);
+    p->data[0] = tag;
+
+    return p;
+}
+
+static void test_pending(void) {
+    struct in6_addr addr;
+    uint8_t mac[6];
+    int i, rv, pbufs = test_pbufs;
+
+    v4_addr(&addr, 0x0A000002);
+    queries = sent = 0;
+
+    /* Only the first packet sends a query, and only the newest are kept. */
+    for(i = 0; i < NEIGH_PENDING_MAX + 2; ++i) {
+        rv = net_neigh_resolve(&dev, AF_INET, &addr, mac, tagged_pkt(i));
+        check(rv == (i ? NEIGH_PENDING : NEIGH_QUERIED),
+              "neigh: resolve %d returned %d\n", i, rv);
+    }
+
+    check(queries == 1, "neigh: %d queries for one address\n", queries);
+    check(test_pbufs - pbufs == NEIGH_PENDING_MAX,
+          "neigh: %d packets queued, wanted %d\n", test_pbufs - pbufs,
+          NEIGH_PENDING_MAX);
+
+    /* The answer sends them, oldest first. */
+    net_neigh_update(&dev, AF_INET, &addr, peer_mac, NEIGH_UPDATE_CONFIRM);
+    check(sent == NEIGH_PENDING_MAX, "neigh: %d packets sent, wanted %d\n",
+          sent, NEIGH_PENDING_MAX);
+
+    for(i = 0; i < sent && i < NEIGH_PENDING_MAX; ++i)
+        check(sent_tags[i] == i + 2, "neigh: packet %d sent as number %d\n",
+              sent_tags[i], i);
+
+    check(test_pbufs == pbufs, "neigh: %d packets leaked\n",
+          test_pbufs - pbufs);
+
+    rv = net_neigh_resolve(&dev, AF_INET, &addr, mac, NULL);
+    check(rv == 0 && !memcmp(mac, peer_mac, 6),
+          "neigh: answered address not resolved\n");
+
+    net_neigh_flush(AF_INET);
+}
+
+static void test_expiry(void) {
+    struct in6_addr addr;
+    uint8_t mac[6];
+    int i, pbufs = test_pbufs;
+
+    /* A query that's never answered is sent NEIGH_MAX_PROBES times, then
+       the entry is thrown out along with what was waiting on it. */
+    v4_addr(&addr, 0x0A000003);
+    queries = 0;
+    net_neigh_resolve(&dev, AF_INET, &addr, mac, tagged_pkt(0));
+
+    for(i = 0; i < NEIGH_MAX_PROBES; ++i) {
+        test_now += NEIGH_RETRANS_TIME;
+        net_neigh_gc();
+    }
+
+    check(queries == NEIGH_MAX_PROBES, "neigh: %d queries sent, wanted %d\n",
+          queries, NEIGH_MAX_PROBES);
+    check(entries == 0 && test_pbufs == pbufs,
+          "neigh: unanswered entry not thrown out\n");
+
+    /* An answered one is used as it is until it goes stale, then a query is
+       sent the next time it's used. */
+    net_neigh_update(&dev, AF_INET, &addr, peer_mac, NEIGH_UPDATE_CONFIRM);
+    queries = 0;
+    test_now += NEIGH_REACHABLE_TIME - 1;
+    check(!net_neigh_resolve(&dev, AF_INET, &addr, mac, NULL) && !queries,
+          "neigh: reachable entry queried\n");
+
+    test_now += 1;
+    check(!net_neigh_resolve(&dev, AF_INET, &addr, mac, NULL) && queries == 1,
+          "neigh: stale entry not used and queried\n");
+
+    /* And if that isn't answered, it goes. */
+    for(i = 0; i < NEIGH_MAX_PROBES; ++i) {
+        test_now += NEIGH_RETRANS_TIME;
+        net_neigh_gc();
+    }
+
+    check(entries == 0, "neigh: unanswered probe not thrown out\n");
+
+    /* One that's answered but then not used goes after NEIGH_GC_TIME. */
+    net_neigh_update(&dev, AF_INET, &addr, peer_mac, NEIGH_UPDATE_CONFIRM);
+    test_now += NEIGH_GC_TIME - 1;
+    net_neigh_gc();
+    check(entries == 1, "neigh: entry thrown out before it expired\n");
+
+    test_now += 1;
+    net_neigh_gc();
+    check(entries == 0, "neigh: unused entry not thrown out\n");
+
+    /* Unless it was added by hand. */
+    net_neigh_update(&dev, AF_INET, &addr, peer_mac, NEIGH_UPDATE_PERMANENT);
+    test_now += NEIGH_GC_TIME * 10;
+    net_neigh_gc();
+    check(entries == 1 && !net_neigh_resolve(&dev, AF_INET, &addr, mac, NULL),
+          "neigh: permanent entry expired\n");
+
+    net_neigh_flush(AF_INET);
+}
+
+static void test_full(void) {
+    struct in6_addr addr;
+    uint8_t mac[6];
+    int i, pbufs = test_pbufs;
+
+    for(i = 0; i < NEIGH_MAX_ENTRIES; ++i) {
+        v4_addr(&addr, 0x0A010000 + i);
+        net_neigh_update(&dev, AF_INET, &addr, peer_mac, NEIGH_UPDATE_CONFIRM);
+    }
+
+    /* A full table still answers for what's in it, but drops packets for
+       anything new rather than keeping them. */
+    v4_addr(&addr, 0x0A020000);
+    check(net_neigh_resolve(&dev, AF_INET, &addr, mac, tagged_pkt(0)) ==
+          NEIGH_NOMEM, "neigh: entry added to a full table\n");
+    check(test_pbufs == pbufs, "neigh: packet kept for a full table\n");
+    check(entries == NEIGH_MAX_ENTRIES, "neigh: %d entries, wanted %d\n",
+          entries, NEIGH_MAX_ENTRIES);
+
+    for(i = 0; i < NEIGH_MAX_ENTRIES; ++i) {
+        v4_addr(&addr, 0x0A010000 + i);
+
+        if(net_neigh_resolve(&dev, AF_INET, &addr, mac, NULL)) {
+            check(0, "neigh: entry %d not found in a full table\n", i);
+            break;
+        }
+    }
+
+    /* Once they expire, there's room again. */
+    test_now += NEIGH_GC_TIME;
+    net_neigh_gc();
+    check(entries == 0, "neigh: %d entries left after they expired\n",
+          entries);
+
+    v4_addr(&addr, 0x0A020000);
+    check(net_neigh_resolve(&dev, AF_INET, &addr, mac, NULL) ==
+          NEIGH_QUERIED, "neigh: no room after the table was emptied\n");
+
+    net_neigh_flush(AF_UNSPEC);
+}
+
+void test_neigh(void) {
+    net_neigh_init();
+
+    test_pending();
+    test_expiry();
+    test_full();
+
+    net_neigh_shutdown();
+}
@@ -0,0 +1,227 @@
+/* KallistiOS ##version##
+
+   nettest.c
+
+   Test parts of the network stack on a PC, built from the kernel sources as
+   they are. This file has the tests of the CRC and checksum code from
+   kernel/net/net_crc.c and kernel/net/net_cksum.c, which check the CRCs
+   against known values and the IP checksum functions against a plain
+   word-at-a-time version, at every alignment, length and split point up to a
+   few hundred bytes. The tests of UDP, the neighbor table and fragment
+   reassembly are in udp.c, neigh.c and frag.c, which build that code with
+   the stand-ins for the rest of KOS in stubs.c.
+
+   Like the Dreamcast, a PC is little endian, so the checksums come out the
+   same as they would on the real thing. Run it with "make check"; it prints
+   each failure, and exits with a nonzero status if there were any.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* newlib's <sys/cdefs.h> has this, but glibc's doesn't. */
+#ifndef __pure
+#define __pure __attribute__((pure))
+#endif
+
+/* net_crc.c only needs <kos/net.h> for its own prototypes, so leave that out
+   rather than dragging in the rest of KOS. */
+#define __KOS_NET_H
+
+#include "../../kernel/net/net_crc.c"
+#include "../../kernel/net/net_cksum.c"
+
+#include "nettest.h"
+
+#define MAX_LEN     300
+#define ALIGNS      8
+
+int failures;
+
+static uint32_t seed = 0x1234;
+
+static uint8_t rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+/* The IP checksum the simple way: add up the 16-bit words as they are in
+   memory, padding an odd byte at the end with a zero, then fold. */
+static uint32_t ref_partial(const uint8_t *data, size_t bytes, uint32_t sum) {
+    uint16_t w;
+
+    while(bytes > 1) {
+        memcpy(&w, data, 2);
+        sum += w;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        data += 2;
+        bytes -= 2;
+    }
+
+    if(bytes) {
+        w = 0;
+        memcpy(&w, data, 1);
+        sum += w;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+/* The CRC-32 a bit at a time, least significant bit first. */
+static uint32_t ref_crc32le(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF;
+    int i;
+
+    while(size--) {
+        rv ^= *data++;
+
+        for(i = 0; i < 8; ++i)
+            rv = (rv >> 1) ^ ((rv & 1) ? 0xEDB88320 : 0);
+    }
+
+    return ~rv;
+}
+
+/* And most significant bit first, the way net_crc32be() used to do it. */
+static uint32_t ref_crc32be(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF, b, c;
+    int i;
+
+    while(size--) {
+        b = *data++;
+
+        for(i = 0; i < 8; ++i) {
+            c = (rv >> 31) ^ (b & 1);
+            b >>= 1;
+            rv = c ? ((rv << 1) ^ 0x04C11DB6) | 1 : rv << 1;
+        }
+    }
+
+    return rv;
+}
+
+static void test_crc(void) {
+    static const uint8_t check_str[] = "123456789";
+    uint8_t buf[MAX_LEN];
+    int len, i;
+
+    /* The usual check values for "123456789". */
+    check(net_crc32le(check_str, 9) == 0xCBF43926,
+          "net_crc32le(\"123456789\") = %08x\n",
+          (unsigned)net_crc32le(check_str, 9));
+    check(net_crc32be(check_str, 9) == 0x9B63D02C,
+          "net_crc32be(\"123456789\") = %08x\n",
+          (unsigned)net_crc32be(check_str, 9));
+    check(net_crc16ccitt(check_str, 9, 0xFFFF) == 0x29B1,
+          "net_crc16ccitt(\"123456789\", 0xFFFF) = %04x\n",
+          net_crc16ccitt(check_str, 9, 0xFFFF));
+    check(net_crc16ccitt(check_str, 9, 0) == 0x31C3,
+          "net_crc16ccitt(\"123456789\", 0) = %04x\n",
+          net_crc16ccitt(check_str, 9, 0));
+
+    check(net_crc32le(check_str, 0) == 0, "net_crc32le of nothing isn't 0\n");
+    check(net_crc32be(check_str, 0) == 0xFFFFFFFF,
+          "net_crc32be of nothing isn't ffffffff\n");
+
+    for(i = 0; i < MAX_LEN; ++i)
+        buf[i] = rnd();
+
+    for(len = 0; len < MAX_LEN; ++len) {
+        check(net_crc32le(buf, len) == ref_crc32le(buf, len),
+              "net_crc32le: wrong for %d bytes\n", len);
+        check(net_crc32be(buf, len) == ref_crc32be(buf, len),
+              "net_crc32be: wrong for %d bytes\n", len);
+    }
+}
+
+static void test_checksum(const uint8_t *data, const char *what) {
+    static uint8_t dst[MAX_LEN + ALIGNS + 8];
+    uint32_t ref, sum, part;
+    size_t len, split;
+    int a, b;
+
+    for(a = 0; a < ALIGNS; ++a) {
+        const uint8_t *p = data + a;
+
+        for(len = 0; len <= MAX_LEN; ++len) {
+            ref = ref_partial(p, len, 0);
+
+            check(net_ipv4_checksum_partial(p, len, 0) == ref,
+                  "%s: net_ipv4_checksum_partial wrong at +%d, %zu bytes\n",
+                  what, a, len);
+            check(net_ipv4_checksum_partial(p, len, 0x1234) ==
+                  ref_partial(p, len, 0x1234),
+                  "%s: net_ipv4_checksum_partial wrong starting from a sum "
+                  "at +%d, %zu bytes\n", what, a, len);
+            check(net_ipv4_checksum(p, len, 0) == (uint16_t)~ref,
+                  "%s: net_ipv4_checksum wrong at +%d, %zu bytes\n",
+                  what, a, len);
+
+            /* Every way of adding it up in two pieces. */
+            for(split = 0; split <= len; ++split) {
+                sum = net_ipv4_checksum_partial(p, split, 0);
+                part = net_ipv4_checksum_partial(p + split, len - split, 0);
+                sum = net_ipv4_checksum_add(sum, part, split);
+
+                check(net_ipv4_checksum_fold(sum) == (uint16_t)~ref,
+                      "%s: net_ipv4_checksum_add wrong at +%d, %zu bytes "
+                      "split at %zu\n", what, a, len, split);
+            }
+
+            /* Copying to every alignment, with a guard byte either side. */
+            for(b = 0; b < ALIGNS; ++b) {
+                memset(dst, 0xA5, sizeof(dst));
+                sum = net_ipv4_checksum_copy(dst + b + 1, p, len, 0);
+
+                check(sum == ref,
+                      "%s: net_ipv4_checksum_copy sum wrong from +%d to +%d, "
+                      "%zu bytes\n", what, a, b, len);
+                check(!memcmp(dst + b + 1, p, len),
+                      "%s: net_ipv4_checksum_copy copied wrong from +%d to "
+                      "+%d, %zu bytes\n", what, a, b, len);
+                check(dst[b] == 0xA5 && dst[b + 1 + len] == 0xA5,
+                      "%s: net_ipv4_checksum_copy wrote outside from +%d to "
+                      "+%d, %zu bytes\n", what, a, b, len);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    /* Kept aligned, so that the offsets into it are the alignments. */
+    static uint8_t data[MAX_LEN + ALIGNS] __attribute__((aligned(8)));
+    int i;
+
+    (void)argc;
+    (void)argv;
+
+    test_crc();
+
+    for(i = 0; i < (int)sizeof(data); ++i)
+        data[i] = rnd();
+
+    test_checksum(data, "random");
+
+    /* All ones, so that every add carries. */
+    memset(data, 0xFF, sizeof(data));
+    test_checksum(data, "ones");
+
+    memset(data, 0, sizeof(data));
+    test_checksum(data, "zeros");
+
+    test_udp();
+    test_neigh();
+    test_frag();
+
+    if(failures) {
+        printf("%d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All tests passed\n");
+    return EXIT_SUCCESS;
+}
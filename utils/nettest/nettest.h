@@ -0,0 +1,37 @@
+/* KallistiOS ##version##
+
+   nettest.h
+
+*/
+
+#ifndef __NETTEST_H
+#define __NETTEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+extern int failures;
+
+#define check(cond, ...) do { \
+        if(!(cond)) { \
+            printf(__VA_ARGS__); \
+            ++failures; \
+        } \
+    } while(0)
+
+/* What the stubs in stubs.c keep track of. The time is what
+   timer_ms_gettime64() returns, and only moves when a test moves it (or a
+   wait times out). */
+extern uint64_t test_now;
+extern int test_pbufs;
+
+/* Called by cond_wait_timed() with the mutex unlocked, standing in for
+   another thread doing something while one waits. If it returns nonzero, the
+   wait returns as if it was signalled, otherwise it times out. */
+extern int (*test_wait_hook)(void);
+
+void test_udp(void);
+void test_neigh(void);
+void test_frag(void);
+
+#endif /* !__NETTEST_H */
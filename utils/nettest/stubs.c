@@ -0,0 +1,169 @@
+/* KallistiOS ##version##
+
+   stubs.c
+
+   Stand-ins for the parts of KOS that the network code being tested calls,
+   keeping track of enough for the tests to check how it used them.
+
+*/
+
+#include "host.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../../kernel/net/net_cksum.h"
+#include "../../kernel/net/net_pbuf.h"
+#include "../../kernel/net/net_thd.h"
+#include "nettest.h"
+
+/* Room in front of the data of a buffer. This is more than
+   NET_PBUF_HEADROOM, since net_udp.c keeps a struct udp_pkt in front of each
+   datagram it receives, which is bigger with a PC's 64-bit pointers. */
+#define TEST_HEADROOM   128
+
+uint64_t test_now;
+int test_pbufs;
+int (*test_wait_hook)(void);
+
+uint64_t timer_ms_gettime64(void) {
+    return test_now;
+}
+
+int mutex_init(mutex_t *m, unsigned int mtype) {
+    (void)mtype;
+
+    m->locked = 0;
+    return 0;
+}
+
+int mutex_destroy(mutex_t *m) {
+    check(!m->locked, "mutex destroyed while locked\n");
+    return 0;
+}
+
+int mutex_lock(mutex_t *m) {
+    check(!m->locked, "mutex locked when it already was\n");
+    m->locked = 1;
+    return 0;
+}
+
+int mutex_lock_irqsafe(mutex_t *m) {
+    return mutex_lock(m);
+}
+
+int mutex_unlock(mutex_t *m) {
+    check(m->locked, "mutex unlocked when it wasn't locked\n");
+    m->locked = 0;
+    return 0;
+}
+
+int cond_init(condvar_t *cv) {
+    (void)cv;
+    return 0;
+}
+
+int cond_destroy(condvar_t *cv) {
+    (void)cv;
+    return 0;
+}
+
+int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout) {
+    int woken;
+
+    (void)cv;
+
+    mutex_unlock(m);
+    woken = test_wait_hook && test_wait_hook();
+    mutex_lock(m);
+
+    if(woken)
+        return 0;
+
+    test_now += timeout;
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+int cond_signal(condvar_t *cv) {
+    (void)cv;
+    return 0;
+}
+
+int cond_broadcast(condvar_t *cv) {
+    (void)cv;
+    return 0;
+}
+
+/* The tests run the network thread's callbacks themselves when they want
+   them to. */
+int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
+    static int next_id;
+
+    (void)cb;
+    (void)data;
+    (void)timeout;
+
+    return next_id++;
+}
+
+int net_thd_del_callback(int cbid) {
+    (void)cbid;
+    return 0;
+}
+
+int net_thd_schedule(int cbid, uint64_t when) {
+    (void)cbid;
+    (void)when;
+    return 0;
+}
+
+net_pbuf_t *net_pbuf_alloc(size_t len) {
+    net_pbuf_t *p;
+
+    if(!(p = (net_pbuf_t *)calloc(1, sizeof(net_pbuf_t) + TEST_HEADROOM +
+                                  len))) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    p->data = p->buf + TEST_HEADROOM;
+    p->len = p->tot_len = len;
+    p->size = TEST_HEADROOM + len;
+    p->ref = 1;
+    ++test_pbufs;
+
+    return p;
+}
+
+void net_pbuf_free(net_pbuf_t *p) {
+    net_pbuf_t *next;
+
+    for(; p && !--p->ref; p = next) {
+        next = p->next;
+        free(p);
+        --test_pbufs;
+    }
+}
+
+uint8_t *net_pbuf_push(net_pbuf_t *p, size_t n) {
+    if((size_t)(p->data - p->buf) < n)
+        return NULL;
+
+    p->data -= n;
+    p->len += n;
+    p->tot_len += n;
+
+    return p->data;
+}
+
+void net_pbuf_copy_in(net_pbuf_t *p, size_t off, const void *src,
+                      size_t len) {
+    memcpy(p->data + off, src, len);
+}
+
+uint32_t net_pbuf_copy_in_cksum(net_pbuf_t *p, size_t off, const void *src,
+                                size_t len) {
+    return net_ipv4_checksum_copy(p->data + off, (const uint8_t *)src, len, 0);
+}
@@ -0,0 +1,437 @@
+/* KallistiOS ##version##
+
+   udp.c
+
+   Tests of receiving and sending batches of datagrams with recvmmsg() and
+   sendmmsg() in kernel/net/net_udp.c. Datagrams are fed in the way the IPv4
+   layer would hand them up, and the ones sent are caught where they'd be
+   passed down to it.
+
+*/
+
+#include "host.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/* <kos/fs.h> uses newlib's name for it. */
+typedef off64_t _off64_t;
+
+/* glibc's <netinet/udp.h> comes first, and doesn't have this. */
+#define UDP_NOCHECKSUM      25
+
+/* struct udp_pkt is meant to fit in NET_PBUF_HEADROOM on the Dreamcast,
+   which it doesn't with a PC's 64-bit pointers. The buffers from stubs.c
+   have more headroom, to make up for it. */
+#define _Static_assert(cond, msg)
+#include "../../kernel/net/net_udp.c"
+#undef _Static_assert
+
+#include "nettest.h"
+
+#define LOCAL_PORT  5000
+#define PEER_PORT   7
+#define PEER_ADDR   0x0A000002
+
+#define MAX_SENT    8
+
+static struct {
+    size_t len;
+    uint8_t data[64];
+    struct in6_addr dst;
+} sent[MAX_SENT];
+static int nsent;
+
+static netif_t dev;
+
+/* What net_udp.c needs from the rest of the stack. */
+void __poll_event_trigger(int fd, short event) {
+    (void)fd;
+    (void)event;
+}
+
+int irq_inside_int(void) {
+    return 0;
+}
+
+int fs_socket_proto_add(fs_socket_proto_t *proto) {
+    (void)proto;
+    return 0;
+}
+
+int fs_socket_proto_remove(fs_socket_proto_t *proto) {
+    (void)proto;
+    return 0;
+}
+
+int pool_init(pool_t *p, const char *name, size_t size, size_t align,
+              pool_ctor_t ctor, pool_ctor_t dtor, void *data, int flags) {
+    (void)p;
+    (void)name;
+    (void)size;
+    (void)align;
+    (void)ctor;
+    (void)dtor;
+    (void)data;
+    (void)flags;
+
+    return 0;
+}
+
+/* udp_sock_pool only ever has sockets in it. */
+void *pool_alloc(pool_t *p) {
+    (void)p;
+    return malloc(sizeof(struct udp_sock));
+}
+
+void pool_free(pool_t *p, void *obj) {
+    (void)p;
+    free(obj);
+}
+
+netif_t *net_route(const struct in6_addr *dst) {
+    (void)dst;
+    return &dev;
+}
+
+uint32_t net_ipv4_address(const uint8_t addr[4]) {
+    return (addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+}
+
+/* The pseudo-headers don't matter here, as long as they're left out of the
+   checksums the same way both ways. */
+uint16_t net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
+                                  uint16_t len) {
+    (void)src;
+    (void)dst;
+    (void)proto;
+    (void)len;
+
+    return 0;
+}
+
+uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
+                                  const struct in6_addr *dst,
+                                  uint32_t upper_len, uint8_t next_hdr) {
+    (void)src;
+    (void)dst;
+    (void)upper_len;
+    (void)next_hdr;
+
+    return 0;
+}
+
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *p, int hop_limit, int proto,
+                       const struct in6_addr *src,
+                       const struct in6_addr *dst) {
+    (void)net;
+    (void)hop_limit;
+    (void)proto;
+    (void)src;
+
+    if(nsent < MAX_SENT) {
+        sent[nsent].len = p->len;
+        memcpy(sent[nsent].data, p->data,
+               p->len < sizeof(sent[0].data) ? p->len : sizeof(sent[0].data));
+        sent[nsent].dst = *dst;
+    }
+
+    ++nsent;
+    net_pbuf_free(p);
+
+    return 0;
+}
+
+/* Hand a datagram of len bytes, each of them tag, up from the IPv4 layer. */
+static int udp_in(uint8_t tag, size_t len) {
+    uint8_t buf[sizeof(udp_hdr_t) + 256];
+    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+    ip_hdr_t ip;
+
+    memset(&ip, 0, sizeof(ip));
+    ip.protocol = IPPROTO_UDP;
+    ip.src = htonl(PEER_ADDR);
+    ip.dest = htonl(0x0A000001);
+
+    hdr->src_port = htons(PEER_PORT);
+    hdr->dst_port = htons(LOCAL_PORT);
+    hdr->length = htons(sizeof(udp_hdr_t) + len);
+    hdr->checksum = 0;
+    memset(buf + sizeof(udp_hdr_t), tag, len);
+
+    return net_udp_input4(&dev, &ip, buf, sizeof(udp_hdr_t) + len);
+}
+
+static int udp_open(net_socket_t *hnd, int bind_port) {
+    struct sockaddr_in addr;
+
+    memset(hnd, 0, sizeof(net_socket_t));
+
+    if(net_udp_socket(hnd, AF_INET, SOCK_DGRAM, IPPROTO_UDP))
+        return -1;
+
+    if(!bind_port)
+        return 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bind_port);
+
+    return net_udp_bind(hnd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+#define VLEN    8
+
+static struct mmsghdr msgs[VLEN];
+static struct iovec iovs[VLEN];
+static uint8_t bufs[VLEN][256];
+static struct sockaddr_in names[VLEN];
+
+static void recv_setup(size_t len) {
+    int i;
+
+    memset(msgs, 0, sizeof(msgs));
+    memset(bufs, 0, sizeof(bufs));
+
+    for(i = 0; i < VLEN; ++i) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &names[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+    }
+}
+
+/* Did message i get a datagram of len bytes of tag, from the peer? */
+static int recv_right(int i, uint8_t tag, size_t len) {
+    size_t j;
+
+    if(msgs[i].msg_len != len || names[i].sin_family != AF_INET ||
+       names[i].sin_port != htons(PEER_PORT) ||
+       names[i].sin_addr.s_addr != htonl(PEER_ADDR))
+        return 0;
+
+    for(j = 0; j < len; ++j) {
+        if(bufs[i][j] != tag)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int arrivals;
+
+/* Another datagram turns up each time the socket waits, up to 3 of them. */
+static int arrive(void) {
+    if(arrivals >= 3)
+        return 0;
+
+    udp_in(0x10 + arrivals, 16);
+    ++arrivals;
+
+    return 1;
+}
+
+static void test_recv(void) {
+    struct udp_sock *sock;
+    struct timespec ts;
+    net_socket_t hnd;
+    int i, rv;
+
+    if(udp_open(&hnd, LOCAL_PORT)) {
+        check(0, "udp: couldn't open a socket\n");
+        return;
+    }
+
+    sock = (struct udp_sock *)hnd.data;
+
+    /* Everything that's queued comes out in one call, in order. */
+    for(i = 0; i < 5; ++i)
+        check(!udp_in(i + 1, 10 + i), "udp: datagram %d not queued\n", i);
+
+    recv_setup(256);
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, MSG_DONTWAIT, NULL);
+    check(rv == 5, "udp: recvmmsg got %d of 5\n", rv);
+
+    for(i = 0; i < rv; ++i)
+        check(recv_right(i, i + 1, 10 + i), "udp: message %d wrong\n", i);
+
+    check(TAILQ_EMPTY(&sock->packets) && sock->rcv_queued == 0,
+          "udp: queue not emptied\n");
+
+    /* No more than were asked for, and the rest are left for next time. */
+    for(i = 0; i < 5; ++i)
+        udp_in(i + 1, 10 + i);
+
+    recv_setup(256);
+    rv = net_udp_recvmmsg(&hnd, msgs, 3, MSG_DONTWAIT, NULL);
+    check(rv == 3 && recv_right(2, 3, 12),
+          "udp: recvmmsg of 3 got %d\n", rv);
+
+    recv_setup(256);
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, MSG_DONTWAIT, NULL);
+    check(rv == 2 && recv_right(0, 4, 13) && recv_right(1, 5, 14),
+          "udp: recvmmsg of the rest got %d\n", rv);
+
+    /* Nothing there, and not waiting for it. */
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, MSG_DONTWAIT, NULL);
+    check(rv == -1 && errno == EWOULDBLOCK,
+          "udp: recvmmsg of nothing returned %d\n", rv);
+
+    /* Peeking only ever gets the first, and leaves it there. */
+    udp_in(9, 20);
+    udp_in(10, 20);
+    recv_setup(8);
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, MSG_DONTWAIT | MSG_PEEK, NULL);
+    check(rv == 1 && msgs[0].msg_len == 8 &&
+          (msgs[0].msg_hdr.msg_flags & MSG_TRUNC) &&
+          TAILQ_FIRST(&sock->packets) && TAILQ_FIRST(&sock->packets)->datasize
+          == 20, "udp: peeking recvmmsg got %d\n", rv);
+
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, MSG_DONTWAIT, NULL);
+    check(rv == 2 && (msgs[1].msg_hdr.msg_flags & MSG_TRUNC),
+          "udp: recvmmsg after peeking got %d\n", rv);
+
+    /* With MSG_WAITFORONE, it only waits for the first. */
+    test_wait_hook = arrive;
+    arrivals = 0;
+    recv_setup(256);
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, MSG_WAITFORONE, NULL);
+    check(rv == 1 && arrivals == 1 && recv_right(0, 0x10, 16),
+          "udp: recvmmsg with MSG_WAITFORONE got %d after %d arrived\n", rv,
+          arrivals);
+
+    /* Without it, it waits for the whole batch until the timeout, and then
+       returns what it has. */
+    arrivals = 1;
+    ts.tv_sec = 1;
+    ts.tv_nsec = 0;
+    recv_setup(256);
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, 0, &ts);
+    check(rv == 2 && recv_right(0, 0x11, 16) && recv_right(1, 0x12, 16),
+          "udp: recvmmsg with a timeout got %d\n", rv);
+
+    /* If nothing at all turns up, that's a timeout. */
+    rv = net_udp_recvmmsg(&hnd, msgs, VLEN, 0, &ts);
+    check(rv == -1 && errno == EAGAIN,
+          "udp: recvmmsg that timed out returned %d\n", rv);
+    test_wait_hook = NULL;
+
+    /* Anything still queued goes with the socket. */
+    udp_in(1, 100);
+    net_udp_close(&hnd);
+}
+
+static int sent_right(int i, uint16_t src_port, uint8_t tag, size_t len) {
+    const udp_hdr_t *hdr = (const udp_hdr_t *)sent[i].data;
+    size_t j;
+
+    if(sent[i].len != sizeof(udp_hdr_t) + len ||
+       hdr->dst_port != htons(PEER_PORT) || hdr->src_port != src_port ||
+       ntohs(hdr->length) != sent[i].len ||
+       sent[i].dst.__s6_addr.__s6_addr32[3] != htonl(PEER_ADDR))
+        return 0;
+
+    /* The checksum was worked out as the data was copied in. */
+    if(net_ipv4_checksum(sent[i].data, sent[i].len, 0))
+        return 0;
+
+    for(j = 0; j < len; ++j) {
+        if(sent[i].data[sizeof(udp_hdr_t) + j] != tag)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void test_send(void) {
+    uint8_t data[4][32];
+    struct iovec iov[4][2];
+    struct sockaddr_in to;
+    struct sockaddr_in6 to6;
+    struct udp_sock *sock;
+    net_socket_t hnd;
+    uint16_t port;
+    int i, rv;
+
+    if(udp_open(&hnd, 0)) {
+        check(0, "udp: couldn't open a socket\n");
+        return;
+    }
+
+    sock = (struct udp_sock *)hnd.data;
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(PEER_PORT);
+    to.sin_addr.s_addr = htonl(PEER_ADDR);
+
+    /* Each in two pieces, the second of them empty for the last one. */
+    memset(msgs, 0, sizeof(msgs));
+
+    for(i = 0; i < 4; ++i) {
+        memset(data[i], i + 1, sizeof(data[i]));
+        iov[i][0].iov_base = data[i];
+        iov[i][0].iov_len = 5 + i;
+        iov[i][1].iov_base = data[i] + 5 + i;
+        iov[i][1].iov_len = i == 3 ? 0 : 7;
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+        msgs[i].msg_hdr.msg_name = &to;
+        msgs[i].msg_hdr.msg_namelen = sizeof(to);
+    }
+
+    nsent = 0;
+    rv = net_udp_sendmmsg(&hnd, msgs, 4, 0);
+    check(rv == 4 && nsent == 4, "udp: sendmmsg sent %d (%d), wanted 4\n",
+          rv, nsent);
+
+    /* It was given a port to send from. */
+    port = sock->local_addr.sin6_port;
+    check(port != 0, "udp: socket sent without a port\n");
+
+    for(i = 0; i < 4 && i < nsent; ++i) {
+        check(msgs[i].msg_len == 5 + i + (i == 3 ? 0 : 7),
+              "udp: message %d sent %u bytes\n", i, msgs[i].msg_len);
+        check(sent_right(i, port, i + 1, 5 + i + (i == 3 ? 0 : 7)),
+              "udp: datagram %d sent wrong\n", i);
+    }
+
+    /* A message that can't be sent stops the batch there, and is only an
+       error if it's the first. */
+    memset(&to6, 0, sizeof(to6));
+    to6.sin6_family = AF_INET6;
+    msgs[1].msg_hdr.msg_name = &to6;
+    msgs[1].msg_hdr.msg_namelen = sizeof(to6);
+
+    nsent = 0;
+    rv = net_udp_sendmmsg(&hnd, msgs, 4, 0);
+    check(rv == 1 && nsent == 1, "udp: sendmmsg with a bad second message "
+          "sent %d (%d), wanted 1\n", rv, nsent);
+
+    nsent = 0;
+    rv = net_udp_sendmmsg(&hnd, msgs + 1, 3, 0);
+    check(rv == -1 && errno == EAFNOSUPPORT && nsent == 0,
+          "udp: sendmmsg with a bad first message returned %d\n", rv);
+
+    net_udp_close(&hnd);
+}
+
+void test_udp(void) {
+    int pbufs = test_pbufs;
+
+    net_udp_init();
+
+    test_recv();
+    test_send();
+
+    check(test_pbufs == pbufs, "udp: %d buffers leaked\n",
+          test_pbufs - pbufs);
+
+    net_udp_shutdown();
+}
@@ -0,0 +1,388 @@
+/* KallistiOS ##version##
+
+   ringtest.c
+
+   Test the single-producer, single-consumer ring buffers from kos/ring.h.
+   ring.c doesn't use anything from KOS beyond its own header, so this builds
+   it as it is and runs it on a PC: filling and emptying rings in pieces of
+   every size so that they wrap around at every point, reading and writing in
+   place across the end of the buffer, elements of more than one byte, the
+   counts wrapping around, and the arguments ring_init() turns down. Last, a
+   producer and a consumer thread push a long sequence through a small ring
+   at the same time.
+
+   Run it with "make check"; it prints each failure, and exits with a nonzero
+   status if there were any.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../../kernel/thread/ring.c"
+
+#define STREAM_LEN  1000000
+
+static int failures;
+
+#define check(cond, ...) do { \
+        if(!(cond)) { \
+            printf(__VA_ARGS__); \
+            ++failures; \
+        } \
+    } while(0)
+
+/* Writing and reading in pieces of every size, so that every piece size
+   meets the end of the buffer at every offset. */
+static void test_wrap(void) {
+    uint8_t in[64], out[64];
+    uint8_t next_in = 0, next_out = 0;
+    size_t piece, round, n, i;
+    ring_t r;
+
+    ring_init(&r, 1, 16, NULL);
+
+    for(piece = 1; piece <= 16; ++piece) {
+        for(round = 0; round < 40; ++round) {
+            for(i = 0; i < piece; ++i)
+                in[i] = next_in + i;
+
+            n = ring_write(&r, in, piece);
+            check(n == piece, "wrap: wrote %zu of %zu\n", n, piece);
+            next_in += n;
+
+            n = ring_read(&r, out, piece);
+            check(n == piece, "wrap: read %zu of %zu\n", n, piece);
+
+            for(i = 0; i < n; ++i, ++next_out)
+                check(out[i] == next_out, "wrap: got %d, wanted %d "
+                      "(pieces of %zu)\n", out[i], next_out, piece);
+
+            check(ring_count(&r) == 0, "wrap: %zu left over\n",
+                  ring_count(&r));
+        }
+    }
+
+    ring_destroy(&r);
+}
+
+/* Writes that don't all fit, and reads that don't all come back. */
+static void test_partial(void) {
+    uint8_t in[32], out[32];
+    size_t n, i;
+    ring_t r;
+
+    for(i = 0; i < sizeof(in); ++i)
+        in[i] = i;
+
+    ring_init(&r, 1, 8, NULL);
+
+    check(ring_read(&r, out, 4) == 0, "partial: read from an empty ring\n");
+
+    n = ring_write(&r, in, 20);
+    check(n == 8, "partial: wrote %zu to a ring of 8\n", n);
+    check(ring_space(&r) == 0, "partial: %zu free when full\n",
+          ring_space(&r));
+    check(ring_write(&r, in, 1) == 0, "partial: wrote to a full ring\n");
+
+    n = ring_read(&r, out, 3);
+    check(n == 3 && !memcmp(out, in, 3), "partial: first read wrong\n");
+
+    /* This one goes around the end. */
+    n = ring_write(&r, in + 8, 10);
+    check(n == 3, "partial: wrote %zu into 3 free\n", n);
+
+    n = ring_read(&r, out, 32);
+    check(n == 8, "partial: read %zu of 8\n", n);
+    check(!memcmp(out, in + 3, 8), "partial: second read wrong\n");
+    check(ring_read(&r, out, 1) == 0, "partial: read from an emptied ring\n");
+
+    ring_destroy(&r);
+}
+
+/* In place reads and writes, which stop short at the end of the buffer. */
+static void test_in_place(void) {
+    uint8_t in[8] = { 1, 2, 3, 4, 5, 6, 7, 8 }, out[8];
+    const uint8_t *rp;
+    uint8_t *wp;
+    size_t n;
+    ring_t r;
+
+    ring_init(&r, 1, 8, NULL);
+
+    /* Move both positions along to 6. */
+    ring_write(&r, in, 6);
+    ring_read(&r, out, 6);
+
+    n = 8;
+    wp = ring_reserve(&r, &n);
+    check(wp && n == 2, "in place: reserved %zu at the end, wanted 2\n", n);
+    memcpy(wp, in, n);
+
+    /* Nothing shows up until it's committed. */
+    n = 8;
+    check(!ring_peek(&r, &n) && n == 0,
+          "in place: peeked at uncommitted data\n");
+
+    ring_commit(&r, 2);
+
+    n = 8;
+    wp = ring_reserve(&r, &n);
+    check(wp == r.buf && n == 6, "in place: reserved %zu after the wrap, "
+          "wanted 6 at the start\n", n);
+    memcpy(wp, in + 2, 3);
+    ring_commit(&r, 3);
+
+    n = 8;
+    rp = ring_peek(&r, &n);
+    check(rp && n == 2 && !memcmp(rp, in, 2),
+          "in place: peeked %zu at the end, wanted 2\n", n);
+    ring_consume(&r, 1);
+
+    n = 8;
+    rp = ring_peek(&r, &n);
+    check(rp && n == 1 && rp[0] == in[1],
+          "in place: peeked %zu after consuming 1, wanted 1\n", n);
+    ring_consume(&r, 1);
+
+    n = 2;
+    rp = ring_peek(&r, &n);
+    check(rp == r.buf && n == 2 && !memcmp(rp, in + 2, 2),
+          "in place: peek after the wrap wrong\n");
+    ring_consume(&r, 2);
+
+    n = 8;
+    rp = ring_peek(&r, &n);
+    check(rp && n == 1 && rp[0] == in[4], "in place: last peek wrong\n");
+    ring_consume(&r, 1);
+
+    n = 8;
+    check(!ring_peek(&r, &n) && n == 0, "in place: peeked an empty ring\n");
+
+    /* Fill it up and check that there's no more room. */
+    ring_write(&r, in, 8);
+    n = 1;
+    check(!ring_reserve(&r, &n) && n == 0,
+          "in place: reserved in a full ring\n");
+
+    ring_destroy(&r);
+}
+
+/* Elements of more than one byte, going around the end. */
+static void test_elements(void) {
+    struct elem {
+        uint32_t a;
+        uint16_t b;
+        uint8_t c;
+    } in[10], out[10];
+    size_t i, n;
+    ring_t r;
+
+    memset(in, 0, sizeof(in));
+
+    for(i = 0; i < 10; ++i) {
+        in[i].a = 0x10000 * i + 1;
+        in[i].b = 0x100 + i;
+        in[i].c = i;
+    }
+
+    ring_init(&r, sizeof(struct elem), 5, NULL);
+    check(ring_capacity(&r) == 8, "elements: capacity %zu, wanted 8\n",
+          ring_capacity(&r));
+
+    ring_write(&r, in, 5);
+    ring_read(&r, out, 5);
+
+    n = ring_write(&r, in, 8);
+    check(n == 8, "elements: wrote %zu of 8\n", n);
+    n = ring_read(&r, out, 10);
+    check(n == 8 && !memcmp(out, in, 8 * sizeof(struct elem)),
+          "elements: read back wrong\n");
+
+    ring_destroy(&r);
+}
+
+/* The counts are free running, so they have to work when they wrap around
+   too. Start them just short of doing so. */
+static void test_count_wrap(void) {
+    uint8_t in[8] = { 1, 2, 3, 4, 5, 6, 7, 8 }, out[8];
+    size_t n, i;
+    ring_t r;
+
+    ring_init(&r, 1, 4, NULL);
+    r.head = r.tail = r.tail_cache = r.head_cache = SIZE_MAX - 2;
+
+    for(i = 0; i < 4; ++i) {
+        n = ring_write(&r, in + i, 3);
+        check(n == 3, "count wrap: wrote %zu of 3\n", n);
+        check(ring_count(&r) == 3, "count wrap: count %zu, wanted 3\n",
+              ring_count(&r));
+        check(ring_write(&r, in, 3) == 1, "count wrap: room is wrong\n");
+        check(ring_read(&r, out, 8) == 4 && !memcmp(out, in + i, 3) &&
+              out[3] == in[0], "count wrap: read back wrong\n");
+    }
+
+    ring_destroy(&r);
+}
+
+static void test_init(void) {
+    static uint8_t buf[16];
+    ring_t r;
+
+    errno = 0;
+    check(ring_init(&r, 0, 8, NULL) == -1 && errno == EINVAL,
+          "init: took an element size of 0\n");
+
+    errno = 0;
+    check(ring_init(&r, 1, 0, NULL) == -1 && errno == EINVAL,
+          "init: took a count of 0\n");
+
+    errno = 0;
+    check(ring_init(&r, 1, 12, buf) == -1 && errno == EINVAL,
+          "init: took a buffer for a count that isn't a power of two\n");
+
+    errno = 0;
+    check(ring_init(&r, 1, SIZE_MAX / 2 + 2, NULL) == -1 && errno == EINVAL,
+          "init: took a count too big to round up\n");
+
+    errno = 0;
+    check(ring_init(&r, 16, SIZE_MAX / 2 + 1, NULL) == -1 && errno == ENOMEM,
+          "init: took a size that overflows\n");
+
+    check(ring_init(&r, 1, 16, buf) == 0 && r.buf == buf && !r.own_buf,
+          "init: didn't use the buffer given\n");
+    ring_destroy(&r);
+
+    check(ring_init(&r, 1, 12, NULL) == 0 && ring_capacity(&r) == 16,
+          "init: didn't round 12 up to 16\n");
+    ring_destroy(&r);
+}
+
+/* The two sides' counts have to be on cache lines of their own, apart from
+   the fields that never change. */
+static void test_layout(void) {
+    size_t head = offsetof(ring_t, head), tail = offsetof(ring_t, tail);
+
+    check(_Alignof(ring_t) >= RING_CACHE_LINE,
+          "layout: ring_t isn't cache line aligned\n");
+    check(!(head % RING_CACHE_LINE) && !(tail % RING_CACHE_LINE),
+          "layout: head or tail doesn't start a cache line\n");
+    check(head >= RING_CACHE_LINE && tail - head >= RING_CACHE_LINE,
+          "layout: the two sides share a cache line\n");
+}
+
+/* One thread writes a sequence of numbers in bits of different sizes, and
+   another reads them back and checks they're all there, in order. Either
+   side gives up the CPU when the ring is full or empty, since the other side
+   can't do anything about it otherwise on a machine with one CPU. */
+static void *producer(void *p) {
+    ring_t *r = (ring_t *)p;
+    uint32_t next = 0, buf[7];
+    size_t n, i, want = 1;
+    uint32_t *wp;
+
+    while(next < STREAM_LEN) {
+        want = want % 7 + 1;
+
+        if(next & 1) {
+            for(i = 0; i < want; ++i)
+                buf[i] = next + i;
+
+            n = ring_write(r, buf, want);
+        }
+        else {
+            n = want;
+
+            if((wp = ring_reserve(r, &n))) {
+                for(i = 0; i < n; ++i)
+                    wp[i] = next + i;
+
+                ring_commit(r, n);
+            }
+        }
+
+        if(!n)
+            sched_yield();
+
+        next += n;
+    }
+
+    return NULL;
+}
+
+static void test_threads(void) {
+    uint32_t next = 0, buf[5];
+    const uint32_t *rp;
+    size_t n, i, want = 1;
+    pthread_t thd;
+    ring_t r;
+    int bad = 0;
+
+    ring_init(&r, sizeof(uint32_t), 16, NULL);
+    pthread_create(&thd, NULL, producer, &r);
+
+    while(next < STREAM_LEN) {
+        want = want % 5 + 1;
+
+        if(next & 2) {
+            n = ring_read(&r, buf, want);
+            rp = buf;
+        }
+        else {
+            n = want;
+            rp = ring_peek(&r, &n);
+        }
+
+        if(!n) {
+            sched_yield();
+            continue;
+        }
+
+        for(i = 0; i < n; ++i, ++next) {
+            /* Only report the first one, and carry on from there. */
+            if(rp[i] != next) {
+                if(!bad++)
+                    printf("threads: got %u, wanted %u\n", rp[i], next);
+
+                next = rp[i];
+            }
+        }
+
+        if(rp != buf)
+            ring_consume(&r, n);
+    }
+
+    if(bad)
+        ++failures;
+
+    pthread_join(thd, NULL);
+    ring_destroy(&r);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    test_init();
+    test_layout();
+    test_wrap();
+    test_partial();
+    test_in_place();
+    test_elements();
+    test_count_wrap();
+    test_threads();
+
+    if(failures) {
+        printf("%d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All tests passed\n");
+    return EXIT_SUCCESS;
+}